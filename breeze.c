@@ -9,47 +9,226 @@
  *   - {% raw %}...{% endraw %} verbatim blocks
  *   - render_template_file() helper
  *   - Dynamic context: context_new / context_set / context_free
- *   - User-registerable filters via breeze_register_filter()
+ *   - User-registerable filters via breeze_register_filter() or per-engine registries
+ *   - Compile-once API: breeze_compile() / breeze_render_compiled()
+ *   - {% include %} partials and {% extends %} / {% block %} through the template cache
+ *   - {% cache %} fragment caching with a pluggable, size-bounded store
  */
 
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "breeze.h"
 
+/* ================================================================
+   Allocation
+   ================================================================ */
+
+/* Every allocation goes through these, so breeze_set_allocator can route
+ * them elsewhere. While a render runs on a BreezeRenderState, its thread
+ * charges each request to the state's counters and refuses one that would
+ * pass the state's memory limit, which the caller sees as TMPL_ERR_MEMORY. */
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+static void* libc_malloc(void* userdata, size_t size) {
+    (void)userdata;
+    return malloc(size);
+}
+
+static void* libc_realloc(void* userdata, void* ptr, size_t size) {
+    (void)userdata;
+    return realloc(ptr, size);
+}
+
+static void libc_free(void* userdata, void* ptr) {
+    (void)userdata;
+    free(ptr);
+}
+
+static const BreezeAllocator libc_allocator = {libc_malloc, libc_realloc, libc_free, NULL};
+static BreezeAllocator g_allocator = {libc_malloc, libc_realloc, libc_free, NULL};
+
+/* The counters and limit allocations on this thread are charged to. */
+typedef struct {
+    BreezeRenderStats* stats;
+    size_t limit; /* bytes per render, 0 = none */
+} AllocCharge;
+
+static THREAD_LOCAL AllocCharge* tls_charge;
+
+static bool charge_alloc(size_t size) {
+    AllocCharge* c = tls_charge;
+    if (!c) return true;
+    if (c->limit && (size > c->limit || c->stats->alloc_bytes > c->limit - size)) return false;
+    c->stats->allocations++;
+    c->stats->alloc_bytes += size;
+    return true;
+}
+
+static void* brz_malloc(size_t size) {
+    return charge_alloc(size) ? g_allocator.malloc_fn(g_allocator.userdata, size ? size : 1) : NULL;
+}
+
+static void* brz_calloc(size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) return NULL;
+    void* p = brz_malloc(count * size);
+    if (p) memset(p, 0, count * size);
+    return p;
+}
+
+static void* brz_realloc(void* ptr, size_t size) {
+    if (!ptr) return brz_malloc(size);
+    return charge_alloc(size) ? g_allocator.realloc_fn(g_allocator.userdata, ptr, size ? size : 1) : NULL;
+}
+
+static void brz_free(void* ptr) {
+    if (ptr) g_allocator.free_fn(g_allocator.userdata, ptr);
+}
+
+static char* brz_strdup(const char* s) {
+    size_t len = strlen(s) + 1;
+    char* copy = brz_malloc(len);
+    if (copy) memcpy(copy, s, len);
+    return copy;
+}
+
+void breeze_set_allocator(const BreezeAllocator* allocator) {
+    g_allocator = allocator ? *allocator : libc_allocator;
+}
+
+void breeze_free(void* ptr) { brz_free(ptr); }
+
 /* ================================================================
    Filter registry
    ================================================================ */
 
-#define BREEZE_MAX_FILTERS 64
+/* Each engine owns an open-addressed table keyed by filter name. The table
+ * is only consulted while compiling; compiled templates carry the resolved
+ * function pointers, so rendering only takes the lock to read the fragment
+ * store of a {% cache %} block. */
 
-static BreezeFilter g_filters[BREEZE_MAX_FILTERS];
-static size_t g_filter_count = 0;
+/* Exactly one of the two is set for a registered filter. */
+typedef BreezeBoundFilter BoundFilter;
 
-void breeze_clear_filters(void) { g_filter_count = 0; }
+typedef struct {
+    char* name; /* NULL marks an empty slot */
+    BoundFilter bound;
+} FilterSlot;
 
-bool breeze_register_filter(const char* name, BreezeFilterFn fn) {
-    if (!name || !fn || g_filter_count >= BREEZE_MAX_FILTERS) return false;
-    /* overwrite if name already exists */
-    for (size_t i = 0; i < g_filter_count; i++) {
-        if (strcmp(g_filters[i].name, name) == 0) {
-            g_filters[i].fn = fn;
-            return true;
-        }
-    }
-    strncpy(g_filters[g_filter_count].name, name, sizeof(g_filters[0].name) - 1);
-    g_filters[g_filter_count].name[sizeof(g_filters[0].name) - 1] = '\0';
-    g_filters[g_filter_count].fn = fn;
-    g_filter_count++;
+typedef struct FragmentEntry FragmentEntry;
+
+/* Built-in {% cache %} store: an LRU over a hash table, bounded in bytes. */
+typedef struct {
+    pthread_mutex_t lock;
+    FragmentEntry** buckets; /* allocated on first put */
+    size_t bucket_count;     /* power of two */
+    size_t count;
+    size_t bytes;
+    size_t max_bytes;
+    FragmentEntry* lru_head; /* most recently used */
+    FragmentEntry* lru_tail;
+} FragmentCache;
+
+struct BreezeEngine {
+    pthread_mutex_t lock;
+    FilterSlot* slots;
+    size_t slot_count; /* power of two */
+    size_t count;
+    bool autoescape; /* escape {{ }} output of templates compiled from now on */
+    bool optimize;   /* run the constant folder on templates compiled from now on */
+    FragmentCache fragments;
+    BreezeFragmentStore store; /* where {% cache %} blocks go; the built-in store by default */
+};
+
+WARN_UNUSED static bool fragment_cache_init(FragmentCache* fc);
+static void fragment_cache_destroy(FragmentCache* fc);
+static BreezeFragmentStore builtin_fragment_store(FragmentCache* fc);
+
+static uint64_t hash_string(const char* s) {
+    uint64_t h = 1469598103934665603ULL; /* FNV-1a */
+    for (; *s; s++) h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+    return h;
+}
+
+static FilterSlot* filter_slot(FilterSlot* slots, size_t slot_count, const char* name) {
+    size_t mask = slot_count - 1;
+    size_t i = (size_t)hash_string(name) & mask;
+    while (slots[i].name && strcmp(slots[i].name, name) != 0) i = (i + 1) & mask;
+    return &slots[i];
+}
+
+WARN_UNUSED static bool filter_table_grow(BreezeEngine* engine) {
+    size_t slot_count = engine->slot_count ? engine->slot_count * 2 : 32;
+    FilterSlot* slots = brz_calloc(slot_count, sizeof(FilterSlot));
+    if (!slots) return false;
+    for (size_t i = 0; i < engine->slot_count; i++)
+        if (engine->slots[i].name) *filter_slot(slots, slot_count, engine->slots[i].name) = engine->slots[i];
+    brz_free(engine->slots);
+    engine->slots = slots;
+    engine->slot_count = slot_count;
     return true;
 }
 
-static BreezeFilterFn find_filter(const char* name) {
-    for (size_t i = 0; i < g_filter_count; i++) {
-        if (strcmp(g_filters[i].name, name) == 0) return g_filters[i].fn;
+/* Caller holds engine->lock. */
+WARN_UNUSED static bool filter_table_put(BreezeEngine* engine, const char* name, BoundFilter bound) {
+    if ((engine->count + 1) * 2 > engine->slot_count && !filter_table_grow(engine)) return false;
+    FilterSlot* slot = filter_slot(engine->slots, engine->slot_count, name);
+    if (!slot->name) {
+        if (!(slot->name = brz_strdup(name))) return false;
+        engine->count++;
     }
-    return NULL;
+    slot->bound = bound;
+    return true;
+}
+
+static void filter_table_clear(BreezeEngine* engine) {
+    for (size_t i = 0; i < engine->slot_count; i++) brz_free(engine->slots[i].name);
+    memset(engine->slots, 0, sizeof(FilterSlot) * engine->slot_count);
+    engine->count = 0;
+}
+
+bool breeze_engine_register_filter(BreezeEngine* engine, const char* name, BreezeFilterFn fn) {
+    if (!engine || !name || !*name || !fn) return false;
+    pthread_mutex_lock(&engine->lock);
+    bool ok = filter_table_put(engine, name, (BoundFilter){.fn = fn});
+    pthread_mutex_unlock(&engine->lock);
+    return ok;
+}
+
+bool breeze_engine_register_value_filter(BreezeEngine* engine, const char* name, BreezeValueFilterFn fn) {
+    if (!engine || !name || !*name || !fn) return false;
+    pthread_mutex_lock(&engine->lock);
+    bool ok = filter_table_put(engine, name, (BoundFilter){.value_fn = fn});
+    pthread_mutex_unlock(&engine->lock);
+    return ok;
+}
+
+BreezeFilterFn breeze_engine_find_filter(BreezeEngine* engine, const char* name) {
+    if (!engine || !name) return NULL;
+    pthread_mutex_lock(&engine->lock);
+    BreezeFilterFn fn = filter_slot(engine->slots, engine->slot_count, name)->bound.fn;
+    pthread_mutex_unlock(&engine->lock);
+    return fn;
 }
 
 /* ================================================================
@@ -58,29 +237,30 @@ static BreezeFilterFn find_filter(const char* name) {
 
 WARN_UNUSED bool buffer_init(OutputBuffer* buf, size_t initial_capacity) {
     if (initial_capacity == 0) initial_capacity = 1024;
-    buf->data = malloc(initial_capacity);
-    if (!buf->data) {
-        perror("malloc");
-        return false;
-    }
+    buf->data = brz_malloc(initial_capacity);
+    if (!buf->data) return false;
     buf->size = 0;
     buf->capacity = initial_capacity;
     buf->data[0] = '\0';
     return true;
 }
 
-WARN_UNUSED static bool buffer_append(OutputBuffer* buf, const char* str, size_t len) {
-    if (!buf || !str || len == 0) return true;
+/* Make room for `len` more bytes plus the terminator. */
+WARN_UNUSED static bool buffer_reserve(OutputBuffer* buf, size_t len) {
     if (buf->size + len + 1 > buf->capacity) {
-        size_t nc = buf->capacity * 2;
+        size_t nc = buf->capacity ? buf->capacity * 2 : 64;
         while (buf->size + len + 1 > nc) nc *= 2;
-        buf->data = realloc(buf->data, nc);
-        if (!buf->data) {
-            perror("realloc");
-            return false;
-        }
+        char* data = brz_realloc(buf->data, nc);
+        if (!data) return false;
+        buf->data = data;
         buf->capacity = nc;
     }
+    return true;
+}
+
+WARN_UNUSED static bool buffer_append(OutputBuffer* buf, const char* str, size_t len) {
+    if (!buf || !str || len == 0) return true;
+    if (!buffer_reserve(buf, len)) return false;
     memcpy(buf->data + buf->size, str, len);
     buf->size += len;
     buf->data[buf->size] = '\0';
@@ -92,20 +272,66 @@ WARN_UNUSED static bool buffer_append_str(OutputBuffer* buf, const char* str) {
     return str ? buffer_append(buf, str, strlen(str)) : true;
 }
 
+bool breeze_buffer_append(OutputBuffer* buf, const char* data, size_t len) { return buffer_append(buf, data, len); }
+
 /* ================================================================
    Dynamic context
    ================================================================ */
 
+/* The index is an open-addressed table of (var position + 1); 0 marks an
+ * empty slot. It is kept at most half full. */
+static size_t index_find(const TemplateContext* ctx, const char* key, bool* found) {
+    size_t mask = ctx->index_size - 1;
+    size_t i = (size_t)hash_string(key) & mask;
+    while (ctx->index[i]) {
+        if (strcmp(ctx->vars[ctx->index[i] - 1].key, key) == 0) {
+            *found = true;
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    *found = false;
+    return i;
+}
+
+WARN_UNUSED static bool index_rebuild(TemplateContext* ctx, size_t size) {
+    uint32_t* table = brz_calloc(size, sizeof(uint32_t));
+    if (!table) return false;
+    brz_free(ctx->index);
+    ctx->index = table;
+    ctx->index_size = size;
+    for (size_t v = 0; v < ctx->count; v++) {
+        bool found;
+        size_t i = index_find(ctx, ctx->vars[v].key, &found);
+        if (!found) ctx->index[i] = (uint32_t)(v + 1); /* first key wins, as in a linear scan */
+    }
+    return true;
+}
+
+bool context_build_index(TemplateContext* ctx) {
+    if (!ctx || ctx->count >= UINT32_MAX) return false;
+    size_t size = 16;
+    while (size < ctx->count * 2) size *= 2;
+    return index_rebuild(ctx, size);
+}
+
+void context_free_index(TemplateContext* ctx) {
+    if (!ctx) return;
+    brz_free(ctx->index);
+    ctx->index = NULL;
+    ctx->index_size = 0;
+}
+
 TemplateContext* context_new(size_t initial_capacity) {
     if (initial_capacity == 0) initial_capacity = 8;
-    TemplateContext* ctx = malloc(sizeof(TemplateContext));
+    TemplateContext* ctx = brz_calloc(1, sizeof(TemplateContext));
     if (!ctx) return NULL;
-    ctx->vars = malloc(sizeof(TemplateVar) * initial_capacity);
-    if (!ctx->vars) {
-        free(ctx);
+    ctx->vars = brz_malloc(sizeof(TemplateVar) * initial_capacity);
+    if (!ctx->vars || !context_build_index(ctx)) {
+        brz_free(ctx->vars);
+        brz_free(ctx);
         return NULL;
     }
-    ctx->count = 0;
     ctx->capacity = initial_capacity;
     return ctx;
 }
@@ -113,138 +339,46 @@ TemplateContext* context_new(size_t initial_capacity) {
 WARN_UNUSED bool context_set(TemplateContext* ctx, const char* key, TemplateValue value) {
     if (!ctx || !key) return false;
     /* update existing */
-    for (size_t i = 0; i < ctx->count; i++) {
-        if (strcmp(ctx->vars[i].key, key) == 0) {
-            ctx->vars[i].value = value;
+    if (ctx->index) {
+        bool found;
+        size_t i = index_find(ctx, key, &found);
+        if (found) {
+            ctx->vars[ctx->index[i] - 1].value = value;
             return true;
         }
+    } else {
+        for (size_t i = 0; i < ctx->count; i++) {
+            if (strcmp(ctx->vars[i].key, key) == 0) {
+                ctx->vars[i].value = value;
+                return true;
+            }
+        }
     }
     /* add new */
     if (ctx->count >= ctx->capacity) {
-        ctx->capacity *= 2;
-        ctx->vars = realloc(ctx->vars, sizeof(TemplateVar) * ctx->capacity);
-        if (!ctx->vars) return false;
+        size_t capacity = ctx->capacity ? ctx->capacity * 2 : 8;
+        TemplateVar* vars = brz_realloc(ctx->vars, sizeof(TemplateVar) * capacity);
+        if (!vars) return false;
+        ctx->vars = vars;
+        ctx->capacity = capacity;
     }
+    if (ctx->index && (ctx->count + 1) * 2 > ctx->index_size && !index_rebuild(ctx, ctx->index_size * 2))
+        return false;
     ctx->vars[ctx->count].key = key;
     ctx->vars[ctx->count].value = value;
     ctx->count++;
+    if (ctx->index) {
+        bool found;
+        ctx->index[index_find(ctx, key, &found)] = (uint32_t)ctx->count;
+    }
     return true;
 }
 
 void context_free(TemplateContext* ctx) {
     if (!ctx) return;
-    free(ctx->vars);
-    free(ctx);
-}
-
-/* ================================================================
-   Loop Stack
-   ================================================================ */
-
-typedef struct {
-    const TemplateValue* array;
-    size_t index;
-    char* item_name;
-    const char* loop_start;
-} LoopFrame;
-
-typedef struct {
-    LoopFrame* frames;
-    size_t depth;
-    size_t capacity;
-} LoopStack;
-
-WARN_UNUSED static bool evaluate_condition(const char* condition, const TemplateContext* ctx,
-                                           const LoopStack* loop_stack, TemplateError* err, const char* template_start,
-                                           const char* error_pos);
-
-ALWAYS_INLINE WARN_UNUSED static inline bool loop_stack_init(LoopStack* s, size_t cap) {
-    s->frames = malloc(sizeof(LoopFrame) * cap);
-    if (!s->frames) {
-        perror("malloc");
-        return false;
-    }
-    s->depth = 0;
-    s->capacity = cap;
-    return true;
-}
-
-ALWAYS_INLINE WARN_UNUSED static inline bool loop_stack_push(LoopStack* s, const TemplateValue* array,
-                                                             const char* item_name, const char* loop_start) {
-    if (s->depth >= s->capacity) {
-        s->capacity *= 2;
-        s->frames = realloc(s->frames, sizeof(LoopFrame) * s->capacity);
-        if (!s->frames) {
-            perror("realloc");
-            return false;
-        }
-    }
-    s->frames[s->depth++] =
-        (LoopFrame){.array = array, .index = 0, .item_name = strdup(item_name), .loop_start = loop_start};
-    return true;
-}
-
-ALWAYS_INLINE static inline void loop_stack_pop(LoopStack* s) {
-    if (s->depth > 0) {
-        s->depth--;
-        free(s->frames[s->depth].item_name);
-    }
-}
-
-ALWAYS_INLINE static inline LoopFrame* loop_stack_top(LoopStack* s) {
-    return s->depth > 0 ? &s->frames[s->depth - 1] : NULL;
-}
-
-/* ================================================================
-   Conditional Stack  (extended: elif support)
-   ================================================================ */
-
-typedef struct {
-    bool condition_met; /* true if any branch (if/elif) was taken   */
-    bool in_else_branch;
-    bool done; /* true once a branch has rendered (skip all others) */
-    const char* if_start;
-} ConditionalFrame;
-
-typedef struct {
-    ConditionalFrame* frames;
-    size_t depth;
-    size_t capacity;
-} ConditionalStack;
-
-WARN_UNUSED static bool conditional_stack_init(ConditionalStack* s, size_t cap) {
-    s->frames = malloc(sizeof(ConditionalFrame) * cap);
-    if (!s->frames) {
-        perror("malloc");
-        return false;
-    }
-    s->depth = 0;
-    s->capacity = cap;
-    return true;
-}
-
-WARN_UNUSED static bool conditional_stack_push(ConditionalStack* s, bool condition, const char* if_start) {
-    if (s->depth >= s->capacity) {
-        s->capacity *= 2;
-        s->frames = realloc(s->frames, sizeof(ConditionalFrame) * s->capacity);
-        if (!s->frames) {
-            perror("realloc");
-            return false;
-        }
-    }
-    s->frames[s->depth++] = (ConditionalFrame){.condition_met = condition,
-                                               .in_else_branch = false,
-                                               .done = condition, /* if true, this branch is "done" (rendered) */
-                                               .if_start = if_start};
-    return true;
-}
-
-static void conditional_stack_pop(ConditionalStack* s) {
-    if (s->depth > 0) s->depth--;
-}
-
-static ConditionalFrame* conditional_stack_top(ConditionalStack* s) {
-    return s->depth > 0 ? &s->frames[s->depth - 1] : NULL;
+    brz_free(ctx->index);
+    brz_free(ctx->vars);
+    brz_free(ctx);
 }
 
 /* ================================================================
@@ -255,20 +389,49 @@ ALWAYS_INLINE static inline bool set_error(TemplateError* err, TemplateErrorType
     if (err) {
         err->type = type;
         err->line = line;
+        err->column = 0;
         snprintf(err->message, sizeof(err->message) - 1, "%s", msg);
         err->message[sizeof(err->message) - 1] = '\0';
     }
     return false;
 }
 
-ALWAYS_INLINE static inline size_t calc_line(const char* start, const char* pos) {
+static int64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Line and column of `pos` by scanning from `start`. Only for errors raised
+ * before a template has its line table. */
+static size_t scan_position(const char* start, const char* pos, size_t* column) {
     size_t line = 1;
-    for (const char* c = start; c && c < pos; c++)
-        if (*c == '\n') line++;
+    const char* line_start = start;
+    for (const char* c = start; c && c < pos; c++) {
+        if (*c == '\n') {
+            line++;
+            line_start = c + 1;
+        }
+    }
+    *column = (size_t)(pos - line_start) + 1;
     return line;
 }
 
+static bool set_error_at(TemplateError* err, TemplateErrorType type, const char* msg, const char* src,
+                         const char* pos) {
+    size_t column;
+    size_t line = scan_position(src, pos, &column);
+    set_error(err, type, msg, line);
+    if (err) err->column = column;
+    return false;
+}
+
 ALWAYS_INLINE static inline const TemplateValue* context_get(const TemplateContext* ctx, const char* key) {
+    if (ctx->index) {
+        bool found;
+        size_t i = index_find(ctx, key, &found);
+        return found ? &ctx->vars[ctx->index[i] - 1].value : NULL;
+    }
     for (size_t i = 0; i < ctx->count; i++)
         if (strcmp(ctx->vars[i].key, key) == 0) return &ctx->vars[i].value;
     return NULL;
@@ -289,37 +452,219 @@ static char* str_trim(char* s) {
    value_to_string  (shared helper, also used by filters)
    ================================================================ */
 
-WARN_UNUSED static bool value_to_string(const TemplateValue* val, OutputBuffer* buf) {
-    char tmp[128];
-    switch (val->type) {
+/* Address of element `i`. Arrays with a stride hold values (or struct fields)
+ * `stride` bytes apart; without one, string arrays are `const char*[]` and
+ * other arrays hold a pointer to each value. */
+ALWAYS_INLINE static inline const void* array_elem(const TemplateValue* a, size_t i) {
+    const char* items = a->value.array.items;
+    if (a->value.array.stride) return items + i * a->value.array.stride;
+    if (a->value.array.item_type == TMPL_STRING) return (const char* const*)(const void*)items + i;
+    return ((const void* const*)(const void*)items)[i];
+}
+
+/* Load a value of `type` stored at `p` (array element or record field). */
+ALWAYS_INLINE static inline void load_value(ValueType type, const void* p, TemplateValue* item) {
+    item->type = type;
+    switch (type) {
         case TMPL_STRING:
-            return buffer_append(buf, val->value.str ? val->value.str : "",
-                                 val->value.str ? strlen(val->value.str) : 0);
+            item->value.str = *(const char* const*)p;
+            break;
         case TMPL_INT:
-            snprintf(tmp, sizeof(tmp), "%d", val->value.integer);
-            return buffer_append_str(buf, tmp);
+            item->value.integer = *(const int*)p;
+            break;
         case TMPL_FLOAT:
-            snprintf(tmp, sizeof(tmp), "%.4f", val->value.floating);
-            return buffer_append_str(buf, tmp);
+            item->value.floating = *(const float*)p;
+            break;
         case TMPL_DOUBLE:
-            snprintf(tmp, sizeof(tmp), "%.4f", val->value.dbl);
-            return buffer_append_str(buf, tmp);
+            item->value.dbl = *(const double*)p;
+            break;
         case TMPL_BOOL:
-            return buffer_append_str(buf, val->value.boolean ? "true" : "false");
+            item->value.boolean = *(const bool*)p;
+            break;
         case TMPL_LONG:
-            snprintf(tmp, sizeof(tmp), "%ld", val->value.long_int);
-            return buffer_append_str(buf, tmp);
+            item->value.long_int = *(const long*)p;
+            break;
         case TMPL_UINT:
-            snprintf(tmp, sizeof(tmp), "%u", val->value.uint);
-            return buffer_append_str(buf, tmp);
+            item->value.uint = *(const unsigned int*)p;
+            break;
+        case TMPL_STRV:
+            item->value.strv = *(const BreezeSlice*)p;
+            break;
         case TMPL_ARRAY:
-            snprintf(tmp, sizeof(tmp), "[array of size %zu]", val->value.array.count);
-            return buffer_append_str(buf, tmp);
+            item->value = *(const TemplateValueUnion*)p;
+            break;
+        default:
+            break;
+    }
+}
+
+ALWAYS_INLINE static inline void array_item(const TemplateValue* a, size_t i, TemplateValue* item) {
+    const void* p = array_elem(a, i);
+    if (a->value.array.item_type == TMPL_RECORD) {
+        *item = (TemplateValue){.type = TMPL_RECORD, .value.record = {p, a->value.array.record}};
+        return;
+    }
+    load_value(a->value.array.item_type, p, item);
+}
+
+bool breeze_array_get(const TemplateValue* array, size_t index, TemplateValue* item) {
+    if (!array || !item || array->type != TMPL_ARRAY || index >= array->value.array.count) return false;
+    array_item(array, index, item);
+    return true;
+}
+
+/* ================================================================
+   Number formatting
+   ================================================================ */
+
+/* Longest text format_number() produces. */
+#define NUMBER_MAX 128
+
+static const char g_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Write the decimal digits of `v` at `dst`; returns the length. */
+static size_t format_u64(char* dst, uint64_t v) {
+    char tmp[20];
+    char* p = tmp + sizeof(tmp);
+    while (v >= 100) {
+        const char* pair = g_digit_pairs + (v % 100) * 2;
+        v /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (v >= 10) {
+        *--p = g_digit_pairs[v * 2 + 1];
+        *--p = g_digit_pairs[v * 2];
+    } else {
+        *--p = (char)('0' + v);
+    }
+    size_t n = (size_t)(tmp + sizeof(tmp) - p);
+    memcpy(dst, p, n);
+    return n;
+}
+
+static size_t format_i64(char* dst, int64_t v) {
+    if (v >= 0) return format_u64(dst, (uint64_t)v);
+    *dst = '-';
+    return 1 + format_u64(dst + 1, (uint64_t)0 - (uint64_t)v);
+}
+
+/* Same text as printf("%.*f", prec, v). Values whose scaled form is small
+ * enough to be exact in a double are done with integer arithmetic; large
+ * values, non-finite values, high precisions and cases too close to a
+ * rounding tie to decide safely go through snprintf. */
+static size_t format_fixed(char* dst, double v, int prec) {
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+    bool neg = signbit(v) != 0;
+    double mag = neg ? -v : v;
+    if (prec >= 0 && prec <= 9 && mag < 1e15 / pow10[prec]) {
+        double scaled = mag * pow10[prec];
+        double whole = (double)(uint64_t)scaled;
+        double frac = scaled - whole;
+        double slack = 1e-9 + scaled * 1e-15; /* bound on the error of the multiplication */
+        if (frac < 0.5 - slack || frac > 0.5 + slack) {
+            uint64_t r = (uint64_t)whole + (frac > 0.5);
+            uint64_t unit = (uint64_t)pow10[prec];
+            size_t n = 0;
+            if (neg) dst[n++] = '-';
+            n += format_u64(dst + n, r / unit);
+            if (prec > 0) {
+                dst[n++] = '.';
+                char digits[20];
+                size_t d = format_u64(digits, r % unit);
+                memset(dst + n, '0', (size_t)prec - d);
+                memcpy(dst + n + (size_t)prec - d, digits, d);
+                n += (size_t)prec;
+            }
+            return n;
+        }
+    }
+    int n = snprintf(dst, NUMBER_MAX, "%.*f", prec, v);
+    return n < 0 ? 0 : n >= NUMBER_MAX ? NUMBER_MAX - 1 : (size_t)n;
+}
+
+/* Default text of a non-string value, written at `dst` (NUMBER_MAX bytes). */
+static size_t format_number(char* dst, const TemplateValue* val) {
+    switch (val->type) {
+        case TMPL_INT:
+            return format_i64(dst, val->value.integer);
+        case TMPL_FLOAT:
+            return format_fixed(dst, val->value.floating, 4);
+        case TMPL_DOUBLE:
+            return format_fixed(dst, val->value.dbl, 4);
+        case TMPL_BOOL:
+            memcpy(dst, val->value.boolean ? "true" : "false", val->value.boolean ? 4 : 5);
+            return val->value.boolean ? 4 : 5;
+        case TMPL_LONG:
+            return format_i64(dst, val->value.long_int);
+        case TMPL_UINT:
+            return format_u64(dst, val->value.uint);
+        case TMPL_RECORD:
+            memcpy(dst, "[record]", 8);
+            return 8;
+        case TMPL_ITER:
+            memcpy(dst, "[iterator]", 10);
+            return 10;
+        case TMPL_ARRAY: {
+            size_t n = sizeof("[array of size ") - 1;
+            memcpy(dst, "[array of size ", n);
+            n += format_u64(dst + n, val->value.array.count);
+            dst[n++] = ']';
+            return n;
+        }
         default:
             abort();
     }
 }
 
+ALWAYS_INLINE static inline bool is_string_value(const TemplateValue* val) {
+    return val->type == TMPL_STRING || val->type == TMPL_STRV;
+}
+
+/* Bytes of a string value. Only TMPL_STRING has to be measured. */
+ALWAYS_INLINE static inline const char* string_bytes(const TemplateValue* val, size_t* len) {
+    if (val->type == TMPL_STRV) {
+        *len = val->value.strv.data ? val->value.strv.len : 0;
+        return val->value.strv.data ? val->value.strv.data : "";
+    }
+    const char* s = val->value.str ? val->value.str : "";
+    *len = strlen(s);
+    return s;
+}
+
+/* Text of a value and its length: strings are returned as-is (TMPL_STRV
+ * text is not NUL-terminated), everything else is formatted into `tmp`. */
+static const char* value_text(const TemplateValue* val, char tmp[NUMBER_MAX], size_t* len) {
+    if (is_string_value(val)) return string_bytes(val, len);
+    *len = format_number(tmp, val);
+    tmp[*len] = '\0';
+    return tmp;
+}
+
+TemplateValue breeze_strn(const char* data, size_t len) {
+    return (TemplateValue){.type = TMPL_STRV, .value.strv = {data, len}};
+}
+
+const char* breeze_value_str(const TemplateValue* val, size_t* len) {
+    size_t n = 0;
+    const char* s = val && is_string_value(val) ? string_bytes(val, &n) : NULL;
+    if (len) *len = n;
+    return s;
+}
+
+WARN_UNUSED static bool value_to_string(const TemplateValue* val, OutputBuffer* buf) {
+    if (val->type == TMPL_STRING) return buffer_append_str(buf, val->value.str);
+    if (val->type == TMPL_STRV)
+        return !val->value.strv.data || buffer_append(buf, val->value.strv.data, val->value.strv.len);
+    if (!buffer_reserve(buf, NUMBER_MAX)) return false;
+    buf->size += format_number(buf->data + buf->size, val);
+    buf->data[buf->size] = '\0';
+    return true;
+}
+
 ALWAYS_INLINE static inline bool is_truthy(const TemplateValue* val) {
     if (!val) return false;
     switch (val->type) {
@@ -336,142 +681,215 @@ ALWAYS_INLINE static inline bool is_truthy(const TemplateValue* val) {
         case TMPL_UINT:
             return val->value.uint != 0;
         case TMPL_STRING:
-            return val->value.str && strlen(val->value.str) > 0;
+            return val->value.str && *val->value.str;
+        case TMPL_STRV:
+            return val->value.strv.data && val->value.strv.len > 0;
         case TMPL_ARRAY:
             return val->value.array.count > 0;
+        case TMPL_RECORD:
+            return val->value.record.ptr != NULL;
+        case TMPL_ITER:
+            return val->value.iter.count != 0; /* items cannot be peeked at without consuming them */
         default:
             return false;
     }
 }
 
+/* ================================================================
+   HTML escaping
+   ================================================================ */
+
+/* Byte-in-word test shared by the escaper and the literal scanner. */
+#define SWAR_ONES  ((uint64_t)0x0101010101010101ULL)
+#define SWAR_HIGHS ((uint64_t)0x8080808080808080ULL)
+
+ALWAYS_INLINE static inline uint64_t swar_has_byte(uint64_t word, unsigned char c) {
+    uint64_t x = word ^ (SWAR_ONES * c);
+    return (x - SWAR_ONES) & ~x & SWAR_HIGHS;
+}
+
+/* Replacement text for the five bytes HTML escaping expands; NULL for the rest. */
+static const char* const g_html_entities[256] = {
+    ['&'] = "&amp;", ['<'] = "&lt;", ['>'] = "&gt;", ['"'] = "&quot;", ['\''] = "&#39;",
+};
+
+/* Return the first byte in [p, end) that needs escaping, or `end`. Clean
+ * text is skipped 16 bytes at a time with SSE2 or NEON, 8 with SWAR. */
+static const char* find_escape_byte(const char* p, const char* end) {
+#if defined(__SSE2__)
+    const __m128i amp = _mm_set1_epi8('&'), lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+    const __m128i quot = _mm_set1_epi8('"'), apos = _mm_set1_epi8('\'');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(const void*)p);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+                                   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, quot)),
+                                                _mm_cmpeq_epi8(v, apos)));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) return p + __builtin_ctz((unsigned)mask);
+        p += 16;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    while (end - p >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)p);
+        uint8x16_t hit = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('&')), vceqq_u8(v, vdupq_n_u8('<'))),
+                                  vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('>')), vceqq_u8(v, vdupq_n_u8('"'))),
+                                           vceqq_u8(v, vdupq_n_u8('\''))));
+        if (vmaxvq_u8(hit)) break;
+        p += 16;
+    }
+#endif
+    while (end - p >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        if (swar_has_byte(word, '&') | swar_has_byte(word, '<') | swar_has_byte(word, '>') |
+            swar_has_byte(word, '"') | swar_has_byte(word, '\''))
+            break;
+        p += 8;
+    }
+    while (p < end && !g_html_entities[(unsigned char)*p]) p++;
+    return p;
+}
+
+/* Append `len` bytes HTML-escaped: clean spans are copied in one append. */
+WARN_UNUSED static bool escape_append(OutputBuffer* buf, const char* s, size_t len) {
+    const char* end = s + len;
+    while (s < end) {
+        const char* q = find_escape_byte(s, end);
+        if (!buffer_append(buf, s, (size_t)(q - s))) return false;
+        if (q == end) break;
+        if (!buffer_append_str(buf, g_html_entities[(unsigned char)*q])) return false;
+        s = q + 1;
+    }
+    return true;
+}
+
+/* Output a value, escaping strings. Numbers, booleans and the array
+ * placeholder never contain escapable bytes. */
+WARN_UNUSED static bool value_to_escaped(const TemplateValue* val, OutputBuffer* buf) {
+    if (!is_string_value(val)) return value_to_string(val, buf);
+    size_t len;
+    const char* s = string_bytes(val, &len);
+    return escape_append(buf, s, len);
+}
+
 /* ================================================================
    Built-in Filters
    ================================================================ */
 
+/* The string filters write their input text straight into `out` and then
+ * transform it there, so they need no temporary buffers. */
+
 static bool filter_upper(const TemplateValue* val, const char* arg, OutputBuffer* out) {
     (void)arg;
-    OutputBuffer tmp = {0};
-    if (!buffer_init(&tmp, 64)) return false;
-    if (!value_to_string(val, &tmp)) {
-        free(tmp.data);
-        return false;
-    }
-    for (size_t i = 0; i < tmp.size; i++) tmp.data[i] = (char)toupper((unsigned char)tmp.data[i]);
-    bool ok = buffer_append(out, tmp.data, tmp.size);
-    free(tmp.data);
-    return ok;
+    size_t start = out->size;
+    if (!value_to_string(val, out)) return false;
+    for (size_t i = start; i < out->size; i++) out->data[i] = (char)toupper((unsigned char)out->data[i]);
+    return true;
 }
 
 static bool filter_lower(const TemplateValue* val, const char* arg, OutputBuffer* out) {
     (void)arg;
-    OutputBuffer tmp = {0};
-    if (!buffer_init(&tmp, 64)) return false;
-    if (!value_to_string(val, &tmp)) {
-        free(tmp.data);
-        return false;
-    }
-    for (size_t i = 0; i < tmp.size; i++) tmp.data[i] = (char)tolower((unsigned char)tmp.data[i]);
-    bool ok = buffer_append(out, tmp.data, tmp.size);
-    free(tmp.data);
-    return ok;
+    size_t start = out->size;
+    if (!value_to_string(val, out)) return false;
+    for (size_t i = start; i < out->size; i++) out->data[i] = (char)tolower((unsigned char)out->data[i]);
+    return true;
 }
 
-static bool filter_len(const TemplateValue* val, const char* arg, OutputBuffer* out) {
+/* len  –  typed result: element count of arrays (and of iterators that know
+ * it), length of the text otherwise */
+static bool filter_len(const TemplateValue* val, const char* arg, TemplateValue* result, OutputBuffer* scratch) {
     (void)arg;
-    char tmp[64];
-    if (val->type == TMPL_STRING) {
-        snprintf(tmp, sizeof(tmp), "%zu", val->value.str ? strlen(val->value.str) : 0);
-    } else if (val->type == TMPL_ARRAY) {
-        snprintf(tmp, sizeof(tmp), "%zu", val->value.array.count);
-    } else {
-        /* length of string representation */
-        OutputBuffer sb = {0};
-        if (!buffer_init(&sb, 64)) return false;
-        if (!value_to_string(val, &sb)) {
-            free(sb.data);
-            return false;
-        }
-        snprintf(tmp, sizeof(tmp), "%zu", sb.size);
-        free(sb.data);
-    }
-    return buffer_append_str(out, tmp);
+    (void)scratch;
+    char tmp[NUMBER_MAX];
+    size_t n;
+    if (val->type == TMPL_ARRAY) n = val->value.array.count;
+    else if (val->type == TMPL_ITER && val->value.iter.count != BREEZE_COUNT_UNKNOWN) n = val->value.iter.count;
+    else value_text(val, tmp, &n);
+    *result = (TemplateValue){.type = TMPL_LONG, .value.long_int = (long)n};
+    return true;
 }
 
 static bool filter_trim(const TemplateValue* val, const char* arg, OutputBuffer* out) {
     (void)arg;
-    OutputBuffer tmp = {0};
-    if (!buffer_init(&tmp, 64)) return false;
-    if (!value_to_string(val, &tmp)) {
-        free(tmp.data);
-        return false;
+    char tmp[NUMBER_MAX];
+    size_t n;
+    const char* s = value_text(val, tmp, &n);
+    while (n > 0 && isspace((unsigned char)*s)) {
+        s++;
+        n--;
     }
-    char* s = str_trim(tmp.data);
-    bool ok = buffer_append_str(out, s);
-    free(tmp.data);
-    return ok;
+    while (n > 0 && isspace((unsigned char)s[n - 1])) n--;
+    return buffer_append(out, s, n);
 }
 
-static bool filter_reverse(const TemplateValue* val, const char* arg, OutputBuffer* out) {
+/* reverse  –  arrays stay arrays (reversed in `scratch`), anything else
+ * reverses its text */
+static bool filter_reverse(const TemplateValue* val, const char* arg, TemplateValue* result, OutputBuffer* scratch) {
     (void)arg;
-    OutputBuffer tmp = {0};
-    if (!buffer_init(&tmp, 64)) return false;
-    if (!value_to_string(val, &tmp)) {
-        free(tmp.data);
-        return false;
+    if (val->type == TMPL_ARRAY) {
+        /* The reversed array uses the pointer layout, whatever the input's. */
+        size_t n = val->value.array.count;
+        bool strings = val->value.array.item_type == TMPL_STRING;
+        for (size_t i = n; i > 0; i--) {
+            const void* elem = array_elem(val, i - 1);
+            if (strings) elem = *(const char* const*)elem;
+            if (!buffer_append(scratch, (const char*)&elem, sizeof(elem))) return false;
+        }
+        *result = *val;
+        result->value.array.items = n ? scratch->data : NULL;
+        result->value.array.stride = 0;
+        return true;
     }
-    /* reverse in place */
-    size_t n = tmp.size;
-    for (size_t i = 0; i < n / 2; i++) {
-        char c = tmp.data[i];
-        tmp.data[i] = tmp.data[n - 1 - i];
-        tmp.data[n - 1 - i] = c;
+    size_t start = scratch->size;
+    if (!value_to_string(val, scratch)) return false;
+    for (size_t i = start, j = scratch->size; i + 1 < j; i++, j--) {
+        char c = scratch->data[i];
+        scratch->data[i] = scratch->data[j - 1];
+        scratch->data[j - 1] = c;
     }
-    bool ok = buffer_append(out, tmp.data, n);
-    free(tmp.data);
-    return ok;
+    return true;
 }
 
-/* default:<fallback>  –  use fallback if value is falsy */
-static bool filter_default(const TemplateValue* val, const char* arg, OutputBuffer* out) {
-    if (!is_truthy(val)) {
-        return buffer_append_str(out, arg ? arg : "");
-    }
-    return value_to_string(val, out);
+/* default:<fallback>  –  pass a truthy value through unchanged, else the fallback */
+static bool filter_default(const TemplateValue* val, const char* arg, TemplateValue* result, OutputBuffer* scratch) {
+    (void)scratch;
+    *result = is_truthy(val) ? *val : (TemplateValue){.type = TMPL_STRING, .value.str = arg ? arg : ""};
+    return true;
 }
 
 /* truncate:<n>  –  cut string to at most n chars, append "..." if cut */
 static bool filter_truncate(const TemplateValue* val, const char* arg, OutputBuffer* out) {
     size_t maxlen = arg ? (size_t)atoi(arg) : 20;
-    OutputBuffer tmp = {0};
-    if (!buffer_init(&tmp, 64)) return false;
-    if (!value_to_string(val, &tmp)) {
-        free(tmp.data);
-        return false;
-    }
-    bool ok;
-    if (tmp.size <= maxlen) {
-        ok = buffer_append(out, tmp.data, tmp.size);
-    } else {
-        ok = buffer_append(out, tmp.data, maxlen) && buffer_append_str(out, "...");
-    }
-    free(tmp.data);
-    return ok;
+    char tmp[NUMBER_MAX];
+    size_t n;
+    const char* s = value_text(val, tmp, &n);
+    if (n <= maxlen) return buffer_append(out, s, n);
+    return buffer_append(out, s, maxlen) && buffer_append_str(out, "...");
 }
 
 /* capitalize  –  first char upper, rest lower */
 static bool filter_capitalize(const TemplateValue* val, const char* arg, OutputBuffer* out) {
     (void)arg;
-    OutputBuffer tmp = {0};
-    if (!buffer_init(&tmp, 64)) return false;
-    if (!value_to_string(val, &tmp)) {
-        free(tmp.data);
-        return false;
+    size_t start = out->size;
+    if (!value_to_string(val, out)) return false;
+    for (size_t i = start; i < out->size; i++) {
+        unsigned char ch = (unsigned char)out->data[i];
+        out->data[i] = i == start ? (char)toupper(ch) : (char)tolower(ch);
     }
-    for (size_t i = 0; i < tmp.size; i++)
-        tmp.data[i] = i == 0 ? (char)toupper((unsigned char)tmp.data[i]) : (char)tolower((unsigned char)tmp.data[i]);
-    bool ok = buffer_append(out, tmp.data, tmp.size);
-    free(tmp.data);
-    return ok;
+    return true;
+}
+
+/* First `n`-byte needle in `len` bytes of `hay`; neither need be NUL-terminated
+ * and `n` must be > 0. */
+static const char* find_bytes(const char* hay, size_t len, const char* needle, size_t n) {
+    while (len >= n) {
+        const char* p = memchr(hay, needle[0], len - n + 1);
+        if (!p) return NULL;
+        if (memcmp(p, needle, n) == 0) return p;
+        len -= (size_t)(p - hay) + 1;
+        hay = p + 1;
+    }
+    return NULL;
 }
 
 /* replace:<from>:<to>  –  replace all occurrences of <from> with <to> */
@@ -479,1061 +897,4724 @@ static bool filter_replace(const TemplateValue* val, const char* arg, OutputBuff
     /* arg format: "from:to" */
     if (!arg) return value_to_string(val, out);
     /* split arg on first ':' */
-    char arg_copy[256];
-    strncpy(arg_copy, arg, sizeof(arg_copy) - 1);
-    arg_copy[sizeof(arg_copy) - 1] = '\0';
-    char* colon = strchr(arg_copy, ':');
-    const char* from = arg_copy;
-    const char* to = "";
-    if (colon) {
-        *colon = '\0';
-        to = colon + 1;
-    }
-
-    OutputBuffer src = {0};
-    if (!buffer_init(&src, 64)) return false;
-    if (!value_to_string(val, &src)) {
-        free(src.data);
-        return false;
-    }
-
-    size_t from_len = strlen(from);
+    const char* colon = strchr(arg, ':');
+    size_t from_len = colon ? (size_t)(colon - arg) : strlen(arg);
+    const char* to = colon ? colon + 1 : "";
     size_t to_len = strlen(to);
-    if (from_len == 0) {
-        bool ok = buffer_append(out, src.data, src.size);
-        free(src.data);
-        return ok;
-    }
-
-    const char* p = src.data;
-    bool ok = true;
-    while (*p) {
-        if (strncmp(p, from, from_len) == 0) {
-            if (to_len > 0) ok = ok && buffer_append(out, to, to_len);
-            p += from_len;
-        } else {
-            ok = ok && buffer_append(out, p, 1);
-            p++;
-        }
-    }
-    free(src.data);
-    return ok;
-}
-
-/* Register all built-in filters */
-static void register_builtin_filters(void) {
-    if (!find_filter("upper")) breeze_register_filter("upper", filter_upper);
-    if (!find_filter("lower")) breeze_register_filter("lower", filter_lower);
-    if (!find_filter("len")) breeze_register_filter("len", filter_len);
-    if (!find_filter("trim")) breeze_register_filter("trim", filter_trim);
-    if (!find_filter("reverse")) breeze_register_filter("reverse", filter_reverse);
-    if (!find_filter("default")) breeze_register_filter("default", filter_default);
-    if (!find_filter("truncate")) breeze_register_filter("truncate", filter_truncate);
-    if (!find_filter("capitalize")) breeze_register_filter("capitalize", filter_capitalize);
-    if (!find_filter("replace")) breeze_register_filter("replace", filter_replace);
-}
-
-/* ================================================================
-   Apply a filter chain  e.g.  "name | upper | truncate:10"
-   ================================================================ */
-
-WARN_UNUSED static bool apply_filters(const TemplateValue* val, const char* filter_expr, OutputBuffer* out,
-                                      TemplateError* err, size_t line) {
-    /* Walk the filter chain (pipe-separated). The first filter receives
-     * the original typed value; subsequent filters receive string output
-     * from the previous filter. */
-    char chain[256];
-    strncpy(chain, filter_expr, sizeof(chain) - 1);
-    chain[sizeof(chain) - 1] = '\0';
-
-    char* saveptr = NULL;
-    char* tok = strtok_r(chain, "|", &saveptr);
-    bool first_filter = true;
-    OutputBuffer cur = {0};
-    while (tok) {
-        char* trimmed = str_trim(tok);
-        if (*trimmed == '\0') {
-            tok = strtok_r(NULL, "|", &saveptr);
-            continue;
-        }
-
-        /* Split on ':' to get filter name and optional arg */
-        char fname[64];
-        fname[0] = '\0';
-        char farg[192];
-        farg[0] = '\0';
-        char* colon = strchr(trimmed, ':');
-        if (colon) {
-            size_t nlen = (size_t)(colon - trimmed);
-            if (nlen >= sizeof(fname)) nlen = sizeof(fname) - 1;
-            memcpy(fname, trimmed, nlen);
-            fname[nlen] = '\0';
-            strncpy(farg, colon + 1, sizeof(farg) - 1);
-            farg[sizeof(farg) - 1] = '\0';
-        } else {
-            strncpy(fname, trimmed, sizeof(fname) - 1);
-            fname[sizeof(fname) - 1] = '\0';
-        }
-
-        BreezeFilterFn fn = find_filter(fname);
-        if (!fn) {
-            if (cur.data) free(cur.data);
-            char msg[128];
-            snprintf(msg, sizeof(msg), "Unknown filter '%s'", fname);
-            return set_error(err, TMPL_ERR_RENDER, msg, line);
-        }
 
-        /* Filter into a new buffer */
-        OutputBuffer next = {0};
-        if (!buffer_init(&next, 64)) {
-            if (cur.data) free(cur.data);
-            return set_error(err, TMPL_ERR_MEMORY, "filter next buf", line);
-        }
-
-        if (first_filter) {
-            if (!fn(val, *farg ? farg : NULL, &next)) {
-                if (cur.data) free(cur.data);
-                free(next.data);
-                return set_error(err, TMPL_ERR_RENDER, "Filter execution failed", line);
-            }
-            first_filter = false;
-        } else {
-            TemplateValue cur_val = {.type = TMPL_STRING, .value.str = cur.data};
-            if (!fn(&cur_val, *farg ? farg : NULL, &next)) {
-                if (cur.data) free(cur.data);
-                free(next.data);
-                return set_error(err, TMPL_ERR_RENDER, "Filter execution failed", line);
-            }
-        }
+    char tmp[NUMBER_MAX];
+    size_t len;
+    const char* p = value_text(val, tmp, &len);
+    const char* end = p + len;
+    if (from_len == 0) return buffer_append(out, p, len);
 
-        if (cur.data) free(cur.data);
-        cur = next;
-
-        tok = strtok_r(NULL, "|", &saveptr);
+    /* copy the text between matches in one append each */
+    bool ok = true;
+    for (const char* m = find_bytes(p, len, arg, from_len); ok && m;
+         m = find_bytes(p, (size_t)(end - p), arg, from_len)) {
+        ok = buffer_append(out, p, (size_t)(m - p)) && buffer_append(out, to, to_len);
+        p = m + from_len;
     }
-
-    bool ok = buffer_append(out, cur.data, cur.size);
-    if (cur.data) free(cur.data);
-    return ok;
+    return ok && buffer_append(out, p, (size_t)(end - p));
 }
 
-/* ================================================================
-   Loop item helper
-   ================================================================ */
-
-static void get_loop_item(const LoopFrame* f, TemplateValue* item) {
-    item->type = f->array->value.array.item_type;
-    switch (item->type) {
-        case TMPL_STRING:
-            item->value.str = ((const char**)f->array->value.array.items)[f->index];
-            break;
+/* round:<n>  –  format a number with n decimals (default 0) */
+static bool filter_round(const TemplateValue* val, const char* arg, OutputBuffer* out) {
+    int prec = arg ? atoi(arg) : 0;
+    if (prec < 0) prec = 0;
+    if (prec > 20) prec = 20;
+    double d;
+    switch (val->type) {
         case TMPL_INT:
-            item->value.integer = *(((int**)f->array->value.array.items)[f->index]);
+            d = val->value.integer;
             break;
         case TMPL_FLOAT:
-            item->value.floating = *(((float**)f->array->value.array.items)[f->index]);
+            d = val->value.floating;
             break;
         case TMPL_DOUBLE:
-            item->value.dbl = *(((double**)f->array->value.array.items)[f->index]);
-            break;
-        case TMPL_BOOL:
-            item->value.boolean = *(((bool**)f->array->value.array.items)[f->index]);
+            d = val->value.dbl;
             break;
         case TMPL_LONG:
-            item->value.long_int = *(((long**)f->array->value.array.items)[f->index]);
+            d = (double)val->value.long_int;
             break;
         case TMPL_UINT:
-            item->value.uint = *(((unsigned int**)f->array->value.array.items)[f->index]);
+            d = val->value.uint;
             break;
-        default:
+        case TMPL_STRING:
+        case TMPL_STRV: {
+            /* numeric strings, e.g. output of an earlier filter */
+            size_t len;
+            const char* str = string_bytes(val, &len);
+            char num[NUMBER_MAX];
+            if (len >= sizeof(num)) return buffer_append(out, str, len);
+            memcpy(num, str, len);
+            num[len] = '\0';
+            char* end;
+            d = strtod(num, &end);
+            if (end == num || *end) return buffer_append(out, str, len);
             break;
+        }
+        default:
+            return value_to_string(val, out);
     }
+    if (!buffer_reserve(out, NUMBER_MAX)) return false;
+    out->size += format_fixed(out->data + out->size, d, prec);
+    out->data[out->size] = '\0';
+    return true;
 }
 
-static bool find_loop_item_by_name(const LoopStack* s, const char* name, TemplateValue* item) {
-    for (size_t i = s->depth; i > 0; i--) {
-        const LoopFrame* lf = &s->frames[i - 1];
-        if (strcmp(name, lf->item_name) == 0) {
-            get_loop_item(lf, item);
-            return true;
-        }
-    }
-    return false;
+/* escape  –  HTML-escape & < > " ' */
+static bool filter_escape(const TemplateValue* val, const char* arg, OutputBuffer* out) {
+    (void)arg;
+    return value_to_escaped(val, out);
 }
 
-/* ================================================================
-   Expression evaluation
-   ================================================================ */
+/* safe  –  identity; marks the expression as exempt from autoescaping */
+static bool filter_safe(const TemplateValue* val, const char* arg, TemplateValue* result, OutputBuffer* scratch) {
+    (void)arg;
+    (void)scratch;
+    *result = *val;
+    return true;
+}
 
-WARN_UNUSED static bool expr_stack_init(ExprStack* s, size_t cap) {
-    s->tokens = malloc(sizeof(ExprToken) * cap);
-    if (!s->tokens) {
-        perror("malloc");
-        return false;
-    }
-    s->size = 0;
-    s->capacity = cap;
+static const struct {
+    const char* name;
+    BoundFilter bound;
+} builtin_filters[] = {
+    {"upper", {.fn = filter_upper}},
+    {"lower", {.fn = filter_lower}},
+    {"len", {.value_fn = filter_len}},
+    {"trim", {.fn = filter_trim}},
+    {"reverse", {.value_fn = filter_reverse}},
+    {"default", {.value_fn = filter_default}},
+    {"truncate", {.fn = filter_truncate}},
+    {"capitalize", {.fn = filter_capitalize}},
+    {"replace", {.fn = filter_replace}},
+    {"round", {.fn = filter_round}},
+    {"escape", {.fn = filter_escape}},
+    {"safe", {.value_fn = filter_safe}},
+};
+
+/* Register all built-in filters. Caller holds engine->lock. */
+WARN_UNUSED static bool register_builtin_filters(BreezeEngine* engine) {
+    for (size_t i = 0; i < sizeof(builtin_filters) / sizeof(builtin_filters[0]); i++)
+        if (!filter_table_put(engine, builtin_filters[i].name, builtin_filters[i].bound)) return false;
     return true;
 }
 
-static char* next_token(char* str, char** saveptr, char* buf, size_t bufsz) {
-    if (!str && !*saveptr) return NULL;
-    char* start = str ? str : *saveptr;
-    if (!*start) return NULL;
-    while (isspace(*start)) start++;
-    if (!*start) return NULL;
-    if (*start == '(' || *start == ')') {
-        if (bufsz >= 2) {
-            buf[0] = *start;
-            buf[1] = '\0';
-            *saveptr = start + 1;
-            return buf;
-        }
+/* Built-ins are pure, so their output on a constant can be computed once.
+ * A registered filter may not be (counters, clocks, lookups), even one that
+ * replaces a built-in under the same name. */
+static bool is_builtin_filter(const BoundFilter* bf) {
+    for (size_t i = 0; i < sizeof(builtin_filters) / sizeof(builtin_filters[0]); i++)
+        if (bf->fn == builtin_filters[i].bound.fn && bf->value_fn == builtin_filters[i].bound.value_fn) return true;
+    return false;
+}
+
+BreezeEngine* breeze_engine_new(void) {
+    BreezeEngine* engine = brz_calloc(1, sizeof(BreezeEngine));
+    if (!engine) return NULL;
+    if (pthread_mutex_init(&engine->lock, NULL) != 0) {
+        brz_free(engine);
         return NULL;
     }
-    char* end = start;
-    while (*end && !isspace(*end) && *end != '(' && *end != ')') end++;
-    size_t len = (size_t)(end - start);
-    if (len >= bufsz) return NULL;
-    memcpy(buf, start, len);
-    buf[len] = '\0';
-    *saveptr = end;
-    return buf;
+    if (!fragment_cache_init(&engine->fragments)) {
+        pthread_mutex_destroy(&engine->lock);
+        brz_free(engine);
+        return NULL;
+    }
+    engine->store = builtin_fragment_store(&engine->fragments);
+    engine->optimize = true;
+    if (!register_builtin_filters(engine)) {
+        breeze_engine_free(engine);
+        return NULL;
+    }
+    return engine;
 }
 
-WARN_UNUSED static bool expr_stack_push(ExprStack* s, ExprToken tok) {
-    if (s->size >= s->capacity) {
-        s->capacity *= 2;
-        s->tokens = realloc(s->tokens, sizeof(ExprToken) * s->capacity);
-        if (!s->tokens) {
-            perror("realloc");
-            return false;
-        }
-    }
-    s->tokens[s->size++] = tok;
-    return true;
+void breeze_engine_free(BreezeEngine* engine) {
+    if (!engine) return;
+    filter_table_clear(engine);
+    brz_free(engine->slots);
+    fragment_cache_destroy(&engine->fragments);
+    pthread_mutex_destroy(&engine->lock);
+    brz_free(engine);
 }
 
-static ExprToken expr_stack_pop(ExprStack* s) { return s->size > 0 ? s->tokens[--s->size] : (ExprToken){0}; }
-static ExprToken expr_stack_peek(ExprStack* s) { return s->size > 0 ? s->tokens[s->size - 1] : (ExprToken){0}; }
-static void expr_stack_free(ExprStack* s) { free(s->tokens); }
+/* Drop user filters and overrides; the built-ins stay available. */
+bool breeze_engine_clear_filters(BreezeEngine* engine) {
+    if (!engine) return false;
+    pthread_mutex_lock(&engine->lock);
+    filter_table_clear(engine);
+    bool ok = register_builtin_filters(engine);
+    pthread_mutex_unlock(&engine->lock);
+    return ok;
+}
 
-static int op_precedence(ExprTokenType op) {
-    switch (op) {
-        case TOKEN_NOT:
-            return 3;
-        case TOKEN_AND:
-            return 2;
-        case TOKEN_OR:
-            return 1;
-        default:
-            return 0;
-    }
-}
-
-WARN_UNUSED static bool infix_to_postfix(const char* expr, const TemplateContext* ctx, const LoopStack* loop_stack,
-                                         ExprStack* output, TemplateError* err, const char* ts, const char* ep) {
-    ExprStack ops = {0};
-    char* copy = NULL;
-    if (!expr_stack_init(&ops, 16)) goto oom;
-    copy = strdup(expr);
-    if (!copy) goto oom;
-    char* sp = NULL;
-    char tb[128];
-    char* tok = next_token(copy, &sp, tb, sizeof(tb));
-    while (tok) {
-        if (strcmp(tok, "and") == 0) {
-            while (ops.size > 0 && op_precedence(expr_stack_peek(&ops).type) >= op_precedence(TOKEN_AND))
-                if (!expr_stack_push(output, expr_stack_pop(&ops))) goto oom;
-            if (!expr_stack_push(&ops, (ExprToken){.type = TOKEN_AND})) goto oom;
-        } else if (strcmp(tok, "or") == 0) {
-            while (ops.size > 0 && op_precedence(expr_stack_peek(&ops).type) >= op_precedence(TOKEN_OR))
-                if (!expr_stack_push(output, expr_stack_pop(&ops))) goto oom;
-            if (!expr_stack_push(&ops, (ExprToken){.type = TOKEN_OR})) goto oom;
-        } else if (strcmp(tok, "not") == 0) {
-            if (!expr_stack_push(&ops, (ExprToken){.type = TOKEN_NOT})) goto oom;
-        } else if (strcmp(tok, "(") == 0) {
-            if (!expr_stack_push(&ops, (ExprToken){.type = TOKEN_LPAREN})) goto oom;
-        } else if (strcmp(tok, ")") == 0) {
-            while (ops.size > 0 && expr_stack_peek(&ops).type != TOKEN_LPAREN)
-                if (!expr_stack_push(output, expr_stack_pop(&ops))) goto oom;
-            if (ops.size == 0) {
-                set_error(err, TMPL_ERR_PARSE, "Mismatched parentheses", calc_line(ts, ep));
-                goto err;
-            }
-            expr_stack_pop(&ops);
-        } else {
-            bool v = evaluate_condition(tok, ctx, loop_stack, err, ts, ep);
-            if (err->type != TMPL_ERR_NONE) goto err;
-            if (!expr_stack_push(output, (ExprToken){.type = TOKEN_VALUE, .value = v})) goto oom;
-        }
-        tok = next_token(NULL, &sp, tb, sizeof(tb));
-    }
-    while (ops.size > 0) {
-        if (expr_stack_peek(&ops).type == TOKEN_LPAREN) {
-            set_error(err, TMPL_ERR_PARSE, "Mismatched parentheses", calc_line(ts, ep));
-            goto err;
-        }
-        if (!expr_stack_push(output, expr_stack_pop(&ops))) goto oom;
-    }
-    free(copy);
-    expr_stack_free(&ops);
-    return true;
-oom:
-    set_error(err, TMPL_ERR_MEMORY, "Memory allocation failed", calc_line(ts, ep));
-err:
-    free(copy);
-    expr_stack_free(&ops);
-    return false;
+void breeze_engine_set_autoescape(BreezeEngine* engine, bool on) {
+    if (!engine) return;
+    pthread_mutex_lock(&engine->lock);
+    engine->autoescape = on;
+    pthread_mutex_unlock(&engine->lock);
 }
 
-WARN_UNUSED static bool evaluate_postfix(ExprStack* s) {
-    ExprStack ev;
-    if (!expr_stack_init(&ev, s->size)) return false;
-    for (size_t i = 0; i < s->size; i++) {
-        ExprToken t = s->tokens[i];
-        switch (t.type) {
-            case TOKEN_VALUE:
-                if (!expr_stack_push(&ev, t)) {
-                    expr_stack_free(&ev);
-                    return false;
-                }
-                break;
-            case TOKEN_NOT: {
-                if (ev.size < 1) {
-                    expr_stack_free(&ev);
-                    return false;
-                }
-                bool v = expr_stack_pop(&ev).value;
-                if (!expr_stack_push(&ev, (ExprToken){.type = TOKEN_VALUE, .value = !v})) {
-                    expr_stack_free(&ev);
-                    return false;
-                }
-                break;
-            }
-            case TOKEN_AND: {
-                if (ev.size < 2) {
-                    expr_stack_free(&ev);
-                    return false;
-                }
-                bool b = expr_stack_pop(&ev).value, a = expr_stack_pop(&ev).value;
-                if (!expr_stack_push(&ev, (ExprToken){.type = TOKEN_VALUE, .value = a && b})) {
-                    expr_stack_free(&ev);
-                    return false;
-                }
-                break;
-            }
-            case TOKEN_OR: {
-                if (ev.size < 2) {
-                    expr_stack_free(&ev);
-                    return false;
-                }
-                bool b = expr_stack_pop(&ev).value, a = expr_stack_pop(&ev).value;
-                if (!expr_stack_push(&ev, (ExprToken){.type = TOKEN_VALUE, .value = a || b})) {
-                    expr_stack_free(&ev);
-                    return false;
-                }
-                break;
-            }
-            default:
-                expr_stack_free(&ev);
-                return false;
-        }
-    }
-    if (ev.size != 1) {
-        expr_stack_free(&ev);
-        return false;
-    }
-    bool r = expr_stack_pop(&ev).value;
-    expr_stack_free(&ev);
-    return r;
+void breeze_engine_set_optimize(BreezeEngine* engine, bool on) {
+    if (!engine) return;
+    pthread_mutex_lock(&engine->lock);
+    engine->optimize = on;
+    pthread_mutex_unlock(&engine->lock);
 }
 
-WARN_UNUSED static bool evaluate_condition(const char* cond, const TemplateContext* ctx, const LoopStack* ls,
-                                           TemplateError* err, const char* ts, const char* ep) {
-    if (!strstr(cond, " and ") && !strstr(cond, " or ") && !strstr(cond, " not ") && !strchr(cond, '(')) {
-        char buf[128];
-        strncpy(buf, cond, sizeof(buf) - 1);
-        buf[sizeof(buf) - 1] = '\0';
-        char* t = str_trim(buf);
+void breeze_engine_set_fragment_store(BreezeEngine* engine, const BreezeFragmentStore* store) {
+    if (!engine) return;
+    pthread_mutex_lock(&engine->lock);
+    engine->store = store ? *store : builtin_fragment_store(&engine->fragments);
+    pthread_mutex_unlock(&engine->lock);
+}
 
-        LoopFrame* lf = loop_stack_top((LoopStack*)ls);
-        TemplateValue item = {0};
-        if (find_loop_item_by_name(ls, t, &item)) return is_truthy(&item);
+static BreezeFragmentStore engine_fragment_store(BreezeEngine* engine) {
+    pthread_mutex_lock(&engine->lock);
+    BreezeFragmentStore store = engine->store;
+    pthread_mutex_unlock(&engine->lock);
+    return store;
+}
 
-        if (lf && strncmp(t, "loop.", 5) == 0) {
-            const char* meta = t + 5;
-            if (strcmp(meta, "index") == 0) return lf->index != 0;
-            if (strcmp(meta, "index1") == 0) return (lf->index + 1) != 0;
-            if (strcmp(meta, "first") == 0) return lf->index == 0;
-            if (strcmp(meta, "last") == 0) return lf->index == lf->array->value.array.count - 1;
-            if (strcmp(meta, "length") == 0) return lf->array->value.array.count != 0;
-        }
+void breeze_engine_invalidate_fragments(BreezeEngine* engine, const char* prefix) {
+    if (!engine) return;
+    BreezeFragmentStore store = engine_fragment_store(engine);
+    store.invalidate(store.userdata, prefix ? prefix : "");
+}
 
-        const TemplateValue* v = context_get(ctx, t);
-        if (!v) {
-            char msg[128];
-            snprintf(msg, sizeof(msg), "Missing template variable for '%s'", t);
-            return set_error(err, TMPL_ERR_PARSE, msg, calc_line(ts, ep));
-        }
-        return is_truthy(v);
-    }
-    ExprStack pf;
-    if (!expr_stack_init(&pf, 32)) return set_error(err, TMPL_ERR_MEMORY, "expr stack init failed", calc_line(ts, ep));
-    if (!infix_to_postfix(cond, ctx, ls, &pf, err, ts, ep)) {
-        expr_stack_free(&pf);
-        return false;
-    }
-    bool r = evaluate_postfix(&pf);
-    expr_stack_free(&pf);
-    return r;
+/* Engine behind breeze_compile(), render_template() and breeze_register_filter(). */
+static BreezeEngine* g_default_engine;
+static pthread_once_t g_default_engine_once = PTHREAD_ONCE_INIT;
+
+static void create_default_engine(void) { g_default_engine = breeze_engine_new(); }
+
+BreezeEngine* breeze_default_engine(void) {
+    pthread_once(&g_default_engine_once, create_default_engine);
+    return g_default_engine;
+}
+
+bool breeze_register_filter(const char* name, BreezeFilterFn fn) {
+    return breeze_engine_register_filter(breeze_default_engine(), name, fn);
+}
+
+bool breeze_register_value_filter(const char* name, BreezeValueFilterFn fn) {
+    return breeze_engine_register_value_filter(breeze_default_engine(), name, fn);
 }
 
+void breeze_clear_filters(void) { (void)breeze_engine_clear_filters(breeze_default_engine()); }
+
 /* ================================================================
-   Render variable expression  "varname | filter1 | filter2:arg"
-   Called when we have determined we should NOT skip output.
+   Compiled template representation
    ================================================================ */
 
-WARN_UNUSED static bool render_variable(const char* expr, const TemplateContext* ctx, const LoopStack* loop_stack,
-                                        OutputBuffer* out, TemplateError* err, const char* ts, const char* ep) {
-    /* Split on first '|' to separate variable name from filters */
-    char expr_copy[256];
-    strncpy(expr_copy, expr, sizeof(expr_copy) - 1);
-    expr_copy[sizeof(expr_copy) - 1] = '\0';
+/* A compiled template is a flat array of nodes. Control flow is expressed
+ * with node indices (branch targets, loop back-edges), so the renderer walks
+ * the array without ever looking at the source text again. All strings live
+ * in a single pool and are referenced by offset. */
 
-    char* pipe = strchr(expr_copy, '|');
-    char* filters_str = NULL;
-    if (pipe) {
-        *pipe = '\0';
-        filters_str = pipe + 1;
-    }
-
-    char* name = str_trim(expr_copy);
-
-    /* ---- handle loop meta-variables ---- */
-    LoopFrame* lf = loop_stack_top((LoopStack*)loop_stack);
-
-    /* loop.* variables */
-    if (strncmp(name, "loop.", 5) == 0 && lf) {
-        const char* meta = name + 5;
-        TemplateValue meta_val = {0};
-        bool found = true;
-        if (strcmp(meta, "index") == 0) {
-            meta_val.type = TMPL_UINT;
-            meta_val.value.uint = (unsigned int)lf->index;
-        } else if (strcmp(meta, "index1") == 0) {
-            meta_val.type = TMPL_UINT;
-            meta_val.value.uint = (unsigned int)(lf->index + 1);
-        } else if (strcmp(meta, "first") == 0) {
-            meta_val.type = TMPL_BOOL;
-            meta_val.value.boolean = (lf->index == 0);
-        } else if (strcmp(meta, "last") == 0) {
-            meta_val.type = TMPL_BOOL;
-            meta_val.value.boolean = (lf->index == lf->array->value.array.count - 1);
-        } else if (strcmp(meta, "length") == 0) {
-            meta_val.type = TMPL_UINT;
-            meta_val.value.uint = (unsigned int)lf->array->value.array.count;
-        } else {
-            found = false;
-        }
+#define NO_INDEX UINT32_MAX
 
-        if (found) {
-            if (filters_str && *str_trim(filters_str)) {
-                return apply_filters(&meta_val, filters_str, out, err, calc_line(ts, ep));
-            }
-            return value_to_string(&meta_val, out);
-        }
+/* Size of the staging chunk used when rendering to a BreezeWriter. */
+#define BREEZE_WRITER_CHUNK 8192
 
-        /* unknown loop.* – fall through to context lookup */
-    }
+typedef enum {
+    NODE_TEXT,   /* literal run from the pool */
+    NODE_VAR,    /* {{ expr | filters }} */
+    NODE_SET,    /* {% set name = value %} */
+    NODE_FOR,    /* loop header; jumps to `end` when the array is empty */
+    NODE_ENDFOR, /* loop back-edge; jumps to `body` while items remain */
+    NODE_BRANCH, /* if/elif condition; jumps to `target` when false */
+    NODE_JUMP,   /* end of a taken if/elif branch */
+    NODE_INCLUDE, /* {% include %}: run a compiled partial */
+    NODE_CACHE,   /* {% cache %}: emit the stored fragment and jump to `end`, or start capturing */
+    NODE_ENDCACHE, /* store the captured fragment */
+} NodeType;
 
-    /* ---- resolve from loop item or context ---- */
-    const TemplateValue* val = NULL;
-    TemplateValue item = {0};
-    if (find_loop_item_by_name(loop_stack, name, &item)) {
-        val = &item;
-    } else {
-        val = context_get(ctx, name);
-    }
+typedef enum { REF_NAME, REF_LOOP_ITEM, REF_LOOP_META } RefKind;
 
-    if (!val) {
-        char msg[128];
-        snprintf(msg, sizeof(msg), "Missing template variable for '%s'", name);
-        return set_error(err, TMPL_ERR_RENDER, msg, calc_line(ts, ep));
+typedef enum { META_INDEX, META_INDEX1, META_FIRST, META_LAST, META_LENGTH } LoopMeta;
+
+/* A variable reference resolved at compile time. Loop items and loop.*
+ * metadata are bound lexically to their loop frame; everything else is a
+ * name looked up in the set-variables and the context at render time. */
+typedef struct {
+    uint8_t kind;   /* RefKind */
+    uint8_t meta;   /* LoopMeta, for REF_LOOP_META */
+    uint16_t depth; /* loop frame, for REF_LOOP_ITEM / REF_LOOP_META */
+    uint32_t name;  /* index into names[], for REF_NAME */
+    uint32_t field; /* index into fields[] for `base.field`, or NO_INDEX */
+} VarRef;
+
+/* A `base.field` access. The field is looked up in the record's descriptor
+ * at render time and cached per site, since the struct type comes from the
+ * context. When the base is not a record, the whole dotted name is looked up
+ * as an ordinary key. */
+typedef struct {
+    uint32_t name; /* pool offset of the field name */
+    uint32_t full; /* name id of the whole dotted name */
+} FieldSite;
+
+typedef struct {
+    uint32_t name; /* pool offset of the filter name */
+    uint32_t arg;  /* pool offset of the argument, or NO_INDEX */
+} FilterCall;
+
+typedef enum {
+    COND_LOAD,  /* push a variable */
+    COND_CONST, /* push a literal */
+    COND_NOT,   /* replace the top with its negated truthiness */
+    COND_CMP,   /* pop two values, push the comparison */
+    COND_AND,   /* if the top is falsy jump to `arg`, else pop it */
+    COND_OR,    /* if the top is truthy jump to `arg`, else pop it */
+} CondOpcode;
+
+typedef enum { CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE, CMP_IN, CMP_NOT_IN } CmpOp;
+
+/* One instruction of a compiled condition. Conditions run on a small value
+ * stack; `and` / `or` jump over the right operand once the result is known,
+ * so it is never looked up. */
+typedef struct {
+    uint8_t op;   /* CondOpcode */
+    uint8_t cmp;  /* CmpOp, for COND_CMP */
+    uint8_t type; /* literal type, for COND_CONST */
+    uint32_t arg; /* jump target relative to the condition start, or pool offset of a string literal */
+    union {
+        VarRef ref; /* COND_LOAD */
+        long l;     /* TMPL_LONG and TMPL_BOOL literals */
+        double d;   /* TMPL_DOUBLE literals */
+    } as;
+} CondOp;
+
+typedef enum { BIND_LOOP_ITEM, BIND_SET } BindKind;
+
+/* A name in an included template that reads the includer's loop item or set
+ * variable of the same name at the include site. */
+typedef struct {
+    uint8_t kind;   /* BindKind */
+    uint32_t child; /* name id in the included template */
+    uint32_t from;  /* loop frame (BIND_LOOP_ITEM) or name id of the set variable (BIND_SET) */
+} IncludeBinding;
+
+/* Node flags */
+#define NODE_F_ESCAPE     0x01 /* NODE_VAR: HTML-escape the output (autoescape) */
+#define NODE_F_LOOP_COUNT 0x02 /* NODE_FOR: the body reads loop.length or loop.last */
+
+typedef struct {
+    uint8_t type;  /* NodeType */
+    uint8_t flags; /* NODE_F_* */
+    uint32_t pos;  /* source offset, for error reporting */
+    union {
+        struct {
+            uint32_t off, len;
+        } text;
+        struct {
+            VarRef ref;
+            uint32_t filters, nfilters;
+        } var;
+        struct {
+            uint32_t name;  /* name id of the variable */
+            uint32_t value; /* COND_CONST literal in conds[] */
+        } set;
+        struct {
+            VarRef array;
+            uint32_t depth, end;
+        } loop;
+        struct {
+            uint32_t depth, body;
+        } endloop;
+        struct {
+            uint32_t cond, ncond, target;
+        } branch;
+        struct {
+            uint32_t target;
+        } jump;
+        struct {
+            uint32_t index, bindings, nbindings;
+        } include;
+        struct {
+            uint32_t name;        /* pool offset of the fragment name */
+            uint32_t ttl;         /* seconds, 0 = no expiry */
+            uint32_t keys, nkeys; /* key variables, in cache_keys[] */
+            uint32_t end;         /* node after the matching NODE_ENDCACHE */
+        } cache;
+    } as;
+} Node;
+
+struct BreezeTemplate {
+    char* source;         /* copy of the template text, for error positions */
+    uint32_t* line_starts; /* source offset of each line, for locating errors by binary search */
+    size_t line_count;
+    Node* nodes;
+    size_t node_count;
+    char* pool; /* text runs, names, filter args and set values */
+    size_t pool_size;
+    uint32_t* names; /* pool offsets of interned identifiers */
+    size_t name_count;
+    FilterCall* filters;
+    BoundFilter* filter_fns; /* bound at compile time, parallel to filters; all NULL if unknown */
+    size_t filter_count;
+    CondOp* conds;
+    size_t cond_count;
+    FieldSite* fields;
+    size_t field_count;
+    size_t loop_depth; /* deepest for-nesting */
+    size_t cond_depth; /* deepest condition evaluation stack */
+    bool has_set;
+    uint32_t* name_slots; /* schema position of each name, NO_INDEX if undeclared; NULL without schema */
+    void* cache_entry; /* owning BreezeTemplateCache entry, if any */
+    BreezeTemplate** includes; /* compiled partials, each holding a cache reference */
+    size_t include_count;
+    IncludeBinding* bindings;
+    size_t binding_count;
+    BreezeTemplateCache* include_cache; /* cache the partials belong to */
+    VarRef* cache_keys; /* variables that key {% cache %} blocks */
+    size_t cache_key_count;
+    BreezeEngine* engine; /* engine compiled against; owns the fragment store */
+    BreezeFoldStats fold;
+    const void* image; /* saved image the arrays point into when loaded, else NULL and the arrays are owned */
+    size_t size_hint;  /* output size of recent renders; the one field written while rendering, atomically */
+};
+
+static void template_release_includes(BreezeTemplate* tpl);
+
+void breeze_template_free(BreezeTemplate* tpl) {
+    if (!tpl) return;
+    brz_free(tpl->filter_fns);
+    if (tpl->image) {
+        brz_free(tpl);
+        return;
     }
+    if (tpl->include_count) template_release_includes(tpl);
+    brz_free(tpl->includes);
+    brz_free(tpl->bindings);
+    brz_free(tpl->cache_keys);
+    brz_free(tpl->source);
+    brz_free(tpl->line_starts);
+    brz_free(tpl->nodes);
+    brz_free(tpl->pool);
+    brz_free(tpl->names);
+    brz_free(tpl->filters);
+    brz_free(tpl->conds);
+    brz_free(tpl->fields);
+    brz_free(tpl->name_slots);
+    brz_free(tpl);
+}
+
+/* Record where every source line starts, so an error position becomes a
+ * line and column by binary search instead of a scan of the source. */
+WARN_UNUSED static bool build_line_table(BreezeTemplate* tpl, size_t len) {
+    size_t count = 1;
+    for (const char* p = tpl->source; (p = memchr(p, '\n', len - (size_t)(p - tpl->source))); p++) count++;
+    if (!(tpl->line_starts = brz_malloc(count * sizeof(uint32_t)))) return false;
+    tpl->line_starts[0] = 0;
+    size_t n = 1;
+    for (const char* p = tpl->source; (p = memchr(p, '\n', len - (size_t)(p - tpl->source))); p++)
+        tpl->line_starts[n++] = (uint32_t)(p - tpl->source) + 1;
+    tpl->line_count = count;
+    return true;
+}
 
-    if (filters_str && *str_trim(filters_str)) {
-        return apply_filters(val, filters_str, out, err, calc_line(ts, ep));
+/* Line of source offset `pos`, and its column in `*column`; both 1-based. */
+static size_t template_position(const BreezeTemplate* tpl, uint32_t pos, size_t* column) {
+    size_t lo = 0, hi = tpl->line_count; /* find the last line starting at or before pos */
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tpl->line_starts[mid] <= pos) lo = mid;
+        else hi = mid;
     }
-    return value_to_string(val, out);
+    *column = pos - tpl->line_starts[lo] + 1;
+    return lo + 1;
+}
+
+static bool set_template_error(TemplateError* err, const BreezeTemplate* tpl, TemplateErrorType type,
+                               const char* msg, uint32_t pos) {
+    size_t column;
+    size_t line = template_position(tpl, pos, &column);
+    set_error(err, type, msg, line);
+    if (err) err->column = column;
+    return false;
 }
 
 /* ================================================================
-   Dynamic variable storage (for {% set %})
+   Compiler
    ================================================================ */
 
-#define SET_VAR_MAX 64
+typedef enum { BLOCK_IF, BLOCK_FOR, BLOCK_CACHE } BlockKind;
 
 typedef struct {
-    char key[64];
-    char value[256];
-} SetVar;
+    uint8_t kind; /* BlockKind */
+    bool has_else;
+    uint32_t node;  /* FOR or CACHE node, or the pending BRANCH node (NO_INDEX if none) */
+    uint32_t jumps; /* head of the chain of JUMP nodes patched at endif */
+    uint32_t item;  /* loop item name (BLOCK_FOR) */
+    uint32_t depth; /* loop frame index (BLOCK_FOR) */
+    uint32_t pos;   /* source offset of the opening tag */
+} CompileBlock;
+
+/* Templates being compiled through a cache, innermost first; used to reject
+ * include and extends cycles. */
+typedef struct IncludeChain {
+    const char* path;
+    const struct IncludeChain* parent;
+} IncludeChain;
+
+/* A file a cached template was built from, checked for hot reload. */
+typedef struct {
+    char* path;
+    int64_t mtime;
+    off_t size;
+} CacheDep;
 
+/* Resolves {% include %} and {% extends %} while compiling through a cache. */
 typedef struct {
-    SetVar vars[SET_VAR_MAX];
-    size_t count;
-} SetVarStore;
+    BreezeTemplateCache* cache;
+    const IncludeChain* chain;
+    CacheDep* deps; /* files read besides the template itself */
+    size_t dep_count, dep_cap;
+} Loader;
+
+static BreezeTemplate* loader_include(Loader* ld, const char* name, TemplateError* err);
+static char* loader_read(Loader* ld, const char* name, const IncludeChain* chain, char** path, TemplateError* err);
+
+typedef struct {
+    const char* src;
+    const char* src_end;
+    BreezeTemplate* tpl;
+    TemplateError* err;
+    Loader* loader; /* NULL unless compiling through a cache */
+    size_t node_cap, pool_cap, name_cap, filter_cap, cond_cap, field_cap, include_cap, binding_cap, cache_key_cap;
+    CompileBlock* blocks;
+    size_t depth, block_cap;
+    size_t loop_depth;
+    size_t open_blocks; /* {% block %} tags awaiting {% endblock %} */
+} Compiler;
+
+/* Grow *data so that it can hold at least `need` elements of `elem` bytes. */
+WARN_UNUSED static bool grow_array(void* data, size_t* cap, size_t need, size_t elem) {
+    void** p = (void**)data;
+    if (need <= *cap) return true;
+    size_t nc = *cap ? *cap * 2 : 16;
+    while (nc < need) nc *= 2;
+    void* nd = brz_realloc(*p, nc * elem);
+    if (!nd) return false;
+    *p = nd;
+    *cap = nc;
+    return true;
+}
 
-static void set_var_store_init(SetVarStore* s) { s->count = 0; }
+static bool compile_error(Compiler* c, TemplateErrorType type, const char* msg, const char* pos) {
+    return set_template_error(c->err, c->tpl, type, msg, (uint32_t)(pos - c->src));
+}
+
+static bool compile_oom(Compiler* c, const char* pos) {
+    return compile_error(c, TMPL_ERR_MEMORY, "Memory allocation failed", pos);
+}
+
+/* Append `len` bytes plus a terminating NUL to the pool; returns the offset. */
+WARN_UNUSED static bool pool_add(Compiler* c, const char* s, size_t len, uint32_t* off) {
+    BreezeTemplate* t = c->tpl;
+    if (!grow_array(&t->pool, &c->pool_cap, t->pool_size + len + 1, 1)) return false;
+    memcpy(t->pool + t->pool_size, s, len);
+    t->pool[t->pool_size + len] = '\0';
+    *off = (uint32_t)t->pool_size;
+    t->pool_size += len + 1;
+    return true;
+}
 
-static bool set_var_store_set(SetVarStore* s, const char* key, const char* value) {
-    for (size_t i = 0; i < s->count; i++) {
-        if (strcmp(s->vars[i].key, key) == 0) {
-            strncpy(s->vars[i].value, value, sizeof(s->vars[i].value) - 1);
-            s->vars[i].value[sizeof(s->vars[i].value) - 1] = '\0';
+WARN_UNUSED static bool intern_name_len(Compiler* c, const char* name, size_t len, uint32_t* id) {
+    BreezeTemplate* t = c->tpl;
+    for (size_t i = 0; i < t->name_count; i++) {
+        const char* known = t->pool + t->names[i];
+        if (strncmp(known, name, len) == 0 && known[len] == '\0') {
+            *id = (uint32_t)i;
             return true;
         }
     }
-    if (s->count >= SET_VAR_MAX) return false;
-    strncpy(s->vars[s->count].key, key, sizeof(s->vars[s->count].key) - 1);
-    strncpy(s->vars[s->count].value, value, sizeof(s->vars[s->count].value) - 1);
-    s->vars[s->count].key[sizeof(s->vars[s->count].key) - 1] = '\0';
-    s->vars[s->count].value[sizeof(s->vars[s->count].value) - 1] = '\0';
-    s->count++;
+    uint32_t off;
+    if (!pool_add(c, name, len, &off)) return false;
+    if (!grow_array(&t->names, &c->name_cap, t->name_count + 1, sizeof(uint32_t))) return false;
+    t->names[t->name_count] = off;
+    *id = (uint32_t)t->name_count++;
     return true;
 }
 
-static const char* set_var_store_get(const SetVarStore* s, const char* key) {
-    for (size_t i = 0; i < s->count; i++)
-        if (strcmp(s->vars[i].key, key) == 0) return s->vars[i].value;
-    return NULL;
+WARN_UNUSED static bool intern_name(Compiler* c, const char* name, uint32_t* id) {
+    return intern_name_len(c, name, strlen(name), id);
 }
 
-typedef enum { IF_BRANCH_NONE, IF_BRANCH_ELIF, IF_BRANCH_ELSE, IF_BRANCH_ENDIF } IfBranchType;
-
-static IfBranchType find_next_if_branch(const char* from, const char** branch_pos) {
-    int depth = 0;
-    const char* scan = from;
+WARN_UNUSED static bool emit_node(Compiler* c, Node node, uint32_t* index) {
+    BreezeTemplate* t = c->tpl;
+    if (!grow_array(&t->nodes, &c->node_cap, t->node_count + 1, sizeof(Node))) return false;
+    t->nodes[t->node_count] = node;
+    if (index) *index = (uint32_t)t->node_count;
+    t->node_count++;
+    return true;
+}
 
-    while (*scan) {
-        if (*scan == '{' && *(scan + 1) == '%') {
-            const char* ds = scan + 2;
-            const char* de = strstr(ds, "%}");
-            if (!de) break;
+WARN_UNUSED static bool emit_text(Compiler* c, const char* start, const char* end) {
+    if (end <= start) return true;
+    Node n = {.type = NODE_TEXT, .pos = (uint32_t)(start - c->src)};
+    if (!pool_add(c, start, (size_t)(end - start), &n.as.text.off)) return false;
+    n.as.text.len = (uint32_t)(end - start);
+    return emit_node(c, n, NULL);
+}
 
-            char directive[256];
-            size_t dlen = (size_t)(de - ds);
-            if (dlen >= sizeof(directive)) dlen = sizeof(directive) - 1;
-            memcpy(directive, ds, dlen);
-            directive[dlen] = '\0';
-            char* cmd = str_trim(directive);
+static bool parse_loop_meta(const char* meta, uint8_t* out) {
+    static const char* const names[] = {"index", "index1", "first", "last", "length"};
+    for (uint8_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(meta, names[i]) == 0) {
+            *out = i;
+            return true;
+        }
+    }
+    return false;
+}
 
-            if (strncmp(cmd, "if ", 3) == 0) {
-                depth++;
-            } else if (strcmp(cmd, "endif") == 0) {
-                if (depth == 0) {
-                    *branch_pos = scan;
-                    return IF_BRANCH_ENDIF;
+/* Bind a name to the innermost loop that declares it, to loop metadata, or
+ * to a render-time name lookup. `base.field` binds `base` that way and
+ * records a field access site. */
+WARN_UNUSED static bool resolve_ref(Compiler* c, const char* name, VarRef* ref) {
+    *ref = (VarRef){.kind = REF_NAME, .field = NO_INDEX};
+    if (c->loop_depth > 0 && strncmp(name, "loop.", 5) == 0 && parse_loop_meta(name + 5, &ref->meta)) {
+        ref->kind = REF_LOOP_META;
+        ref->depth = (uint16_t)(c->loop_depth - 1);
+        if (ref->meta == META_LAST || ref->meta == META_LENGTH) {
+            /* Iterators only know these when they carry a count; let the loop check up front. */
+            for (size_t i = c->depth; i > 0; i--) {
+                if (c->blocks[i - 1].kind == BLOCK_FOR) {
+                    c->tpl->nodes[c->blocks[i - 1].node].flags |= NODE_F_LOOP_COUNT;
+                    break;
                 }
-                depth--;
-            } else if (depth == 0 && strncmp(cmd, "elif ", 5) == 0) {
-                *branch_pos = scan;
-                return IF_BRANCH_ELIF;
-            } else if (depth == 0 && strcmp(cmd, "else") == 0) {
-                *branch_pos = scan;
-                return IF_BRANCH_ELSE;
             }
-
-            scan = de + 2;
-            continue;
         }
-        scan++;
+        return true;
+    }
+    size_t base_len = strlen(name);
+    const char* dot = strchr(name, '.');
+    if (dot && dot > name && dot[1]) {
+        BreezeTemplate* t = c->tpl;
+        FieldSite site;
+        if (!intern_name(c, name, &site.full) || !pool_add(c, dot + 1, strlen(dot + 1), &site.name) ||
+            !grow_array(&t->fields, &c->field_cap, t->field_count + 1, sizeof(FieldSite)))
+            return false;
+        t->fields[t->field_count] = site;
+        ref->field = (uint32_t)t->field_count++;
+        base_len = (size_t)(dot - name);
+    }
+    uint32_t id;
+    if (!intern_name_len(c, name, base_len, &id)) return false;
+    for (size_t i = c->depth; i > 0; i--) {
+        const CompileBlock* b = &c->blocks[i - 1];
+        if (b->kind == BLOCK_FOR && b->item == id) {
+            ref->kind = REF_LOOP_ITEM;
+            ref->depth = (uint16_t)b->depth;
+            return true;
+        }
     }
+    ref->name = id;
+    return true;
+}
 
-    *branch_pos = NULL;
-    return IF_BRANCH_NONE;
+WARN_UNUSED static bool push_block(Compiler* c, CompileBlock b) {
+    if (!grow_array(&c->blocks, &c->block_cap, c->depth + 1, sizeof(CompileBlock))) return false;
+    c->blocks[c->depth++] = b;
+    return true;
 }
 
-static const char* find_matching_endfor(const char* from) {
-    int depth = 1;
-    const char* scan = from;
+static CompileBlock* top_block(Compiler* c) { return c->depth > 0 ? &c->blocks[c->depth - 1] : NULL; }
 
-    while (*scan && depth > 0) {
-        if (*scan == '{' && *(scan + 1) == '%') {
-            const char* ds = scan + 2;
-            const char* de = strstr(ds, "%}");
-            if (!de) break;
+/* {{ name | filter1 | filter2:arg }} */
+static bool compile_variable(Compiler* c, const char* expr, const char* tag) {
+    BreezeTemplate* t = c->tpl;
+    char* copy = brz_strdup(expr);
+    if (!copy) return compile_oom(c, tag);
 
-            char directive[256];
-            size_t dlen = (size_t)(de - ds);
-            if (dlen >= sizeof(directive)) dlen = sizeof(directive) - 1;
-            memcpy(directive, ds, dlen);
-            directive[dlen] = '\0';
-            char* cmd = str_trim(directive);
+    char* pipe = strchr(copy, '|');
+    char* filters = NULL;
+    if (pipe) {
+        *pipe = '\0';
+        filters = pipe + 1;
+    }
 
-            if (strncmp(cmd, "for ", 4) == 0) {
-                depth++;
-            } else if (strcmp(cmd, "endfor") == 0) {
-                depth--;
-                if (depth == 0) return de + 2;
-            }
+    Node n = {.type = NODE_VAR, .pos = (uint32_t)(tag - c->src)};
+    if (!resolve_ref(c, str_trim(copy), &n.as.var.ref)) goto oom;
+    n.as.var.filters = (uint32_t)t->filter_count;
 
-            scan = de + 2;
-            continue;
+    char* saveptr = NULL;
+    for (char* tok = filters ? strtok_r(filters, "|", &saveptr) : NULL; tok; tok = strtok_r(NULL, "|", &saveptr)) {
+        char* trimmed = str_trim(tok);
+        if (*trimmed == '\0') continue;
+
+        /* Split on ':' to get filter name and optional arg */
+        FilterCall fc = {.arg = NO_INDEX};
+        char* colon = strchr(trimmed, ':');
+        if (colon) {
+            *colon = '\0';
+            if (colon[1] && !pool_add(c, colon + 1, strlen(colon + 1), &fc.arg)) goto oom;
         }
-        scan++;
+        char* fname = str_trim(trimmed);
+        if (!pool_add(c, fname, strlen(fname), &fc.name)) goto oom;
+        if (!grow_array(&t->filters, &c->filter_cap, t->filter_count + 1, sizeof(FilterCall))) goto oom;
+        t->filters[t->filter_count++] = fc;
+        n.as.var.nfilters++;
     }
 
-    return scan;
+    brz_free(copy);
+    if (!emit_node(c, n, NULL)) return compile_oom(c, tag);
+    return true;
+oom:
+    brz_free(copy);
+    return compile_oom(c, tag);
 }
 
-static const char* find_matching_endif(const char* from) {
-    int depth = 0;
-    const char* scan = from;
-
-    while (*scan) {
-        if (*scan == '{' && *(scan + 1) == '%') {
-            const char* ds = scan + 2;
-            const char* de = strstr(ds, "%}");
-            if (!de) break;
-
-            char directive[256];
-            size_t dlen = (size_t)(de - ds);
-            if (dlen >= sizeof(directive)) dlen = sizeof(directive) - 1;
-            memcpy(directive, ds, dlen);
-            directive[dlen] = '\0';
-            char* cmd = str_trim(directive);
+WARN_UNUSED static bool emit_cond_op(Compiler* c, CondOp op) {
+    BreezeTemplate* t = c->tpl;
+    if (!grow_array(&t->conds, &c->cond_cap, t->cond_count + 1, sizeof(CondOp))) return false;
+    t->conds[t->cond_count++] = op;
+    return true;
+}
 
-            if (strncmp(cmd, "if ", 3) == 0) {
-                depth++;
-            } else if (strcmp(cmd, "endif") == 0) {
-                if (depth == 0) return de + 2;
-                depth--;
-            }
+typedef enum {
+    CTOK_END,
+    CTOK_LPAREN,
+    CTOK_RPAREN,
+    CTOK_AND,
+    CTOK_OR,
+    CTOK_NOT,
+    CTOK_IN,
+    CTOK_CMP,
+    CTOK_STRING,
+    CTOK_WORD, /* name or number */
+    CTOK_BAD,
+} CondTokType;
+
+/* Recursive-descent parser for if/elif conditions:
+ *
+ *   or   := and ('or' and)*
+ *   and  := not ('and' not)*
+ *   not  := 'not' not | cmp
+ *   cmp  := atom [('==' | '!=' | '<' | '<=' | '>' | '>=' | 'in' | 'not in') atom]
+ *   atom := '(' or ')' | "string" | 'string' | number | true | false | name
+ */
+typedef struct {
+    Compiler* c;
+    const char* tag;
+    const char* p;     /* next unread character */
+    uint8_t tok;       /* CondTokType of the current token */
+    uint8_t cmp;       /* CmpOp, for CTOK_CMP */
+    const char* start; /* current token text (string contents for CTOK_STRING) */
+    size_t len;
+    uint32_t base;  /* index of the condition's first instruction */
+    size_t depth;   /* value stack depth at the current instruction */
+    bool failed;    /* an error has been reported */
+} CondParser;
+
+static bool cond_word_char(char ch) {
+    return ch && !isspace((unsigned char)ch) && !strchr("()=!<>\"'", ch);
+}
 
-            scan = de + 2;
-            continue;
+static void cond_next(CondParser* ps) {
+    const char* p = ps->p;
+    while (isspace((unsigned char)*p)) p++;
+    ps->start = p;
+    ps->len = 1;
+    if (!*p) {
+        ps->tok = CTOK_END;
+        ps->len = 0;
+    } else if (*p == '(' || *p == ')') {
+        ps->tok = *p == '(' ? CTOK_LPAREN : CTOK_RPAREN;
+    } else if (*p == '"' || *p == '\'') {
+        const char* close = strchr(p + 1, *p);
+        ps->tok = close ? CTOK_STRING : CTOK_BAD;
+        ps->start = p + 1;
+        ps->len = close ? (size_t)(close - p - 1) : 0;
+        p = close ? close : p;
+    } else if (strchr("=!<>", *p)) {
+        bool eq = p[1] == '=';
+        ps->tok = CTOK_CMP;
+        ps->len = eq ? 2 : 1;
+        switch (*p) {
+            case '=':
+                ps->cmp = CMP_EQ;
+                if (!eq) ps->tok = CTOK_BAD;
+                break;
+            case '!':
+                ps->cmp = CMP_NE;
+                if (!eq) ps->tok = CTOK_BAD;
+                break;
+            case '<':
+                ps->cmp = eq ? CMP_LE : CMP_LT;
+                break;
+            default:
+                ps->cmp = eq ? CMP_GE : CMP_GT;
+                break;
         }
-        scan++;
+        p += ps->len - 1;
+    } else {
+        const char* e = p;
+        while (cond_word_char(*e)) e++;
+        ps->len = (size_t)(e - p);
+        p = e - 1;
+        if (ps->len == 3 && strncmp(ps->start, "and", 3) == 0) ps->tok = CTOK_AND;
+        else if (ps->len == 2 && strncmp(ps->start, "or", 2) == 0) ps->tok = CTOK_OR;
+        else if (ps->len == 3 && strncmp(ps->start, "not", 3) == 0) ps->tok = CTOK_NOT;
+        else if (ps->len == 2 && strncmp(ps->start, "in", 2) == 0) ps->tok = CTOK_IN;
+        else ps->tok = CTOK_WORD;
     }
+    ps->p = p + (*p ? 1 : 0);
+}
 
-    return scan;
+static bool cond_fail(CondParser* ps, TemplateErrorType type, const char* msg) {
+    if (!ps->failed) compile_error(ps->c, type, msg, ps->tag);
+    ps->failed = true;
+    return false;
 }
 
-/* ================================================================
-   Core render function
-   ================================================================ */
+static bool cond_emit(CondParser* ps, CondOp op, int stack_effect) {
+    if (!emit_cond_op(ps->c, op)) return cond_fail(ps, TMPL_ERR_MEMORY, "Memory allocation failed");
+    ps->depth = (size_t)((ptrdiff_t)ps->depth + stack_effect);
+    if (ps->depth > ps->c->tpl->cond_depth) ps->c->tpl->cond_depth = ps->depth;
+    return true;
+}
 
-bool render_template(const char* template, const TemplateContext* ctx, OutputBuffer* out, TemplateError* err) {
-    register_builtin_filters();
+/* Parse a number literal; false if the word is not entirely a number. */
+static bool parse_number_literal(const char* s, size_t len, CondOp* op) {
+    char buf[64];
+    if (len == 0 || len >= sizeof(buf) || !(isdigit((unsigned char)s[0]) || s[0] == '-' || s[0] == '.')) return false;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    char* end;
+    errno = 0;
+    long l = strtol(buf, &end, 10);
+    if (*end == '\0' && errno == 0) {
+        op->type = TMPL_LONG;
+        op->as.l = l;
+        return true;
+    }
+    double d = strtod(buf, &end);
+    if (*end != '\0') return false;
+    op->type = TMPL_DOUBLE;
+    op->as.d = d;
+    return true;
+}
 
-    /* Ensure error is initialised */
-    if (err) {
-        err->type = TMPL_ERR_NONE;
-        err->line = 0;
-        err->message[0] = '\0';
+/* A `true` / `false` or number literal, as a COND_CONST; false for any other word. */
+static bool parse_literal_word(const char* s, size_t len, CondOp* op) {
+    if ((len == 4 && strncmp(s, "true", 4) == 0) || (len == 5 && strncmp(s, "false", 5) == 0)) {
+        op->type = TMPL_BOOL;
+        op->as.l = len == 4;
+        return true;
     }
+    return parse_number_literal(s, len, op);
+}
 
-    LoopStack loop_stack;
-    ConditionalStack cond_stack;
-    SetVarStore set_vars;
+static bool parse_cond_or(CondParser* ps);
 
-    if (!loop_stack_init(&loop_stack, 4)) return set_error(err, TMPL_ERR_MEMORY, "malloc failed for loop stack", 1);
-    if (!conditional_stack_init(&cond_stack, 4)) {
-        free(loop_stack.frames);
-        return set_error(err, TMPL_ERR_MEMORY, "malloc failed for conditional stack", 1);
+static bool parse_cond_atom(CondParser* ps) {
+    CondOp op = {.op = COND_CONST};
+    switch (ps->tok) {
+        case CTOK_LPAREN:
+            cond_next(ps);
+            if (!parse_cond_or(ps)) return false;
+            if (ps->tok != CTOK_RPAREN) return cond_fail(ps, TMPL_ERR_PARSE, "Mismatched parentheses");
+            cond_next(ps);
+            return true;
+        case CTOK_STRING:
+            if (!pool_add(ps->c, ps->start, ps->len, &op.arg))
+                return cond_fail(ps, TMPL_ERR_MEMORY, "Memory allocation failed");
+            op.type = TMPL_STRING;
+            break;
+        case CTOK_WORD:
+            if (!parse_literal_word(ps->start, ps->len, &op)) {
+                char name[128];
+                if (ps->len >= sizeof(name)) return cond_fail(ps, TMPL_ERR_PARSE, "Condition operand too long");
+                memcpy(name, ps->start, ps->len);
+                name[ps->len] = '\0';
+                op = (CondOp){.op = COND_LOAD};
+                if (!resolve_ref(ps->c, name, &op.as.ref))
+                    return cond_fail(ps, TMPL_ERR_MEMORY, "Memory allocation failed");
+            }
+            break;
+        case CTOK_RPAREN:
+            return cond_fail(ps, TMPL_ERR_PARSE, "Mismatched parentheses");
+        default:
+            return cond_fail(ps, TMPL_ERR_PARSE, "Malformed condition");
     }
-    set_var_store_init(&set_vars);
+    cond_next(ps);
+    return cond_emit(ps, op, 1);
+}
 
-    bool in_comment = false;
-    const char* last_comment = NULL;
-    bool in_raw = false;
+static bool parse_cond_cmp(CondParser* ps) {
+    if (!parse_cond_atom(ps)) return false;
+    CondOp op = {.op = COND_CMP};
+    if (ps->tok == CTOK_CMP) {
+        op.cmp = ps->cmp;
+    } else if (ps->tok == CTOK_IN) {
+        op.cmp = CMP_IN;
+    } else if (ps->tok == CTOK_NOT) {
+        /* `not in`; a bare `not` here is an error either way */
+        cond_next(ps);
+        if (ps->tok != CTOK_IN) return cond_fail(ps, TMPL_ERR_PARSE, "Malformed condition");
+        op.cmp = CMP_NOT_IN;
+    } else {
+        return true;
+    }
+    cond_next(ps);
+    if (!parse_cond_atom(ps)) return false;
+    if (ps->tok == CTOK_CMP || ps->tok == CTOK_IN)
+        return cond_fail(ps, TMPL_ERR_PARSE, "Chained comparisons are not supported");
+    return cond_emit(ps, op, -1);
+}
 
-    const char* p = template;
+static bool parse_cond_not(CondParser* ps) {
+    if (ps->tok != CTOK_NOT) return parse_cond_cmp(ps);
+    cond_next(ps);
+    return parse_cond_not(ps) && cond_emit(ps, (CondOp){.op = COND_NOT}, 0);
+}
 
-#define CLEANUP()                                                        \
-    do {                                                                 \
-        while (loop_stack.depth > 0) loop_stack_pop(&loop_stack);        \
-        while (cond_stack.depth > 0) conditional_stack_pop(&cond_stack); \
-        free(loop_stack.frames);                                         \
-        free(cond_stack.frames);                                         \
-    } while (0)
+/* Parse one `and` / `or` level: operands joined by jumps that skip the rest
+ * of the chain once its value is decided. */
+static bool parse_cond_chain(CondParser* ps, uint8_t tok, uint8_t opcode, bool (*operand)(CondParser*)) {
+    if (!operand(ps)) return false;
+    uint32_t pending = NO_INDEX; /* jumps to patch, linked through `arg` */
+    while (ps->tok == tok) {
+        cond_next(ps);
+        CondOp j = {.op = opcode, .arg = pending};
+        pending = (uint32_t)ps->c->tpl->cond_count;
+        if (!cond_emit(ps, j, -1) || !operand(ps)) return false;
+    }
+    CondOp* ops = ps->c->tpl->conds;
+    uint32_t end = (uint32_t)ps->c->tpl->cond_count - ps->base;
+    while (pending != NO_INDEX) {
+        uint32_t next = ops[pending].arg;
+        ops[pending].arg = end;
+        pending = next;
+    }
+    return true;
+}
 
-    while (*p) {
-        /* ----- HTML comment handling ----- */
-        if (!in_comment && !in_raw && *p == '<' && strncmp(p, "<!--", 4) == 0) {
-            in_comment = true;
-            last_comment = p;
-            p += 4;
-            continue;
+static bool parse_cond_and(CondParser* ps) { return parse_cond_chain(ps, CTOK_AND, COND_AND, parse_cond_not); }
+
+static bool parse_cond_or(CondParser* ps) { return parse_cond_chain(ps, CTOK_OR, COND_OR, parse_cond_and); }
+
+/* Compile an if/elif condition into a stack program. Operands are bound to
+ * variable references here and only looked up when evaluated. */
+static bool compile_condition(Compiler* c, const char* expr, const char* tag, Node* n) {
+    CondParser ps = {.c = c, .tag = tag, .p = expr, .base = (uint32_t)c->tpl->cond_count};
+    n->as.branch.cond = ps.base;
+    cond_next(&ps);
+    if (!parse_cond_or(&ps)) return false;
+    if (ps.tok == CTOK_RPAREN) return cond_fail(&ps, TMPL_ERR_PARSE, "Mismatched parentheses");
+    if (ps.tok != CTOK_END) return cond_fail(&ps, TMPL_ERR_PARSE, "Malformed condition");
+    n->as.branch.ncond = (uint32_t)(c->tpl->cond_count - ps.base);
+    return true;
+}
+
+/* {% for item in items %} */
+static bool compile_for(Compiler* c, char* cmd, const char* tag) {
+    char* sp2;
+    char* parts[4] = {0};
+    char* tok = strtok_r(cmd, " ", &sp2);
+    for (int i = 0; tok && i < 4; i++) {
+        parts[i] = tok;
+        tok = strtok_r(NULL, " ", &sp2);
+    }
+    if (!parts[0] || !parts[1] || !parts[2] || !parts[3] || strcmp(parts[0], "for") != 0 ||
+        strcmp(parts[2], "in") != 0) {
+        return compile_error(c, TMPL_ERR_SYNTAX, "Invalid 'for' loop. Use: {% for item in items %}", tag);
+    }
+    if (c->loop_depth >= UINT16_MAX) return compile_error(c, TMPL_ERR_SYNTAX, "Loops nested too deeply", tag);
+
+    Node n = {.type = NODE_FOR, .pos = (uint32_t)(tag - c->src)};
+    CompileBlock b = {.kind = BLOCK_FOR, .pos = n.pos, .depth = (uint32_t)c->loop_depth};
+    n.as.loop.depth = b.depth;
+    n.as.loop.end = NO_INDEX;
+    if (!resolve_ref(c, parts[3], &n.as.loop.array) || !intern_name(c, parts[1], &b.item) ||
+        !emit_node(c, n, &b.node) || !push_block(c, b)) {
+        return compile_oom(c, tag);
+    }
+    c->loop_depth++;
+    if (c->loop_depth > c->tpl->loop_depth) c->tpl->loop_depth = c->loop_depth;
+    return true;
+}
+
+static bool compile_endfor(Compiler* c, const char* tag) {
+    CompileBlock* b = top_block(c);
+    if (!b || b->kind != BLOCK_FOR)
+        return compile_error(c, TMPL_ERR_SYNTAX, "Found 'endfor' with no matching 'for'", tag);
+    Node n = {.type = NODE_ENDFOR, .pos = (uint32_t)(tag - c->src)};
+    n.as.endloop.depth = b->depth;
+    n.as.endloop.body = b->node + 1;
+    if (!emit_node(c, n, NULL)) return compile_oom(c, tag);
+    c->tpl->nodes[b->node].as.loop.end = (uint32_t)c->tpl->node_count;
+    c->depth--;
+    c->loop_depth--;
+    return true;
+}
+
+/* Emit a JUMP at the end of a taken branch and chain it for patching at endif. */
+static bool close_branch(Compiler* c, CompileBlock* b, const char* tag) {
+    Node j = {.type = NODE_JUMP, .pos = (uint32_t)(tag - c->src)};
+    j.as.jump.target = b->jumps;
+    if (!emit_node(c, j, &b->jumps)) return compile_oom(c, tag);
+    if (b->node != NO_INDEX) c->tpl->nodes[b->node].as.branch.target = (uint32_t)c->tpl->node_count;
+    b->node = NO_INDEX;
+    return true;
+}
+
+static bool compile_if(Compiler* c, const char* cond, const char* tag) {
+    Node n = {.type = NODE_BRANCH, .pos = (uint32_t)(tag - c->src)};
+    n.as.branch.target = NO_INDEX;
+    if (!compile_condition(c, cond, tag, &n)) return false;
+    CompileBlock b = {.kind = BLOCK_IF, .pos = n.pos, .jumps = NO_INDEX};
+    if (!emit_node(c, n, &b.node) || !push_block(c, b)) return compile_oom(c, tag);
+    return true;
+}
+
+static bool compile_elif(Compiler* c, const char* cond, const char* tag) {
+    CompileBlock* b = top_block(c);
+    if (!b || b->kind != BLOCK_IF) return compile_error(c, TMPL_ERR_SYNTAX, "Found 'elif' with no matching 'if'", tag);
+    if (b->has_else) return compile_error(c, TMPL_ERR_SYNTAX, "Found 'elif' after 'else'", tag);
+    if (!close_branch(c, b, tag)) return false;
+    Node n = {.type = NODE_BRANCH, .pos = (uint32_t)(tag - c->src)};
+    n.as.branch.target = NO_INDEX;
+    if (!compile_condition(c, cond, tag, &n)) return false;
+    if (!emit_node(c, n, &b->node)) return compile_oom(c, tag);
+    return true;
+}
+
+static bool compile_else(Compiler* c, const char* tag) {
+    CompileBlock* b = top_block(c);
+    if (!b || b->kind != BLOCK_IF) return compile_error(c, TMPL_ERR_SYNTAX, "Found 'else' with no matching 'if'", tag);
+    if (b->has_else) return compile_error(c, TMPL_ERR_SYNTAX, "Found duplicate 'else'", tag);
+    b->has_else = true;
+    return close_branch(c, b, tag);
+}
+
+static bool compile_endif(Compiler* c, const char* tag) {
+    CompileBlock* b = top_block(c);
+    if (!b || b->kind != BLOCK_IF) return compile_error(c, TMPL_ERR_SYNTAX, "Found 'endif' with no matching 'if'", tag);
+    Node* nodes = c->tpl->nodes;
+    uint32_t here = (uint32_t)c->tpl->node_count;
+    if (b->node != NO_INDEX) nodes[b->node].as.branch.target = here;
+    for (uint32_t j = b->jumps; j != NO_INDEX;) {
+        uint32_t next = nodes[j].as.jump.target;
+        nodes[j].as.jump.target = here;
+        j = next;
+    }
+    c->depth--;
+    return true;
+}
+
+/* {% set varname = value %}. The value is a literal like a condition
+ * operand, stored as a COND_CONST in conds[]: numbers and true/false keep
+ * their type, quoted text and bare words are strings. */
+static bool compile_set(Compiler* c, char* cmd, const char* tag) {
+    char* rest = cmd + 4;
+    while (isspace((unsigned char)*rest)) rest++;
+    char* eq = strchr(rest, '=');
+    if (!eq) return compile_error(c, TMPL_ERR_SYNTAX, "{% set %} requires '=': {% set x = value %}", tag);
+    *eq = '\0';
+    char* varname = str_trim(rest);
+    char* value = str_trim(eq + 1);
+    size_t vlen = strlen(value);
+    CondOp lit = {.op = COND_CONST, .type = TMPL_STRING};
+    bool quoted = vlen >= 2 && (*value == '"' || *value == '\'') && value[vlen - 1] == *value;
+    if (quoted) {
+        value++;
+        vlen -= 2;
+    }
+    bool typed = !quoted && parse_literal_word(value, vlen, &lit);
+    Node n = {.type = NODE_SET, .pos = (uint32_t)(tag - c->src), .as.set.value = (uint32_t)c->tpl->cond_count};
+    if (!intern_name(c, varname, &n.as.set.name) || (!typed && !pool_add(c, value, vlen, &lit.arg)) ||
+        !emit_cond_op(c, lit) || !emit_node(c, n, NULL)) {
+        return compile_oom(c, tag);
+    }
+    c->tpl->has_set = true;
+    return true;
+}
+
+/* The text of a quoted argument ("..." or '...'), or NULL. */
+static char* quoted_arg(char* s) {
+    s = str_trim(s);
+    size_t n = strlen(s);
+    if (n < 3 || (*s != '"' && *s != '\'') || s[n - 1] != *s) return NULL;
+    s[n - 1] = '\0';
+    return s + 1;
+}
+
+/* Bind the partial's names that match a loop item or set variable in scope. */
+WARN_UNUSED static bool bind_include_scope(Compiler* c, const BreezeTemplate* part, Node* n) {
+    BreezeTemplate* t = c->tpl;
+    n->as.include.bindings = (uint32_t)t->binding_count;
+    for (size_t j = 0; j < part->name_count; j++) {
+        const char* name = part->pool + part->names[j];
+        IncludeBinding b = {.kind = BIND_LOOP_ITEM, .child = (uint32_t)j, .from = NO_INDEX};
+        for (size_t i = c->depth; i > 0 && b.from == NO_INDEX; i--) {
+            const CompileBlock* blk = &c->blocks[i - 1];
+            if (blk->kind == BLOCK_FOR && strcmp(t->pool + t->names[blk->item], name) == 0) b.from = blk->depth;
+        }
+        for (size_t k = 0; k < t->node_count && b.from == NO_INDEX && t->has_set; k++) {
+            if (t->nodes[k].type == NODE_SET && strcmp(t->pool + t->names[t->nodes[k].as.set.name], name) == 0) {
+                b.kind = BIND_SET;
+                b.from = t->nodes[k].as.set.name;
+            }
+        }
+        if (b.from == NO_INDEX) continue;
+        if (!grow_array(&t->bindings, &c->binding_cap, t->binding_count + 1, sizeof(IncludeBinding))) return false;
+        t->bindings[t->binding_count++] = b;
+    }
+    n->as.include.nbindings = (uint32_t)t->binding_count - n->as.include.bindings;
+    return true;
+}
+
+/* {% include "path" %} – the partial is compiled once, through the cache, and
+ * shared by pointer. */
+static bool compile_include(Compiler* c, char* cmd, const char* tag) {
+    char* name = quoted_arg(cmd + 7);
+    if (!name) return compile_error(c, TMPL_ERR_SYNTAX, "Invalid 'include'. Use: {% include \"file.html\" %}", tag);
+    if (!c->loader)
+        return compile_error(c, TMPL_ERR_SYNTAX, "{% include %} needs a template loaded through a cache", tag);
+    BreezeTemplate* t = c->tpl;
+    if (!grow_array(&t->includes, &c->include_cap, t->include_count + 1, sizeof(BreezeTemplate*)))
+        return compile_oom(c, tag);
+    BreezeTemplate* part = loader_include(c->loader, name, c->err);
+    if (!part) return false;
+    t->includes[t->include_count] = part;
+    t->include_cache = c->loader->cache;
+    Node n = {.type = NODE_INCLUDE, .pos = (uint32_t)(tag - c->src)};
+    n.as.include.index = (uint32_t)t->include_count++;
+    if (!bind_include_scope(c, part, &n) || !emit_node(c, n, NULL)) return compile_oom(c, tag);
+    return true;
+}
+
+/* {% cache "name" ttl [var ...] %} */
+static bool compile_cache(Compiler* c, char* cmd, const char* tag) {
+    const char* usage = "Invalid 'cache'. Use: {% cache \"name\" seconds [var ...] %}";
+    char* q = cmd + 5;
+    while (isspace((unsigned char)*q)) q++;
+    char* close = (*q == '"' || *q == '\'') ? strchr(q + 1, *q) : NULL;
+    if (!close || close == q + 1) return compile_error(c, TMPL_ERR_SYNTAX, usage, tag);
+    *close = '\0';
+
+    BreezeTemplate* t = c->tpl;
+    Node n = {.type = NODE_CACHE, .pos = (uint32_t)(tag - c->src)};
+    n.as.cache.keys = (uint32_t)t->cache_key_count;
+    char* sp;
+    char* ttl = strtok_r(close + 1, " \t", &sp);
+    char* end;
+    unsigned long secs = ttl ? strtoul(ttl, &end, 10) : 0;
+    if (!ttl || *end != '\0' || !isdigit((unsigned char)*ttl) || secs > UINT32_MAX)
+        return compile_error(c, TMPL_ERR_SYNTAX, usage, tag);
+    n.as.cache.ttl = (uint32_t)secs;
+    if (!pool_add(c, q + 1, (size_t)(close - q - 1), &n.as.cache.name)) return compile_oom(c, tag);
+    for (char* var = strtok_r(NULL, " \t", &sp); var; var = strtok_r(NULL, " \t", &sp)) {
+        if (!grow_array(&t->cache_keys, &c->cache_key_cap, t->cache_key_count + 1, sizeof(VarRef)) ||
+            !resolve_ref(c, var, &t->cache_keys[t->cache_key_count]))
+            return compile_oom(c, tag);
+        t->cache_key_count++;
+    }
+    n.as.cache.nkeys = (uint32_t)t->cache_key_count - n.as.cache.keys;
+    n.as.cache.end = NO_INDEX;
+    CompileBlock b = {.kind = BLOCK_CACHE, .pos = n.pos};
+    if (!emit_node(c, n, &b.node) || !push_block(c, b)) return compile_oom(c, tag);
+    return true;
+}
+
+static bool compile_endcache(Compiler* c, const char* tag) {
+    CompileBlock* b = top_block(c);
+    if (!b || b->kind != BLOCK_CACHE)
+        return compile_error(c, TMPL_ERR_SYNTAX, "Found 'endcache' with no matching 'cache'", tag);
+    Node n = {.type = NODE_ENDCACHE, .pos = (uint32_t)(tag - c->src)};
+    if (!emit_node(c, n, NULL)) return compile_oom(c, tag);
+    c->tpl->nodes[b->node].as.cache.end = (uint32_t)c->tpl->node_count;
+    c->depth--;
+    return true;
+}
+
+/* A tag is standalone when it is the only non-whitespace on its source line.
+ * Standalone tags swallow their indentation and the trailing newline. */
+static bool is_standalone_tag(const char* src, const char* tag_start, const char* tag_end, const char** line_start) {
+    const char* ls = tag_start;
+    while (ls > src && *(ls - 1) != '\n') ls--;
+    for (const char* s = ls; s < tag_start; s++)
+        if (!isspace((unsigned char)*s)) return false;
+    for (const char* s = tag_end; *s && *s != '\n'; s++)
+        if (!isspace((unsigned char)*s)) return false;
+    *line_start = ls;
+    return true;
+}
+
+/* Trim markers: `{%-`/`{{-` drop all whitespace before the tag, newlines
+ * included, and `-%}`/`-}}` all whitespace after it. */
+static const char* trim_before_tag(const char* text_start, const char* tag_start) {
+    while (tag_start > text_start && isspace((unsigned char)*(tag_start - 1))) tag_start--;
+    return tag_start;
+}
+
+static const char* trim_after_tag(const char* p, const char* end) {
+    while (p < end && isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+/* ================================================================
+   Literal scanning
+   ================================================================ */
+
+/* Template text is scanned a word at a time: a byte that may start markup
+ * ('{' for {{ and {%, '<' for <!--, '-' for -->) is located with SWAR
+ * compares, and everything before it is one literal run. */
+
+ALWAYS_INLINE static inline bool is_markup_byte(char ch) { return ch == '{' || ch == '<' || ch == '-'; }
+
+/* Return the first byte in [p, end) that may start markup, or `end`. */
+static const char* find_markup_byte(const char* p, const char* end) {
+    while (end - p >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        if (swar_has_byte(word, '{') | swar_has_byte(word, '<') | swar_has_byte(word, '-')) break;
+        p += 8;
+    }
+    while (p < end && !is_markup_byte(*p)) p++;
+    return p;
+}
+
+/* Find the {% endraw %} closing a raw block that starts at `from`. */
+static const char* find_endraw(const char* from, const char* end, const char** after) {
+    for (const char* s = memchr(from, '{', (size_t)(end - from)); s; s = memchr(s + 1, '{', (size_t)(end - s - 1))) {
+        if (s[1] != '%') continue;
+        const char* ds = s + 2;
+        const char* de = strstr(ds, "%}");
+        if (!de) return NULL;
+        const char* te = de;
+        if (ds < te && *ds == '-') ds++;
+        if (te > ds && *(te - 1) == '-') te--;
+        while (ds < te && isspace((unsigned char)*ds)) ds++;
+        while (te > ds && isspace((unsigned char)*(te - 1))) te--;
+        if (te - ds == 6 && memcmp(ds, "endraw", 6) == 0) {
+            *after = de + 2;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static bool compile_directive(Compiler* c, const char* tag_start, const char** pp, const char** text_start) {
+    const char* dir_start = tag_start + 2;
+    const char* dir_end = strstr(dir_start, "%}");
+    if (!dir_end) return compile_error(c, TMPL_ERR_PARSE, "Unterminated '{%' tag", tag_start);
+    bool trim_before = *dir_start == '-';
+    bool trim_after = dir_end > dir_start + trim_before && *(dir_end - 1) == '-';
+
+    /* Whitespace control – trim markers, else standalone tag detection */
+    const char* line_start = NULL;
+    const char* p = dir_end + 2;
+    bool standalone = is_standalone_tag(c->src, tag_start, p, &line_start);
+    const char* text_end = tag_start;
+    if (trim_before)
+        text_end = trim_before_tag(*text_start, tag_start);
+    else if (standalone)
+        text_end = line_start > *text_start ? line_start : *text_start;
+    if (!emit_text(c, *text_start, text_end)) return compile_oom(c, tag_start);
+    if (trim_after) {
+        p = trim_after_tag(p, c->src_end);
+    } else if (standalone) {
+        while (*p && *p != '\n') p++;
+        if (*p == '\n') p++;
+    }
+    *pp = p;
+    *text_start = p;
+
+    dir_start += trim_before;
+    size_t dl = (size_t)(dir_end - trim_after - dir_start);
+    char* directive = brz_malloc(dl + 1);
+    if (!directive) return compile_oom(c, tag_start);
+    memcpy(directive, dir_start, dl);
+    directive[dl] = '\0';
+    char* cmd = str_trim(directive);
+
+    bool ok;
+    if (strcmp(cmd, "raw") == 0) {
+        const char* after = NULL;
+        const char* end = find_endraw(p, c->src_end, &after);
+        if (!end) {
+            ok = compile_error(c, TMPL_ERR_SYNTAX, "Unclosed {% raw %} block", c->src_end);
+        } else {
+            const char* body_end = end[2] == '-' ? trim_before_tag(p, end) : end;
+            ok = emit_text(c, p, body_end) || compile_oom(c, tag_start);
+            if (*(after - 3) == '-')
+                after = trim_after_tag(after, c->src_end);
+            else if (*after == '\n')
+                after++; /* consume trailing newline */
+            *pp = after;
+            *text_start = after;
+        }
+    } else if (strncmp(cmd, "for ", 4) == 0) {
+        ok = compile_for(c, cmd, tag_start);
+    } else if (strcmp(cmd, "endfor") == 0) {
+        ok = compile_endfor(c, tag_start);
+    } else if (strncmp(cmd, "if ", 3) == 0) {
+        ok = compile_if(c, cmd + 3, tag_start);
+    } else if (strncmp(cmd, "elif ", 5) == 0) {
+        ok = compile_elif(c, cmd + 5, tag_start);
+    } else if (strcmp(cmd, "else") == 0) {
+        ok = compile_else(c, tag_start);
+    } else if (strcmp(cmd, "endif") == 0) {
+        ok = compile_endif(c, tag_start);
+    } else if (strncmp(cmd, "set ", 4) == 0) {
+        ok = compile_set(c, cmd, tag_start);
+    } else if (strncmp(cmd, "include ", 8) == 0) {
+        ok = compile_include(c, cmd, tag_start);
+    } else if (strncmp(cmd, "cache ", 6) == 0) {
+        ok = compile_cache(c, cmd, tag_start);
+    } else if (strcmp(cmd, "endcache") == 0) {
+        ok = compile_endcache(c, tag_start);
+    } else if (strncmp(cmd, "block ", 6) == 0) {
+        c->open_blocks++; /* overrides were spliced in by flatten_extends() */
+        ok = true;
+    } else if (strcmp(cmd, "endblock") == 0 || strncmp(cmd, "endblock ", 9) == 0) {
+        ok = c->open_blocks-- > 0 ||
+             compile_error(c, TMPL_ERR_SYNTAX, "Found 'endblock' with no matching 'block'", tag_start);
+    } else if (strncmp(cmd, "extends ", 8) == 0) {
+        ok = compile_error(c, TMPL_ERR_SYNTAX, "'extends' must be the first tag in the template", tag_start);
+    } else {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Unknown directive: '%s'", cmd);
+        ok = compile_error(c, TMPL_ERR_SYNTAX, msg, tag_start);
+    }
+    brz_free(directive);
+    return ok;
+}
+
+static bool compile_source(Compiler* c) {
+    const char* p = c->src;
+    const char* end = c->src_end;
+    const char* text_start = p;
+
+    while ((p = find_markup_byte(p, end)) < end) {
+        /* ----- HTML comments are dropped ----- */
+        if (*p == '<' && strncmp(p, "<!--", 4) == 0) {
+            const char* close = strstr(p + 4, "-->");
+            if (!close) return compile_error(c, TMPL_ERR_SYNTAX, "Unterminated HTML comment '<!--'", p);
+            if (!emit_text(c, text_start, p)) return compile_oom(c, p);
+            p = close + 3;
+            text_start = p;
+            continue;
+        }
+        if (*p == '-' && strncmp(p, "-->", 3) == 0)
+            return compile_error(c, TMPL_ERR_PARSE, "Unmatched comment closing tag '-->'", p);
+
+        /* ----- {{ variable }} ----- */
+        if (*p == '{' && *(p + 1) == '{') {
+            const char* var_start = p + 2;
+            const char* var_end = strstr(var_start, "}}");
+            if (!var_end) return compile_error(c, TMPL_ERR_PARSE, "Unterminated '{{' tag", p);
+            bool trim_before = *var_start == '-';
+            bool trim_after = var_end > var_start + trim_before && *(var_end - 1) == '-';
+            const char* text_end = trim_before ? trim_before_tag(text_start, p) : p;
+            if (!emit_text(c, text_start, text_end)) return compile_oom(c, p);
+
+            var_start += trim_before;
+            size_t vl = (size_t)(var_end - trim_after - var_start);
+            char* expr = brz_malloc(vl + 1);
+            if (!expr) return compile_oom(c, p);
+            memcpy(expr, var_start, vl);
+            expr[vl] = '\0';
+            bool ok = compile_variable(c, expr, p);
+            brz_free(expr);
+            if (!ok) return false;
+            p = var_end + 2;
+            if (trim_after) p = trim_after_tag(p, end);
+            text_start = p;
+
+            /* ----- {% directive %} ----- */
+        } else if (*p == '{' && *(p + 1) == '%') {
+            if (!compile_directive(c, p, &p, &text_start)) return false;
+        } else {
+            p++;
+        }
+    }
+    if (!emit_text(c, text_start, p)) return compile_oom(c, p);
+
+    CompileBlock* b = top_block(c);
+    if (b && b->kind == BLOCK_FOR)
+        return compile_error(c, TMPL_ERR_SYNTAX, "Unclosed 'for' loop at end of template", p);
+    if (b && b->kind == BLOCK_CACHE)
+        return compile_error(c, TMPL_ERR_SYNTAX, "Unclosed 'cache' block at end of template", p);
+    if (b) return compile_error(c, TMPL_ERR_SYNTAX, "Unclosed 'if' statement at end of template", p);
+    if (c->open_blocks) return compile_error(c, TMPL_ERR_SYNTAX, "Unclosed 'block' at end of template", p);
+    return true;
+}
+
+/* ================================================================
+   Template inheritance
+   ================================================================ */
+
+/* {% extends %} is resolved before compiling: the parent's source is taken
+ * and each {% block %} the child overrides has its body replaced by the
+ * child's. The block tags stay in place, so a grandchild can override the
+ * result again, and compile as no-ops. */
+
+typedef struct {
+    const char* start; /* "{%" */
+    const char* end;   /* just past "%}" */
+    const char* body;  /* directive text, trimmed */
+    size_t len;
+} TagSpan;
+
+typedef struct {
+    const char* name;
+    size_t name_len;
+    const char* body; /* between the block tags */
+    const char* body_end;
+} BlockDef;
+
+/* Find the next {% %} tag in [p, end), skipping raw blocks. */
+static bool next_tag(const char* p, const char* end, TagSpan* t) {
+    for (; (p = memchr(p, '{', (size_t)(end - p))) && p + 1 < end; p++) {
+        if (p[1] != '%') continue;
+        const char* close = strstr(p + 2, "%}");
+        if (!close || close + 2 > end) return false;
+        const char* b = p + 2;
+        const char* e = close;
+        if (b < e && *b == '-') b++;
+        if (e > b && *(e - 1) == '-') e--;
+        while (b < e && isspace((unsigned char)*b)) b++;
+        while (e > b && isspace((unsigned char)*(e - 1))) e--;
+        if (e - b == 3 && memcmp(b, "raw", 3) == 0) {
+            const char* after;
+            if (!find_endraw(close + 2, end, &after)) return false;
+            p = after - 1;
+            continue;
+        }
+        *t = (TagSpan){p, close + 2, b, (size_t)(e - b)};
+        return true;
+    }
+    return false;
+}
+
+/* True if the tag is `word` or starts with `word` and a space; `rest` gets
+ * what follows. */
+static bool tag_is(const TagSpan* t, const char* word, const char** rest, size_t* rest_len) {
+    size_t n = strlen(word);
+    if (t->len < n || memcmp(t->body, word, n) != 0 || (t->len > n && !isspace((unsigned char)t->body[n])))
+        return false;
+    const char* r = t->body + n;
+    while (r < t->body + t->len && isspace((unsigned char)*r)) r++;
+    if (rest) *rest = r;
+    if (rest_len) *rest_len = (size_t)(t->body + t->len - r);
+    return true;
+}
+
+/* Find the {% endblock %} matching a block whose body starts at `p`. */
+static bool find_endblock(const char* p, const char* end, TagSpan* close) {
+    size_t depth = 1;
+    while (next_tag(p, end, close)) {
+        if (tag_is(close, "block", NULL, NULL)) depth++;
+        else if (tag_is(close, "endblock", NULL, NULL) && --depth == 0) return true;
+        p = close->end;
+    }
+    return false;
+}
+
+static const BlockDef* find_block_def(const BlockDef* defs, size_t n, const char* name, size_t len) {
+    for (size_t i = 0; i < n; i++)
+        if (defs[i].name_len == len && memcmp(defs[i].name, name, len) == 0) return &defs[i];
+    return NULL;
+}
+
+/* Collect every block defined in [p, end), nested ones included. */
+static bool collect_blocks(const char* src, const char* p, const char* end, BlockDef** defs, size_t* n, size_t* cap,
+                           TemplateError* err) {
+    TagSpan t, close;
+    while (next_tag(p, end, &t)) {
+        const char* name;
+        size_t len;
+        if (!tag_is(&t, "block", &name, &len)) {
+            p = t.end;
+            continue;
+        }
+        if (!find_endblock(t.end, end, &close))
+            return set_error_at(err, TMPL_ERR_SYNTAX, "Unclosed 'block'", src, t.start);
+        if (find_block_def(*defs, *n, name, len))
+            return set_error_at(err, TMPL_ERR_SYNTAX, "Block defined twice", src, t.start);
+        if (!grow_array(defs, cap, *n + 1, sizeof(BlockDef)))
+            return set_error(err, TMPL_ERR_MEMORY, "malloc failed for block table", 0);
+        (*defs)[(*n)++] = (BlockDef){name, len, t.end, close.start};
+        if (!collect_blocks(src, t.end, close.start, defs, n, cap, err)) return false;
+        p = close.end;
+    }
+    return true;
+}
+
+/* Copy [p, end) of a parent template into `out`, replacing overridden block bodies. */
+WARN_UNUSED static bool splice_blocks(OutputBuffer* out, const char* p, const char* end, const BlockDef* defs,
+                                      size_t n) {
+    const char* copied = p;
+    TagSpan t, close;
+    while (next_tag(p, end, &t)) {
+        const char* name;
+        size_t len;
+        p = t.end;
+        if (!tag_is(&t, "block", &name, &len) || !find_endblock(t.end, end, &close)) continue;
+        const BlockDef* def = find_block_def(defs, n, name, len);
+        if (!buffer_append(out, copied, (size_t)(t.end - copied))) return false;
+        if (def ? !buffer_append(out, def->body, (size_t)(def->body_end - def->body))
+                : !splice_blocks(out, t.end, close.start, defs, n))
+            return false;
+        if (!buffer_append(out, close.start, (size_t)(close.end - close.start))) return false;
+        p = copied = close.end;
+    }
+    return buffer_append(out, copied, (size_t)(end - copied));
+}
+
+/* Return the source to compile for `src`, with any {% extends %} chain
+ * resolved, as a heap copy. */
+static char* flatten_extends(Loader* ld, const char* src, const IncludeChain* chain, TemplateError* err) {
+    const char* end = src + strlen(src);
+    TagSpan t;
+    const char* arg;
+    size_t arg_len;
+    if (!next_tag(src, end, &t) || !tag_is(&t, "extends", &arg, &arg_len)) {
+        char* copy = brz_strdup(src);
+        if (!copy) set_error(err, TMPL_ERR_MEMORY, "malloc failed for template source", 0);
+        return copy;
+    }
+    if (!ld) {
+        set_error_at(err, TMPL_ERR_SYNTAX, "{% extends %} needs a template loaded through a cache", src, t.start);
+        return NULL;
+    }
+    char name[512];
+    if (arg_len < 3 || arg_len >= sizeof(name) || (*arg != '"' && *arg != '\'') || arg[arg_len - 1] != *arg) {
+        set_error_at(err, TMPL_ERR_SYNTAX, "Invalid 'extends'. Use: {% extends \"base.html\" %}", src, t.start);
+        return NULL;
+    }
+    memcpy(name, arg + 1, arg_len - 2);
+    name[arg_len - 2] = '\0';
+
+    BlockDef* defs = NULL;
+    size_t n = 0, cap = 0;
+    char* parent_path = NULL;
+    char* parent_src = NULL;
+    char* base = NULL;
+    OutputBuffer out = {0};
+    bool ok = collect_blocks(src, t.end, end, &defs, &n, &cap, err) &&
+              (parent_src = loader_read(ld, name, chain, &parent_path, err)) != NULL;
+    if (ok) {
+        IncludeChain link = {parent_path, chain};
+        ok = (base = flatten_extends(ld, parent_src, &link, err)) != NULL;
+    }
+    if (ok && !(buffer_init(&out, strlen(base) + 1) && splice_blocks(&out, base, base + strlen(base), defs, n)))
+        ok = set_error(err, TMPL_ERR_MEMORY, "malloc failed for template source", 0);
+    brz_free(base);
+    brz_free(parent_src);
+    brz_free(parent_path);
+    brz_free(defs);
+    if (!ok) {
+        brz_free(out.data);
+        return NULL;
+    }
+    return out.data;
+}
+
+/* Record where each referenced name sits in the declared context layout. */
+WARN_UNUSED static bool bind_schema(BreezeTemplate* tpl, const BreezeSchema* schema, TemplateError* err) {
+    if (!tpl->name_count) return true;
+    if (!(tpl->name_slots = brz_malloc(sizeof(uint32_t) * tpl->name_count)))
+        return set_error(err, TMPL_ERR_MEMORY, "malloc failed for schema slots", 0);
+    for (size_t id = 0; id < tpl->name_count; id++) {
+        tpl->name_slots[id] = NO_INDEX;
+        for (size_t k = 0; k < schema->count && k < NO_INDEX; k++) {
+            if (schema->keys[k] && strcmp(schema->keys[k], tpl->pool + tpl->names[id]) == 0) {
+                tpl->name_slots[id] = (uint32_t)k;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+/* Flag every {{ }} for escaping unless its chain already ends up escaped or
+ * was declared safe. Decided by the bound functions, so a user override of
+ * `safe` or `escape` does not get the exemption. */
+static void mark_autoescape(BreezeTemplate* tpl) {
+    for (size_t n = 0; n < tpl->node_count; n++) {
+        Node* node = &tpl->nodes[n];
+        if (node->type != NODE_VAR) continue;
+        bool exempt = false;
+        for (uint32_t i = 0; i < node->as.var.nfilters; i++) {
+            const BoundFilter* bf = &tpl->filter_fns[node->as.var.filters + i];
+            exempt |= bf->fn == filter_escape || bf->value_fn == filter_safe;
+        }
+        if (!exempt) node->flags |= NODE_F_ESCAPE;
+    }
+}
+
+/* Resolve every filter call against the engine's registry. Unknown names stay
+ * unbound and are reported if the expression is ever rendered. */
+WARN_UNUSED static bool lookup_filters(BreezeTemplate* tpl, BreezeEngine* engine, bool* autoescape,
+                                       TemplateError* err) {
+    if (tpl->filter_count && !(tpl->filter_fns = brz_malloc(sizeof(BoundFilter) * tpl->filter_count)))
+        return set_error(err, TMPL_ERR_MEMORY, "malloc failed for filter bindings", 0);
+    pthread_mutex_lock(&engine->lock);
+    for (size_t i = 0; i < tpl->filter_count; i++)
+        tpl->filter_fns[i] = filter_slot(engine->slots, engine->slot_count, tpl->pool + tpl->filters[i].name)->bound;
+    *autoescape = engine->autoescape;
+    pthread_mutex_unlock(&engine->lock);
+    return true;
+}
+
+WARN_UNUSED static bool bind_filters(BreezeTemplate* tpl, BreezeEngine* engine, TemplateError* err) {
+    bool autoescape;
+    if (!lookup_filters(tpl, engine, &autoescape, err)) return false;
+    if (autoescape) mark_autoescape(tpl);
+    return true;
+}
+
+WARN_UNUSED static bool fold_template(Compiler* c);
+
+/* Point every forward edge that lands on a JUMP at the JUMP's destination,
+ * so an if nested at the end of a branch leaves both at once. JUMPs only go
+ * forward, so walking backwards resolves each chain in one step. */
+static void thread_jumps(BreezeTemplate* tpl) {
+    Node* nodes = tpl->nodes;
+    uint32_t n = (uint32_t)tpl->node_count;
+    for (uint32_t i = n; i-- > 0;) {
+        uint32_t* target;
+        switch (nodes[i].type) {
+            case NODE_FOR:
+                target = &nodes[i].as.loop.end;
+                break;
+            case NODE_BRANCH:
+                target = &nodes[i].as.branch.target;
+                break;
+            case NODE_JUMP:
+                target = &nodes[i].as.jump.target;
+                break;
+            case NODE_CACHE:
+                target = &nodes[i].as.cache.end;
+                break;
+            default:
+                continue;
+        }
+        if (*target < n && nodes[*target].type == NODE_JUMP) *target = nodes[*target].as.jump.target;
+    }
+}
+
+static BreezeTemplate* compile_template(BreezeEngine* engine, const char* source, const BreezeSchema* schema,
+                                        Loader* loader, TemplateError* err) {
+    if (err) {
+        err->type = TMPL_ERR_NONE;
+        err->line = 0;
+        err->column = 0;
+        err->message[0] = '\0';
+    }
+    if (!source) {
+        set_error(err, TMPL_ERR_PARSE, "NULL template", 0);
+        return NULL;
+    }
+    if (!engine) {
+        set_error(err, TMPL_ERR_MEMORY, "No template engine", 0);
+        return NULL;
+    }
+    char* flat = flatten_extends(loader, source, loader ? loader->chain : NULL, err);
+    if (!flat) return NULL;
+    size_t len = strlen(flat);
+    if (len >= NO_INDEX) {
+        brz_free(flat);
+        set_error(err, TMPL_ERR_PARSE, "Template too large", 0);
+        return NULL;
+    }
+
+    BreezeTemplate* tpl = brz_calloc(1, sizeof(BreezeTemplate));
+    if (!tpl) {
+        brz_free(flat);
+        set_error(err, TMPL_ERR_MEMORY, "malloc failed for compiled template", 0);
+        return NULL;
+    }
+    tpl->source = flat;
+    tpl->engine = engine;
+    if (!build_line_table(tpl, len)) {
+        breeze_template_free(tpl);
+        set_error(err, TMPL_ERR_MEMORY, "malloc failed for line table", 0);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    bool optimize = engine->optimize;
+    pthread_mutex_unlock(&engine->lock);
+
+    Compiler c = {.src = tpl->source, .src_end = tpl->source + len, .tpl = tpl, .err = err, .loader = loader};
+    bool ok = compile_source(&c) && bind_filters(tpl, engine, err) && (!optimize || fold_template(&c)) &&
+              (!schema || bind_schema(tpl, schema, err));
+    if (ok) thread_jumps(tpl);
+    tpl->fold.nodes_after = tpl->node_count;
+    if (!optimize) tpl->fold.nodes_before = tpl->node_count;
+    brz_free(c.blocks);
+    if (!ok) {
+        breeze_template_free(tpl);
+        return NULL;
+    }
+    return tpl;
+}
+
+BreezeTemplate* breeze_engine_compile(BreezeEngine* engine, const char* source, const BreezeSchema* schema,
+                                      TemplateError* err) {
+    return compile_template(engine, source, schema, NULL, err);
+}
+
+BreezeTemplate* breeze_compile(const char* source, TemplateError* err) {
+    return breeze_engine_compile(breeze_default_engine(), source, NULL, err);
+}
+
+BreezeTemplate* breeze_compile_schema(const char* source, const BreezeSchema* schema, TemplateError* err) {
+    return breeze_engine_compile(breeze_default_engine(), source, schema, err);
+}
+
+/* ================================================================
+   Render state
+   ================================================================ */
+
+/* Bump allocator for per-render stacks. Memory is handed out from the newest
+ * block; reset keeps a single block big enough for everything the previous
+ * render used, so a state that has seen a template renders it again without
+ * calling malloc. */
+
+#define ARENA_ALIGN       16
+#define ARENA_BLOCK_MIN 1024
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* prev;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct {
+    ArenaBlock* head;
+    size_t total; /* capacity of all blocks */
+} Arena;
+
+/* A {% cache %} block being rendered; its output is stored at the end. */
+typedef struct {
+    size_t out_start; /* offset of the block's output in the output buffer */
+    size_t key_start; /* offset of its key in fragment_keys */
+    uint32_t ttl;
+    BreezeFragmentStore store;
+} Capture;
+
+struct BreezeRenderState {
+    Arena arena;
+    OutputBuffer scratch[2]; /* filter chains; heap-owned because filters may realloc them */
+    OutputBuffer chunk;      /* staging chunk for BreezeWriter output */
+    OutputBuffer fragment_keys; /* NUL-separated keys of open captures */
+    Capture* captures;          /* open {% cache %} blocks, innermost last */
+    size_t capture_count, capture_cap;
+    size_t flushed;         /* bytes handed to the writer during this render */
+    BreezeProfile* profile; /* attached with breeze_state_set_profile */
+    BreezeRenderStats stats; /* of the last render */
+    size_t memory_limit;     /* bytes a render may request, 0 = no limit */
+    /* Resumable render (breeze_render_begin): the VM is kept in the arena
+     * between steps and runs until `yield_at` bytes are staged in `chunk`. */
+    struct RenderVM* resume; /* NULL when no resumable render is in progress */
+    size_t yield_at;         /* 0 unless a step is running */
+    bool suspended;          /* the last run stopped at yield_at rather than at the end */
+    bool finished;           /* the program has stopped for good; chunk may still hold output */
+    size_t delivered;        /* bytes of chunk already copied out by steps */
+    TemplateError error;     /* why the resumable render failed, reported once its output is out */
+};
+
+WARN_UNUSED static bool arena_push_block(Arena* a, size_t min_size) {
+    size_t size = a->total > ARENA_BLOCK_MIN ? a->total : ARENA_BLOCK_MIN;
+    while (size < min_size) size *= 2;
+    ArenaBlock* b = brz_malloc(ARENA_HEADER + size);
+    if (!b) return false;
+    *b = (ArenaBlock){.prev = a->head, .size = size};
+    a->head = b;
+    a->total += size;
+    return true;
+}
+
+static void* arena_alloc(Arena* a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if ((!a->head || a->head->size - a->head->used < size) && !arena_push_block(a, size)) return NULL;
+    void* p = (char*)a->head + ARENA_HEADER + a->head->used;
+    a->head->used += size;
+    return p;
+}
+
+static void arena_free(Arena* a) {
+    while (a->head) {
+        ArenaBlock* prev = a->head->prev;
+        brz_free(a->head);
+        a->head = prev;
+    }
+    a->total = 0;
+}
+
+/* Coalesce into one block when the last render needed more than one. */
+static void arena_reset(Arena* a) {
+    if (a->head && a->head->prev) {
+        size_t total = a->total;
+        arena_free(a);
+        if (!arena_push_block(a, total)) return; /* allocation retried on demand */
+    }
+    if (a->head) a->head->used = 0;
+}
+
+static void render_state_release(BreezeRenderState* state) {
+    arena_free(&state->arena);
+    brz_free(state->scratch[0].data);
+    brz_free(state->scratch[1].data);
+    brz_free(state->chunk.data);
+    brz_free(state->fragment_keys.data);
+    brz_free(state->captures);
+}
+
+BreezeRenderState* breeze_render_state_new(void) { return brz_calloc(1, sizeof(BreezeRenderState)); }
+
+void breeze_render_state_free(BreezeRenderState* state) {
+    if (!state) return;
+    render_state_release(state);
+    brz_free(state);
+}
+
+/* ================================================================
+   JSON contexts
+   ================================================================ */
+
+/* breeze_context_from_json works in two passes. The first parses the text
+ * into a tree of JsonNodes in a scratch arena, copying nothing but member
+ * names and strings with escapes. The second lays the values out in the
+ * caller's arena: strings stay slices of the text, arrays are stored
+ * contiguously with a stride, and the objects of one array share a record
+ * type, the union of their members. An object inside an object is
+ * flattened into its parent's record under dotted names ("address.city"),
+ * which is how `user.address.city` reads it in a template. */
+
+struct BreezeArena {
+    Arena arena;
+};
+
+BreezeArena* breeze_arena_new(void) { return brz_calloc(1, sizeof(BreezeArena)); }
+
+void breeze_arena_reset(BreezeArena* arena) {
+    if (arena) arena_reset(&arena->arena);
+}
+
+void breeze_arena_free(BreezeArena* arena) {
+    if (!arena) return;
+    arena_free(&arena->arena);
+    brz_free(arena);
+}
+
+#define JSON_MAX_DEPTH 256
+
+typedef enum { JSON_NULL, JSON_BOOL, JSON_INT, JSON_DOUBLE, JSON_STRING, JSON_ARRAY, JSON_OBJECT } JsonKind;
+
+typedef struct JsonNode {
+    uint8_t kind;          /* JsonKind */
+    const char* at;        /* where the value starts in the text, for errors */
+    const char* key;       /* member name, NUL-terminated in the output arena; NULL for array items */
+    struct JsonNode* next; /* next member or item */
+    union {
+        bool b;
+        long l;
+        double d;
+        BreezeSlice s;
+        struct {
+            struct JsonNode* first;
+            size_t count;
+        } kids;
+    } as;
+} JsonNode;
+
+typedef struct JsonShape JsonShape;
+
+/* A member of a record shape, with the kind its values merge to. */
+typedef struct {
+    const char* key;
+    uint8_t kind;      /* JsonKind; JSON_NULL while every value seen was null */
+    JsonShape* record; /* members of JSON_OBJECT values, flattened into the same record */
+    size_t offset;     /* of the member's field, once laid out */
+} JsonMember;
+
+struct JsonShape {
+    JsonMember* members;
+    size_t count, cap;
+};
+
+typedef struct {
+    const char* src;
+    const char* p;
+    const char* end;
+    Arena* out; /* the caller's arena: everything the context points to */
+    Arena tmp;  /* the tree and shapes, freed before returning */
+    TemplateError* err;
+} JsonParser;
+
+static bool json_fail_at(JsonParser* jp, const char* at, const char* msg) {
+    return set_error_at(jp->err, TMPL_ERR_PARSE, msg, jp->src, at);
+}
+
+static bool json_fail(JsonParser* jp, const char* msg) { return json_fail_at(jp, jp->p, msg); }
+
+static bool json_oom(JsonParser* jp) {
+    return set_error(jp->err, TMPL_ERR_MEMORY, "malloc failed for JSON context", 0);
+}
+
+static void json_skip_ws(JsonParser* jp) {
+    while (jp->p < jp->end && (*jp->p == ' ' || *jp->p == '\t' || *jp->p == '\n' || *jp->p == '\r')) jp->p++;
+}
+
+/* True if `c` is the next byte after whitespace; consumes it. */
+static bool json_accept(JsonParser* jp, char c) {
+    json_skip_ws(jp);
+    if (jp->p == jp->end || *jp->p != c) return false;
+    jp->p++;
+    return true;
+}
+
+static bool json_hex4(const char* p, const char* end, unsigned* cp) {
+    if (end - p < 4) return false;
+    *cp = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = (unsigned char)p[i];
+        int d = isdigit(c) ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+        if (d < 0) return false;
+        *cp = *cp << 4 | (unsigned)d;
+    }
+    return true;
+}
+
+static size_t utf8_encode(char* dst, unsigned cp) {
+    if (cp < 0x80) {
+        dst[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        dst[0] = (char)(0xC0 | cp >> 6);
+        dst[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        dst[0] = (char)(0xE0 | cp >> 12);
+        dst[1] = (char)(0x80 | (cp >> 6 & 0x3F));
+        dst[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    dst[0] = (char)(0xF0 | cp >> 18);
+    dst[1] = (char)(0x80 | (cp >> 12 & 0x3F));
+    dst[2] = (char)(0x80 | (cp >> 6 & 0x3F));
+    dst[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+/* Decode the escapes of the `len` raw bytes at `raw` into `dst`, which has
+ * room for `len` bytes: no escape decodes to more bytes than it is written
+ * with. Returns the decoded length, or SIZE_MAX with `*bad` at the escape. */
+static size_t json_unescape(const char* raw, size_t len, char* dst, const char** bad) {
+    const char* end = raw + len;
+    size_t n = 0;
+    for (const char* q = raw; q < end; q++) {
+        if (*q != '\\') {
+            dst[n++] = *q;
+            continue;
+        }
+        *bad = q++;
+        switch (*q) {
+            case '"':
+            case '\\':
+            case '/':
+                dst[n++] = *q;
+                break;
+            case 'b':
+                dst[n++] = '\b';
+                break;
+            case 'f':
+                dst[n++] = '\f';
+                break;
+            case 'n':
+                dst[n++] = '\n';
+                break;
+            case 'r':
+                dst[n++] = '\r';
+                break;
+            case 't':
+                dst[n++] = '\t';
+                break;
+            case 'u': {
+                unsigned cp, lo;
+                if (!json_hex4(q + 1, end, &cp) || (cp >= 0xDC00 && cp < 0xE000)) return SIZE_MAX;
+                q += 4;
+                if (cp >= 0xD800 && cp < 0xDC00) {
+                    /* a high surrogate must be followed by its low half */
+                    if (end - q < 7 || q[1] != '\\' || q[2] != 'u' || !json_hex4(q + 3, end, &lo) || lo < 0xDC00 ||
+                        lo >= 0xE000)
+                        return SIZE_MAX;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    q += 6;
+                }
+                n += utf8_encode(dst + n, cp);
+                break;
+            }
+            default:
+                return SIZE_MAX;
+        }
+    }
+    return n;
+}
+
+/* The string at jp->p. It is a slice of the text unless it has escapes, or
+ * `copy` asks for a NUL-terminated copy; copies go to the output arena. */
+static bool json_parse_string(JsonParser* jp, BreezeSlice* s, bool copy) {
+    const char* start = ++jp->p;
+    bool escaped = false;
+    while (jp->p < jp->end && *jp->p != '"') {
+        if ((unsigned char)*jp->p < 0x20) return json_fail(jp, "Control character in JSON string");
+        if (*jp->p == '\\') {
+            escaped = true;
+            if (++jp->p == jp->end) break;
+        }
+        jp->p++;
+    }
+    if (jp->p >= jp->end) return json_fail_at(jp, start - 1, "Unterminated JSON string");
+    size_t len = (size_t)(jp->p - start);
+    jp->p++;
+    if (!escaped && !copy) {
+        *s = (BreezeSlice){start, len};
+        return true;
+    }
+    char* dst = arena_alloc(jp->out, len + 1);
+    if (!dst) return json_oom(jp);
+    const char* bad = NULL;
+    size_t n = escaped ? json_unescape(start, len, dst, &bad) : len;
+    if (n == SIZE_MAX) return json_fail_at(jp, bad, "Invalid escape in JSON string");
+    if (!escaped) memcpy(dst, start, len);
+    dst[n] = '\0';
+    *s = (BreezeSlice){dst, n};
+    return true;
+}
+
+static bool json_number(JsonParser* jp, JsonNode* n) {
+    const char *q = jp->p, *end = jp->end;
+    bool integral = true;
+    if (q < end && *q == '-') q++;
+    if (q == end || !isdigit((unsigned char)*q)) return json_fail(jp, "Invalid JSON value");
+    if (*q == '0') q++;
+    else
+        while (q < end && isdigit((unsigned char)*q)) q++;
+    if (q < end && *q == '.') {
+        integral = false;
+        if (++q == end || !isdigit((unsigned char)*q)) return json_fail_at(jp, q, "Invalid JSON number");
+        while (q < end && isdigit((unsigned char)*q)) q++;
+    }
+    if (q < end && (*q == 'e' || *q == 'E')) {
+        integral = false;
+        if (++q < end && (*q == '+' || *q == '-')) q++;
+        if (q == end || !isdigit((unsigned char)*q)) return json_fail_at(jp, q, "Invalid JSON number");
+        while (q < end && isdigit((unsigned char)*q)) q++;
+    }
+    size_t len = (size_t)(q - jp->p);
+    char buf[64];
+    char* num = len < sizeof(buf) ? buf : arena_alloc(&jp->tmp, len + 1);
+    if (!num) return json_oom(jp);
+    memcpy(num, jp->p, len);
+    num[len] = '\0';
+    jp->p = q;
+    if (integral) {
+        errno = 0;
+        long l = strtol(num, NULL, 10);
+        if (errno == 0) {
+            n->kind = JSON_INT;
+            n->as.l = l;
+            return true;
+        }
+    }
+    n->kind = JSON_DOUBLE; /* out-of-range integers too */
+    n->as.d = strtod(num, NULL);
+    return true;
+}
+
+static bool json_value(JsonParser* jp, JsonNode* n, int depth);
+
+static bool json_container(JsonParser* jp, JsonNode* n, int depth) {
+    bool object = *jp->p++ == '{';
+    char close = object ? '}' : ']';
+    if (depth >= JSON_MAX_DEPTH) return json_fail_at(jp, n->at, "JSON nested too deeply");
+    n->kind = object ? JSON_OBJECT : JSON_ARRAY;
+    n->as.kids.first = NULL;
+    n->as.kids.count = 0;
+    if (json_accept(jp, close)) return true;
+    JsonNode** tail = &n->as.kids.first;
+    do {
+        JsonNode* kid = arena_alloc(&jp->tmp, sizeof(JsonNode));
+        if (!kid) return json_oom(jp);
+        kid->key = NULL;
+        kid->next = NULL;
+        if (object) {
+            BreezeSlice key;
+            json_skip_ws(jp);
+            if (jp->p == jp->end || *jp->p != '"') return json_fail(jp, "Expected a member name in JSON object");
+            if (!json_parse_string(jp, &key, true)) return false;
+            if (!json_accept(jp, ':')) return json_fail(jp, "Expected ':' in JSON object");
+            kid->key = key.data;
+        }
+        if (!json_value(jp, kid, depth + 1)) return false;
+        *tail = kid;
+        tail = &kid->next;
+        n->as.kids.count++;
+    } while (json_accept(jp, ','));
+    if (!json_accept(jp, close))
+        return json_fail(jp, object ? "Expected ',' or '}' in JSON object" : "Expected ',' or ']' in JSON array");
+    return true;
+}
+
+/* True if the text at jp->p is `word`; consumes it. */
+static bool json_word(JsonParser* jp, const char* word, size_t len) {
+    if ((size_t)(jp->end - jp->p) < len || memcmp(jp->p, word, len) != 0) return false;
+    jp->p += len;
+    return true;
+}
+
+static bool json_value(JsonParser* jp, JsonNode* n, int depth) {
+    json_skip_ws(jp);
+    n->at = jp->p;
+    if (jp->p == jp->end) return json_fail(jp, "Unexpected end of JSON");
+    switch (*jp->p) {
+        case '{':
+        case '[':
+            return json_container(jp, n, depth);
+        case '"':
+            n->kind = JSON_STRING;
+            return json_parse_string(jp, &n->as.s, false);
+        default:
+            break;
+    }
+    if (json_word(jp, "true", 4) || json_word(jp, "false", 5)) {
+        n->kind = JSON_BOOL;
+        n->as.b = *n->at == 't';
+        return true;
+    }
+    if (json_word(jp, "null", 4)) {
+        n->kind = JSON_NULL;
+        return true;
+    }
+    return json_number(jp, n);
+}
+
+/* Merge a value of `kind` into a slot; false if they cannot share one.
+ * Integers and doubles share a double slot; null fits any slot. */
+static bool json_merge_kind(uint8_t* slot, uint8_t kind) {
+    if (kind == JSON_NULL || *slot == kind) return true;
+    if (*slot == JSON_NULL) {
+        *slot = kind;
+        return true;
+    }
+    bool numbers = (*slot == JSON_INT || *slot == JSON_DOUBLE) && (kind == JSON_INT || kind == JSON_DOUBLE);
+    if (numbers) *slot = JSON_DOUBLE;
+    return numbers;
+}
+
+/* The member of `shape` named `key`. Objects of one array usually list their
+ * members in the same order, so position `hint` is tried first. */
+static JsonMember* json_member(JsonParser* jp, JsonShape* shape, const char* key, size_t hint, bool add) {
+    if (hint < shape->count && strcmp(shape->members[hint].key, key) == 0) return &shape->members[hint];
+    for (size_t i = 0; i < shape->count; i++)
+        if (strcmp(shape->members[i].key, key) == 0) return &shape->members[i];
+    if (!add) return NULL;
+    if (shape->count == shape->cap) {
+        size_t cap = shape->cap ? shape->cap * 2 : 8;
+        JsonMember* grown = arena_alloc(&jp->tmp, cap * sizeof(JsonMember));
+        if (!grown) return NULL;
+        if (shape->count) memcpy(grown, shape->members, shape->count * sizeof(JsonMember));
+        shape->members = grown;
+        shape->cap = cap;
+    }
+    JsonMember* m = &shape->members[shape->count++];
+    *m = (JsonMember){.key = key, .kind = JSON_NULL};
+    return m;
+}
+
+/* Add the members of object `obj` to `shape`. */
+static bool json_shape_add(JsonParser* jp, JsonShape* shape, const JsonNode* obj) {
+    size_t k = 0;
+    for (const JsonNode* kid = obj->as.kids.first; kid; kid = kid->next, k++) {
+        JsonMember* m = json_member(jp, shape, kid->key, k, true);
+        if (!m) return json_oom(jp);
+        if (!json_merge_kind(&m->kind, kid->kind))
+            return json_fail_at(jp, kid->at, "JSON member has a different type than in earlier objects");
+        if (kid->kind != JSON_OBJECT) continue;
+        if (!m->record) {
+            if (!(m->record = arena_alloc(&jp->tmp, sizeof(JsonShape)))) return json_oom(jp);
+            *m->record = (JsonShape){0};
         }
-        if (in_comment) {
-            if (*p == '-' && strncmp(p, "-->", 3) == 0) {
-                in_comment = false;
-                p += 3;
-            } else
-                p++;
+        if (!json_shape_add(jp, m->record, kid)) return false;
+    }
+    return true;
+}
+
+/* Field type and size of a slot of `kind`; nulls read as empty strings. */
+static ValueType json_slot_type(uint8_t kind, size_t* size) {
+    switch (kind) {
+        case JSON_BOOL:
+            *size = sizeof(bool);
+            return TMPL_BOOL;
+        case JSON_INT:
+            *size = sizeof(long);
+            return TMPL_LONG;
+        case JSON_DOUBLE:
+            *size = sizeof(double);
+            return TMPL_DOUBLE;
+        case JSON_ARRAY:
+            *size = sizeof(TemplateValueUnion);
+            return TMPL_ARRAY;
+        default:
+            *size = sizeof(BreezeSlice);
+            return TMPL_STRV;
+    }
+}
+
+static size_t json_field_count(const JsonShape* shape) {
+    size_t n = 0;
+    for (size_t i = 0; i < shape->count; i++)
+        n += shape->members[i].kind == JSON_OBJECT ? json_field_count(shape->members[i].record) : 1;
+    return n;
+}
+
+/* Give every leaf member of `shape` a field, named under `prefix`. */
+static bool json_layout_fields(JsonParser* jp, JsonShape* shape, const char* prefix, BreezeField* fields,
+                               size_t* nfields, size_t* size) {
+    size_t plen = prefix ? strlen(prefix) : 0;
+    for (size_t i = 0; i < shape->count; i++) {
+        JsonMember* m = &shape->members[i];
+        char* name = (char*)m->key;
+        if (prefix) {
+            size_t klen = strlen(m->key);
+            if (!(name = arena_alloc(jp->out, plen + klen + 2))) return json_oom(jp);
+            memcpy(name, prefix, plen);
+            name[plen] = '.';
+            memcpy(name + plen + 1, m->key, klen + 1);
+        }
+        if (m->kind == JSON_OBJECT) {
+            if (!json_layout_fields(jp, m->record, name, fields, nfields, size)) return false;
+            continue;
+        }
+        size_t bytes;
+        ValueType type = json_slot_type(m->kind, &bytes);
+        size_t align = bytes < 8 ? bytes : 8;
+        m->offset = (*size + align - 1) & ~(align - 1);
+        *size = m->offset + bytes;
+        fields[(*nfields)++] = (BreezeField){name, m->offset, type};
+    }
+    return true;
+}
+
+/* The record type of `shape`, in the output arena. */
+static const BreezeRecordType* json_layout(JsonParser* jp, JsonShape* shape) {
+    size_t count = json_field_count(shape), n = 0, size = 0;
+    BreezeRecordType* type = arena_alloc(jp->out, sizeof(BreezeRecordType));
+    BreezeField* fields = arena_alloc(jp->out, (count ? count : 1) * sizeof(BreezeField));
+    if (!type || !fields) {
+        json_oom(jp);
+        return NULL;
+    }
+    if (!json_layout_fields(jp, shape, NULL, fields, &n, &size)) return NULL;
+    *type = (BreezeRecordType){(size + 7) & ~(size_t)7, fields, count};
+    return type;
+}
+
+static bool json_array(JsonParser* jp, const JsonNode* arr, TemplateValue* v);
+
+/* Store value `n` in a slot of `kind` at `p`; a null leaves the slot zeroed. */
+static bool json_store(JsonParser* jp, uint8_t kind, const JsonNode* n, char* p) {
+    TemplateValue array;
+    switch (n->kind) {
+        case JSON_NULL:
+            return true;
+        case JSON_BOOL:
+            *(bool*)p = n->as.b;
+            return true;
+        case JSON_INT:
+            if (kind == JSON_DOUBLE) *(double*)p = (double)n->as.l;
+            else *(long*)p = n->as.l;
+            return true;
+        case JSON_DOUBLE:
+            *(double*)p = n->as.d;
+            return true;
+        case JSON_STRING:
+            *(BreezeSlice*)p = n->as.s;
+            return true;
+        default:
+            if (!json_array(jp, n, &array)) return false;
+            *(TemplateValueUnion*)p = array.value;
+            return true;
+    }
+}
+
+/* Fill the zeroed record at `dst` from object `obj`. */
+static bool json_fill(JsonParser* jp, JsonShape* shape, const JsonNode* obj, char* dst) {
+    size_t k = 0;
+    for (const JsonNode* kid = obj->as.kids.first; kid; kid = kid->next, k++) {
+        JsonMember* m = json_member(jp, shape, kid->key, k, false);
+        if (m->kind == JSON_OBJECT) {
+            if (kid->kind == JSON_OBJECT && !json_fill(jp, m->record, kid, dst)) return false;
+        } else if (!json_store(jp, m->kind, kid, dst + m->offset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool json_array(JsonParser* jp, const JsonNode* arr, TemplateValue* v) {
+    uint8_t kind = JSON_NULL;
+    JsonShape shape = {0};
+    for (const JsonNode* item = arr->as.kids.first; item; item = item->next) {
+        if (!json_merge_kind(&kind, item->kind))
+            return json_fail_at(jp, item->at, "JSON array items must share a type");
+        if (item->kind == JSON_OBJECT && !json_shape_add(jp, &shape, item)) return false;
+    }
+    size_t stride;
+    ValueType type = json_slot_type(kind, &stride);
+    const BreezeRecordType* record = NULL;
+    if (kind == JSON_OBJECT) {
+        if (!(record = json_layout(jp, &shape))) return false;
+        type = TMPL_RECORD;
+        stride = record->size ? record->size : 8;
+    }
+    size_t count = arr->as.kids.count;
+    char* items = NULL;
+    if (count) {
+        if (stride > UINT32_MAX || count > SIZE_MAX / stride || !(items = arena_alloc(jp->out, count * stride)))
+            return json_oom(jp);
+        memset(items, 0, count * stride);
+    }
+    char* p = items;
+    for (const JsonNode* item = arr->as.kids.first; item; item = item->next, p += stride) {
+        bool ok = item->kind != JSON_OBJECT ? json_store(jp, kind, item, p) : json_fill(jp, &shape, item, p);
+        if (!ok) return false;
+    }
+    *v = (TemplateValue){.type = TMPL_ARRAY, .value.array = {items, count, type, (uint32_t)stride, record}};
+    return true;
+}
+
+static bool json_to_value(JsonParser* jp, const JsonNode* n, TemplateValue* v) {
+    switch (n->kind) {
+        case JSON_NULL:
+            *v = breeze_strn("", 0);
+            return true;
+        case JSON_BOOL:
+            *v = (TemplateValue){.type = TMPL_BOOL, .value.boolean = n->as.b};
+            return true;
+        case JSON_INT:
+            *v = (TemplateValue){.type = TMPL_LONG, .value.long_int = n->as.l};
+            return true;
+        case JSON_DOUBLE:
+            *v = (TemplateValue){.type = TMPL_DOUBLE, .value.dbl = n->as.d};
+            return true;
+        case JSON_STRING:
+            *v = (TemplateValue){.type = TMPL_STRV, .value.strv = n->as.s};
+            return true;
+        case JSON_ARRAY:
+            return json_array(jp, n, v);
+        default:
+            break;
+    }
+    JsonShape shape = {0};
+    if (!json_shape_add(jp, &shape, n)) return false;
+    const BreezeRecordType* type = json_layout(jp, &shape);
+    if (!type) return false;
+    char* rec = arena_alloc(jp->out, type->size ? type->size : 8);
+    if (!rec) return json_oom(jp);
+    memset(rec, 0, type->size);
+    *v = (TemplateValue){.type = TMPL_RECORD, .value.record = {rec, type}};
+    return json_fill(jp, &shape, n, rec);
+}
+
+TemplateContext* breeze_context_from_json(const char* json, size_t len, BreezeArena* arena, TemplateError* err) {
+    if (err) *err = (TemplateError){.type = TMPL_ERR_NONE};
+    if (!json || !arena) {
+        set_error(err, TMPL_ERR_PARSE, "JSON text and arena are required", 0);
+        return NULL;
+    }
+    JsonParser jp = {.src = json, .p = json, .end = json + len, .out = &arena->arena, .err = err};
+    JsonNode root;
+    TemplateContext* ctx = NULL;
+    json_skip_ws(&jp);
+    bool ok = jp.p < jp.end && *jp.p == '{' ? json_value(&jp, &root, 0)
+                                            : json_fail(&jp, "JSON context must be an object");
+    if (ok) {
+        json_skip_ws(&jp);
+        if (jp.p != jp.end) ok = json_fail(&jp, "Unexpected text after JSON object");
+    }
+    if (ok) {
+        size_t count = root.as.kids.count;
+        ctx = arena_alloc(jp.out, sizeof(TemplateContext));
+        if (!ctx || !(ctx->vars = arena_alloc(jp.out, (count ? count : 1) * sizeof(TemplateVar)))) ok = json_oom(&jp);
+        else *ctx = (TemplateContext){.vars = ctx->vars, .count = count, .capacity = count};
+    }
+    size_t i = 0;
+    for (const JsonNode* kid = ok ? root.as.kids.first : NULL; kid && ok; kid = kid->next, i++) {
+        ctx->vars[i].key = kid->key;
+        ok = json_to_value(&jp, kid, &ctx->vars[i].value);
+    }
+    arena_free(&jp.tmp);
+    return ok ? ctx : NULL;
+}
+
+/* ================================================================
+   Renderer
+   ================================================================ */
+
+/* Shared with generated code, which keeps the same state on its stack. */
+typedef BreezeGenLoop LoopFrame;
+typedef BreezeGenField FieldCache; /* field resolved for the last record type seen */
+
+typedef struct RenderVM {
+    const BreezeTemplate* tpl;
+    const TemplateContext* ctx;
+    OutputBuffer* out;         /* final output, or the staging chunk when streaming */
+    const BreezeWriter* sink;  /* NULL unless streaming */
+    size_t flush_at;           /* staged bytes that trigger a flush to `sink` */
+    TemplateError* err;
+    LoopFrame* frames;
+    TemplateValue* sets;          /* value of each set variable, by name id; NULL without sets */
+    const TemplateValue** values; /* value of each name: resolved in the context once per render, or a set */
+    TemplateValue* cond_stack;
+    OutputBuffer* scratch; /* two filter-chain buffers, allocated on first use */
+    FieldCache* field_cache; /* resolved field per FieldSite */
+    Arena* arena;
+    BreezeRenderState* state; /* shared by the VMs of included templates */
+    struct RenderVM** subs; /* per include, created on first use */
+    BreezeProfile* profile; /* NULL unless this template is being profiled */
+    size_t pc;              /* where to continue after a suspended run */
+    struct RenderVM* active; /* included template suspended mid-render, continued before pc moves on */
+} RenderVM;
+
+struct BreezeProfile {
+    const BreezeTemplate* tpl;
+    BreezeNodeProfile* nodes;
+    BreezeFilterProfile* filters;
+    uint64_t renders;
+    size_t current;  /* node being timed, or NO_INDEX */
+    int64_t started; /* when `current` started */
+    size_t emitted;  /* output produced by then */
+};
+
+/* Charge the time and output since the last switch to the node being timed,
+ * then start timing node `pc` (NO_INDEX: stop). */
+static void profile_switch(const RenderVM* vm, size_t pc) {
+    BreezeProfile* p = vm->profile;
+    int64_t now = monotonic_ns();
+    size_t emitted = vm->state->flushed + vm->out->size;
+    if (p->current != NO_INDEX) {
+        BreezeNodeProfile* np = &p->nodes[p->current];
+        np->nanoseconds += (uint64_t)(now - p->started);
+        np->bytes += emitted - p->emitted;
+    }
+    if (pc != NO_INDEX) p->nodes[pc].executions++;
+    p->current = pc;
+    p->started = now;
+    p->emitted = emitted;
+}
+
+static bool render_error(const RenderVM* vm, const Node* node, TemplateErrorType type, const char* msg) {
+    return set_template_error(vm->err, vm->tpl, type, msg, node->pos);
+}
+
+/* Start a loop over `arr`; NULL, or why it cannot be iterated. */
+static const char* start_loop(LoopFrame* f, const TemplateValue* arr, bool counted) {
+    if (!arr || (arr->type != TMPL_ARRAY && arr->type != TMPL_ITER)) return "Variable for loop is not a valid array";
+    f->array = *arr;
+    f->index = 0;
+    f->count = arr->type == TMPL_ARRAY ? arr->value.array.count : arr->value.iter.count;
+    if (f->count == BREEZE_COUNT_UNKNOWN && counted)
+        return "loop.length and loop.last need an iterator with a known count";
+    return NULL;
+}
+
+/* Load item `f->index`; false once the sequence is exhausted. */
+static bool get_loop_item(LoopFrame* f) {
+    if (f->array.type == TMPL_ITER) return f->array.value.iter.next(f->array.value.iter.userdata, &f->item);
+    if (f->index >= f->count) return false;
+    array_item(&f->array, f->index, &f->item);
+    return true;
+}
+
+static void get_loop_meta(const LoopFrame* f, uint8_t meta, TemplateValue* v) {
+    size_t count = f->count;
+    switch (meta) {
+        case META_INDEX:
+            *v = (TemplateValue){.type = TMPL_UINT, .value.uint = (unsigned int)f->index};
+            break;
+        case META_INDEX1:
+            *v = (TemplateValue){.type = TMPL_UINT, .value.uint = (unsigned int)(f->index + 1)};
+            break;
+        case META_FIRST:
+            *v = (TemplateValue){.type = TMPL_BOOL, .value.boolean = f->index == 0};
+            break;
+        case META_LAST:
+            *v = (TemplateValue){.type = TMPL_BOOL, .value.boolean = f->index == count - 1};
+            break;
+        default:
+            *v = (TemplateValue){.type = TMPL_UINT, .value.uint = (unsigned int)count};
+            break;
+    }
+}
+
+/* The value of a COND_CONST literal. */
+ALWAYS_INLINE static inline void literal_value(const BreezeTemplate* tpl, const CondOp* op, TemplateValue* v) {
+    v->type = op->type;
+    if (op->type == TMPL_STRING) v->value.str = tpl->pool + op->arg;
+    else if (op->type == TMPL_DOUBLE) v->value.dbl = op->as.d;
+    else if (op->type == TMPL_BOOL) v->value.boolean = op->as.l != 0;
+    else v->value.long_int = op->as.l;
+}
+
+/* A {% set %} points the name's entry in values[] at its slot in sets[],
+ * so a name is a single load whether or not it was set. */
+ALWAYS_INLINE static inline void assign_set(RenderVM* vm, const CondOp* lit, uint32_t name) {
+    literal_value(vm->tpl, lit, &vm->sets[name]);
+    vm->values[name] = &vm->sets[name];
+}
+
+static const TemplateValue* lookup_name(const RenderVM* vm, uint32_t name) { return vm->values[name]; }
+
+/* Read field `fname` of a record. The descriptor search runs once per site
+ * and record type; after that each access is a load from the struct. */
+static const TemplateValue* record_field(const TemplateValue* record, const char* fname, FieldCache* fc,
+                                         TemplateValue* tmp) {
+    const BreezeRecordType* type = record->value.record.type;
+    if (fc->type != type) {
+        const BreezeField* found = NULL;
+        for (size_t i = 0; type && i < type->field_count && !found; i++)
+            if (strcmp(type->fields[i].name, fname) == 0) found = &type->fields[i];
+        if (!found) return NULL;
+        fc->type = type;
+        fc->field = found;
+    }
+    load_value(fc->field->type, (const char*)record->value.record.ptr + fc->field->offset, tmp);
+    return tmp;
+}
+
+/* Read `base.field`; a base that is not a record means the dotted name is a key. */
+static const TemplateValue* lookup_field(const RenderVM* vm, const VarRef* ref, const TemplateValue* base,
+                                         TemplateValue* tmp) {
+    const FieldSite* site = &vm->tpl->fields[ref->field];
+    if (!base || base->type != TMPL_RECORD)
+        return ref->kind == REF_NAME ? lookup_name(vm, site->full) : NULL;
+    return record_field(base, vm->tpl->pool + site->name, &vm->field_cache[ref->field], tmp);
+}
+
+/* Resolve a reference; `tmp` receives computed values (loop metadata, set
+ * variables, record fields). Returns NULL when a name is neither set nor in
+ * the context. */
+static const TemplateValue* lookup_ref(const RenderVM* vm, const VarRef* ref, TemplateValue* tmp) {
+    const TemplateValue* v;
+    switch (ref->kind) {
+        case REF_LOOP_ITEM:
+            v = &vm->frames[ref->depth].item;
+            break;
+        case REF_LOOP_META:
+            get_loop_meta(&vm->frames[ref->depth], ref->meta, tmp);
+            return tmp;
+        default:
+            v = lookup_name(vm, ref->name);
+            break;
+    }
+    return ref->field == NO_INDEX ? v : lookup_field(vm, ref, v, tmp);
+}
+
+static const char* ref_name(const RenderVM* vm, const VarRef* ref) {
+    const BreezeTemplate* tpl = vm->tpl;
+    return tpl->pool + tpl->names[ref->field == NO_INDEX ? ref->name : tpl->fields[ref->field].full];
+}
+
+/* Which scratch buffer a value's data lives in, or -1. */
+static int scratch_owner(const OutputBuffer scratch[2], const TemplateValue* v) {
+    const char* p;
+    if (v->type == TMPL_STRING) p = v->value.str;
+    else if (v->type == TMPL_STRV) p = v->value.strv.data;
+    else if (v->type == TMPL_ARRAY) p = v->value.array.items;
+    else return -1;
+    for (int k = 0; k < 2; k++) {
+        const OutputBuffer* b = &scratch[k];
+        if (p && b->data && p >= b->data && p < b->data + b->capacity) return k;
+    }
+    return -1;
+}
+
+/* A filter chain in progress. Values stay typed between filters; each filter
+ * writes into whichever of the two scratch buffers its input does not live
+ * in, so the chain allocates nothing once the buffers have grown. */
+typedef struct {
+    TemplateValue cur;
+    int buf; /* scratch buffer holding cur's text, when cur is a filter's text output; else -1 */
+} FilterChain;
+
+/* Run one filter of a chain: TMPL_ERR_NONE, or the kind of failure. */
+WARN_UNUSED static TemplateErrorType chain_step(OutputBuffer scratch[2], FilterChain* ch, const BoundFilter* bf,
+                                                const char* arg, BreezeFilterProfile* fp) {
+    int in_buf = ch->buf >= 0 ? ch->buf : scratch_owner(scratch, &ch->cur);
+    int k = in_buf == 0 ? 1 : 0;
+    OutputBuffer* out = &scratch[k];
+    int64_t t0 = fp ? monotonic_ns() : 0;
+    const char* data0 = out->data;
+    size_t cap0 = out->capacity;
+    if (!out->data && !buffer_init(out, 256)) return TMPL_ERR_MEMORY;
+    out->size = 0;
+    out->data[0] = '\0';
+
+    TemplateValue result = {.type = TMPL_STRING, .value.str = NULL};
+    bool ok = bf->fn ? bf->fn(&ch->cur, arg, out) : bf->value_fn(&ch->cur, arg, &result, out);
+    if (fp) {
+        fp->calls++;
+        fp->nanoseconds += (uint64_t)(monotonic_ns() - t0);
+        fp->allocations += out->data != data0 || out->capacity != cap0;
+    }
+    if (!ok) return TMPL_ERR_RENDER;
+
+    if (result.type == TMPL_STRING && !result.value.str) {
+        ch->cur = (TemplateValue){.type = TMPL_STRING, .value.str = out->data};
+        ch->buf = k;
+    } else {
+        ch->cur = result;
+        ch->buf = -1;
+    }
+    return TMPL_ERR_NONE;
+}
+
+static const char* chain_error(TemplateErrorType type) {
+    return type == TMPL_ERR_MEMORY ? "malloc failed for filter scratch" : "Filter execution failed";
+}
+
+WARN_UNUSED static bool chain_output(OutputBuffer* out, const OutputBuffer scratch[2], const FilterChain* ch,
+                                     bool escape) {
+    if (ch->buf >= 0) {
+        const OutputBuffer* text = &scratch[ch->buf];
+        return escape ? escape_append(out, text->data, text->size) : buffer_append(out, text->data, text->size);
+    }
+    return escape ? value_to_escaped(&ch->cur, out) : value_to_string(&ch->cur, out);
+}
+
+/* Run a pre-parsed filter chain and output its result. */
+WARN_UNUSED static bool apply_filters(const RenderVM* vm, const Node* node, const TemplateValue* val) {
+    const BreezeTemplate* tpl = vm->tpl;
+    FilterChain ch = {*val, -1};
+    for (uint32_t i = 0; i < node->as.var.nfilters; i++) {
+        const FilterCall* fc = &tpl->filters[node->as.var.filters + i];
+        const BoundFilter* bf = &tpl->filter_fns[node->as.var.filters + i];
+        if (!bf->fn && !bf->value_fn) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Unknown filter '%s'", tpl->pool + fc->name);
+            return render_error(vm, node, TMPL_ERR_RENDER, msg);
+        }
+        const char* farg = fc->arg == NO_INDEX ? NULL : tpl->pool + fc->arg;
+        BreezeFilterProfile* fp = vm->profile ? &vm->profile->filters[node->as.var.filters + i] : NULL;
+        TemplateErrorType e = chain_step(vm->scratch, &ch, bf, farg, fp);
+        if (e != TMPL_ERR_NONE) return render_error(vm, node, e, chain_error(e));
+    }
+    return chain_output(vm->out, vm->scratch, &ch, node->flags & NODE_F_ESCAPE);
+}
+
+WARN_UNUSED static bool render_var_node(const RenderVM* vm, const Node* node) {
+    TemplateValue tmp;
+    const TemplateValue* val = lookup_ref(vm, &node->as.var.ref, &tmp);
+    if (!val) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Missing template variable for '%s'", ref_name(vm, &node->as.var.ref));
+        return render_error(vm, node, TMPL_ERR_RENDER, msg);
+    }
+    bool ok = node->as.var.nfilters            ? apply_filters(vm, node, val)
+              : node->flags & NODE_F_ESCAPE ? value_to_escaped(val, vm->out)
+                                            : value_to_string(val, vm->out);
+    if (!ok && vm->err->type == TMPL_ERR_NONE) return render_error(vm, node, TMPL_ERR_MEMORY, "buffer_append failed");
+    return ok;
+}
+
+static bool value_is_number(const TemplateValue* v) {
+    return !is_string_value(v) && v->type != TMPL_ARRAY && v->type != TMPL_RECORD && v->type != TMPL_ITER;
+}
+
+static bool value_is_integer(const TemplateValue* v) {
+    return v->type == TMPL_INT || v->type == TMPL_LONG || v->type == TMPL_UINT || v->type == TMPL_BOOL;
+}
+
+static long long value_as_integer(const TemplateValue* v) {
+    switch (v->type) {
+        case TMPL_INT:
+            return v->value.integer;
+        case TMPL_LONG:
+            return v->value.long_int;
+        case TMPL_UINT:
+            return v->value.uint;
+        default:
+            return v->value.boolean;
+    }
+}
+
+static double value_as_double(const TemplateValue* v) {
+    if (v->type == TMPL_FLOAT) return v->value.floating;
+    if (v->type == TMPL_DOUBLE) return v->value.dbl;
+    return (double)value_as_integer(v);
+}
+
+/* Read a string that is entirely a number, e.g. the value of a set variable. */
+static bool string_as_number(const TemplateValue* v, TemplateValue* out) {
+    const char* s = v->value.str;
+    char num[NUMBER_MAX];
+    if (v->type == TMPL_STRV) {
+        size_t len;
+        const char* data = string_bytes(v, &len);
+        if (len >= sizeof(num)) return false;
+        memcpy(num, data, len);
+        num[len] = '\0';
+        s = num;
+    }
+    if (!s || !*s || isspace((unsigned char)*s)) return false;
+    char* end;
+    double d = strtod(s, &end);
+    if (*end != '\0') return false;
+    *out = (TemplateValue){.type = TMPL_DOUBLE, .value.dbl = d};
+    return true;
+}
+
+/* Three-way compare of two scalars: numbers numerically (numeric strings
+ * included), strings bytewise. False when the values are not comparable. */
+static bool compare_scalars(const TemplateValue* a, const TemplateValue* b, int* order) {
+    TemplateValue na, nb;
+    if (a->type == TMPL_STRING && b->type == TMPL_STRING) {
+        if (!a->value.str || !b->value.str) return false;
+        int r = strcmp(a->value.str, b->value.str);
+        *order = (r > 0) - (r < 0);
+        return true;
+    }
+    if (is_string_value(a) && is_string_value(b)) {
+        if ((a->type == TMPL_STRING && !a->value.str) || (b->type == TMPL_STRING && !b->value.str)) return false;
+        size_t al, bl;
+        const char* x = string_bytes(a, &al);
+        const char* y = string_bytes(b, &bl);
+        int r = memcmp(x, y, al < bl ? al : bl);
+        *order = r ? (r > 0) - (r < 0) : (al > bl) - (al < bl);
+        return true;
+    }
+    if (is_string_value(a)) {
+        if (!value_is_number(b) || !string_as_number(a, &na)) return false;
+        a = &na;
+    } else if (is_string_value(b)) {
+        if (!value_is_number(a) || !string_as_number(b, &nb)) return false;
+        b = &nb;
+    }
+    if (!value_is_number(a) || !value_is_number(b)) return false;
+    if (value_is_integer(a) && value_is_integer(b)) {
+        long long x = value_as_integer(a), y = value_as_integer(b);
+        *order = (x > y) - (x < y);
+    } else {
+        double x = value_as_double(a), y = value_as_double(b);
+        if (isnan(x) || isnan(y)) return false;
+        *order = (x > y) - (x < y);
+    }
+    return true;
+}
+
+static bool values_equal(const TemplateValue* a, const TemplateValue* b) {
+    int order;
+    return compare_scalars(a, b, &order) && order == 0;
+}
+
+/* `needle in haystack`: membership for arrays, substring for strings. */
+static bool value_contains(const TemplateValue* haystack, const TemplateValue* needle, bool* found,
+                           const char** why) {
+    *found = false;
+    if (haystack->type == TMPL_ARRAY) {
+        TemplateValue item;
+        for (size_t i = 0; i < haystack->value.array.count && !*found; i++) {
+            array_item(haystack, i, &item);
+            *found = values_equal(&item, needle);
+        }
+        return true;
+    }
+    if (is_string_value(haystack) && (haystack->type == TMPL_STRV || haystack->value.str)) {
+        char tmp[NUMBER_MAX];
+        size_t hay_len, len;
+        const char* hay = string_bytes(haystack, &hay_len);
+        const char* text = value_text(needle, tmp, &len);
+        *found = !len || find_bytes(hay, hay_len, text, len);
+        return true;
+    }
+    *why = "Right side of 'in' must be an array or a string";
+    return false;
+}
+
+/* Evaluate `a cmp b`; on failure `why` says what was wrong with the operands. */
+WARN_UNUSED static bool compare_values(uint8_t cmp, const TemplateValue* a, const TemplateValue* b, bool* result,
+                                       const char** why) {
+    int order;
+    switch (cmp) {
+        case CMP_IN:
+            return value_contains(b, a, result, why);
+        case CMP_NOT_IN:
+            if (!value_contains(b, a, result, why)) return false;
+            *result = !*result;
+            return true;
+        case CMP_EQ:
+            *result = values_equal(a, b);
+            return true;
+        case CMP_NE:
+            *result = !values_equal(a, b);
+            return true;
+        default:
+            break;
+    }
+    if (!compare_scalars(a, b, &order)) {
+        *why = "Values cannot be ordered";
+        return false;
+    }
+    switch (cmp) {
+        case CMP_LT:
+            *result = order < 0;
+            break;
+        case CMP_LE:
+            *result = order <= 0;
+            break;
+        case CMP_GT:
+            *result = order > 0;
+            break;
+        default:
+            *result = order >= 0;
+            break;
+    }
+    return true;
+}
+
+WARN_UNUSED static bool eval_condition(const RenderVM* vm, const Node* node, bool* result) {
+    const BreezeTemplate* tpl = vm->tpl;
+    const CondOp* ops = tpl->conds + node->as.branch.cond;
+    TemplateValue* st = vm->cond_stack;
+    size_t sp = 0;
+    for (uint32_t i = 0; i < node->as.branch.ncond;) {
+        const CondOp* op = &ops[i++];
+        switch (op->op) {
+            case COND_LOAD: {
+                const TemplateValue* v = lookup_ref(vm, &op->as.ref, &st[sp]);
+                if (!v) {
+                    char msg[128];
+                    snprintf(msg, sizeof(msg), "Missing template variable for '%s'", ref_name(vm, &op->as.ref));
+                    return render_error(vm, node, TMPL_ERR_PARSE, msg);
+                }
+                st[sp++] = *v;
+                break;
+            }
+            case COND_CONST:
+                literal_value(tpl, op, &st[sp++]);
+                break;
+            case COND_NOT:
+                st[sp - 1] = (TemplateValue){.type = TMPL_BOOL, .value.boolean = !is_truthy(&st[sp - 1])};
+                break;
+            case COND_CMP: {
+                bool r;
+                const char* why;
+                sp--;
+                if (!compare_values(op->cmp, &st[sp - 1], &st[sp], &r, &why))
+                    return render_error(vm, node, TMPL_ERR_RENDER, why);
+                st[sp - 1] = (TemplateValue){.type = TMPL_BOOL, .value.boolean = r};
+                break;
+            }
+            case COND_AND:
+            case COND_OR:
+                if (is_truthy(&st[sp - 1]) == (op->op == COND_OR)) i = op->arg;
+                else sp--;
+                break;
+            default:
+                break;
+        }
+    }
+    *result = is_truthy(&st[0]);
+    return true;
+}
+
+/* Output goes to the sink as it is produced, unless a {% cache %} block is
+ * capturing it: captured bytes must stay in the buffer until stored. */
+ALWAYS_INLINE static inline bool streaming(const RenderVM* vm) { return vm->sink && !vm->state->capture_count; }
+
+/* Hand the staged chunk, plus an optional extra slice, to the sink. */
+WARN_UNUSED static bool flush_output(const RenderVM* vm, const char* extra, size_t extra_len) {
+    BreezeSlice slices[2];
+    size_t n = 0;
+    if (vm->out->size) slices[n++] = (BreezeSlice){vm->out->data, vm->out->size};
+    if (extra_len) slices[n++] = (BreezeSlice){extra, extra_len};
+    if (n && !vm->sink->write(vm->sink->userdata, slices, n)) return false;
+    vm->state->flushed += vm->out->size + extra_len;
+    vm->out->size = 0;
+    vm->out->data[0] = '\0';
+    return true;
+}
+
+/* Emit literal text. When streaming, runs at least as large as the chunk
+ * bypass it and go to the sink together with whatever is staged. */
+WARN_UNUSED static bool emit_literal(const RenderVM* vm, const Node* node, const char* data, size_t len) {
+    if (streaming(vm) && len >= vm->flush_at) {
+        if (!flush_output(vm, data, len)) return render_error(vm, node, TMPL_ERR_IO, "Output write failed");
+        return true;
+    }
+    if (!buffer_append(vm->out, data, len)) return render_error(vm, node, TMPL_ERR_MEMORY, "buffer_append failed");
+    return true;
+}
+
+WARN_UNUSED static bool render_include(RenderVM* vm, const Node* n);
+static bool run_program(RenderVM* vm);
+
+/* Build the key of a {% cache %} block: its name, then ":value" per key variable. */
+WARN_UNUSED static bool fragment_key(const RenderVM* vm, const Node* n, OutputBuffer* keys) {
+    const BreezeTemplate* tpl = vm->tpl;
+    if (!buffer_append_str(keys, tpl->pool + n->as.cache.name)) return false;
+    for (uint32_t i = 0; i < n->as.cache.nkeys; i++) {
+        const VarRef* ref = &tpl->cache_keys[n->as.cache.keys + i];
+        TemplateValue tmp;
+        const TemplateValue* v = lookup_ref(vm, ref, &tmp);
+        if (!v) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Missing template variable for '%s'", ref_name(vm, ref));
+            return render_error(vm, n, TMPL_ERR_RENDER, msg);
+        }
+        char text[NUMBER_MAX];
+        size_t len;
+        const char* s = value_text(v, text, &len);
+        if (!buffer_append(keys, ":", 1) || !buffer_append(keys, s, len)) return false;
+    }
+    return buffer_append(keys, "\0", 1); /* keep the NUL: nested blocks append their keys after it */
+}
+
+/* Splice in a stored fragment (`*hit`), or start capturing the block. */
+WARN_UNUSED static bool begin_fragment(const RenderVM* vm, const Node* n, bool* hit) {
+    BreezeRenderState* st = vm->state;
+    OutputBuffer* keys = &st->fragment_keys;
+    size_t key_start = keys->size;
+    if (!fragment_key(vm, n, keys)) {
+        keys->size = key_start;
+        if (vm->err->type == TMPL_ERR_NONE) render_error(vm, n, TMPL_ERR_MEMORY, "malloc failed for fragment key");
+        return false;
+    }
+    BreezeFragmentStore store = engine_fragment_store(vm->tpl->engine);
+    size_t before = vm->out->size;
+    *hit = store.get(store.userdata, keys->data + key_start, vm->out);
+    if (*hit) {
+        keys->size = key_start;
+        return true;
+    }
+    vm->out->size = before; /* a failed get must not leave partial output */
+    if (!grow_array(&st->captures, &st->capture_cap, st->capture_count + 1, sizeof(Capture))) {
+        keys->size = key_start;
+        return render_error(vm, n, TMPL_ERR_MEMORY, "malloc failed for fragment capture");
+    }
+    st->captures[st->capture_count++] = (Capture){before, key_start, n->as.cache.ttl, store};
+    return true;
+}
+
+static void end_fragment(const RenderVM* vm) {
+    BreezeRenderState* st = vm->state;
+    const Capture* cap = &st->captures[--st->capture_count];
+    cap->store.put(cap->store.userdata, st->fragment_keys.data + cap->key_start, vm->out->data + cap->out_start,
+                   vm->out->size - cap->out_start, cap->ttl);
+    st->fragment_keys.size = cap->key_start;
+}
+
+/* Run from vm->pc to the end, or until a resumable render has staged
+ * enough output. A suspended run keeps its position in vm->pc and sets
+ * state->suspended; it never stops inside a {% cache %} capture. */
+static bool run_nodes(RenderVM* vm) {
+    const BreezeTemplate* tpl = vm->tpl;
+    const Node* nodes = tpl->nodes;
+    size_t pc = vm->pc;
+
+    while (pc < tpl->node_count) {
+        const Node* n = &nodes[pc];
+        BreezeRenderState* st = vm->state;
+        if (st->yield_at && vm->out->size >= st->yield_at && !st->capture_count) {
+            st->suspended = true;
+            vm->pc = pc;
+            return true;
+        }
+        if (vm->profile) profile_switch(vm, pc);
+        if (streaming(vm) && vm->out->size >= vm->flush_at && !flush_output(vm, NULL, 0))
+            return render_error(vm, n, TMPL_ERR_IO, "Output write failed");
+        switch (n->type) {
+            case NODE_TEXT:
+                if (!emit_literal(vm, n, tpl->pool + n->as.text.off, n->as.text.len)) return false;
+                pc++;
+                break;
+            case NODE_VAR:
+                if (!render_var_node(vm, n)) return false;
+                pc++;
+                break;
+            case NODE_SET:
+                assign_set(vm, &tpl->conds[n->as.set.value], n->as.set.name);
+                pc++;
+                break;
+            case NODE_FOR: {
+                TemplateValue tmp;
+                LoopFrame* f = &vm->frames[n->as.loop.depth];
+                const char* why = start_loop(f, lookup_ref(vm, &n->as.loop.array, &tmp), n->flags & NODE_F_LOOP_COUNT);
+                if (why) return render_error(vm, n, TMPL_ERR_RENDER, why);
+                pc = get_loop_item(f) ? pc + 1 : n->as.loop.end;
+                break;
+            }
+            case NODE_ENDFOR: {
+                LoopFrame* f = &vm->frames[n->as.endloop.depth];
+                f->index++;
+                if (get_loop_item(f)) {
+                    pc = n->as.endloop.body;
+                } else {
+                    pc++;
+                }
+                break;
+            }
+            case NODE_BRANCH: {
+                bool taken;
+                if (!eval_condition(vm, n, &taken)) return false;
+                pc = taken ? pc + 1 : n->as.branch.target;
+                break;
+            }
+            case NODE_JUMP:
+                pc = n->as.jump.target;
+                break;
+            case NODE_INCLUDE:
+                if (!(vm->active ? run_program(vm->active) : render_include(vm, n))) return false;
+                vm->active = NULL;
+                if (vm->state->suspended) {
+                    vm->active = vm->subs[n->as.include.index];
+                    vm->pc = pc;
+                    return true;
+                }
+                pc++;
+                break;
+            case NODE_CACHE: {
+                bool hit;
+                if (!begin_fragment(vm, n, &hit)) return false;
+                pc = hit ? n->as.cache.end : pc + 1;
+                break;
+            }
+            case NODE_ENDCACHE:
+                end_fragment(vm);
+                pc++;
+                break;
+            default:
+                abort();
+        }
+    }
+    return true;
+}
+
+static bool run_program(RenderVM* vm) {
+    bool ok = run_nodes(vm);
+    if (vm->profile) profile_switch(vm, NO_INDEX);
+    return ok;
+}
+
+/* Look every name up once, so loop bodies never search the context. With a
+ * schema the declared slot is used directly when the context matches it. */
+static const TemplateValue* resolve_name(const TemplateContext* ctx, const char* name, size_t slot) {
+    if (slot < ctx->count && strcmp(ctx->vars[slot].key, name) == 0) return &ctx->vars[slot].value;
+    return context_get(ctx, name);
+}
+
+static void resolve_names(RenderVM* vm) {
+    const BreezeTemplate* tpl = vm->tpl;
+    for (size_t id = 0; id < tpl->name_count; id++)
+        vm->values[id] = resolve_name(vm->ctx, tpl->pool + tpl->names[id],
+                                      tpl->name_slots ? tpl->name_slots[id] : NO_INDEX);
+}
+
+/* Allocate the per-template stacks of `vm` from its arena. */
+WARN_UNUSED static bool prepare_vm(RenderVM* vm) {
+    const BreezeTemplate* tpl = vm->tpl;
+    Arena* a = vm->arena;
+    if ((tpl->loop_depth && !(vm->frames = arena_alloc(a, sizeof(LoopFrame) * tpl->loop_depth))) ||
+        (tpl->has_set && !(vm->sets = arena_alloc(a, sizeof(TemplateValue) * tpl->name_count))) ||
+        (tpl->cond_depth && !(vm->cond_stack = arena_alloc(a, sizeof(TemplateValue) * tpl->cond_depth))) ||
+        (tpl->name_count && !(vm->values = arena_alloc(a, sizeof(TemplateValue*) * tpl->name_count))) ||
+        (tpl->field_count && !(vm->field_cache = arena_alloc(a, sizeof(FieldCache) * tpl->field_count))) ||
+        (tpl->include_count && !(vm->subs = arena_alloc(a, sizeof(RenderVM*) * tpl->include_count))))
+        return false;
+    if (vm->field_cache) memset(vm->field_cache, 0, sizeof(FieldCache) * tpl->field_count);
+    if (vm->subs) memset(vm->subs, 0, sizeof(RenderVM*) * tpl->include_count);
+    return true;
+}
+
+/* Run a partial against the same context and output. Its VM is built on the
+ * first visit of the include and reused for later ones, e.g. in a loop. */
+static bool render_include(RenderVM* vm, const Node* n) {
+    const BreezeTemplate* tpl = vm->tpl;
+    uint32_t index = n->as.include.index;
+    RenderVM* sub = vm->subs[index];
+    if (!sub) {
+        sub = arena_alloc(vm->arena, sizeof(RenderVM));
+        if (!sub) return render_error(vm, n, TMPL_ERR_MEMORY, "malloc failed for render state");
+        *sub = (RenderVM){.tpl = tpl->includes[index],
+                          .ctx = vm->ctx,
+                          .out = vm->out,
+                          .sink = vm->sink,
+                          .flush_at = vm->flush_at,
+                          .err = vm->err,
+                          .scratch = vm->scratch,
+                          .arena = vm->arena,
+                          .state = vm->state};
+        if (!prepare_vm(sub)) return render_error(vm, n, TMPL_ERR_MEMORY, "malloc failed for render state");
+        vm->subs[index] = sub;
+    }
+    resolve_names(sub);
+    const IncludeBinding* b = tpl->bindings + n->as.include.bindings;
+    for (uint32_t i = 0; i < n->as.include.nbindings; i++, b++) {
+        if (b->kind == BIND_LOOP_ITEM) {
+            sub->values[b->child] = &vm->frames[b->from].item;
+        } else if (vm->values[b->from] == &vm->sets[b->from]) {
+            sub->values[b->child] = &vm->sets[b->from];
+        }
+    }
+    sub->pc = 0;
+    return run_program(sub);
+}
+
+/* Set up `vm` at the first node of `tpl`. The arena must have been reset;
+ * a resumable render in progress on `state` is abandoned. */
+WARN_UNUSED static bool start_program(RenderVM* vm, const BreezeTemplate* tpl, const TemplateContext* ctx,
+                                      OutputBuffer* out, const BreezeWriter* sink, BreezeRenderState* state,
+                                      TemplateError* err) {
+    *vm = (RenderVM){.tpl = tpl,
+                     .ctx = ctx,
+                     .out = out,
+                     .sink = sink,
+                     .flush_at = BREEZE_WRITER_CHUNK / 2,
+                     .err = err,
+                     .scratch = state->scratch,
+                     .arena = &state->arena,
+                     .state = state};
+    state->capture_count = 0;
+    state->fragment_keys.size = 0;
+    state->flushed = 0;
+    state->resume = NULL;
+    state->yield_at = 0;
+    state->suspended = false;
+    if (state->profile && state->profile->tpl == tpl) {
+        vm->profile = state->profile;
+        vm->profile->renders++;
+        vm->profile->current = NO_INDEX;
+    }
+    if (!prepare_vm(vm)) return set_error(err, TMPL_ERR_MEMORY, "malloc failed for render state", 1);
+    resolve_names(vm);
+    return true;
+}
+
+/* The output size hint follows a larger page at once and closes an eighth of
+ * the gap to a smaller one, so one small page does not undo it. Renders on
+ * other threads may race on it; any of their values will do. */
+static size_t size_hint_get(const BreezeTemplate* tpl) { return __atomic_load_n(&tpl->size_hint, __ATOMIC_RELAXED); }
+
+static void size_hint_learn(const BreezeTemplate* tpl, size_t produced) {
+    size_t hint = size_hint_get(tpl);
+    size_t next = produced >= hint ? produced : hint - (hint - produced) / 8;
+    if (next != hint) __atomic_store_n((size_t*)&tpl->size_hint, next, __ATOMIC_RELAXED);
+}
+
+size_t breeze_template_size_hint(const BreezeTemplate* tpl) { return tpl ? size_hint_get(tpl) : 0; }
+
+void breeze_state_stats(const BreezeRenderState* state, BreezeRenderStats* stats) {
+    if (stats) *stats = state ? state->stats : (BreezeRenderStats){0};
+}
+
+void breeze_state_set_memory_limit(BreezeRenderState* state, size_t max_bytes) {
+    if (state) state->memory_limit = max_bytes;
+}
+
+static bool render_program(const BreezeTemplate* tpl, const TemplateContext* ctx, OutputBuffer* out,
+                           const BreezeWriter* sink, BreezeRenderState* state, TemplateError* err) {
+    /* Ensure error is initialised */
+    TemplateError local_err;
+    if (!err) err = &local_err;
+    err->type = TMPL_ERR_NONE;
+    err->line = 0;
+    err->column = 0;
+    err->message[0] = '\0';
+
+    AllocCharge charge = {&state->stats, state->memory_limit};
+    AllocCharge* outer = tls_charge;
+    state->stats = (BreezeRenderStats){0};
+    tls_charge = &charge;
+    size_t start = out->size, hint = size_hint_get(tpl);
+    arena_reset(&state->arena);
+    RenderVM vm;
+    bool ok = start_program(&vm, tpl, ctx, out, sink, state, err);
+    if (ok && !sink && hint && !buffer_reserve(out, hint))
+        ok = set_error(err, TMPL_ERR_MEMORY, "malloc failed for output", 0);
+    if (ok) ok = run_program(&vm);
+    if (ok && sink && !flush_output(&vm, NULL, 0)) ok = set_error(err, TMPL_ERR_IO, "Output write failed", 0);
+    tls_charge = outer;
+    state->stats.output_bytes = state->flushed + out->size - start;
+    if (ok) size_hint_learn(tpl, state->stats.output_bytes);
+    return ok;
+}
+
+static bool render_to_writer(BreezeRenderState* state, const BreezeTemplate* tpl, const TemplateContext* ctx,
+                             const BreezeWriter* writer, TemplateError* err) {
+    OutputBuffer* chunk = &state->chunk;
+    if (!chunk->data && !buffer_init(chunk, BREEZE_WRITER_CHUNK))
+        return set_error(err, TMPL_ERR_MEMORY, "malloc failed for chunk", 0);
+    chunk->size = 0;
+    chunk->data[0] = '\0';
+    return render_program(tpl, ctx, chunk, writer, state, err);
+}
+
+bool breeze_state_render(BreezeRenderState* state, const BreezeTemplate* tpl, const TemplateContext* ctx,
+                         OutputBuffer* out, TemplateError* err) {
+    if (!state) return breeze_render_compiled(tpl, ctx, out, err);
+    return render_program(tpl, ctx, out, NULL, state, err);
+}
+
+bool breeze_state_render_to_writer(BreezeRenderState* state, const BreezeTemplate* tpl, const TemplateContext* ctx,
+                                   const BreezeWriter* writer, TemplateError* err) {
+    if (!state) return breeze_render_to_writer(tpl, ctx, writer, err);
+    return render_to_writer(state, tpl, ctx, writer, err);
+}
+
+/* A resumable render stages output in state->chunk. Each step hands out
+ * what is staged and runs the program on until the step's buffer could be
+ * filled, so a step never produces much more than it can deliver and a
+ * large page is never built whole. A failure is reported by the step that
+ * delivers the last of the output written before it. */
+bool breeze_render_begin(BreezeRenderState* state, const BreezeTemplate* tpl, const TemplateContext* ctx,
+                         TemplateError* err) {
+    if (err) *err = (TemplateError){.type = TMPL_ERR_NONE};
+    if (!state || !tpl || !ctx) return set_error(err, TMPL_ERR_RENDER, "State, template and context are required", 0);
+    OutputBuffer* chunk = &state->chunk;
+    if (!chunk->data && !buffer_init(chunk, BREEZE_WRITER_CHUNK))
+        return set_error(err, TMPL_ERR_MEMORY, "malloc failed for chunk", 0);
+    chunk->size = 0;
+    chunk->data[0] = '\0';
+
+    AllocCharge charge = {&state->stats, state->memory_limit};
+    AllocCharge* outer = tls_charge;
+    state->stats = (BreezeRenderStats){0};
+    tls_charge = &charge;
+    arena_reset(&state->arena);
+    state->error = (TemplateError){.type = TMPL_ERR_NONE};
+    RenderVM* vm = arena_alloc(&state->arena, sizeof(RenderVM));
+    bool ok = vm ? start_program(vm, tpl, ctx, chunk, NULL, state, &state->error)
+                 : set_error(&state->error, TMPL_ERR_MEMORY, "malloc failed for render state", 0);
+    tls_charge = outer;
+    if (!ok) {
+        if (err) *err = state->error;
+        return false;
+    }
+    state->resume = vm;
+    state->finished = false;
+    state->delivered = 0;
+    return true;
+}
+
+BreezeRenderStatus breeze_render_step(BreezeRenderState* state, char* buf, size_t cap, size_t* written,
+                                      TemplateError* err) {
+    size_t n = 0;
+    if (written) *written = 0;
+    if (!state || !state->resume) {
+        set_error(err, TMPL_ERR_RENDER, "No render in progress", 0);
+        return BREEZE_RENDER_ERROR;
+    }
+    OutputBuffer* chunk = &state->chunk;
+    while (n < cap) {
+        if (state->delivered < chunk->size) {
+            size_t len = chunk->size - state->delivered;
+            if (len > cap - n) len = cap - n;
+            memcpy(buf + n, chunk->data + state->delivered, len);
+            state->delivered += len;
+            n += len;
             continue;
         }
-        if (!in_raw && *p == '-' && strncmp(p, "-->", 3) == 0) {
-            CLEANUP();
-            return set_error(err, TMPL_ERR_PARSE, "Unmatched comment closing tag '-->'", calc_line(template, p));
-        }
-
-        /* ----- raw block ----- */
-        if (in_raw) {
-            if (*p == '{' && strncmp(p, "{%", 2) == 0) {
-                const char* ds = p + 2;
-                const char* de = strstr(ds, "%}");
-                if (de) {
-                    char dir[64];
-                    size_t dl = (size_t)(de - ds);
-                    if (dl < sizeof(dir)) {
-                        memcpy(dir, ds, dl);
-                        dir[dl] = '\0';
-                        if (strcmp(str_trim(dir), "endraw") == 0) {
-                            in_raw = false;
-                            p = de + 2;
-                            if (*p == '\n') p++; /* consume trailing newline */
-                            continue;
-                        }
-                    }
+        if (state->finished) break;
+        state->flushed += chunk->size;
+        chunk->size = 0;
+        chunk->data[0] = '\0';
+        state->delivered = 0;
+        state->yield_at = cap - n;
+        state->suspended = false;
+        AllocCharge charge = {&state->stats, state->memory_limit};
+        AllocCharge* outer = tls_charge;
+        tls_charge = &charge;
+        bool ok = run_program(state->resume);
+        tls_charge = outer;
+        state->yield_at = 0;
+        state->finished = !ok || !state->suspended;
+    }
+    if (written) *written = n;
+    state->stats.output_bytes = state->flushed + chunk->size;
+    if (!state->finished || state->delivered < chunk->size) return BREEZE_RENDER_MORE;
+    state->resume = NULL;
+    if (state->error.type == TMPL_ERR_NONE) return BREEZE_RENDER_DONE;
+    if (err) *err = state->error;
+    return BREEZE_RENDER_ERROR;
+}
+
+bool breeze_render_compiled(const BreezeTemplate* tpl, const TemplateContext* ctx, OutputBuffer* out,
+                            TemplateError* err) {
+    BreezeRenderState state = {0};
+    bool ok = render_program(tpl, ctx, out, NULL, &state, err);
+    render_state_release(&state);
+    return ok;
+}
+
+bool breeze_render_to_writer(const BreezeTemplate* tpl, const TemplateContext* ctx, const BreezeWriter* writer,
+                             TemplateError* err) {
+    BreezeRenderState state = {0};
+    bool ok = render_to_writer(&state, tpl, ctx, writer, err);
+    render_state_release(&state);
+    return ok;
+}
+
+/* ================================================================
+   Constant folding
+   ================================================================ */
+
+/* After a template is bound, a variable set exactly once at the top level
+ * holds the same value wherever it is read after that tag, so {{ }} of it
+ * can be rendered once, through the real filter chain, and conditions over
+ * such variables and literals can be decided. Decided branches leave
+ * unreachable nodes and no-op jumps, which are dropped before adjacent text
+ * runs are merged. Anything that fails to evaluate is left for render time,
+ * where it reports its error as usual. */
+
+#define FOLD_DYNAMIC (NO_INDEX - 1) /* set more than once, or inside a block */
+
+/* Successors of node `i`; returns their number. */
+static int node_successors(const Node* n, uint32_t i, uint32_t next[2]) {
+    switch (n->type) {
+        case NODE_FOR:
+            next[1] = n->as.loop.end;
+            break;
+        case NODE_ENDFOR:
+            next[1] = n->as.endloop.body;
+            break;
+        case NODE_BRANCH:
+            next[1] = n->as.branch.target;
+            break;
+        case NODE_CACHE:
+            next[1] = n->as.cache.end;
+            break;
+        case NODE_JUMP:
+            next[0] = n->as.jump.target;
+            return 1;
+        default:
+            next[0] = i + 1;
+            return 1;
+    }
+    next[0] = i + 1;
+    return 2;
+}
+
+/* Node index of the set that makes `ref` a constant at node `at`, else NO_INDEX. */
+static uint32_t const_set(const uint32_t* set_at, const VarRef* ref, uint32_t at) {
+    if (ref->kind != REF_NAME || ref->field != NO_INDEX) return NO_INDEX;
+    uint32_t s = set_at[ref->name];
+    return s < at ? s : NO_INDEX;
+}
+
+/* Find the constant set variables: set once, outside every block. */
+static void find_constants(const BreezeTemplate* t, int32_t* nest, uint32_t* set_at) {
+    size_t n = t->node_count;
+    for (size_t i = 0; i < n; i++) {
+        const Node* nd = &t->nodes[i];
+        uint32_t end = nd->type == NODE_FOR     ? nd->as.loop.end
+                       : nd->type == NODE_CACHE ? nd->as.cache.end
+                       : nd->type == NODE_BRANCH ? nd->as.branch.target
+                       : nd->type == NODE_JUMP   ? nd->as.jump.target
+                                                 : NO_INDEX;
+        if (end != NO_INDEX && end > i + 1) {
+            nest[i + 1]++;
+            nest[end]--;
+        }
+    }
+    for (size_t id = 0; id < t->name_count; id++) set_at[id] = NO_INDEX;
+    int32_t depth = 0;
+    for (size_t i = 0; i < n; i++) {
+        depth += nest[i];
+        const Node* nd = &t->nodes[i];
+        if (nd->type != NODE_SET) continue;
+        uint32_t* s = &set_at[nd->as.set.name];
+        *s = *s == NO_INDEX && depth == 0 ? (uint32_t)i : FOLD_DYNAMIC;
+    }
+}
+
+/* Only chains of built-in filters are run at compile time. */
+static bool pure_filters(const BreezeTemplate* t, const Node* nd) {
+    for (uint32_t k = 0; k < nd->as.var.nfilters; k++)
+        if (!is_builtin_filter(&t->filter_fns[nd->as.var.filters + k])) return false;
+    return true;
+}
+
+/* Render {{ }} of constants into text and decide constant conditions. */
+WARN_UNUSED static bool fold_constants(Compiler* c, RenderVM* vm, const uint32_t* set_at) {
+    BreezeTemplate* t = c->tpl;
+    for (uint32_t i = 0; i < t->node_count; i++) {
+        Node* nd = &t->nodes[i];
+        vm->err->type = TMPL_ERR_NONE;
+        if (nd->type == NODE_VAR) {
+            uint32_t s = const_set(set_at, &nd->as.var.ref, i);
+            if (s == NO_INDEX || !pure_filters(t, nd)) continue;
+            assign_set(vm, &t->conds[t->nodes[s].as.set.value], nd->as.var.ref.name);
+            vm->out->size = 0;
+            if (!render_var_node(vm, nd)) {
+                if (vm->err->type == TMPL_ERR_MEMORY) return false;
+                continue;
+            }
+            Node text = {.type = NODE_TEXT, .pos = nd->pos};
+            if (!pool_add(c, vm->out->data, vm->out->size, &text.as.text.off)) return false;
+            text.as.text.len = (uint32_t)vm->out->size;
+            t->nodes[i] = text;
+            t->fold.vars_folded++;
+        } else if (nd->type == NODE_BRANCH) {
+            const CondOp* ops = t->conds + nd->as.branch.cond;
+            bool constant = true;
+            for (uint32_t k = 0; k < nd->as.branch.ncond && constant; k++) {
+                if (ops[k].op != COND_LOAD) continue;
+                uint32_t s = const_set(set_at, &ops[k].as.ref, i);
+                if (s == NO_INDEX) constant = false;
+                else assign_set(vm, &t->conds[t->nodes[s].as.set.value], ops[k].as.ref.name);
+            }
+            bool taken;
+            if (!constant || !eval_condition(vm, nd, &taken)) continue;
+            uint32_t target = taken ? i + 1 : nd->as.branch.target;
+            *nd = (Node){.type = NODE_JUMP, .pos = nd->pos, .as.jump.target = target};
+            t->fold.branches_folded++;
+        }
+    }
+    return true;
+}
+
+static void count_read(uint32_t* reads, const BreezeTemplate* t, const VarRef* ref) {
+    if (ref->kind != REF_NAME) return;
+    reads[ref->name]++;
+    if (ref->field != NO_INDEX) reads[t->fields[ref->field].full]++;
+}
+
+/* Count, per name, the reads left in reachable nodes. */
+static void count_reads(const BreezeTemplate* t, const uint8_t* reached, uint32_t* reads) {
+    for (size_t i = 0; i < t->node_count; i++) {
+        const Node* nd = &t->nodes[i];
+        if (!reached[i]) continue;
+        if (nd->type == NODE_VAR) count_read(reads, t, &nd->as.var.ref);
+        else if (nd->type == NODE_FOR) count_read(reads, t, &nd->as.loop.array);
+        else if (nd->type == NODE_BRANCH) {
+            for (uint32_t k = 0; k < nd->as.branch.ncond; k++) {
+                const CondOp* op = &t->conds[nd->as.branch.cond + k];
+                if (op->op == COND_LOAD) count_read(reads, t, &op->as.ref);
+            }
+        } else if (nd->type == NODE_CACHE) {
+            for (uint32_t k = 0; k < nd->as.cache.nkeys; k++)
+                count_read(reads, t, &t->cache_keys[nd->as.cache.keys + k]);
+        } else if (nd->type == NODE_INCLUDE) {
+            for (uint32_t k = 0; k < nd->as.include.nbindings; k++) {
+                const IncludeBinding* b = &t->bindings[nd->as.include.bindings + k];
+                if (b->kind == BIND_SET) reads[b->from]++;
+            }
+        }
+    }
+}
+
+/* Drop unreachable nodes, empty text, unread sets and jumps to the next
+ * node, then rewrite every jump target. `next` and `pos` hold n + 1 entries. */
+static void compact_nodes(BreezeTemplate* t, uint8_t* keep, uint32_t* next, uint32_t* pos) {
+    uint32_t n = (uint32_t)t->node_count;
+    next[n] = n;
+    for (uint32_t i = n; i-- > 0;) {
+        const Node* nd = &t->nodes[i];
+        /* JUMPs only go forward, so their target is already resolved here. */
+        if (keep[i] && nd->type == NODE_JUMP && next[nd->as.jump.target] == next[i + 1]) keep[i] = 0;
+        next[i] = keep[i] ? i : next[i + 1];
+    }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i <= n; i++) {
+        pos[i] = count;
+        if (i < n && keep[i]) count++;
+    }
+    t->has_set = false;
+    uint32_t out = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (!keep[i]) continue;
+        Node nd = t->nodes[i];
+        switch (nd.type) {
+            case NODE_FOR:
+                nd.as.loop.end = pos[next[nd.as.loop.end]];
+                break;
+            case NODE_ENDFOR:
+                nd.as.endloop.body = pos[next[nd.as.endloop.body]];
+                break;
+            case NODE_BRANCH:
+                nd.as.branch.target = pos[next[nd.as.branch.target]];
+                break;
+            case NODE_JUMP:
+                nd.as.jump.target = pos[next[nd.as.jump.target]];
+                break;
+            case NODE_CACHE:
+                nd.as.cache.end = pos[next[nd.as.cache.end]];
+                break;
+            case NODE_SET:
+                t->has_set = true;
+                break;
+            default:
+                break;
+        }
+        t->nodes[out++] = nd;
+    }
+    t->node_count = out;
+}
+
+/* Merge runs of adjacent text nodes that no jump lands inside into their
+ * first node; the rest are cleared from `keep`. */
+WARN_UNUSED static bool merge_texts(Compiler* c, uint8_t* keep, uint8_t* landing, OutputBuffer* buf) {
+    BreezeTemplate* t = c->tpl;
+    uint32_t n = (uint32_t)t->node_count;
+    memset(landing, 0, n + 1);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t next[2];
+        int k = node_successors(&t->nodes[i], i, next);
+        if (t->nodes[i].type == NODE_JUMP) landing[next[0]] = 1;
+        else if (k == 2) landing[next[1]] = 1;
+    }
+    memset(keep, 1, n);
+    for (uint32_t i = 0; i < n;) {
+        uint32_t end = i + 1;
+        while (t->nodes[i].type == NODE_TEXT && end < n && t->nodes[end].type == NODE_TEXT && !landing[end]) end++;
+        if (end > i + 1) {
+            buf->size = 0;
+            for (uint32_t k = i; k < end; k++) {
+                const Node* tx = &t->nodes[k];
+                if (!buffer_append(buf, t->pool + tx->as.text.off, tx->as.text.len)) return false;
+                keep[k] = k == i;
+            }
+            Node* nd = &t->nodes[i];
+            if (!pool_add(c, buf->data, buf->size, &nd->as.text.off)) return false;
+            nd->as.text.len = (uint32_t)buf->size;
+            t->fold.texts_merged += end - i - 1;
+        }
+        i = end;
+    }
+    return true;
+}
+
+static bool fold_template(Compiler* c) {
+    BreezeTemplate* t = c->tpl;
+    uint32_t n = (uint32_t)t->node_count;
+    t->fold.nodes_before = n;
+    if (!n) return true;
+
+    size_t names = t->name_count ? t->name_count : 1;
+    int32_t* nest = brz_calloc(n + 1, sizeof(int32_t));
+    uint32_t* set_at = brz_malloc(names * sizeof(uint32_t));
+    uint32_t* next = brz_malloc((n + 1) * sizeof(uint32_t));
+    uint32_t* pos = brz_malloc((n + 1) * sizeof(uint32_t));
+    uint8_t* keep = brz_calloc(n + 1, 1);
+    uint8_t* landing = brz_malloc(n + 1);
+    TemplateValue* sets = brz_calloc(names, sizeof(TemplateValue));
+    const TemplateValue** values = brz_calloc(names, sizeof(TemplateValue*));
+    TemplateValue* stack = brz_malloc((t->cond_depth ? t->cond_depth : 1) * sizeof(TemplateValue));
+    OutputBuffer scratch[2] = {{0}};
+    OutputBuffer buf = {0};
+    TemplateError ferr = {0};
+    bool ok = nest && set_at && next && pos && keep && landing && sets && values && stack && buffer_init(&buf, 256);
+    if (ok) {
+        RenderVM vm = {.tpl = t,
+                       .out = &buf,
+                       .err = &ferr,
+                       .sets = sets,
+                       .values = values,
+                       .cond_stack = stack,
+                       .scratch = scratch};
+        find_constants(t, nest, set_at);
+        ok = fold_constants(c, &vm, set_at);
+    }
+    if (ok) {
+        /* Walk the control flow from the first node. */
+        uint32_t* todo = next; /* free until compaction */
+        size_t top = 0;
+        todo[top++] = 0;
+        keep[0] = 1;
+        while (top) {
+            uint32_t i = todo[--top];
+            uint32_t succ[2];
+            int k = node_successors(&t->nodes[i], i, succ);
+            for (int j = 0; j < k; j++) {
+                if (succ[j] < n && !keep[succ[j]]) {
+                    keep[succ[j]] = 1;
+                    todo[top++] = succ[j];
                 }
             }
-            if (!buffer_append(out, p, 1)) {
-                CLEANUP();
-                return set_error(err, TMPL_ERR_MEMORY, "buffer_append failed", calc_line(template, p));
+        }
+        uint32_t* reads = set_at; /* constants are no longer needed */
+        memset(reads, 0, names * sizeof(uint32_t));
+        count_reads(t, keep, reads);
+        for (uint32_t i = 0; i < n; i++) {
+            const Node* nd = &t->nodes[i];
+            if (!keep[i]) continue;
+            if (nd->type == NODE_SET && !reads[nd->as.set.name]) {
+                keep[i] = 0;
+                t->fold.sets_dropped++;
+            } else if (nd->type == NODE_TEXT && nd->as.text.len == 0) {
+                keep[i] = 0;
             }
-            p++;
-            continue;
         }
+        compact_nodes(t, keep, next, pos);
+        ok = merge_texts(c, keep, landing, &buf);
+        if (ok) compact_nodes(t, keep, next, pos);
+        t->fold.nodes_dropped = n - t->node_count - t->fold.texts_merged - t->fold.sets_dropped;
+    }
+    brz_free(nest);
+    brz_free(set_at);
+    brz_free(next);
+    brz_free(pos);
+    brz_free(keep);
+    brz_free(landing);
+    brz_free(sets);
+    brz_free((void*)values);
+    brz_free(stack);
+    brz_free(scratch[0].data);
+    brz_free(scratch[1].data);
+    brz_free(buf.data);
+    return ok || compile_oom(c, c->src);
+}
+
+void breeze_template_fold_stats(const BreezeTemplate* tpl, BreezeFoldStats* stats) {
+    if (!stats) return;
+    *stats = tpl ? tpl->fold : (BreezeFoldStats){0};
+}
+
+/* ================================================================
+   Batch rendering
+   ================================================================ */
+
+/* One template, many contexts. The index range is split evenly between the
+ * workers; each takes small chunks from the front of its own range and, once
+ * that is empty, steals the back half of the fullest remaining range. Only
+ * the range bounds are shared, so a worker holds a lock once per chunk. The
+ * calling thread works as worker 0. */
+
+#define BATCH_MAX_THREADS 256
+#define BATCH_GRAIN_MAX   64 /* contexts taken per chunk, at most */
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next, end; /* indices not yet taken */
+} BatchRange;
+
+typedef struct {
+    const BreezeTemplate* tpl;
+    const TemplateContext* ctxs;
+    OutputBuffer* outs;
+    TemplateError* errs; /* NULL if the caller does not want them */
+    BatchRange* ranges;
+    size_t workers;
+    size_t grain;
+    pthread_mutex_t lock; /* guards `failed` */
+    bool failed;
+} Batch;
+
+typedef struct {
+    Batch* batch;
+    size_t self;
+} BatchWorker;
+
+/* Take up to `grain` indices from the front of range `r`. */
+static bool batch_take(Batch* b, size_t r, size_t* lo, size_t* hi) {
+    BatchRange* range = &b->ranges[r];
+    pthread_mutex_lock(&range->lock);
+    *lo = range->next;
+    *hi = range->end - range->next > b->grain ? range->next + b->grain : range->end;
+    range->next = *hi;
+    pthread_mutex_unlock(&range->lock);
+    return *lo < *hi;
+}
+
+/* Move the back half of the largest other range into range `self`. */
+static bool batch_steal(Batch* b, size_t self) {
+    for (;;) {
+        size_t victim = b->workers, best = 0;
+        for (size_t i = 0; i < b->workers; i++) {
+            if (i == self) continue;
+            BatchRange* r = &b->ranges[i];
+            pthread_mutex_lock(&r->lock);
+            size_t left = r->end - r->next;
+            pthread_mutex_unlock(&r->lock);
+            if (left > best) {
+                best = left;
+                victim = i;
+            }
+        }
+        if (victim == b->workers) return false;
+
+        BatchRange* r = &b->ranges[victim];
+        pthread_mutex_lock(&r->lock);
+        size_t left = r->end - r->next;
+        size_t lo = r->end - (left + 1) / 2, hi = r->end;
+        r->end = lo;
+        pthread_mutex_unlock(&r->lock);
+        if (lo == hi) continue; /* drained meanwhile; look again */
+
+        BatchRange* mine = &b->ranges[self];
+        pthread_mutex_lock(&mine->lock);
+        mine->next = lo;
+        mine->end = hi;
+        pthread_mutex_unlock(&mine->lock);
+        return true;
+    }
+}
+
+static void* batch_run(void* arg) {
+    BatchWorker* w = arg;
+    Batch* b = w->batch;
+    BreezeRenderState state = {0};
+    bool failed = false;
+    size_t lo, hi;
+    do {
+        while (batch_take(b, w->self, &lo, &hi)) {
+            for (size_t i = lo; i < hi; i++) {
+                TemplateError local;
+                TemplateError* err = b->errs ? &b->errs[i] : &local;
+                OutputBuffer* out = &b->outs[i];
+                if (!out->data && !buffer_init(out, 256)) {
+                    failed |= !set_error(err, TMPL_ERR_MEMORY, "malloc failed for batch output", 0);
+                    continue;
+                }
+                failed |= !render_program(b->tpl, &b->ctxs[i], out, NULL, &state, err);
+            }
+        }
+    } while (batch_steal(b, w->self));
+    render_state_release(&state);
+    if (failed) {
+        pthread_mutex_lock(&b->lock);
+        b->failed = true;
+        pthread_mutex_unlock(&b->lock);
+    }
+    return NULL;
+}
+
+static size_t online_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+bool breeze_render_batch(const BreezeTemplate* tpl, const TemplateContext* ctxs, size_t n, OutputBuffer* outs,
+                         TemplateError* errs, size_t threads) {
+    if (!n) return true;
+    if (!tpl || !ctxs || !outs) {
+        for (size_t i = 0; errs && i < n; i++) set_error(&errs[i], TMPL_ERR_RENDER, "NULL template or batch", 0);
+        return false;
+    }
+    if (threads == 0) threads = online_cpus();
+    if (threads > BATCH_MAX_THREADS) threads = BATCH_MAX_THREADS;
+    if (threads > n) threads = n;
+
+    Batch b = {.tpl = tpl, .ctxs = ctxs, .outs = outs, .errs = errs};
+    BatchRange* ranges = brz_calloc(threads, sizeof(BatchRange));
+    BatchWorker* workers = brz_calloc(threads, sizeof(BatchWorker));
+    pthread_t* tids = brz_calloc(threads, sizeof(pthread_t));
+    size_t inited = 0;
+    while (ranges && inited < threads && pthread_mutex_init(&ranges[inited].lock, NULL) == 0) inited++;
+    if (!inited || !workers || !tids || pthread_mutex_init(&b.lock, NULL) != 0) {
+        for (size_t t = 0; t < inited; t++) pthread_mutex_destroy(&ranges[t].lock);
+        brz_free(ranges);
+        brz_free(workers);
+        brz_free(tids);
+        for (size_t i = 0; errs && i < n; i++) set_error(&errs[i], TMPL_ERR_MEMORY, "malloc failed for batch", 0);
+        return false;
+    }
+    b.ranges = ranges;
+    b.workers = inited;
+    /* A few chunks per worker keep the tail balanced without much locking. */
+    b.grain = n / (inited * 8);
+    if (b.grain < 1) b.grain = 1;
+    if (b.grain > BATCH_GRAIN_MAX) b.grain = BATCH_GRAIN_MAX;
+    for (size_t t = 0; t < inited; t++) {
+        ranges[t].next = n * t / inited;
+        ranges[t].end = n * (t + 1) / inited;
+        workers[t] = (BatchWorker){&b, t};
+    }
+
+    size_t started = 1;
+    while (started < inited && pthread_create(&tids[started], NULL, batch_run, &workers[started]) == 0) started++;
+    /* The ranges of workers that did not start are stolen by the others. */
+    batch_run(&workers[0]);
+    for (size_t t = 1; t < started; t++) pthread_join(tids[t], NULL);
+
+    for (size_t t = 0; t < inited; t++) pthread_mutex_destroy(&ranges[t].lock);
+    pthread_mutex_destroy(&b.lock);
+    brz_free(ranges);
+    brz_free(workers);
+    brz_free(tids);
+    return !b.failed;
+}
+
+/* ================================================================
+   Profiling
+   ================================================================ */
+
+static const char* const node_kinds[] = {"text", "var",  "set",     "for",   "endfor",
+                                         "if",   "jump", "include", "cache", "endcache"};
+
+BreezeProfile* breeze_profile_new(const BreezeTemplate* tpl) {
+    if (!tpl) return NULL;
+    BreezeProfile* p = brz_calloc(1, sizeof(BreezeProfile));
+    if (!p) return NULL;
+    p->tpl = tpl;
+    p->current = NO_INDEX;
+    p->nodes = brz_calloc(tpl->node_count ? tpl->node_count : 1, sizeof(BreezeNodeProfile));
+    p->filters = brz_calloc(tpl->filter_count ? tpl->filter_count : 1, sizeof(BreezeFilterProfile));
+    if (!p->nodes || !p->filters) {
+        breeze_profile_free(p);
+        return NULL;
+    }
+    breeze_profile_reset(p);
+    return p;
+}
+
+void breeze_profile_free(BreezeProfile* profile) {
+    if (!profile) return;
+    brz_free(profile->nodes);
+    brz_free(profile->filters);
+    brz_free(profile);
+}
+
+void breeze_profile_reset(BreezeProfile* profile) {
+    if (!profile) return;
+    const BreezeTemplate* tpl = profile->tpl;
+    profile->renders = 0;
+    for (size_t i = 0; i < tpl->node_count; i++) {
+        const Node* n = &tpl->nodes[i];
+        size_t column;
+        size_t line = template_position(tpl, n->pos, &column);
+        profile->nodes[i] = (BreezeNodeProfile){.kind = node_kinds[n->type], .line = line};
+        for (uint32_t k = 0; n->type == NODE_VAR && k < n->as.var.nfilters; k++)
+            profile->filters[n->as.var.filters + k].line = line;
+    }
+    for (size_t i = 0; i < tpl->filter_count; i++)
+        profile->filters[i] = (BreezeFilterProfile){.name = tpl->pool + tpl->filters[i].name,
+                                                    .line = profile->filters[i].line};
+}
+
+void breeze_state_set_profile(BreezeRenderState* state, BreezeProfile* profile) {
+    if (state) state->profile = profile;
+}
+
+uint64_t breeze_profile_renders(const BreezeProfile* profile) { return profile ? profile->renders : 0; }
+
+const BreezeNodeProfile* breeze_profile_dump(const BreezeProfile* profile, size_t* count) {
+    if (count) *count = profile ? profile->tpl->node_count : 0;
+    return profile ? profile->nodes : NULL;
+}
+
+const BreezeFilterProfile* breeze_profile_filters(const BreezeProfile* profile, size_t* count) {
+    if (count) *count = profile ? profile->tpl->filter_count : 0;
+    return profile ? profile->filters : NULL;
+}
+
+WARN_UNUSED static bool json_string(OutputBuffer* out, const char* s) {
+    if (!buffer_append(out, "\"", 1)) return false;
+    for (; *s; s++) {
+        char esc[8];
+        unsigned char ch = (unsigned char)*s;
+        bool ok;
+        if (ch == '"' || ch == '\\') ok = buffer_append(out, "\\", 1) && buffer_append(out, s, 1);
+        else if (ch < 0x20) ok = buffer_append(out, esc, (size_t)snprintf(esc, sizeof(esc), "\\u%04x", ch));
+        else ok = buffer_append(out, s, 1);
+        if (!ok) return false;
+    }
+    return buffer_append(out, "\"", 1);
+}
+
+bool breeze_profile_dump_json(const BreezeProfile* profile, OutputBuffer* out) {
+    if (!profile || !out) return false;
+    char num[160];
+    snprintf(num, sizeof(num), "{\"renders\":%llu,\"nodes\":[", (unsigned long long)profile->renders);
+    if (!buffer_append_str(out, num)) return false;
+    for (size_t i = 0; i < profile->tpl->node_count; i++) {
+        const BreezeNodeProfile* n = &profile->nodes[i];
+        snprintf(num, sizeof(num), "%s{\"node\":%zu,\"kind\":\"%s\",\"line\":%zu,\"executions\":%llu,\"ns\":%llu,"
+                 "\"bytes\":%llu}", i ? "," : "", i, n->kind, n->line, (unsigned long long)n->executions,
+                 (unsigned long long)n->nanoseconds, (unsigned long long)n->bytes);
+        if (!buffer_append_str(out, num)) return false;
+    }
+    if (!buffer_append_str(out, "],\"filters\":[")) return false;
+    for (size_t i = 0; i < profile->tpl->filter_count; i++) {
+        const BreezeFilterProfile* f = &profile->filters[i];
+        if (!buffer_append_str(out, i ? ",{\"name\":" : "{\"name\":") || !json_string(out, f->name)) return false;
+        snprintf(num, sizeof(num), ",\"line\":%zu,\"calls\":%llu,\"ns\":%llu,\"allocations\":%llu}", f->line,
+                 (unsigned long long)f->calls, (unsigned long long)f->nanoseconds,
+                 (unsigned long long)f->allocations);
+        if (!buffer_append_str(out, num)) return false;
+    }
+    return buffer_append_str(out, "]}");
+}
+
+/* ================================================================
+   Template images
+   ================================================================ */
+
+/* A saved template is a header followed by the program's arrays, each on an
+ * 8-byte boundary. Everything in them is an index or a pool offset, so a
+ * loaded template points straight into the image and only its filter
+ * bindings are rebuilt, against the loading engine. The arrays are stored
+ * as this build lays them out: an image from a build with another layout or
+ * byte order is rejected rather than converted. */
+
+#define IMAGE_VERSION    2
+#define IMAGE_ALIGN      8
+#define IMAGE_BYTE_ORDER 0x01020304u
+
+static const char image_magic[8] = {'B', 'R', 'Z', 'T', 'P', 'L', '\r', '\n'};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; /* IMAGE_BYTE_ORDER as the writer stored it */
+    uint32_t node_size;  /* sizeof(Node) and sizeof(CondOp) of the writer */
+    uint32_t cond_size;
+    uint64_t size; /* whole image, padded to IMAGE_ALIGN */
+    uint64_t node_count, cond_count, cache_key_count, name_count, filter_count, field_count, line_count, pool_size;
+    uint64_t loop_depth, cond_depth, has_set, has_slots;
+    uint64_t fold[7]; /* BreezeFoldStats, in declaration order */
+} ImageHeader;
+
+enum {
+    IMG_NODES,
+    IMG_CONDS,
+    IMG_CACHE_KEYS,
+    IMG_NAMES,
+    IMG_SLOTS,
+    IMG_FILTERS,
+    IMG_FIELDS,
+    IMG_LINES,
+    IMG_POOL,
+    IMG_COUNT
+};
+
+typedef struct {
+    uint64_t offset, bytes;
+} ImageSection;
+
+static uint64_t image_align(uint64_t n) { return (n + IMAGE_ALIGN - 1) & ~(uint64_t)(IMAGE_ALIGN - 1); }
+
+/* Where each array goes and the image size; false if a count is out of range. */
+static bool image_layout(const ImageHeader* h, ImageSection sec[IMG_COUNT], uint64_t* size) {
+    const uint64_t counts[IMG_COUNT] = {h->node_count,   h->cond_count,  h->cache_key_count,
+                                        h->name_count,   h->has_slots ? h->name_count : 0,
+                                        h->filter_count, h->field_count, h->line_count,
+                                        h->pool_size};
+    const uint64_t sizes[IMG_COUNT] = {sizeof(Node),      sizeof(CondOp),   sizeof(VarRef),
+                                       sizeof(uint32_t),  sizeof(uint32_t), sizeof(FilterCall),
+                                       sizeof(FieldSite), sizeof(uint32_t), 1};
+    uint64_t at = image_align(sizeof(ImageHeader));
+    for (int i = 0; i < IMG_COUNT; i++) {
+        if (counts[i] > NO_INDEX) return false; /* every index in a program is 32-bit */
+        sec[i] = (ImageSection){at, counts[i] * sizes[i]};
+        at = image_align(at + sec[i].bytes);
+    }
+    *size = at;
+    return true;
+}
+
+bool breeze_template_save(const BreezeTemplate* tpl, OutputBuffer* out, TemplateError* err) {
+    if (!tpl || !out) return set_error(err, TMPL_ERR_PARSE, "Template and output are required", 0);
+    if (tpl->include_count) return set_error(err, TMPL_ERR_SYNTAX, "Templates with {% include %} cannot be saved", 0);
+    ImageHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, image_magic, sizeof(h.magic));
+    h.version = IMAGE_VERSION;
+    h.byte_order = IMAGE_BYTE_ORDER;
+    h.node_size = sizeof(Node);
+    h.cond_size = sizeof(CondOp);
+    h.node_count = tpl->node_count;
+    h.cond_count = tpl->cond_count;
+    h.cache_key_count = tpl->cache_key_count;
+    h.name_count = tpl->name_count;
+    h.filter_count = tpl->filter_count;
+    h.field_count = tpl->field_count;
+    h.line_count = tpl->line_count;
+    h.pool_size = tpl->pool_size;
+    h.loop_depth = tpl->loop_depth;
+    h.cond_depth = tpl->cond_depth;
+    h.has_set = tpl->has_set;
+    h.has_slots = tpl->name_slots != NULL;
+    const BreezeFoldStats* f = &tpl->fold;
+    const size_t fold[7] = {f->nodes_before,  f->nodes_after,   f->vars_folded, f->branches_folded,
+                            f->sets_dropped, f->nodes_dropped, f->texts_merged};
+    for (int i = 0; i < 7; i++) h.fold[i] = fold[i];
+
+    ImageSection sec[IMG_COUNT];
+    uint64_t size;
+    if (!image_layout(&h, sec, &size)) return set_error(err, TMPL_ERR_PARSE, "Template too large to save", 0);
+    h.size = size;
+    if (!buffer_reserve(out, size)) return set_error(err, TMPL_ERR_MEMORY, "malloc failed for template image", 0);
+    char* base = out->data + out->size;
+    memset(base, 0, size);
+    memcpy(base, &h, sizeof(h));
+    const void* const arrays[IMG_COUNT] = {tpl->nodes,  tpl->conds,      tpl->cache_keys,
+                                           tpl->names,  tpl->name_slots, tpl->filters,
+                                           tpl->fields, tpl->line_starts, tpl->pool};
+    for (int i = 0; i < IMG_COUNT; i++)
+        if (sec[i].bytes) memcpy(base + sec[i].offset, arrays[i], sec[i].bytes);
+    out->size += size;
+    out->data[out->size] = '\0';
+    return true;
+}
+
+/* A loaded image is checked in full before anything renders it, since a
+ * truncated or stale file must fail to load rather than corrupt memory:
+ * every index and pool offset is in range, blocks nest, loops close on
+ * their own FOR, conditions keep their value stack within cond_depth, and
+ * every jump goes forward to a node of the block it leaves from. */
+
+static bool image_pool_ok(const BreezeTemplate* t, uint32_t off) { return off < t->pool_size; }
+
+static bool image_ref_ok(const BreezeTemplate* t, const VarRef* ref, uint32_t loops) {
+    if (ref->field != NO_INDEX && ref->field >= t->field_count) return false;
+    switch (ref->kind) {
+        case REF_NAME:
+            return ref->name < t->name_count;
+        case REF_LOOP_META:
+            return ref->meta <= META_LENGTH && ref->depth < loops;
+        case REF_LOOP_ITEM:
+            return ref->depth < loops;
+        default:
+            return false;
+    }
+}
+
+static bool image_literal_ok(const BreezeTemplate* t, const CondOp* op) {
+    if (op->op != COND_CONST) return false;
+    if (op->type == TMPL_STRING) return image_pool_ok(t, op->arg);
+    return op->type == TMPL_LONG || op->type == TMPL_DOUBLE || op->type == TMPL_BOOL;
+}
+
+/* Replay a condition's stack heights; `height` has ncond + 1 entries. */
+static bool image_cond_ok(const BreezeTemplate* t, const Node* nd, uint32_t loops, uint32_t* height) {
+    uint32_t first = nd->as.branch.cond, n = nd->as.branch.ncond;
+    if (n == 0 || first > t->cond_count || n > t->cond_count - first) return false;
+    for (uint32_t k = 0; k <= n; k++) height[k] = NO_INDEX;
+    uint32_t sp = 0;
+    for (uint32_t k = 0; k < n; k++) {
+        const CondOp* op = &t->conds[first + k];
+        if (height[k] != NO_INDEX && height[k] != sp) return false;
+        switch (op->op) {
+            case COND_LOAD:
+                if (!image_ref_ok(t, &op->as.ref, loops)) return false;
+                sp++;
+                break;
+            case COND_CONST:
+                if (!image_literal_ok(t, op)) return false;
+                sp++;
+                break;
+            case COND_NOT:
+                if (sp < 1) return false;
+                break;
+            case COND_CMP:
+                if (sp < 2 || op->cmp > CMP_NOT_IN) return false;
+                sp--;
+                break;
+            case COND_AND:
+            case COND_OR:
+                if (sp < 1 || op->arg <= k || op->arg > n) return false;
+                if (height[op->arg] != NO_INDEX && height[op->arg] != sp) return false;
+                height[op->arg] = sp--;
+                break;
+            default:
+                return false;
+        }
+        if (sp > t->cond_depth) return false;
+    }
+    return sp == 1 && (height[n] == NO_INDEX || height[n] == 1);
+}
+
+/* Check one node; `open` is the stack of enclosing FOR and CACHE nodes and
+ * `loops` the number of FORs on it. */
+static bool image_node_ok(const BreezeTemplate* t, uint32_t i, uint32_t* open, uint32_t* depth, uint32_t* loops,
+                          uint32_t* height) {
+    const Node* nd = &t->nodes[i];
+    const Node* top = *depth ? &t->nodes[open[*depth - 1]] : NULL;
+    switch (nd->type) {
+        case NODE_TEXT:
+            return nd->as.text.off <= t->pool_size && nd->as.text.len <= t->pool_size - nd->as.text.off;
+        case NODE_VAR:
+            return image_ref_ok(t, &nd->as.var.ref, *loops) && nd->as.var.filters <= t->filter_count &&
+                   nd->as.var.nfilters <= t->filter_count - nd->as.var.filters;
+        case NODE_SET:
+            return t->has_set && nd->as.set.name < t->name_count && nd->as.set.value < t->cond_count &&
+                   image_literal_ok(t, &t->conds[nd->as.set.value]);
+        case NODE_FOR:
+            if (nd->as.loop.depth != *loops || nd->as.loop.depth >= t->loop_depth ||
+                !image_ref_ok(t, &nd->as.loop.array, *loops))
+                return false;
+            open[(*depth)++] = i;
+            ++*loops;
+            return true;
+        case NODE_ENDFOR:
+            if (!top || top->type != NODE_FOR || nd->as.endloop.depth != top->as.loop.depth ||
+                nd->as.endloop.body != open[*depth - 1] + 1)
+                return false;
+            --*depth;
+            --*loops;
+            return true;
+        case NODE_BRANCH:
+            return image_cond_ok(t, nd, *loops, height);
+        case NODE_JUMP:
+            return true;
+        case NODE_CACHE: {
+            uint32_t keys = nd->as.cache.keys, nkeys = nd->as.cache.nkeys;
+            if (!image_pool_ok(t, nd->as.cache.name) || keys > t->cache_key_count || nkeys > t->cache_key_count - keys)
+                return false;
+            for (uint32_t k = 0; k < nkeys; k++)
+                if (!image_ref_ok(t, &t->cache_keys[keys + k], *loops)) return false;
+            open[(*depth)++] = i;
+            return true;
+        }
+        case NODE_ENDCACHE:
+            if (!top || top->type != NODE_CACHE) return false;
+            --*depth;
+            return true;
+        default: /* includes: images never have any */
+            return false;
+    }
+}
+
+/* A forward jump that stays in its block; an ENDFOR or ENDCACHE counts as
+ * the inside of the block it closes. */
+static bool image_jump_ok(const BreezeTemplate* t, const uint32_t* owner, uint32_t from, uint32_t to) {
+    return to > from && to <= t->node_count && owner[to] == owner[from];
+}
+
+static bool image_arrays_ok(const BreezeTemplate* t) {
+    if (t->loop_depth > t->node_count || t->cond_depth > t->cond_count || t->line_starts[0] != 0) return false;
+    for (size_t i = 1; i < t->line_count; i++)
+        if (t->line_starts[i] <= t->line_starts[i - 1]) return false;
+    for (size_t i = 0; i < t->name_count; i++)
+        if (!image_pool_ok(t, t->names[i])) return false;
+    for (size_t i = 0; i < t->field_count; i++)
+        if (!image_pool_ok(t, t->fields[i].name) || t->fields[i].full >= t->name_count) return false;
+    for (size_t i = 0; i < t->filter_count; i++) {
+        const FilterCall* fc = &t->filters[i];
+        if (!image_pool_ok(t, fc->name) || (fc->arg != NO_INDEX && !image_pool_ok(t, fc->arg))) return false;
+    }
+    return true;
+}
+
+WARN_UNUSED static bool image_check(const BreezeTemplate* t, TemplateError* err) {
+    uint32_t n = (uint32_t)t->node_count;
+    /* owner[i]: innermost FOR or CACHE around node i, NO_INDEX at top level */
+    uint32_t* owner = brz_malloc(sizeof(uint32_t) * ((size_t)n * 2 + t->cond_count + 2));
+    if (!owner) return set_error(err, TMPL_ERR_MEMORY, "malloc failed for template image check", 0);
+    uint32_t *open = owner + n + 1, *height = open + n;
+    uint32_t depth = 0, loops = 0;
+    bool ok = image_arrays_ok(t);
+    for (uint32_t i = 0; i < n && ok; i++) {
+        owner[i] = depth ? open[depth - 1] : NO_INDEX;
+        ok = image_node_ok(t, i, open, &depth, &loops, height);
+    }
+    owner[n] = NO_INDEX;
+    ok = ok && depth == 0;
+    for (uint32_t i = 0; i < n && ok; i++) {
+        const Node* nd = &t->nodes[i];
+        if (nd->type == NODE_FOR) ok = image_jump_ok(t, owner, i, nd->as.loop.end);
+        else if (nd->type == NODE_CACHE) ok = image_jump_ok(t, owner, i, nd->as.cache.end);
+        else if (nd->type == NODE_BRANCH) ok = image_jump_ok(t, owner, i, nd->as.branch.target);
+        else if (nd->type == NODE_JUMP) ok = image_jump_ok(t, owner, i, nd->as.jump.target);
+    }
+    brz_free(owner);
+    return ok || set_error(err, TMPL_ERR_PARSE, "Template image is corrupt", 0);
+}
+
+BreezeTemplate* breeze_template_load(BreezeEngine* engine, const void* data, size_t len, size_t* used,
+                                     TemplateError* err) {
+    if (err) *err = (TemplateError){.type = TMPL_ERR_NONE};
+    if (!engine) engine = breeze_default_engine();
+    ImageHeader h;
+    if (!data || len < sizeof(h) || (uintptr_t)data % IMAGE_ALIGN) {
+        set_error(err, TMPL_ERR_PARSE, "Template image is truncated or misaligned", 0);
+        return NULL;
+    }
+    memcpy(&h, data, sizeof(h));
+    const char* why = NULL;
+    ImageSection sec[IMG_COUNT];
+    uint64_t size;
+    const char* base = data;
+    if (memcmp(h.magic, image_magic, sizeof(h.magic)) != 0) why = "Not a template image";
+    else if (h.version != IMAGE_VERSION) why = "Unsupported template image version";
+    else if (h.byte_order != IMAGE_BYTE_ORDER || h.node_size != sizeof(Node) || h.cond_size != sizeof(CondOp))
+        why = "Template image was saved by an incompatible build";
+    else if (!image_layout(&h, sec, &size) || size != h.size || size > len) why = "Template image is truncated";
+    else if (!h.line_count || (h.pool_size && base[sec[IMG_POOL].offset + h.pool_size - 1] != '\0'))
+        why = "Template image is corrupt";
+    if (why) {
+        set_error(err, TMPL_ERR_PARSE, why, 0);
+        return NULL;
+    }
+
+    BreezeTemplate* tpl = brz_calloc(1, sizeof(BreezeTemplate));
+    if (!tpl) {
+        set_error(err, TMPL_ERR_MEMORY, "malloc failed for compiled template", 0);
+        return NULL;
+    }
+    /* The template is read-only while rendering, so the arrays can stay in
+     * the image, even a read-only mapping of it. */
+#define IMAGE_ARRAY(type, i) (sec[i].bytes ? (type*)(uintptr_t)(base + sec[i].offset) : NULL)
+    tpl->image = data;
+    tpl->engine = engine;
+    tpl->nodes = IMAGE_ARRAY(Node, IMG_NODES);
+    tpl->conds = IMAGE_ARRAY(CondOp, IMG_CONDS);
+    tpl->cache_keys = IMAGE_ARRAY(VarRef, IMG_CACHE_KEYS);
+    tpl->names = IMAGE_ARRAY(uint32_t, IMG_NAMES);
+    tpl->name_slots = IMAGE_ARRAY(uint32_t, IMG_SLOTS);
+    tpl->filters = IMAGE_ARRAY(FilterCall, IMG_FILTERS);
+    tpl->fields = IMAGE_ARRAY(FieldSite, IMG_FIELDS);
+    tpl->line_starts = IMAGE_ARRAY(uint32_t, IMG_LINES);
+    tpl->pool = IMAGE_ARRAY(char, IMG_POOL);
+#undef IMAGE_ARRAY
+    tpl->node_count = h.node_count;
+    tpl->cond_count = h.cond_count;
+    tpl->cache_key_count = h.cache_key_count;
+    tpl->name_count = h.name_count;
+    tpl->filter_count = h.filter_count;
+    tpl->field_count = h.field_count;
+    tpl->line_count = h.line_count;
+    tpl->pool_size = h.pool_size;
+    tpl->loop_depth = h.loop_depth;
+    tpl->cond_depth = h.cond_depth;
+    tpl->has_set = h.has_set != 0;
+    tpl->fold = (BreezeFoldStats){h.fold[0], h.fold[1], h.fold[2], h.fold[3], h.fold[4], h.fold[5], h.fold[6]};
+
+    bool autoescape; /* decided when the template was compiled, and kept in its nodes */
+    if (!image_check(tpl, err) || !lookup_filters(tpl, engine, &autoescape, err)) {
+        breeze_template_free(tpl);
+        return NULL;
+    }
+    if (used) *used = size;
+    return tpl;
+}
+
+/* ================================================================
+   C code generation
+   ================================================================ */
+
+/* Runtime of generated code. These are the renderer's own steps, for code
+ * that has the template's structure compiled in instead of walking nodes. */
+
+void breeze_gen_begin(BreezeGen* g, OutputBuffer* out, TemplateError* err, const BreezeGenFilter* filters,
+                      BreezeBoundFilter* bound, size_t nfilters) {
+    *g = (BreezeGen){.out = out, .err = err, .filters = filters, .bound = bound};
+    if (err) *err = (TemplateError){.type = TMPL_ERR_NONE};
+    BreezeEngine* engine = breeze_default_engine();
+    pthread_mutex_lock(&engine->lock);
+    for (size_t i = 0; i < nfilters; i++)
+        bound[i] = filter_slot(engine->slots, engine->slot_count, filters[i].name)->bound;
+    pthread_mutex_unlock(&engine->lock);
+}
+
+static void gen_release(BreezeGen* g) {
+    brz_free(g->scratch[0].data);
+    brz_free(g->scratch[1].data);
+    memset(g->scratch, 0, sizeof(g->scratch));
+}
+
+bool breeze_gen_end(BreezeGen* g) {
+    gen_release(g);
+    return true;
+}
+
+bool breeze_gen_fail(BreezeGen* g, size_t line, size_t column) {
+    gen_release(g);
+    if (g->err) {
+        g->err->line = line;
+        g->err->column = column;
+    }
+    return false;
+}
+
+bool breeze_gen_missing(BreezeGen* g, TemplateErrorType type, const char* name, size_t line, size_t column) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Missing template variable for '%s'", name);
+    set_error(g->err, type, msg, line);
+    return breeze_gen_fail(g, line, column);
+}
+
+void breeze_gen_resolve(const TemplateContext* ctx, const char* const* names, const size_t* slots, size_t n,
+                        const TemplateValue** values) {
+    for (size_t i = 0; i < n; i++) values[i] = resolve_name(ctx, names[i], slots ? slots[i] : BREEZE_GEN_NO_SLOT);
+}
+
+const TemplateValue* breeze_gen_field(const TemplateValue* base, const char* field, BreezeGenField* site,
+                                      const TemplateValue* fallback, TemplateValue* tmp) {
+    if (!base || base->type != TMPL_RECORD) return fallback;
+    return record_field(base, field, site, tmp);
+}
+
+bool breeze_gen_text(BreezeGen* g, const char* data, size_t len) {
+    return buffer_append(g->out, data, len) || set_error(g->err, TMPL_ERR_MEMORY, "buffer_append failed", 0);
+}
+
+bool breeze_gen_output(BreezeGen* g, const TemplateValue* val, bool escape) {
+    bool ok = escape ? value_to_escaped(val, g->out) : value_to_string(val, g->out);
+    return ok || set_error(g->err, TMPL_ERR_MEMORY, "buffer_append failed", 0);
+}
 
-        /* ----- determine skip state ----- */
-        ConditionalFrame* cf = conditional_stack_top(&cond_stack);
-        bool should_skip =
-            cf && ((cf->condition_met && cf->in_else_branch) || (!cf->condition_met && !cf->in_else_branch));
+bool breeze_gen_filters(BreezeGen* g, const TemplateValue* val, size_t first, size_t count, bool escape) {
+    FilterChain ch = {*val, -1};
+    for (size_t i = first; i < first + count; i++) {
+        const BoundFilter* bf = &g->bound[i];
+        if (!bf->fn && !bf->value_fn) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Unknown filter '%s'", g->filters[i].name);
+            return set_error(g->err, TMPL_ERR_RENDER, msg, 0);
+        }
+        TemplateErrorType e = chain_step(g->scratch, &ch, bf, g->filters[i].arg, NULL);
+        if (e != TMPL_ERR_NONE) return set_error(g->err, e, chain_error(e), 0);
+    }
+    return chain_output(g->out, g->scratch, &ch, escape) ||
+           set_error(g->err, TMPL_ERR_MEMORY, "buffer_append failed", 0);
+}
 
-        /* ----- {{ variable }} ----- */
-        if (*p == '{' && *(p + 1) == '{') {
-            const char* var_start = p + 2;
-            const char* var_end = strstr(var_start, "}}");
-            if (!var_end) {
-                CLEANUP();
-                return set_error(err, TMPL_ERR_PARSE, "Unterminated '{{' tag", calc_line(template, p));
-            }
+bool breeze_gen_compare(BreezeGen* g, BreezeCmp cmp, const TemplateValue* a, const TemplateValue* b,
+                        bool* result) {
+    const char* why;
+    return compare_values((uint8_t)cmp, a, b, result, &why) || set_error(g->err, TMPL_ERR_RENDER, why, 0);
+}
 
-            if (!should_skip) {
-                char expr[256];
-                size_t vl = (size_t)(var_end - var_start);
-                if (vl >= sizeof(expr)) {
-                    CLEANUP();
-                    return set_error(err, TMPL_ERR_PARSE, "Variable expression too long", calc_line(template, p));
-                }
-                memcpy(expr, var_start, vl);
-                expr[vl] = '\0';
-                char* trimmed = str_trim(expr);
-
-                /* Check set_var store first */
-                const char* sv = set_var_store_get(&set_vars, trimmed);
-                if (sv) {
-                    if (!buffer_append_str(out, sv)) {
-                        CLEANUP();
-                        return set_error(err, TMPL_ERR_MEMORY, "buffer_append failed", calc_line(template, p));
-                    }
-                } else {
-                    if (!render_variable(trimmed, ctx, &loop_stack, out, err, template, p)) {
-                        CLEANUP();
-                        return false;
-                    }
-                }
-            }
-            p = var_end + 2;
+bool breeze_gen_truthy(const TemplateValue* val) { return is_truthy(val); }
 
-            /* ----- {% directive %} ----- */
-        } else if (*p == '{' && *(p + 1) == '%') {
-            const char* tag_start = p;
-            const char* dir_start = p + 2;
-            const char* dir_end = strstr(dir_start, "%}");
-            if (!dir_end) {
-                CLEANUP();
-                return set_error(err, TMPL_ERR_PARSE, "Unterminated '{%' tag", calc_line(template, p));
-            }
+bool breeze_gen_loop_start(BreezeGen* g, BreezeGenLoop* loop, const TemplateValue* array, bool counted) {
+    const char* why = start_loop(loop, array, counted);
+    return !why || set_error(g->err, TMPL_ERR_RENDER, why, 0);
+}
 
-            /* Whitespace control – standalone tag detection */
-            bool is_standalone = false;
-            const char* line_start = tag_start;
-            while (line_start > template && *(line_start - 1) != '\n') line_start--;
-            bool only_ws_before = true;
-            for (const char* c = line_start; c < tag_start; c++)
-                if (!isspace((unsigned char)*c)) {
-                    only_ws_before = false;
-                    break;
-                }
-            if (only_ws_before) {
-                const char* scan = dir_end + 2;
-                bool only_ws_after = true;
-                while (*scan && *scan != '\n')
-                    if (!isspace((unsigned char)*scan)) {
-                        only_ws_after = false;
-                        break;
-                    } else
-                        scan++;
-                if (only_ws_after) is_standalone = true;
-            }
+bool breeze_gen_loop_item(BreezeGenLoop* loop) { return get_loop_item(loop); }
 
-            if (is_standalone) {
-                if (!should_skip) {
-                    ssize_t bls = 0;
-                    for (ssize_t i = (ssize_t)out->size - 1; i >= 0; i--)
-                        if (out->data[i] == '\n') {
-                            bls = i + 1;
-                            break;
-                        }
-                    out->size = (size_t)bls;
-                    out->data[out->size] = '\0';
-                }
-                p = dir_end + 2;
-                while (*p && *p != '\n') p++;
-                if (*p == '\n') p++;
-            } else {
-                p = dir_end + 2;
-            }
+/* The generator writes declarations and the function body to separate
+ * buffers, so the body can decide which locals the function needs. */
+typedef struct {
+    const BreezeTemplate* tpl;
+    const char* fn;
+    OutputBuffer decls;
+    OutputBuffer body;
+    bool ok;
+    bool uses_v, uses_tmp, uses_r, uses_math;
+} CGen;
+
+static const char* const cg_cmp_names[] = {"BREEZE_CMP_EQ", "BREEZE_CMP_NE", "BREEZE_CMP_LT",    "BREEZE_CMP_LE",
+                                           "BREEZE_CMP_GT", "BREEZE_CMP_GE", "BREEZE_CMP_IN", "BREEZE_CMP_NOT_IN"};
+
+static const char* const cg_type_names[] = {"TMPL_STRING", "TMPL_INT", "TMPL_FLOAT", "TMPL_DOUBLE",
+                                            "TMPL_BOOL",   "TMPL_LONG", "TMPL_UINT"};
+
+static void cg_printf(CGen* g, OutputBuffer* out, const char* fmt, ...) {
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= sizeof(line) || !buffer_append(out, line, (size_t)n)) g->ok = false;
+}
 
-            /* Parse directive */
-            char directive[256];
-            size_t dl = (size_t)(dir_end - dir_start);
-            if (dl >= sizeof(directive)) {
-                CLEANUP();
-                return set_error(err, TMPL_ERR_PARSE, "Directive too long", calc_line(template, tag_start));
-            }
-            memcpy(directive, dir_start, dl);
-            directive[dl] = '\0';
-            char* cmd = str_trim(directive);
-
-            /* ---- raw ---- */
-            if (strcmp(cmd, "raw") == 0) {
-                in_raw = true;
-
-                /* ---- for ---- */
-            } else if (strncmp(cmd, "for ", 4) == 0) {
-                if (!should_skip) {
-                    char* sp2;
-                    char* parts[4] = {0};
-                    char* tok = strtok_r(cmd, " ", &sp2);
-                    for (int i = 0; tok && i < 4; i++) {
-                        parts[i] = tok;
-                        tok = strtok_r(NULL, " ", &sp2);
-                    }
-                    if (!parts[0] || !parts[1] || !parts[2] || !parts[3] || strcmp(parts[0], "for") != 0 ||
-                        strcmp(parts[2], "in") != 0) {
-                        CLEANUP();
-                        return set_error(err, TMPL_ERR_SYNTAX, "Invalid 'for' loop. Use: {% for item in items %}",
-                                         calc_line(template, tag_start));
-                    }
-                    const TemplateValue* arr = context_get(ctx, parts[3]);
-                    if (!arr || arr->type != TMPL_ARRAY) {
-                        CLEANUP();
-                        return set_error(err, TMPL_ERR_RENDER, "Variable for loop is not a valid array",
-                                         calc_line(template, tag_start));
-                    }
-                    if (!loop_stack_push(&loop_stack, arr, parts[1], p)) {
-                        CLEANUP();
-                        return set_error(err, TMPL_ERR_MEMORY, "loop_stack_push failed",
-                                         calc_line(template, tag_start));
-                    }
-                    if (arr->value.array.count == 0) {
-                        p = find_matching_endfor(p);
-                        loop_stack_pop(&loop_stack);
-                    }
-                }
+/* Append `s` as a C string literal. With `indent`, text is split into one
+ * literal per source line, and long lines into several. */
+static void cg_string(CGen* g, OutputBuffer* out, const char* s, size_t len, const char* indent) {
+    bool ok = buffer_append(out, "\"", 1);
+    size_t width = 0;
+    for (size_t i = 0; i < len && ok; i++) {
+        unsigned char ch = (unsigned char)s[i];
+        char esc[8] = {(char)ch};
+        size_t n = 2;
+        if (ch == '\n') memcpy(esc, "\\n", 2);
+        else if (ch == '\t') memcpy(esc, "\\t", 2);
+        else if (ch == '\r') memcpy(esc, "\\r", 2);
+        else if (ch == '"' || ch == '\\') esc[0] = '\\', esc[1] = (char)ch;
+        else if (ch == '?' && i > 0 && s[i - 1] == '?') memcpy(esc, "\\?", 2); /* no trigraphs */
+        else if (ch < 0x20 || ch >= 0x7f) n = (size_t)snprintf(esc, sizeof(esc), "\\%03o", ch);
+        else n = 1;
+        ok = buffer_append(out, esc, n);
+        width += n;
+        if (ok && indent && i + 1 < len && (ch == '\n' || width >= 96)) {
+            ok = buffer_append_str(out, "\"\n") && buffer_append_str(out, indent) && buffer_append(out, "\"", 1);
+            width = 0;
+        }
+    }
+    if (!ok || !buffer_append(out, "\"", 1)) g->ok = false;
+}
 
-                /* ---- endfor ---- */
-            } else if (strcmp(cmd, "endfor") == 0) {
-                if (!should_skip) {
-                    LoopFrame* lf = loop_stack_top(&loop_stack);
-                    if (!lf) {
-                        CLEANUP();
-                        return set_error(err, TMPL_ERR_SYNTAX, "Found 'endfor' with no matching 'for'",
-                                         calc_line(template, tag_start));
-                    }
-                    lf->index++;
-                    if (lf->index < lf->array->value.array.count) {
-                        p = lf->loop_start;
-                    } else {
-                        loop_stack_pop(&loop_stack);
-                    }
-                }
+static size_t cg_line(const CGen* g, const Node* n, size_t* column) {
+    return template_position(g->tpl, n->pos, column);
+}
 
-                /* ---- if ---- */
-            } else if (strncmp(cmd, "if ", 3) == 0) {
-                const char* cond = cmd + 3;
-                bool result = should_skip ? false : evaluate_condition(cond, ctx, &loop_stack, err, template, p);
-                if (!should_skip && err->type != TMPL_ERR_NONE) {
-                    CLEANUP();
-                    return false;
-                }
+/* Set `v` to the value of `ref`, as lookup_ref() would. */
+static void cg_ref(CGen* g, const VarRef* ref) {
+    g->uses_v = true;
+    if (ref->kind == REF_LOOP_META) {
+        static const char* const meta[] = {
+            "TMPL_UINT, .value.uint = (unsigned int)loops[%u].index",
+            "TMPL_UINT, .value.uint = (unsigned int)(loops[%u].index + 1)",
+            "TMPL_BOOL, .value.boolean = loops[%u].index == 0",
+            "TMPL_BOOL, .value.boolean = loops[%u].index == loops[%u].count - 1",
+            "TMPL_UINT, .value.uint = (unsigned int)loops[%u].count",
+        };
+        g->uses_tmp = true;
+        cg_printf(g, &g->body, "    tmp = (TemplateValue){.type = ", ref->depth);
+        cg_printf(g, &g->body, meta[ref->meta], ref->depth, ref->depth);
+        cg_printf(g, &g->body, "};\n    v = &tmp;\n");
+        return;
+    }
+    char base[48];
+    if (ref->kind == REF_LOOP_ITEM) snprintf(base, sizeof(base), "&loops[%u].item", ref->depth);
+    else snprintf(base, sizeof(base), "values[%u]", ref->name);
+    if (ref->field == NO_INDEX) {
+        cg_printf(g, &g->body, "    v = %s;\n", base);
+        return;
+    }
+    const FieldSite* site = &g->tpl->fields[ref->field];
+    char fallback[32] = "NULL";
+    if (ref->kind == REF_NAME) snprintf(fallback, sizeof(fallback), "values[%u]", site->full);
+    g->uses_tmp = true;
+    cg_printf(g, &g->body, "    v = breeze_gen_field(%s, ", base);
+    cg_string(g, &g->body, g->tpl->pool + site->name, strlen(g->tpl->pool + site->name), NULL);
+    cg_printf(g, &g->body, ", &fields[%u], %s, &tmp);\n", ref->field, fallback);
+}
 
-                if (!conditional_stack_push(&cond_stack, result, p)) {
-                    CLEANUP();
-                    return set_error(err, TMPL_ERR_MEMORY, "conditional_stack_push failed", calc_line(template, p));
-                }
+/* Report a missing value for `ref` when it can be missing at all. */
+static void cg_check_ref(CGen* g, const VarRef* ref, const Node* n, const char* type) {
+    if (ref->kind == REF_LOOP_META || (ref->kind == REF_LOOP_ITEM && ref->field == NO_INDEX)) return;
+    size_t column, line = cg_line(g, n, &column);
+    uint32_t name = ref->field == NO_INDEX ? ref->name : g->tpl->fields[ref->field].full;
+    cg_printf(g, &g->body, "    if (!v) return breeze_gen_missing(&g, %s, %s_names[%u], %zu, %zu);\n", type, g->fn,
+              name, line, column);
+}
 
-                if (!result) {
-                    const char* branch = NULL;
-                    IfBranchType bt = find_next_if_branch(p, &branch);
-                    if (bt == IF_BRANCH_ELIF && branch) {
-                        p = branch;
-                    } else if (bt == IF_BRANCH_ELSE && branch) {
-                        p = branch;
-                    } else if (bt == IF_BRANCH_ENDIF && branch) {
-                        const char* de = strstr(branch + 2, "%}");
-                        p = de ? de + 2 : branch;
-                        conditional_stack_pop(&cond_stack);
-                    }
-                }
+/* `if (!call) return breeze_gen_fail(...)` with the position of `n`. */
+static void cg_check(CGen* g, const Node* n, const char* call) {
+    size_t column, line = cg_line(g, n, &column);
+    cg_printf(g, &g->body, "    if (!%s) return breeze_gen_fail(&g, %zu, %zu);\n", call, line, column);
+}
 
-                /* ---- elif ---- */
-            } else if (strncmp(cmd, "elif ", 5) == 0) {
-                ConditionalFrame* top = conditional_stack_top(&cond_stack);
-                if (!top) {
-                    CLEANUP();
-                    return set_error(err, TMPL_ERR_SYNTAX, "Found 'elif' with no matching 'if'",
-                                     calc_line(template, tag_start));
-                }
+/* The initializer of a COND_CONST literal. */
+static void cg_literal(CGen* g, OutputBuffer* out, const CondOp* op) {
+    if (op->type == TMPL_STRING) {
+        cg_printf(g, out, "{.type = TMPL_STRING, .value.str = ");
+        cg_string(g, out, g->tpl->pool + op->arg, strlen(g->tpl->pool + op->arg), NULL);
+        cg_printf(g, out, "}");
+    } else if (op->type == TMPL_DOUBLE) {
+        char num[40];
+        if (isfinite(op->as.d)) snprintf(num, sizeof(num), "%.17g", op->as.d);
+        else snprintf(num, sizeof(num), "%sHUGE_VAL", op->as.d < 0 ? "-" : "");
+        g->uses_math |= !isfinite(op->as.d);
+        cg_printf(g, out, "{.type = TMPL_DOUBLE, .value.dbl = %s}", num);
+    } else if (op->type == TMPL_BOOL) {
+        cg_printf(g, out, "{.type = TMPL_BOOL, .value.boolean = %s}", op->as.l ? "true" : "false");
+    } else {
+        cg_printf(g, out, "{.type = %s, .value.long_int = %ldL}", cg_type_names[op->type], op->as.l);
+    }
+}
 
-                if (top->done) {
-                    p = find_matching_endif(p);
-                    conditional_stack_pop(&cond_stack);
-                } else {
-                    /* Evaluate the elif condition */
-                    const char* cond = cmd + 5;
-                    bool result = evaluate_condition(cond, ctx, &loop_stack, err, template, p);
-                    if (err->type != TMPL_ERR_NONE) {
-                        CLEANUP();
-                        return false;
-                    }
-
-                    top->condition_met = result;
-                    top->done = result;
-                    top->in_else_branch = false;
-
-                    if (!result) {
-                        const char* branch = NULL;
-                        IfBranchType bt = find_next_if_branch(p, &branch);
-                        if ((bt == IF_BRANCH_ELIF || bt == IF_BRANCH_ELSE) && branch) {
-                            p = branch;
-                        } else if (bt == IF_BRANCH_ENDIF && branch) {
-                            const char* de = strstr(branch + 2, "%}");
-                            p = de ? de + 2 : branch;
-                            conditional_stack_pop(&cond_stack);
-                        }
-                    }
-                }
+/* A condition becomes straight-line code over st[]: the stack depth at each
+ * op is known statically, and `and` / `or` jump to labels. */
+static void cg_condition(CGen* g, size_t pc, const Node* n) {
+    const CondOp* ops = g->tpl->conds + n->as.branch.cond;
+    uint32_t count = n->as.branch.ncond;
+    bool* target = brz_calloc(count + 1, sizeof(bool));
+    if (!target) {
+        g->ok = false;
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++)
+        if (ops[i].op == COND_AND || ops[i].op == COND_OR) target[ops[i].arg] = true;
+    size_t sp = 0;
+    for (uint32_t i = 0; i <= count; i++) {
+        if (target[i]) cg_printf(g, &g->body, "c%zu_%u:;\n", pc, i);
+        if (i == count) break;
+        const CondOp* op = &ops[i];
+        switch (op->op) {
+            case COND_LOAD:
+                cg_ref(g, &op->as.ref);
+                cg_check_ref(g, &op->as.ref, n, "TMPL_ERR_PARSE");
+                cg_printf(g, &g->body, "    st[%zu] = *v;\n", sp++);
+                break;
+            case COND_CONST:
+                cg_printf(g, &g->body, "    st[%zu] = (TemplateValue)", sp++);
+                cg_literal(g, &g->body, op);
+                cg_printf(g, &g->body, ";\n");
+                break;
+            case COND_NOT:
+                cg_printf(g, &g->body, "    st[%zu] = (TemplateValue){.type = TMPL_BOOL, .value.boolean = ", sp - 1);
+                cg_printf(g, &g->body, "!breeze_gen_truthy(&st[%zu])};\n", sp - 1);
+                break;
+            case COND_CMP: {
+                char call[96];
+                sp--;
+                g->uses_r = true;
+                snprintf(call, sizeof(call), "breeze_gen_compare(&g, %s, &st[%zu], &st[%zu], &r)",
+                         cg_cmp_names[op->cmp], sp - 1, sp);
+                cg_check(g, n, call);
+                cg_printf(g, &g->body, "    st[%zu] = (TemplateValue){.type = TMPL_BOOL, .value.boolean = r};\n",
+                          sp - 1);
+                break;
+            }
+            default: /* COND_AND / COND_OR: the jump keeps the top, falling through pops it */
+                cg_printf(g, &g->body, "    if (%sbreeze_gen_truthy(&st[%zu])) goto c%zu_%u;\n",
+                          op->op == COND_AND ? "!" : "", sp - 1, pc, op->arg);
+                sp--;
+                break;
+        }
+    }
+    brz_free(target);
+    cg_printf(g, &g->body, "    if (!breeze_gen_truthy(&st[0])) goto n%u;\n", n->as.branch.target);
+}
 
-                /* ---- else ---- */
-            } else if (strcmp(cmd, "else") == 0) {
-                ConditionalFrame* top = conditional_stack_top(&cond_stack);
-                if (!top) {
-                    CLEANUP();
-                    return set_error(err, TMPL_ERR_SYNTAX, "Found 'else' with no matching 'if'",
-                                     calc_line(template, tag_start));
-                }
-                top->in_else_branch = true;
-                if (top->done) {
-                    p = find_matching_endif(p);
-                    conditional_stack_pop(&cond_stack);
-                    while (*p == '\n') p++;
-                }
+static bool cg_node(CGen* g, size_t pc, const Node* n, TemplateError* err) {
+    const BreezeTemplate* tpl = g->tpl;
+    char call[96];
+    switch (n->type) {
+        case NODE_TEXT:
+            cg_printf(g, &g->decls, "static const char %s_t%zu[] =\n    ", g->fn, pc);
+            cg_string(g, &g->decls, tpl->pool + n->as.text.off, n->as.text.len, "    ");
+            cg_printf(g, &g->decls, ";\n");
+            snprintf(call, sizeof(call), "breeze_gen_text(&g, %s_t%zu, sizeof(%s_t%zu) - 1)", g->fn, pc, g->fn, pc);
+            cg_check(g, n, call);
+            break;
+        case NODE_VAR:
+            cg_ref(g, &n->as.var.ref);
+            cg_check_ref(g, &n->as.var.ref, n, "TMPL_ERR_RENDER");
+            if (n->as.var.nfilters)
+                snprintf(call, sizeof(call), "breeze_gen_filters(&g, v, %u, %u, %s)", n->as.var.filters,
+                         n->as.var.nfilters, n->flags & NODE_F_ESCAPE ? "true" : "false");
+            else
+                snprintf(call, sizeof(call), "breeze_gen_output(&g, v, %s)",
+                         n->flags & NODE_F_ESCAPE ? "true" : "false");
+            cg_check(g, n, call);
+            break;
+        case NODE_SET:
+            /* A set name reads the set value from here on, so it can replace the context's. */
+            cg_printf(g, &g->decls, "static const TemplateValue %s_s%zu = ", g->fn, pc);
+            cg_literal(g, &g->decls, &tpl->conds[n->as.set.value]);
+            cg_printf(g, &g->decls, ";\n");
+            cg_printf(g, &g->body, "    values[%u] = &%s_s%zu;\n", n->as.set.name, g->fn, pc);
+            break;
+        case NODE_FOR:
+            cg_ref(g, &n->as.loop.array);
+            snprintf(call, sizeof(call), "breeze_gen_loop_start(&g, &loops[%u], v, %s)", n->as.loop.depth,
+                     n->flags & NODE_F_LOOP_COUNT ? "true" : "false");
+            cg_check(g, n, call);
+            cg_printf(g, &g->body, "    if (!breeze_gen_loop_item(&loops[%u])) goto n%u;\n", n->as.loop.depth,
+                      n->as.loop.end);
+            break;
+        case NODE_ENDFOR:
+            cg_printf(g, &g->body, "    loops[%u].index++;\n    if (breeze_gen_loop_item(&loops[%u])) goto n%u;\n",
+                      n->as.endloop.depth, n->as.endloop.depth, n->as.endloop.body);
+            break;
+        case NODE_BRANCH:
+            cg_condition(g, pc, n);
+            break;
+        case NODE_JUMP:
+            cg_printf(g, &g->body, "    goto n%u;\n", n->as.jump.target);
+            break;
+        default:
+            return set_template_error(err, tpl, TMPL_ERR_SYNTAX,
+                                      n->type == NODE_INCLUDE ? "{% include %} is not supported by the C generator"
+                                                              : "{% cache %} is not supported by the C generator",
+                                      n->pos);
+    }
+    return true;
+}
 
-                /* ---- endif ---- */
-            } else if (strcmp(cmd, "endif") == 0) {
-                ConditionalFrame* top = conditional_stack_top(&cond_stack);
-                if (!top) {
-                    CLEANUP();
-                    return set_error(err, TMPL_ERR_SYNTAX, "Found 'endif' with no matching 'if'",
-                                     calc_line(template, tag_start));
-                }
-                conditional_stack_pop(&cond_stack);
-
-                /* ---- set ---- */
-            } else if (strncmp(cmd, "set ", 4) == 0) {
-                if (!should_skip) {
-                    /* Format: set varname = value */
-                    char* rest = cmd + 4;
-                    while (isspace((unsigned char)*rest)) rest++;
-                    char* eq = strchr(rest, '=');
-                    if (!eq) {
-                        CLEANUP();
-                        return set_error(err, TMPL_ERR_SYNTAX, "{% set %} requires '=': {% set x = value %}",
-                                         calc_line(template, tag_start));
-                    }
-                    *eq = '\0';
-                    char* varname = str_trim(rest);
-                    char* value = str_trim(eq + 1);
-                    /* strip surrounding quotes if present */
-                    if ((*value == '"' || *value == '\'') && value[strlen(value) - 1] == *value) {
-                        value++;
-                        value[strlen(value) - 1] = '\0';
-                    }
-                    if (!set_var_store_set(&set_vars, varname, value)) {
-                        CLEANUP();
-                        return set_error(err, TMPL_ERR_MEMORY, "set variable store full",
-                                         calc_line(template, tag_start));
-                    }
-                }
+static bool is_c_identifier(const char* s) {
+    if (!s || !(isalpha((unsigned char)*s) || *s == '_')) return false;
+    size_t len = 1;
+    for (const char* p = s + 1; *p; p++, len++)
+        if (!isalnum((unsigned char)*p) && *p != '_') return false;
+    return len <= 64;
+}
 
-                /* ---- unknown directive ---- */
+/* Write the tables the function reads: names, schema slots and filters. */
+static void cg_tables(CGen* g, OutputBuffer* out) {
+    const BreezeTemplate* tpl = g->tpl;
+    if (tpl->name_count) {
+        cg_printf(g, out, "static const char* const %s_names[] = {\n", g->fn);
+        for (size_t i = 0; i < tpl->name_count; i++) {
+            cg_printf(g, out, "    ");
+            cg_string(g, out, tpl->pool + tpl->names[i], strlen(tpl->pool + tpl->names[i]), NULL);
+            cg_printf(g, out, ",\n");
+        }
+        cg_printf(g, out, "};\n");
+    }
+    if (tpl->name_count && tpl->name_slots) {
+        cg_printf(g, out, "static const size_t %s_slots[] = {\n", g->fn);
+        for (size_t i = 0; i < tpl->name_count; i++) {
+            if (tpl->name_slots[i] == NO_INDEX) cg_printf(g, out, "    BREEZE_GEN_NO_SLOT,\n");
+            else cg_printf(g, out, "    %u,\n", tpl->name_slots[i]);
+        }
+        cg_printf(g, out, "};\n");
+    }
+    if (tpl->filter_count) {
+        cg_printf(g, out, "static const BreezeGenFilter %s_filters[] = {\n", g->fn);
+        for (size_t i = 0; i < tpl->filter_count; i++) {
+            const FilterCall* fc = &tpl->filters[i];
+            cg_printf(g, out, "    {");
+            cg_string(g, out, tpl->pool + fc->name, strlen(tpl->pool + fc->name), NULL);
+            if (fc->arg == NO_INDEX) {
+                cg_printf(g, out, ", NULL},\n");
             } else {
-                char msg[128];
-                snprintf(msg, sizeof(msg), "Unknown directive: '%s'", cmd);
-                CLEANUP();
-                return set_error(err, TMPL_ERR_SYNTAX, msg, calc_line(template, tag_start));
+                cg_printf(g, out, ", ");
+                cg_string(g, out, tpl->pool + fc->arg, strlen(tpl->pool + fc->arg), NULL);
+                cg_printf(g, out, "},\n");
             }
-
-        } else {
-            /* ----- plain text ----- */
-            if (!should_skip) {
-                if (!buffer_append(out, p, 1)) {
-                    CLEANUP();
-                    return set_error(err, TMPL_ERR_MEMORY, "buffer_append failed", calc_line(template, p));
-                }
-            }
-            p++;
         }
-    } /* while *p */
+        cg_printf(g, out, "};\n");
+    }
+}
 
-    /* Post-render validation */
-    if (in_raw) {
-        CLEANUP();
-        return set_error(err, TMPL_ERR_SYNTAX, "Unclosed {% raw %} block", calc_line(template, p));
+/* The function's locals and setup; only what the body uses is declared. */
+static void cg_prologue(CGen* g, OutputBuffer* out) {
+    const BreezeTemplate* tpl = g->tpl;
+    const char* fn = g->fn;
+    cg_printf(g, out, "\nbool %s(const TemplateContext* ctx, OutputBuffer* out, TemplateError* err);\n\n", fn);
+    cg_printf(g, out, "bool %s(const TemplateContext* ctx, OutputBuffer* out, TemplateError* err) {\n", fn);
+    cg_printf(g, out, "    BreezeGen g;\n");
+    if (tpl->name_count) cg_printf(g, out, "    const TemplateValue* values[%zu];\n", tpl->name_count);
+    if (tpl->filter_count) cg_printf(g, out, "    BreezeBoundFilter bound[%zu];\n", tpl->filter_count);
+    if (tpl->loop_depth) cg_printf(g, out, "    BreezeGenLoop loops[%zu];\n", tpl->loop_depth);
+    if (tpl->field_count) cg_printf(g, out, "    BreezeGenField fields[%zu] = {{0}};\n", tpl->field_count);
+    if (tpl->cond_depth) cg_printf(g, out, "    TemplateValue st[%zu];\n", tpl->cond_depth);
+    if (g->uses_tmp) cg_printf(g, out, "    TemplateValue tmp;\n");
+    if (g->uses_v) cg_printf(g, out, "    const TemplateValue* v;\n");
+    if (g->uses_r) cg_printf(g, out, "    bool r;\n");
+    if (tpl->filter_count)
+        cg_printf(g, out, "    breeze_gen_begin(&g, out, err, %s_filters, bound, %zu);\n", fn, tpl->filter_count);
+    else
+        cg_printf(g, out, "    breeze_gen_begin(&g, out, err, NULL, NULL, 0);\n");
+    if (tpl->name_count) {
+        char slots[80] = "NULL";
+        if (tpl->name_slots) snprintf(slots, sizeof(slots), "%s_slots", fn);
+        cg_printf(g, out, "    breeze_gen_resolve(ctx, %s_names, %s, %zu, values);\n", fn, slots, tpl->name_count);
+    } else {
+        cg_printf(g, out, "    (void)ctx;\n");
     }
-    if (in_comment && last_comment) {
-        CLEANUP();
-        return set_error(err, TMPL_ERR_SYNTAX, "Unterminated HTML comment '<!--'", calc_line(template, last_comment));
+}
+
+bool breeze_template_to_c(const BreezeTemplate* tpl, const char* name, OutputBuffer* out, TemplateError* err) {
+    if (!tpl || !out) return set_error(err, TMPL_ERR_PARSE, "Template and output are required", 0);
+    if (!is_c_identifier(name)) return set_error(err, TMPL_ERR_PARSE, "Function name is not a C identifier", 0);
+    CGen g = {.tpl = tpl, .fn = name, .ok = true};
+    OutputBuffer head = {0};
+    bool* target = brz_calloc(tpl->node_count + 1, sizeof(bool));
+    bool ok = target && buffer_init(&g.decls, 1024) && buffer_init(&g.body, 4096) && buffer_init(&head, 1024);
+    if (!ok) set_error(err, TMPL_ERR_MEMORY, "malloc failed for generated code", 0);
+
+    /* Only nodes that are jumped to get a label. */
+    for (size_t i = 0; ok && i < tpl->node_count; i++) {
+        const Node* n = &tpl->nodes[i];
+        if (n->type == NODE_FOR) target[n->as.loop.end] = true;
+        else if (n->type == NODE_ENDFOR) target[n->as.endloop.body] = true;
+        else if (n->type == NODE_BRANCH) target[n->as.branch.target] = true;
+        else if (n->type == NODE_JUMP) target[n->as.jump.target] = true;
     }
-    if (loop_stack_top(&loop_stack)) {
-        CLEANUP();
-        return set_error(err, TMPL_ERR_SYNTAX, "Unclosed 'for' loop at end of template", calc_line(template, p));
+    for (size_t i = 0; ok && i <= tpl->node_count; i++) {
+        if (target[i]) cg_printf(&g, &g.body, "n%zu:;\n", i);
+        if (i < tpl->node_count) ok = cg_node(&g, i, &tpl->nodes[i], err);
     }
-    if (conditional_stack_top(&cond_stack)) {
-        CLEANUP();
-        return set_error(err, TMPL_ERR_SYNTAX, "Unclosed 'if' statement at end of template", calc_line(template, p));
+    if (ok) {
+        cg_printf(&g, &head, "/* Generated by breeze_template_to_c(); do not edit. */\n\n");
+        if (g.uses_math) cg_printf(&g, &head, "#include <math.h>\n\n");
+        cg_printf(&g, &head, "#include \"breeze.h\"\n\n");
+        cg_tables(&g, &head);
+        cg_prologue(&g, &g.decls);
+        cg_printf(&g, &g.body, "    return breeze_gen_end(&g);\n}\n");
+        ok = g.ok && buffer_append(out, head.data, head.size) && buffer_append(out, g.decls.data, g.decls.size) &&
+             buffer_append(out, g.body.data, g.body.size);
+        if (!ok) set_error(err, TMPL_ERR_MEMORY, "malloc failed for generated code", 0);
     }
+    brz_free(target);
+    brz_free(head.data);
+    brz_free(g.decls.data);
+    brz_free(g.body.data);
+    return ok;
+}
+
+/* ================================================================
+   Writers
+   ================================================================ */
+
+static bool write_buffer(void* userdata, const BreezeSlice* slices, size_t count) {
+    OutputBuffer* buf = userdata;
+    for (size_t i = 0; i < count; i++)
+        if (!buffer_append(buf, slices[i].data, slices[i].len)) return false;
+    return true;
+}
+
+static bool write_file(void* userdata, const BreezeSlice* slices, size_t count) {
+    FILE* fp = userdata;
+    for (size_t i = 0; i < count; i++)
+        if (fwrite(slices[i].data, 1, slices[i].len, fp) != slices[i].len) return false;
+    return true;
+}
 
-    CLEANUP();
+/* writev() all slices, resuming after short writes and EINTR. */
+static bool write_fd(void* userdata, const BreezeSlice* slices, size_t count) {
+    int fd = (int)(intptr_t)userdata;
+    struct iovec iov[16];
+    size_t next = 0;    /* first slice not yet queued */
+    size_t skip = 0;    /* bytes of slices[next] already written */
+    while (next < count) {
+        int n = 0;
+        for (size_t i = next; i < count && n < 16; i++, n++) {
+            size_t off = i == next ? skip : 0;
+            iov[n].iov_base = (void*)(slices[i].data + off);
+            iov[n].iov_len = slices[i].len - off;
+        }
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        /* advance past fully written slices */
+        size_t left = (size_t)w;
+        while (next < count && left >= slices[next].len - skip) {
+            left -= slices[next].len - skip;
+            skip = 0;
+            next++;
+        }
+        skip += left;
+    }
     return true;
 }
 
+BreezeWriter breeze_writer_buffer(OutputBuffer* buf) { return (BreezeWriter){.write = write_buffer, .userdata = buf}; }
+
+BreezeWriter breeze_writer_file(FILE* fp) { return (BreezeWriter){.write = write_file, .userdata = fp}; }
+
+BreezeWriter breeze_writer_fd(int fd) { return (BreezeWriter){.write = write_fd, .userdata = (void*)(intptr_t)fd}; }
+
 /* ================================================================
-   render_template_file
+   Convenience wrappers
    ================================================================ */
 
-bool render_template_file(const char* path, const TemplateContext* ctx, OutputBuffer* out, TemplateError* err) {
+bool render_template(const char* template, const TemplateContext* ctx, OutputBuffer* out, TemplateError* err) {
+    BreezeTemplate* tpl = breeze_compile(template, err);
+    if (!tpl) return false;
+    bool ok = breeze_render_compiled(tpl, ctx, out, err);
+    breeze_template_free(tpl);
+    return ok;
+}
+
+/* Read a whole template file into a NUL-terminated heap buffer. */
+static char* read_template_file(const char* path, TemplateError* err) {
     FILE* fp = fopen(path, "r");
     if (!fp) {
         char msg[256];
         snprintf(msg, sizeof(msg), "Cannot open template file '%s': %s", path, strerror(errno));
-        return set_error(err, TMPL_ERR_IO, msg, 0);
+        set_error(err, TMPL_ERR_IO, msg, 0);
+        return NULL;
     }
 
     fseek(fp, 0, SEEK_END);
@@ -1542,20 +5623,573 @@ bool render_template_file(const char* path, const TemplateContext* ctx, OutputBu
 
     if (fsize <= 0) {
         fclose(fp);
-        return set_error(err, TMPL_ERR_IO, "Empty template file", 0);
+        set_error(err, TMPL_ERR_IO, "Empty template file", 0);
+        return NULL;
     }
 
-    char* buf = malloc((size_t)fsize + 1);
+    char* buf = brz_malloc((size_t)fsize + 1);
     if (!buf) {
         fclose(fp);
-        return set_error(err, TMPL_ERR_MEMORY, "malloc failed reading template file", 0);
+        set_error(err, TMPL_ERR_MEMORY, "malloc failed reading template file", 0);
+        return NULL;
     }
 
     size_t n = fread(buf, 1, (size_t)fsize, fp);
     buf[n] = '\0';
     fclose(fp);
+    return buf;
+}
 
+bool render_template_file(const char* path, const TemplateContext* ctx, OutputBuffer* out, TemplateError* err) {
+    char* buf = read_template_file(path, err);
+    if (!buf) return false;
     bool ok = render_template(buf, ctx, out, err);
-    free(buf);
+    brz_free(buf);
+    return ok;
+}
+
+/* ================================================================
+   Template cache
+   ================================================================ */
+
+/* Compiled templates keyed by path. Entries sit in a hash table and on an
+ * LRU list. Callers hold references while rendering, so an entry that is
+ * evicted or reloaded stays alive until its last reference is released. */
+
+typedef struct CacheEntry {
+    char* path;
+    uint64_t hash;
+    BreezeTemplate* tpl;
+    int64_t mtime; /* nanoseconds */
+    off_t size;
+    size_t bytes; /* footprint of the compiled template */
+    size_t refs;  /* outstanding breeze_cache_acquire() and include references */
+    CacheDep* deps; /* other files the template was built from */
+    size_t dep_count;
+    bool linked;  /* still reachable through the table */
+    struct CacheEntry* bucket_next;
+    struct CacheEntry* lru_prev; /* towards most recently used */
+    struct CacheEntry* lru_next;
+} CacheEntry;
+
+struct BreezeTemplateCache {
+    pthread_mutex_t lock;
+    BreezeCacheOptions opts;
+    CacheEntry** buckets;
+    size_t bucket_count; /* power of two */
+    size_t count;
+    size_t bytes;
+    CacheEntry* lru_head; /* most recently used */
+    CacheEntry* lru_tail;
+};
+
+static int64_t stat_mtime_ns(const struct stat* st) {
+#if defined(__APPLE__)
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    return (int64_t)st->st_mtime * 1000000000;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+static size_t template_footprint(const BreezeTemplate* t) {
+    return sizeof(*t) + strlen(t->source) + 1 + t->node_count * sizeof(Node) + t->pool_size +
+           t->name_count * sizeof(uint32_t) + t->filter_count * sizeof(FilterCall) + t->cond_count * sizeof(CondOp);
+}
+
+BreezeTemplateCache* breeze_cache_new(const BreezeCacheOptions* opts) {
+    BreezeTemplateCache* cache = brz_calloc(1, sizeof(BreezeTemplateCache));
+    if (!cache) return NULL;
+    if (opts) cache->opts = *opts;
+    if (!cache->opts.engine) cache->opts.engine = breeze_default_engine();
+    cache->bucket_count = 64;
+    cache->buckets = brz_calloc(cache->bucket_count, sizeof(CacheEntry*));
+    if (!cache->buckets || pthread_mutex_init(&cache->lock, NULL) != 0) {
+        brz_free(cache->buckets);
+        brz_free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static void free_deps(CacheDep* deps, size_t n) {
+    for (size_t i = 0; i < n; i++) brz_free(deps[i].path);
+    brz_free(deps);
+}
+
+static void release_includes_locked(BreezeTemplate* tpl);
+
+/* Called with the cache lock held (or while the cache is torn down). */
+static void cache_entry_free(CacheEntry* e) {
+    release_includes_locked(e->tpl);
+    breeze_template_free(e->tpl);
+    free_deps(e->deps, e->dep_count);
+    brz_free(e->path);
+    brz_free(e);
+}
+
+static void cache_release_locked(CacheEntry* e) {
+    if (e->refs > 0 && --e->refs == 0 && !e->linked) cache_entry_free(e);
+}
+
+static void release_includes_locked(BreezeTemplate* tpl) {
+    for (size_t i = 0; i < tpl->include_count; i++) cache_release_locked(tpl->includes[i]->cache_entry);
+    tpl->include_count = 0;
+}
+
+static void template_release_includes(BreezeTemplate* tpl) {
+    BreezeTemplateCache* cache = tpl->include_cache;
+    pthread_mutex_lock(&cache->lock);
+    release_includes_locked(tpl);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static CacheEntry* cache_find(const BreezeTemplateCache* cache, const char* path, uint64_t hash) {
+    for (CacheEntry* e = cache->buckets[hash & (cache->bucket_count - 1)]; e; e = e->bucket_next)
+        if (e->hash == hash && strcmp(e->path, path) == 0) return e;
+    return NULL;
+}
+
+static void lru_remove(BreezeTemplateCache* cache, CacheEntry* e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else cache->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else cache->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(BreezeTemplateCache* cache, CacheEntry* e) {
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = e;
+    cache->lru_head = e;
+    if (!cache->lru_tail) cache->lru_tail = e;
+}
+
+/* Remove an entry from the table; it is freed now or by the last release. */
+static void cache_unlink(BreezeTemplateCache* cache, CacheEntry* e) {
+    CacheEntry** pp = &cache->buckets[e->hash & (cache->bucket_count - 1)];
+    while (*pp != e) pp = &(*pp)->bucket_next;
+    *pp = e->bucket_next;
+    lru_remove(cache, e);
+    e->linked = false;
+    cache->count--;
+    cache->bytes -= e->bytes;
+    if (e->refs == 0) cache_entry_free(e);
+}
+
+static void cache_grow(BreezeTemplateCache* cache) {
+    size_t nc = cache->bucket_count * 2;
+    CacheEntry** nb = brz_calloc(nc, sizeof(CacheEntry*));
+    if (!nb) return; /* keep the current table; chains just get longer */
+    for (size_t i = 0; i < cache->bucket_count; i++) {
+        for (CacheEntry* e = cache->buckets[i]; e;) {
+            CacheEntry* next = e->bucket_next;
+            e->bucket_next = nb[e->hash & (nc - 1)];
+            nb[e->hash & (nc - 1)] = e;
+            e = next;
+        }
+    }
+    brz_free(cache->buckets);
+    cache->buckets = nb;
+    cache->bucket_count = nc;
+}
+
+static void cache_insert(BreezeTemplateCache* cache, CacheEntry* e) {
+    if (cache->count + 1 > cache->bucket_count) cache_grow(cache);
+    CacheEntry** bucket = &cache->buckets[e->hash & (cache->bucket_count - 1)];
+    e->bucket_next = *bucket;
+    *bucket = e;
+    e->linked = true;
+    lru_push_front(cache, e);
+    cache->count++;
+    cache->bytes += e->bytes;
+
+    /* Evict least recently used entries, never the one just inserted. */
+    while (cache->opts.max_bytes && cache->bytes > cache->opts.max_bytes && cache->lru_tail != e)
+        cache_unlink(cache, cache->lru_tail);
+}
+
+/* A file changed since it was read. */
+static bool dep_changed(const CacheDep* d) {
+    struct stat st;
+    return stat(d->path, &st) != 0 || stat_mtime_ns(&st) != d->mtime || st.st_size != d->size;
+}
+
+static bool entry_is_stale(const CacheEntry* e, const struct stat* st) {
+    if (e->mtime != stat_mtime_ns(st) || e->size != st->st_size) return true;
+    for (size_t i = 0; i < e->dep_count; i++)
+        if (dep_changed(&e->deps[i])) return true;
+    return false;
+}
+
+static BreezeTemplate* cache_acquire(BreezeTemplateCache* cache, const char* path, const IncludeChain* chain,
+                                     TemplateError* err) {
+    struct stat st = {0};
+    if (cache->opts.check_mtime && stat(path, &st) != 0) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Cannot open template file '%s': %s", path, strerror(errno));
+        set_error(err, TMPL_ERR_IO, msg, 0);
+        return NULL;
+    }
+
+    uint64_t hash = hash_string(path);
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry* e = cache_find(cache, path, hash);
+    int64_t mtime = stat_mtime_ns(&st);
+    if (e && cache->opts.check_mtime && entry_is_stale(e, &st)) {
+        cache_unlink(cache, e); /* stale: reload below */
+        e = NULL;
+    }
+    if (e) {
+        e->refs++;
+        lru_remove(cache, e);
+        lru_push_front(cache, e);
+        pthread_mutex_unlock(&cache->lock);
+        return e->tpl;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    /* Miss: read and compile without holding the lock. */
+    char* source = read_template_file(path, err);
+    if (!source) return NULL;
+    IncludeChain link = {path, chain};
+    Loader loader = {.cache = cache, .chain = &link};
+    BreezeTemplate* tpl = compile_template(cache->opts.engine, source, NULL, &loader, err);
+    brz_free(source);
+    if (!tpl) {
+        free_deps(loader.deps, loader.dep_count);
+        return NULL;
+    }
+
+    CacheEntry* ne = brz_calloc(1, sizeof(CacheEntry));
+    if (!ne || !(ne->path = brz_strdup(path))) {
+        brz_free(ne);
+        free_deps(loader.deps, loader.dep_count);
+        breeze_template_free(tpl);
+        set_error(err, TMPL_ERR_MEMORY, "malloc failed for cache entry", 0);
+        return NULL;
+    }
+    ne->deps = loader.deps;
+    ne->dep_count = loader.dep_count;
+    ne->hash = hash;
+    ne->tpl = tpl;
+    ne->mtime = mtime;
+    ne->size = st.st_size;
+    ne->bytes = template_footprint(tpl);
+    ne->refs = 1;
+    tpl->cache_entry = ne;
+
+    pthread_mutex_lock(&cache->lock);
+    e = cache_find(cache, path, hash);
+    if (e && (!cache->opts.check_mtime || (e->mtime == mtime && e->size == st.st_size))) {
+        /* Another thread compiled the same file first; use its copy. */
+        e->refs++;
+        cache_entry_free(ne);
+        pthread_mutex_unlock(&cache->lock);
+        return e->tpl;
+    }
+    if (e) cache_unlink(cache, e);
+    cache_insert(cache, ne);
+    pthread_mutex_unlock(&cache->lock);
+    return tpl;
+}
+
+BreezeTemplate* breeze_cache_acquire(BreezeTemplateCache* cache, const char* path, TemplateError* err) {
+    if (err) {
+        err->type = TMPL_ERR_NONE;
+        err->line = 0;
+        err->column = 0;
+        err->message[0] = '\0';
+    }
+    if (!cache || !path) {
+        set_error(err, TMPL_ERR_IO, "NULL cache or path", 0);
+        return NULL;
+    }
+    return cache_acquire(cache, path, NULL, err);
+}
+
+void breeze_cache_release(BreezeTemplateCache* cache, BreezeTemplate* tpl) {
+    if (!cache || !tpl) return;
+    pthread_mutex_lock(&cache->lock);
+    cache_release_locked(tpl->cache_entry);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Path of an include/extends target, relative to the cache root. */
+static char* template_path(const BreezeTemplateCache* cache, const char* name, TemplateError* err) {
+    const char* root = cache->opts.root;
+    size_t rl = root && name[0] != '/' ? strlen(root) : 0;
+    size_t nl = strlen(name);
+    char* path = brz_malloc(rl + nl + 2);
+    if (!path) {
+        set_error(err, TMPL_ERR_MEMORY, "malloc failed for template path", 0);
+        return NULL;
+    }
+    memcpy(path, root, rl);
+    if (rl && root[rl - 1] != '/') path[rl++] = '/';
+    memcpy(path + rl, name, nl + 1);
+    return path;
+}
+
+static bool check_cycle(const IncludeChain* chain, const char* path, TemplateError* err) {
+    for (; chain; chain = chain->parent) {
+        if (strcmp(chain->path, path) == 0) {
+            char msg[256];
+            snprintf(msg, sizeof(msg), "Template '%s' includes or extends itself", path);
+            return set_error(err, TMPL_ERR_SYNTAX, msg, 0);
+        }
+    }
+    return true;
+}
+
+WARN_UNUSED static bool loader_add_dep(Loader* ld, const char* path, int64_t mtime, off_t size) {
+    char* copy = brz_strdup(path);
+    if (!copy || !grow_array(&ld->deps, &ld->dep_cap, ld->dep_count + 1, sizeof(CacheDep))) {
+        brz_free(copy);
+        return false;
+    }
+    ld->deps[ld->dep_count++] = (CacheDep){copy, mtime, size};
+    return true;
+}
+
+/* Acquire a partial for the template being compiled. The reference is owned
+ * by that template; the partial's files become its dependencies too. */
+static BreezeTemplate* loader_include(Loader* ld, const char* name, TemplateError* err) {
+    char* path = template_path(ld->cache, name, err);
+    if (!path) return NULL;
+    BreezeTemplate* part = NULL;
+    if (check_cycle(ld->chain, path, err)) part = cache_acquire(ld->cache, path, ld->chain, err);
+    brz_free(path);
+    if (!part) return NULL;
+    const CacheEntry* e = part->cache_entry;
+    bool ok = loader_add_dep(ld, e->path, e->mtime, e->size);
+    for (size_t i = 0; ok && i < e->dep_count; i++)
+        ok = loader_add_dep(ld, e->deps[i].path, e->deps[i].mtime, e->deps[i].size);
+    if (!ok) {
+        breeze_cache_release(ld->cache, part);
+        set_error(err, TMPL_ERR_MEMORY, "malloc failed for template dependencies", 0);
+        return NULL;
+    }
+    return part;
+}
+
+/* Read the parent named by {% extends %} and record it as a dependency. */
+static char* loader_read(Loader* ld, const char* name, const IncludeChain* chain, char** path, TemplateError* err) {
+    if (!(*path = template_path(ld->cache, name, err))) return NULL;
+    if (!check_cycle(chain, *path, err)) return NULL;
+    struct stat st = {0};
+    if (ld->cache->opts.check_mtime) stat(*path, &st);
+    char* src = read_template_file(*path, err);
+    if (src && !loader_add_dep(ld, *path, stat_mtime_ns(&st), st.st_size)) {
+        brz_free(src);
+        set_error(err, TMPL_ERR_MEMORY, "malloc failed for template dependencies", 0);
+        return NULL;
+    }
+    return src;
+}
+
+bool breeze_cache_render(BreezeTemplateCache* cache, const char* path, const TemplateContext* ctx, OutputBuffer* out,
+                         TemplateError* err) {
+    BreezeTemplate* tpl = breeze_cache_acquire(cache, path, err);
+    if (!tpl) return false;
+    bool ok = breeze_render_compiled(tpl, ctx, out, err);
+    breeze_cache_release(cache, tpl);
     return ok;
 }
+
+void breeze_cache_invalidate(BreezeTemplateCache* cache, const char* path) {
+    if (!cache) return;
+    pthread_mutex_lock(&cache->lock);
+    if (path) {
+        CacheEntry* e = cache_find(cache, path, hash_string(path));
+        if (e) cache_unlink(cache, e);
+    } else {
+        while (cache->lru_head) cache_unlink(cache, cache->lru_head);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void breeze_cache_free(BreezeTemplateCache* cache) {
+    if (!cache) return;
+    /* Every linked entry is freed below, so only references to unlinked
+     * (reloaded or evicted) partials need releasing. */
+    for (CacheEntry* e = cache->lru_head; e; e = e->lru_next) {
+        for (size_t i = 0; i < e->tpl->include_count; i++) {
+            CacheEntry* part = e->tpl->includes[i]->cache_entry;
+            if (!part->linked) cache_release_locked(part);
+        }
+        e->tpl->include_count = 0;
+    }
+    for (CacheEntry* e = cache->lru_head; e;) {
+        CacheEntry* next = e->lru_next;
+        cache_entry_free(e);
+        e = next;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    brz_free(cache->buckets);
+    brz_free(cache);
+}
+
+/* ================================================================
+   Fragment cache
+   ================================================================ */
+
+/* Default store behind {% cache %}: entries keyed by the fragment key, in a
+ * hash table and on an LRU list, evicted once the stored bytes pass
+ * max_bytes. Lookups copy the fragment out under the lock. */
+
+#define FRAGMENT_LIMIT_DEFAULT ((size_t)4 << 20)
+
+struct FragmentEntry {
+    uint64_t hash;
+    int64_t expires; /* CLOCK_MONOTONIC nanoseconds, 0 = never */
+    size_t len;
+    size_t bytes; /* accounted size: entry, key and data */
+    FragmentEntry* bucket_next;
+    FragmentEntry* lru_prev; /* towards most recently used */
+    FragmentEntry* lru_next;
+    char* data;
+    char key[]; /* NUL-terminated, followed by the data */
+};
+
+static bool fragment_cache_init(FragmentCache* fc) {
+    *fc = (FragmentCache){.max_bytes = FRAGMENT_LIMIT_DEFAULT};
+    return pthread_mutex_init(&fc->lock, NULL) == 0;
+}
+
+static void fragment_unlink(FragmentCache* fc, FragmentEntry* e) {
+    FragmentEntry** pp = &fc->buckets[e->hash & (fc->bucket_count - 1)];
+    while (*pp != e) pp = &(*pp)->bucket_next;
+    *pp = e->bucket_next;
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else fc->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else fc->lru_tail = e->lru_prev;
+    fc->count--;
+    fc->bytes -= e->bytes;
+    brz_free(e);
+}
+
+static void fragment_cache_destroy(FragmentCache* fc) {
+    for (FragmentEntry* e = fc->lru_head; e;) {
+        FragmentEntry* next = e->lru_next;
+        brz_free(e);
+        e = next;
+    }
+    brz_free(fc->buckets);
+    pthread_mutex_destroy(&fc->lock);
+}
+
+static FragmentEntry* fragment_find(const FragmentCache* fc, const char* key, uint64_t hash) {
+    if (!fc->buckets) return NULL;
+    for (FragmentEntry* e = fc->buckets[hash & (fc->bucket_count - 1)]; e; e = e->bucket_next)
+        if (e->hash == hash && strcmp(e->key, key) == 0) return e;
+    return NULL;
+}
+
+static void fragment_touch(FragmentCache* fc, FragmentEntry* e) {
+    if (fc->lru_head == e) return;
+    e->lru_prev->lru_next = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else fc->lru_tail = e->lru_prev;
+    e->lru_prev = NULL;
+    e->lru_next = fc->lru_head;
+    fc->lru_head->lru_prev = e;
+    fc->lru_head = e;
+}
+
+static bool fragment_grow(FragmentCache* fc) {
+    size_t nc = fc->bucket_count ? fc->bucket_count * 2 : 64;
+    FragmentEntry** nb = brz_calloc(nc, sizeof(FragmentEntry*));
+    if (!nb) return fc->buckets != NULL; /* keep the current table; chains just get longer */
+    for (FragmentEntry* e = fc->lru_head; e; e = e->lru_next) {
+        e->bucket_next = nb[e->hash & (nc - 1)];
+        nb[e->hash & (nc - 1)] = e;
+    }
+    brz_free(fc->buckets);
+    fc->buckets = nb;
+    fc->bucket_count = nc;
+    return true;
+}
+
+static bool fragment_get(void* userdata, const char* key, OutputBuffer* out) {
+    FragmentCache* fc = userdata;
+    uint64_t hash = hash_string(key);
+    bool hit = false;
+    pthread_mutex_lock(&fc->lock);
+    FragmentEntry* e = fragment_find(fc, key, hash);
+    if (e && e->expires && e->expires <= monotonic_ns()) {
+        fragment_unlink(fc, e);
+        e = NULL;
+    }
+    if (e) {
+        fragment_touch(fc, e);
+        hit = buffer_append(out, e->data, e->len);
+    }
+    pthread_mutex_unlock(&fc->lock);
+    return hit;
+}
+
+static void fragment_put(void* userdata, const char* key, const char* data, size_t len, unsigned ttl) {
+    FragmentCache* fc = userdata;
+    size_t kl = strlen(key);
+    size_t bytes = sizeof(FragmentEntry) + kl + 1 + len;
+    pthread_mutex_lock(&fc->lock);
+    size_t max = fc->max_bytes;
+    pthread_mutex_unlock(&fc->lock);
+    if (bytes > max) return; /* would evict everything else and still not fit */
+
+    FragmentEntry* ne = brz_malloc(bytes);
+    if (!ne) return; /* caching is best effort */
+    *ne = (FragmentEntry){.hash = hash_string(key), .len = len, .bytes = bytes};
+    memcpy(ne->key, key, kl + 1);
+    ne->data = ne->key + kl + 1;
+    if (len) memcpy(ne->data, data, len);
+    if (ttl) ne->expires = monotonic_ns() + (int64_t)ttl * 1000000000;
+
+    pthread_mutex_lock(&fc->lock);
+    FragmentEntry* old = fragment_find(fc, key, ne->hash);
+    if (old) fragment_unlink(fc, old);
+    if ((fc->count + 1 > fc->bucket_count && !fragment_grow(fc))) {
+        pthread_mutex_unlock(&fc->lock);
+        brz_free(ne);
+        return;
+    }
+    ne->bucket_next = fc->buckets[ne->hash & (fc->bucket_count - 1)];
+    fc->buckets[ne->hash & (fc->bucket_count - 1)] = ne;
+    ne->lru_next = fc->lru_head;
+    if (fc->lru_head) fc->lru_head->lru_prev = ne;
+    fc->lru_head = ne;
+    if (!fc->lru_tail) fc->lru_tail = ne;
+    fc->count++;
+    fc->bytes += bytes;
+    while (fc->bytes > fc->max_bytes && fc->lru_tail != ne) fragment_unlink(fc, fc->lru_tail);
+    pthread_mutex_unlock(&fc->lock);
+}
+
+static void fragment_invalidate(void* userdata, const char* prefix) {
+    FragmentCache* fc = userdata;
+    size_t pl = strlen(prefix);
+    pthread_mutex_lock(&fc->lock);
+    for (FragmentEntry* e = fc->lru_head; e;) {
+        FragmentEntry* next = e->lru_next;
+        if (strncmp(e->key, prefix, pl) == 0) fragment_unlink(fc, e);
+        e = next;
+    }
+    pthread_mutex_unlock(&fc->lock);
+}
+
+static BreezeFragmentStore builtin_fragment_store(FragmentCache* fc) {
+    return (BreezeFragmentStore){fragment_get, fragment_put, fragment_invalidate, fc};
+}
+
+void breeze_engine_set_fragment_limit(BreezeEngine* engine, size_t max_bytes) {
+    if (!engine) return;
+    FragmentCache* fc = &engine->fragments;
+    pthread_mutex_lock(&fc->lock);
+    fc->max_bytes = max_bytes;
+    while (fc->bytes > fc->max_bytes && fc->lru_tail) fragment_unlink(fc, fc->lru_tail);
+    pthread_mutex_unlock(&fc->lock);
+}
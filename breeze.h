@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,10 +24,54 @@ extern "C" {
 
 /* ==================== Value Types ==================== */
 
-typedef enum { TMPL_STRING, TMPL_INT, TMPL_FLOAT, TMPL_DOUBLE, TMPL_BOOL, TMPL_LONG, TMPL_UINT, TMPL_ARRAY } ValueType;
+typedef enum {
+    TMPL_STRING,
+    TMPL_INT,
+    TMPL_FLOAT,
+    TMPL_DOUBLE,
+    TMPL_BOOL,
+    TMPL_LONG,
+    TMPL_UINT,
+    TMPL_ARRAY,
+    TMPL_RECORD, /* a C struct described by a BreezeRecordType */
+    TMPL_ITER,   /* items pulled one at a time from a callback */
+    TMPL_STRV,   /* string with an explicit length, need not be NUL-terminated */
+} ValueType;
+
+/* Bytes with a length. A TMPL_STRV value, and array items and record fields
+ * of type TMPL_STRV, are stored this way. */
+typedef struct {
+    const char* data;
+    size_t len;
+} BreezeSlice;
+
+struct TemplateValue;
+
+/* Produce the next item of a TMPL_ITER into `item`; return false at the end.
+ * The item only has to stay valid until the next call. */
+typedef bool (*BreezeNextFn)(void* userdata, struct TemplateValue* item);
+
+/* Count of an iterator that cannot tell how many items it holds. */
+#define BREEZE_COUNT_UNKNOWN SIZE_MAX
+
+/* One readable member of a C struct. Fields hold scalars, `const char*`, a
+ * BreezeSlice or, for TMPL_ARRAY, a TemplateValueUnion. */
+typedef struct {
+    const char* name;
+    size_t offset;
+    ValueType type;
+} BreezeField;
+
+/* Field layout of a C struct, normally a static const per struct type. */
+typedef struct {
+    size_t size; /* sizeof the struct */
+    const BreezeField* fields;
+    size_t field_count;
+} BreezeRecordType;
 
 typedef union {
     const char* str;
+    BreezeSlice strv;
     int integer;
     float floating;
     double dbl;
@@ -37,7 +82,18 @@ typedef union {
         const void* items;
         size_t count;
         ValueType item_type;
+        uint32_t stride; /* bytes from one item to the next; 0 = array of pointers (see VAR_ARRAY) */
+        const BreezeRecordType* record; /* item layout, for TMPL_RECORD items */
     } array;
+    struct {
+        const void* ptr;
+        const BreezeRecordType* type;
+    } record;
+    struct {
+        BreezeNextFn next;
+        void* userdata;
+        size_t count; /* exact number of items, or BREEZE_COUNT_UNKNOWN */
+    } iter;
 } TemplateValueUnion;
 
 typedef enum {
@@ -49,7 +105,7 @@ typedef enum {
     TMPL_ERR_IO
 } TemplateErrorType;
 
-typedef struct {
+typedef struct TemplateValue {
     ValueType type;
     TemplateValueUnion value;
 } TemplateValue;
@@ -63,12 +119,15 @@ typedef struct {
     TemplateVar* vars;
     size_t count;
     size_t capacity;
+    uint32_t* index; /* optional hash index over vars, see context_build_index() */
+    size_t index_size;
 } TemplateContext;
 
 typedef struct {
     TemplateErrorType type;
     char message[256];
     size_t line;
+    size_t column; /* 1-based byte offset within the line; 0 when unknown */
 } TemplateError;
 
 typedef struct {
@@ -81,29 +140,330 @@ typedef struct {
 
 typedef bool (*BreezeFilterFn)(const TemplateValue* val, const char* arg, OutputBuffer* out);
 
+/* Typed filter. `*result` starts out meaning "the text appended to scratch";
+ * append to `scratch` to return text, or overwrite `*result` to pass any value
+ * (number, array, ...) on to the next filter. A result may point into
+ * `scratch`, into `val`'s data, or into `arg`. `scratch` is empty on entry and
+ * owned by the renderer. */
+typedef bool (*BreezeValueFilterFn)(const TemplateValue* val, const char* arg, TemplateValue* result,
+                                    OutputBuffer* scratch);
+
 typedef struct {
     char name[64];
     BreezeFilterFn fn;
 } BreezeFilter;
 
+/* Global registry: these act on the default engine used by render_template(),
+ * breeze_compile() and the template cache. breeze_clear_filters() removes
+ * user filters and overrides; the built-ins remain. */
 bool breeze_register_filter(const char* name, BreezeFilterFn fn);
+bool breeze_register_value_filter(const char* name, BreezeValueFilterFn fn);
 void breeze_clear_filters(void);
 
+/* ==================== Engines ==================== */
+
+/* An engine owns a filter registry. All functions are thread-safe. Filters
+ * are bound when a template is compiled: registering a filter afterwards does
+ * not affect templates that are already compiled. */
+typedef struct BreezeEngine BreezeEngine;
+
+WARN_UNUSED BreezeEngine* breeze_engine_new(void); /* built-in filters pre-registered */
+void breeze_engine_free(BreezeEngine* engine);
+BreezeEngine* breeze_default_engine(void);
+
+bool breeze_engine_register_filter(BreezeEngine* engine, const char* name, BreezeFilterFn fn);
+bool breeze_engine_register_value_filter(BreezeEngine* engine, const char* name, BreezeValueFilterFn fn);
+bool breeze_engine_clear_filters(BreezeEngine* engine);
+
+/* HTML-escape the output of every {{ }} in templates compiled after this
+ * call, except expressions that use the `safe` or `escape` filter. */
+void breeze_engine_set_autoescape(BreezeEngine* engine, bool on);
+BreezeFilterFn breeze_engine_find_filter(BreezeEngine* engine, const char* name); /* NULL for value filters */
+
+/* Fold constants in templates compiled after this call (on by default).
+ * {{ }} of a constant is rendered at compile time only when its filters are
+ * all built-ins; registered filters always run at render time. */
+void breeze_engine_set_optimize(BreezeEngine* engine, bool on);
+
+/* Storage for {% cache %} fragments. get() appends the bytes of a live entry
+ * to `out` and returns true; put() stores a rendered fragment for `ttl`
+ * seconds (0 = until evicted); invalidate() drops every key that starts with
+ * `prefix` ("" = all). Called concurrently from rendering threads. */
+typedef struct {
+    bool (*get)(void* userdata, const char* key, OutputBuffer* out);
+    void (*put)(void* userdata, const char* key, const char* data, size_t len, unsigned ttl);
+    void (*invalidate)(void* userdata, const char* prefix);
+    void* userdata;
+} BreezeFragmentStore;
+
+/* Use `store` for the engine's fragments; NULL restores the built-in LRU store. */
+void breeze_engine_set_fragment_store(BreezeEngine* engine, const BreezeFragmentStore* store);
+void breeze_engine_set_fragment_limit(BreezeEngine* engine, size_t max_bytes); /* built-in store, default 4 MiB */
+void breeze_engine_invalidate_fragments(BreezeEngine* engine, const char* prefix);
+
 /* ==================== Dynamic Context ==================== */
 
 TemplateContext* context_new(size_t initial_capacity);
 WARN_UNUSED bool context_set(TemplateContext* ctx, const char* key, TemplateValue value);
 void context_free(TemplateContext* ctx);
 
+/* Hash index for name lookups. Contexts from context_new() maintain one
+ * automatically; for a static context, build it once after filling `vars`
+ * and release it with context_free_index(). Editing `vars` directly
+ * afterwards requires rebuilding the index. */
+WARN_UNUSED bool context_build_index(TemplateContext* ctx);
+void context_free_index(TemplateContext* ctx);
+
+/* Read item `index` of any array layout into `item`; false if out of range. */
+bool breeze_array_get(const TemplateValue* array, size_t index, TemplateValue* item);
+
+/* A TMPL_STRV value over `len` bytes at `data`, e.g. a slice of a larger
+ * buffer. The bytes are not copied. */
+TemplateValue breeze_strn(const char* data, size_t len);
+
+/* Bytes and length of a TMPL_STRING or TMPL_STRV value, for filters; NULL
+ * for other types. TMPL_STRV data need not be NUL-terminated. */
+const char* breeze_value_str(const TemplateValue* val, size_t* len);
+
+/* ==================== JSON Contexts ==================== */
+
+/* Bump allocator for contexts built from JSON. Everything allocated in it is
+ * released at once by breeze_arena_reset (keeping the memory for reuse) or
+ * breeze_arena_free. */
+typedef struct BreezeArena BreezeArena;
+
+WARN_UNUSED BreezeArena* breeze_arena_new(void);
+void breeze_arena_reset(BreezeArena* arena);
+void breeze_arena_free(BreezeArena* arena);
+
+/* Parse a JSON object of `len` bytes into a context allocated in `arena`.
+ * Strings are TMPL_STRV slices of `json` (escaped ones are decoded into the
+ * arena), so the text must outlive the context. Integers are TMPL_LONG,
+ * other numbers TMPL_DOUBLE, null an empty string. Arrays are stored
+ * contiguously, so their items must share a type (integers and doubles mix
+ * as doubles); an array of objects is an array of records whose fields are
+ * the union of the objects' members, absent ones zeroed. An object inside
+ * an object is flattened into its record under dotted names, read as
+ * `a.b.c`. The context has no hash index and must not be passed to
+ * context_set or context_free. Returns NULL with `err` set on failure;
+ * memory already used stays in the arena until it is reset. */
+WARN_UNUSED TemplateContext* breeze_context_from_json(const char* json, size_t len, BreezeArena* arena,
+                                                      TemplateError* err);
+
 /* ==================== Output Buffer ==================== */
 
 WARN_UNUSED bool buffer_init(OutputBuffer* buf, size_t initial_capacity);
+WARN_UNUSED bool breeze_buffer_append(OutputBuffer* buf, const char* data, size_t len); /* keeps data NUL-terminated */
+
+/* ==================== Memory ==================== */
+
+/* Where breeze gets its memory: every allocation the library makes, buffers
+ * and contexts included, goes through these. Install one before any other
+ * call, since memory must be freed by the allocator that made it; NULL
+ * restores malloc/realloc/free. realloc_fn is never passed NULL. */
+typedef struct {
+    void* (*malloc_fn)(void* userdata, size_t size);
+    void* (*realloc_fn)(void* userdata, void* ptr, size_t size);
+    void (*free_fn)(void* userdata, void* ptr);
+    void* userdata;
+} BreezeAllocator;
+
+void breeze_set_allocator(const BreezeAllocator* allocator);
+void breeze_free(void* ptr); /* release memory breeze handed out, e.g. OutputBuffer.data */
 
 /* ==================== Render API ==================== */
 
 bool render_template(const char* template, const TemplateContext* ctx, OutputBuffer* out, TemplateError* err);
 bool render_template_file(const char* path, const TemplateContext* ctx, OutputBuffer* out, TemplateError* err);
 
+/* ==================== Compiled Templates ==================== */
+
+/* Opaque compiled template. Text runs, {{ }} expressions, filter chains and
+ * for/if/elif/else blocks are resolved once by breeze_compile(); rendering
+ * only walks the result. A compiled template is read-only while rendering,
+ * apart from its output size hint (breeze_template_size_hint). */
+typedef struct BreezeTemplate BreezeTemplate;
+
+WARN_UNUSED BreezeTemplate* breeze_compile(const char* source, TemplateError* err);
+bool breeze_render_compiled(const BreezeTemplate* tpl, const TemplateContext* ctx, OutputBuffer* out,
+                            TemplateError* err);
+void breeze_template_free(BreezeTemplate* tpl);
+
+/* Declared context layout: keys[i] is the key expected at ctx->vars[i].
+ * Templates compiled against a schema read matching contexts by position;
+ * names not in the schema, or contexts laid out differently, fall back to a
+ * normal lookup. */
+typedef struct {
+    const char* const* keys;
+    size_t count;
+} BreezeSchema;
+
+WARN_UNUSED BreezeTemplate* breeze_compile_schema(const char* source, const BreezeSchema* schema, TemplateError* err);
+
+/* Compile against a specific engine's filters; `schema` may be NULL. */
+WARN_UNUSED BreezeTemplate* breeze_engine_compile(BreezeEngine* engine, const char* source, const BreezeSchema* schema,
+                                                  TemplateError* err);
+
+/* What the compile-time optimizer did to a template. A variable set once at
+ * the top level with {% set %} is a constant after that tag. */
+typedef struct {
+    size_t nodes_before;    /* program size as parsed */
+    size_t nodes_after;     /* program size as rendered */
+    size_t vars_folded;     /* {{ }} of constants rendered at compile time, filters included */
+    size_t branches_folded; /* if/elif conditions over constants decided at compile time */
+    size_t sets_dropped;    /* set tags nothing reads any more */
+    size_t nodes_dropped;   /* unreachable branches and jumps that became no-ops */
+    size_t texts_merged;    /* text runs merged into the run before them */
+} BreezeFoldStats;
+
+void breeze_template_fold_stats(const BreezeTemplate* tpl, BreezeFoldStats* stats);
+
+/* Bytes the template's recent renders produced. Each render into an
+ * OutputBuffer reserves this much up front, so the buffer rarely has to grow
+ * while rendering; use it to size buffers passed in. It follows larger pages
+ * at once and smaller ones slowly; 0 before the first render. */
+size_t breeze_template_size_hint(const BreezeTemplate* tpl);
+
+/* ==================== Streaming Output ==================== */
+
+/* Output sink. `write` receives one or more slices to be written in order
+ * and returns false on failure, which aborts the render with TMPL_ERR_IO. */
+typedef struct {
+    bool (*write)(void* userdata, const BreezeSlice* slices, size_t count);
+    void* userdata;
+} BreezeWriter;
+
+BreezeWriter breeze_writer_buffer(OutputBuffer* buf);
+BreezeWriter breeze_writer_file(FILE* fp);
+BreezeWriter breeze_writer_fd(int fd); /* POSIX writev(), retries short writes */
+
+/* Render through a small fixed chunk that is flushed to `writer` whenever it
+ * fills, so memory use does not grow with the size of the page. */
+bool breeze_render_to_writer(const BreezeTemplate* tpl, const TemplateContext* ctx, const BreezeWriter* writer,
+                             TemplateError* err);
+
+/* ==================== Render State ==================== */
+
+/* Reusable scratch memory for rendering: loop and condition stacks, lookup
+ * tables, filter buffers and the streaming chunk. Once a state has rendered a
+ * template, rendering it again does not call malloc. A state may be used by
+ * one render at a time, typically one per worker thread. */
+typedef struct BreezeRenderState BreezeRenderState;
+
+WARN_UNUSED BreezeRenderState* breeze_render_state_new(void);
+void breeze_render_state_free(BreezeRenderState* state);
+
+/* Memory use of the last render on a state. A warm state renders a template
+ * it has seen with no allocations besides growth of the output buffer. */
+typedef struct {
+    size_t allocations;  /* allocator calls made while rendering */
+    size_t alloc_bytes;  /* bytes they requested, reallocs at their new size */
+    size_t output_bytes; /* bytes rendered */
+} BreezeRenderStats;
+
+void breeze_state_stats(const BreezeRenderState* state, BreezeRenderStats* stats);
+
+/* Fail a render on `state` with TMPL_ERR_MEMORY once its allocations would
+ * request more than `max_bytes` in total (0 = no limit, the default). */
+void breeze_state_set_memory_limit(BreezeRenderState* state, size_t max_bytes);
+
+/* As breeze_render_compiled / breeze_render_to_writer; a NULL state uses a
+ * temporary one. */
+bool breeze_state_render(BreezeRenderState* state, const BreezeTemplate* tpl, const TemplateContext* ctx,
+                         OutputBuffer* out, TemplateError* err);
+bool breeze_state_render_to_writer(BreezeRenderState* state, const BreezeTemplate* tpl, const TemplateContext* ctx,
+                                   const BreezeWriter* writer, TemplateError* err);
+
+/* Pull-style rendering. breeze_render_begin starts rendering `tpl` on
+ * `state`, abandoning any render already in progress there; each
+ * breeze_render_step then fills up to `cap` bytes of `buf` (not
+ * NUL-terminated) and sets `*written`. MORE means call again, DONE that the
+ * whole output has been delivered, ERROR that the render failed, once the
+ * output written before the failure has been delivered. `tpl` and `ctx`
+ * must stay alive until the render is done. The render only pauses between
+ * nodes and never inside {% cache %}, so a step may stage more than `cap`;
+ * the rest is handed out by the next steps. */
+typedef enum { BREEZE_RENDER_DONE, BREEZE_RENDER_MORE, BREEZE_RENDER_ERROR } BreezeRenderStatus;
+
+WARN_UNUSED bool breeze_render_begin(BreezeRenderState* state, const BreezeTemplate* tpl, const TemplateContext* ctx,
+                                     TemplateError* err);
+BreezeRenderStatus breeze_render_step(BreezeRenderState* state, char* buf, size_t cap, size_t* written,
+                                      TemplateError* err);
+
+/* Render `tpl` once per context on `threads` workers (0 = one per online
+ * CPU), each with its own render state. outs[i] receives the output for
+ * ctxs[i]; zeroed buffers are initialised. `errs`, if not NULL, holds n
+ * errors. Returns false if any render failed. */
+bool breeze_render_batch(const BreezeTemplate* tpl, const TemplateContext* ctxs, size_t n, OutputBuffer* outs,
+                         TemplateError* errs, size_t threads);
+
+/* ==================== Profiling ==================== */
+
+/* Counters for one node of a compiled template, in program order. Time and
+ * bytes are exclusive: a loop's body is charged to the body's nodes, an
+ * include to the include node. */
+typedef struct {
+    const char* kind; /* "text", "var", "set", "for", "endfor", "if", "jump", "include", "cache", "endcache" */
+    size_t line;      /* source line of the tag or text */
+    uint64_t executions;
+    uint64_t nanoseconds;
+    uint64_t bytes; /* output produced */
+} BreezeNodeProfile;
+
+/* Counters for one filter call site, e.g. the `upper` in {{ name | upper }}. */
+typedef struct {
+    const char* name;
+    size_t line;
+    uint64_t calls;
+    uint64_t nanoseconds;
+    uint64_t allocations; /* times the call had to allocate or grow its output buffer */
+} BreezeFilterProfile;
+
+/* Profiling is off unless a profile is attached to a render state. Renders
+ * of the profile's template through that state then add to its counters;
+ * other templates, including partials, are not profiled. A profile must not
+ * be attached to two states in use at once, and must not outlive its
+ * template. */
+typedef struct BreezeProfile BreezeProfile;
+
+WARN_UNUSED BreezeProfile* breeze_profile_new(const BreezeTemplate* tpl);
+void breeze_profile_free(BreezeProfile* profile);
+void breeze_profile_reset(BreezeProfile* profile);
+void breeze_state_set_profile(BreezeRenderState* state, BreezeProfile* profile); /* NULL detaches */
+
+uint64_t breeze_profile_renders(const BreezeProfile* profile);
+const BreezeNodeProfile* breeze_profile_dump(const BreezeProfile* profile, size_t* count);
+const BreezeFilterProfile* breeze_profile_filters(const BreezeProfile* profile, size_t* count);
+/* Append {"renders":N,"nodes":[...],"filters":[...]} to `out`. */
+WARN_UNUSED bool breeze_profile_dump_json(const BreezeProfile* profile, OutputBuffer* out);
+
+/* ==================== Template Cache ==================== */
+
+/* Path-keyed cache of compiled templates. All functions are thread-safe. */
+typedef struct BreezeTemplateCache BreezeTemplateCache;
+
+typedef struct {
+    bool check_mtime; /* stat on every lookup, recompile when mtime/size change (dev hot reload) */
+    size_t max_bytes; /* evict least recently used templates above this footprint; 0 = unlimited */
+    BreezeEngine* engine; /* filters to compile against; NULL = default engine */
+    const char* root;     /* directory {% include %} / {% extends %} paths are relative to; NULL = as given */
+} BreezeCacheOptions;
+
+BreezeTemplateCache* breeze_cache_new(const BreezeCacheOptions* opts);
+void breeze_cache_free(BreezeTemplateCache* cache);
+
+/* Return the compiled template for `path`, compiling it on a miss. The
+ * template stays valid until breeze_cache_release(), even if it is evicted
+ * or reloaded in the meantime. */
+WARN_UNUSED BreezeTemplate* breeze_cache_acquire(BreezeTemplateCache* cache, const char* path, TemplateError* err);
+void breeze_cache_release(BreezeTemplateCache* cache, BreezeTemplate* tpl);
+
+bool breeze_cache_render(BreezeTemplateCache* cache, const char* path, const TemplateContext* ctx, OutputBuffer* out,
+                         TemplateError* err);
+
+/* Drop `path` from the cache, or every entry when `path` is NULL. */
+void breeze_cache_invalidate(BreezeTemplateCache* cache, const char* path);
+
 /* ==================== Convenience Macros ==================== */
 
 // clang-format off
@@ -114,6 +474,8 @@ bool render_template_file(const char* path, const TemplateContext* ctx, OutputBu
 #define VAR_BOOL(k, v)     {k, {TMPL_BOOL,   .value = {.boolean = v}}}
 #define VAR_LONG(k, v)     {k, {TMPL_LONG,   .value = {.long_int = v}}}
 #define VAR_UINT(k, v)     {k, {TMPL_UINT,   .value = {.uint = v}}}
+#define VAR_STRN(k, s, n)  {k, {TMPL_STRV,   .value = {.strv = {s, n}}}}
+#define VAR_STRLIT(k, lit) VAR_STRN(k, lit, sizeof(lit) - 1)
 // clang-format on
 
 #define VAR_ARRAY(key, ptr_array, item_type_enum)                    \
@@ -129,31 +491,191 @@ bool render_template_file(const char* path, const TemplateContext* ctx, OutputBu
 
 #define VAR_ARRAY_STR(key, str_array) VAR_ARRAY(key, str_array, TMPL_STRING)
 
+/* Contiguous arrays of plain values: int[], double[], const char*[], BreezeSlice[], ... */
+#define VAR_ARRAY_OF(key, value_array, item_type_enum)                       \
+    {                                                                        \
+        key, {                                                               \
+            TMPL_ARRAY, .value.array = {                                     \
+                .items = (value_array),                                      \
+                .count = sizeof(value_array) / sizeof((value_array)[0]),     \
+                .item_type = (item_type_enum),                               \
+                .stride = (uint32_t)sizeof((value_array)[0])                 \
+            }                                                                \
+        }                                                                    \
+    }
+
+// clang-format off
+#define VAR_ARRAY_INT(k, a)    VAR_ARRAY_OF(k, a, TMPL_INT)
+#define VAR_ARRAY_FLOAT(k, a)  VAR_ARRAY_OF(k, a, TMPL_FLOAT)
+#define VAR_ARRAY_DOUBLE(k, a) VAR_ARRAY_OF(k, a, TMPL_DOUBLE)
+#define VAR_ARRAY_BOOL(k, a)   VAR_ARRAY_OF(k, a, TMPL_BOOL)
+#define VAR_ARRAY_LONG(k, a)   VAR_ARRAY_OF(k, a, TMPL_LONG)
+#define VAR_ARRAY_UINT(k, a)   VAR_ARRAY_OF(k, a, TMPL_UINT)
+#define VAR_ARRAY_STRV(k, a)   VAR_ARRAY_OF(k, a, TMPL_STRV)
+// clang-format on
+
+/* One field of each struct in `ptr[0..n)`, read in place, e.g.
+ * VAR_ARRAY_FIELD("prices", rows, nrows, price, TMPL_DOUBLE). */
+#define VAR_ARRAY_FIELD(key, ptr, n, field, item_type_enum) \
+    {                                                       \
+        key, {                                              \
+            TMPL_ARRAY, .value.array = {                    \
+                .items = &(ptr)[0].field,                   \
+                .count = (n),                               \
+                .item_type = (item_type_enum),              \
+                .stride = (uint32_t)sizeof((ptr)[0])        \
+            }                                               \
+        }                                                   \
+    }
+
 #define MAKE_PTR_ARRAY(arr, ptrs, name)        \
     ptrs name[sizeof(arr) / sizeof((arr)[0])]; \
     for (size_t __i = 0; __i < sizeof(arr) / sizeof((arr)[0]); ++__i) name[__i] = &(arr)[__i]
 
-/* ==================== Expression Stack (exposed for tests) ==================== */
+/* ==================== Records ==================== */
+
+/* Describe a struct once and its fields become {{ item.field }}:
+ *
+ *   static const BreezeField order_fields[] = {
+ *       BREEZE_FIELD(Order, id, TMPL_INT),
+ *       BREEZE_FIELD(Order, total, TMPL_DOUBLE),
+ *   };
+ *   static const BreezeRecordType order_type = BREEZE_RECORD_TYPE(Order, order_fields);
+ */
+#define BREEZE_FIELD(struct_type, member, value_type) {#member, offsetof(struct_type, member), value_type}
+#define BREEZE_RECORD_TYPE(struct_type, field_array) \
+    {sizeof(struct_type), field_array, sizeof(field_array) / sizeof((field_array)[0])}
+
+#define VAR_RECORD(key, ptr, rectype) {key, {TMPL_RECORD, .value.record = {(ptr), (rectype)}}}
+
+/* Array of `n` structs stored contiguously at `ptr`. */
+#define VAR_ARRAY_RECORDS(key, ptr, n, rectype)         \
+    {                                                   \
+        key, {                                          \
+            TMPL_ARRAY, .value.array = {                \
+                .items = (ptr),                         \
+                .count = (n),                           \
+                .item_type = TMPL_RECORD,               \
+                .stride = (uint32_t)(rectype)->size,    \
+                .record = (rectype)                     \
+            }                                           \
+        }                                               \
+    }
 
+/* ==================== Iterators ==================== */
+
+/* A sequence produced on demand, e.g. rows from a database cursor:
+ *
+ *   TemplateVar v = VAR_ITER("rows", next_row, cursor, BREEZE_COUNT_UNKNOWN);
+ *
+ * {% for %} calls next() once per item, so nothing is buffered. An iterator
+ * is consumed by the loop that walks it. loop.length and loop.last need the
+ * count; looping over an iterator without one while using them is a render
+ * error. */
+#define VAR_ITER(key, next_fn, data, n) {key, {TMPL_ITER, .value.iter = {(next_fn), (data), (n)}}}
+
+/* ==================== Template Images ==================== */
+
+/* breeze_template_save() appends a compiled template to `out` as a binary
+ * image. breeze_template_load() makes a template of an image in place, with
+ * no copying or parsing: `data` may be a read-only mmap shared by worker
+ * processes, and must stay mapped and unchanged until the template is
+ * freed. It must be 8-byte aligned, as a mapping or malloc block is. Images
+ * are padded to a multiple of 8, so they can be concatenated into a bundle
+ * and walked with `used`, which receives the size of the image at `data`.
+ *
+ * Filters are bound against `engine` (NULL = default) at load; autoescape
+ * and folding are as they were when the template was compiled. An image
+ * only loads into the build that wrote it, or one with the same version,
+ * byte order and layout. Every index, offset and jump in the program is
+ * checked at load; a damaged image fails with TMPL_ERR_PARSE. Templates
+ * with {% include %} cannot be saved. */
+WARN_UNUSED bool breeze_template_save(const BreezeTemplate* tpl, OutputBuffer* out, TemplateError* err);
+WARN_UNUSED BreezeTemplate* breeze_template_load(BreezeEngine* engine, const void* data, size_t len, size_t* used,
+                                                 TemplateError* err);
+
+/* ==================== Generated Code ==================== */
+
+/* breeze_template_to_c() turns a compiled template into a C99 function
+ *
+ *   bool <name>(const TemplateContext* ctx, OutputBuffer* out, TemplateError* err);
+ *
+ * with the same output and errors as breeze_render_compiled(). Text becomes
+ * static arrays and control flow becomes native jumps; filters are resolved
+ * by name in the default engine once per render. {% include %} and
+ * {% cache %} are not supported. `breeze compile` is its command-line front
+ * end. The declarations below exist for the generated code. */
+WARN_UNUSED bool breeze_template_to_c(const BreezeTemplate* tpl, const char* name, OutputBuffer* out,
+                                      TemplateError* err);
+
+#define BREEZE_GEN_NO_SLOT ((size_t)-1)
+
+/* Comparison operators of compiled conditions. */
 typedef enum {
-    TOKEN_VALUE,
-    TOKEN_AND,
-    TOKEN_OR,
-    TOKEN_NOT,
-    TOKEN_LPAREN,
-    TOKEN_RPAREN,
-} ExprTokenType;
+    BREEZE_CMP_EQ,
+    BREEZE_CMP_NE,
+    BREEZE_CMP_LT,
+    BREEZE_CMP_LE,
+    BREEZE_CMP_GT,
+    BREEZE_CMP_GE,
+    BREEZE_CMP_IN,
+    BREEZE_CMP_NOT_IN
+} BreezeCmp;
+
+/* A filter call site, and the filter it resolves to: one of fn / value_fn. */
+typedef struct {
+    const char* name;
+    const char* arg; /* NULL without an argument */
+} BreezeGenFilter;
 
 typedef struct {
-    ExprTokenType type;
-    bool value;
-} ExprToken;
+    BreezeFilterFn fn;
+    BreezeValueFilterFn value_fn;
+} BreezeBoundFilter;
 
+/* A {% for %} in progress. */
 typedef struct {
-    ExprToken* tokens;
-    size_t size;
-    size_t capacity;
-} ExprStack;
+    TemplateValue array; /* TMPL_ARRAY or TMPL_ITER */
+    size_t index;
+    size_t count; /* BREEZE_COUNT_UNKNOWN for an iterator without a count */
+    TemplateValue item;
+} BreezeGenLoop;
+
+/* Field of `base.field` resolved for the last record type seen at a site. */
+typedef struct {
+    const BreezeRecordType* type;
+    const BreezeField* field;
+} BreezeGenField;
+
+typedef struct {
+    OutputBuffer* out;
+    TemplateError* err;
+    OutputBuffer scratch[2]; /* filter chains */
+    const BreezeGenFilter* filters;
+    const BreezeBoundFilter* bound;
+} BreezeGen;
+
+/* The runtime of generated code. A failing call records the error without a
+ * position; the caller returns breeze_gen_fail() with the tag's position,
+ * which also releases the scratch buffers, as does breeze_gen_end(). */
+void breeze_gen_begin(BreezeGen* g, OutputBuffer* out, TemplateError* err, const BreezeGenFilter* filters,
+                      BreezeBoundFilter* bound, size_t nfilters);
+bool breeze_gen_end(BreezeGen* g);                              /* true */
+bool breeze_gen_fail(BreezeGen* g, size_t line, size_t column); /* false */
+bool breeze_gen_missing(BreezeGen* g, TemplateErrorType type, const char* name, size_t line, size_t column);
+void breeze_gen_resolve(const TemplateContext* ctx, const char* const* names, const size_t* slots, size_t n,
+                        const TemplateValue** values);
+/* `base.field`, or `fallback` (the dotted name as a key) when the base is not a record. */
+const TemplateValue* breeze_gen_field(const TemplateValue* base, const char* field, BreezeGenField* site,
+                                      const TemplateValue* fallback, TemplateValue* tmp);
+WARN_UNUSED bool breeze_gen_text(BreezeGen* g, const char* data, size_t len);
+WARN_UNUSED bool breeze_gen_output(BreezeGen* g, const TemplateValue* val, bool escape);
+WARN_UNUSED bool breeze_gen_filters(BreezeGen* g, const TemplateValue* val, size_t first, size_t count, bool escape);
+WARN_UNUSED bool breeze_gen_compare(BreezeGen* g, BreezeCmp cmp, const TemplateValue* a, const TemplateValue* b,
+                                    bool* result);
+bool breeze_gen_truthy(const TemplateValue* val);
+WARN_UNUSED bool breeze_gen_loop_start(BreezeGen* g, BreezeGenLoop* loop, const TemplateValue* array, bool counted);
+bool breeze_gen_loop_item(BreezeGenLoop* loop); /* load item `index`; false at the end */
 
 #ifdef __cplusplus
 }
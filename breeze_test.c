@@ -4,9 +4,14 @@
 
 #include "breeze.h"
 #include <assert.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 /* ------------------------------------------------------------------ */
 /*  Test harness                                                        */
@@ -607,6 +612,55 @@ static void test_set_reuse_in_loop(void) {
     free(out.data);
 }
 
+static void test_set_typed_values(void) {
+    TemplateVar vars[] = {VAR_BOOL("flag", true)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{% set n = 5 %}{% if n > 4.5 %}big{% endif %}"
+                                "{% set on = false %}{% if on %} on{% else %} off{% endif %}"
+                                "{% set z = 0 %}{% if not z %} zero{% endif %}"
+                                "{% set code = \"007\" %}{% set num = 007 %} {{ code }}/{{ num }}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("big off zero 007/7", out.data);
+
+    /* Set inside a branch, so decided at render time rather than folded. */
+    out.size = 0;
+    TEST_ASSERT(render_template("{% set n = 1 %}{% if flag %}{% set n = 10 %}{% set r = 2.5 %}{% endif %}"
+                                "{% if n > 9 and r < 3 %}{{ n }} {{ r }}{% endif %}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("10 2.5000", out.data);
+    free(out.data);
+}
+
+/* No fixed limits on the number of set variables or the length of a value. */
+static void test_set_no_limits(void) {
+    OutputBuffer src = new_buf(), want = new_buf(), out = new_buf();
+    char tag[64];
+    for (int i = 0; i < 200; i++) {
+        snprintf(tag, sizeof(tag), "{%% set v%d = %d %%}", i, i * 3);
+        TEST_ASSERT(breeze_buffer_append(&src, tag, strlen(tag)));
+    }
+    TEST_ASSERT(breeze_buffer_append(&src, "{% set long = \"", 15));
+    for (int i = 0; i < 1000; i++) TEST_ASSERT(breeze_buffer_append(&src, "ab", 2));
+    TEST_ASSERT(breeze_buffer_append(&src, "\" %}", 4));
+    for (int i = 0; i < 200; i += 37) {
+        snprintf(tag, sizeof(tag), "{{ v%d }},", i);
+        TEST_ASSERT(breeze_buffer_append(&src, tag, strlen(tag)));
+        snprintf(tag, sizeof(tag), "%d,", i * 3);
+        TEST_ASSERT(breeze_buffer_append(&want, tag, strlen(tag)));
+    }
+    TEST_ASSERT(breeze_buffer_append(&src, "{{ long | len }}", 16));
+    TEST_ASSERT(breeze_buffer_append(&want, "2000", 4));
+    TemplateContext ctx = {0};
+    TemplateError err = {0};
+    TEST_ASSERT(render_template(src.data, &ctx, &out, &err));
+    TEST_ASSERT_STR(want.data, out.data);
+    free(src.data);
+    free(want.data);
+    free(out.data);
+}
+
 static void test_set_bad_syntax(void) {
     TemplateContext ctx = {.vars = NULL, .count = 0};
     OutputBuffer out = new_buf();
@@ -1109,118 +1163,3143 @@ static void test_edge_deep_nesting(void) {
 }
 
 /* ================================================================
-   main
+  13. Compiled templates
    ================================================================ */
 
-int main(void) {
-    printf("\n=== Breeze Template Engine – Expanded Test Suite ===\n\n");
+static void test_compile_render_many(void) {
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("Hi {{ name | upper }}{% if vip %}!{% endif %}", &err);
+    TEST_ASSERT(tpl != NULL);
+
+    const char* names[] = {"ann", "bob"};
+    bool vips[] = {true, false};
+    const char* expected[] = {"Hi ANN!", "Hi BOB"};
+    for (int i = 0; i < 2; i++) {
+        TemplateContext ctx = {.vars = (TemplateVar[]){{"name", {.type = TMPL_STRING, .value.str = names[i]}},
+                                                       {"vip", {.type = TMPL_BOOL, .value.boolean = vips[i]}}},
+                               .count = 2};
+        OutputBuffer out = new_buf();
+        TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+        TEST_ASSERT_STR(expected[i], out.data);
+        free(out.data);
+    }
+    breeze_template_free(tpl);
+}
 
-    printf("── 1. Regression (original features) ──────────────────\n");
-    RUN(test_orig_variable_substitution);
-    RUN(test_orig_for_loop);
-    RUN(test_orig_if_else);
-    RUN(test_orig_complex_expr);
-    RUN(test_orig_all_value_types);
-    RUN(test_orig_whitespace_control);
-    RUN(test_orig_missing_variable);
-    RUN(test_orig_unclosed_for);
-    RUN(test_orig_nested_loops);
-    RUN(test_orig_html_comment);
+static void test_compile_syntax_error(void) {
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("line1\n{% if x %}\n{% endfor %}", &err);
+    TEST_ASSERT(tpl == NULL);
+    TEST_ASSERT_ERR(TMPL_ERR_SYNTAX, err);
+    TEST_ASSERT(err.line == 3);
+    TEST_ASSERT(err.column == 1);
+}
 
-    printf("\n── 2. Built-in Filters ─────────────────────────────────\n");
-    RUN(test_filter_upper);
-    RUN(test_filter_lower);
-    RUN(test_filter_len_string);
-    RUN(test_filter_len_array);
-    RUN(test_filter_trim);
-    RUN(test_filter_reverse);
-    RUN(test_filter_default_falsy);
-    RUN(test_filter_default_truthy);
-    RUN(test_filter_default_false_bool);
-    RUN(test_filter_truncate_cuts);
-    RUN(test_filter_truncate_noop);
-    RUN(test_filter_capitalize);
-    RUN(test_filter_replace);
-    RUN(test_filter_on_int);
-    RUN(test_filter_upper_int);
+static void test_compile_error_columns(void) {
+    TemplateError err = {0};
+    TEST_ASSERT(breeze_compile("a\n\nxx {% if (n %}y{% endif %}", &err) == NULL);
+    TEST_ASSERT(err.line == 3 && err.column == 4);
+
+    /* Render errors are located from the template's line table. */
+    BreezeTemplate* tpl = breeze_compile("{{ a }}\n  <p>{{ a | nosuch }}</p>\n", &err);
+    TEST_ASSERT(tpl != NULL);
+    TemplateVar vars[] = {VAR_STRING("a", "x")};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(!breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT(err.line == 2 && err.column == 6);
+    free(out.data);
+    breeze_template_free(tpl);
+
+    /* A long template with filters in a loop renders without any position work. */
+    size_t n = 4000;
+    char* src = malloc(n * 24 + 64);
+    TEST_ASSERT(src != NULL);
+    char* p = src;
+    p += sprintf(p, "{%% for w in ws %%}");
+    for (size_t i = 0; i < n; i++) p += sprintf(p, "{{ w | upper }}\n");
+    sprintf(p, "{%% endfor %%}{{ nope }}");
+    const char* ws[] = {"a", "b", "c"};
+    TemplateVar lv[] = {VAR_ARRAY_STR("ws", ws)};
+    TemplateContext lctx = {.vars = lv, .count = 1};
+    tpl = breeze_compile(src, &err);
+    TEST_ASSERT(tpl != NULL);
+    out = new_buf();
+    TEST_ASSERT(!breeze_render_compiled(tpl, &lctx, &out, &err));
+    TEST_ASSERT(err.line == n + 1 && err.column == 13);
+    TEST_ASSERT(out.size == 3 * n * 2);
+    free(out.data);
+    free(src);
+    breeze_template_free(tpl);
+}
 
-    printf("\n── 3. Chained Filters ──────────────────────────────────\n");
-    RUN(test_chain_upper_truncate);
-    RUN(test_chain_trim_upper_reverse);
-    RUN(test_chain_replace_upper);
+static void test_compile_missing_var_at_render(void) {
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("ok\n{% if show %}{{ missing }}{% endif %}", &err);
+    TEST_ASSERT(tpl != NULL);
 
-    printf("\n── 4. Loop Meta-variables ──────────────────────────────\n");
-    RUN(test_loop_index);
-    RUN(test_loop_index1);
-    RUN(test_loop_first_last);
-    RUN(test_loop_length);
-    RUN(test_loop_meta_combined);
-    RUN(test_loop_filter_on_item);
-    RUN(test_loop_separator_pattern);
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"show", {.type = TMPL_BOOL, .value.boolean = false}}}, .count = 1};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("ok\n", out.data);
 
-    printf("\n── 5. elif chains ──────────────────────────────────────\n");
-    RUN(test_elif_first_branch);
-    RUN(test_elif_middle_branch);
-    RUN(test_elif_else_branch);
-    RUN(test_elif_no_else);
-    RUN(test_elif_multiple_chains);
-    RUN(test_elif_without_if);
+    ctx.vars[0].value.value.boolean = true;
+    out.size = 0;
+    TEST_ASSERT(!breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_RENDER, err);
+    TEST_ASSERT(err.line == 2);
+    free(out.data);
+    breeze_template_free(tpl);
+}
 
-    printf("\n── 6. set tag ──────────────────────────────────────────\n");
-    RUN(test_set_basic);
-    RUN(test_set_quoted);
-    RUN(test_set_single_quoted);
-    RUN(test_set_overrides_context);
-    RUN(test_set_multiple);
-    RUN(test_set_reuse_in_loop);
-    RUN(test_set_bad_syntax);
+static void test_compile_nested_loops_and_branches(void) {
+    const char* outer[] = {"A", "B"};
+    const char* inner[] = {"1", "2", "3"};
+    TemplateValue oa = {.type = TMPL_ARRAY, .value.array = {.items = outer, .count = 2, .item_type = TMPL_STRING}};
+    TemplateValue ia = {.type = TMPL_ARRAY, .value.array = {.items = inner, .count = 3, .item_type = TMPL_STRING}};
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"o", oa}, {"i", ia}}, .count = 2};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(
+        "{% for x in o %}{% for y in i %}"
+        "{% if loop.first %}[{% elif loop.last %}]{% else %}{{ x }}{% endif %}"
+        "{% endfor %}{% endfor %}",
+        &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("[A][B]", out.data);
+    free(out.data);
+    breeze_template_free(tpl);
+}
 
-    printf("\n── 7. raw blocks ───────────────────────────────────────\n");
-    RUN(test_raw_basic);
-    RUN(test_raw_mixed);
-    RUN(test_raw_unclosed);
-    RUN(test_raw_preserves_braces);
+static void test_compile_not_operator(void) {
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"x", {.type = TMPL_BOOL, .value.boolean = false}}}, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{% if not x %}yes{% endif %}", &ctx, &out, &err));
+    TEST_ASSERT_STR("yes", out.data);
+    free(out.data);
+}
 
-    printf("\n── 8. render_template_file ─────────────────────────────\n");
-    RUN(test_render_file_ok);
-    RUN(test_render_file_missing);
-    RUN(test_render_file_with_filters);
+/* Nested blocks that end together leave them with one jump. */
+static void test_compile_threaded_jumps(void) {
+    const char* xs[] = {"a", "b"};
+    TemplateVar vars[] = {VAR_BOOL("p", true), VAR_BOOL("q", true), VAR_ARRAY_STR("xs", xs)};
+    TemplateContext ctx = {.vars = vars, .count = 3};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("{% if p %}{% if q %}<{% for x in xs %}{{ x }}{% endfor %}>"
+                                         "{% else %}none{% endif %}{% else %}off{% endif %}.",
+                                         &err);
+    TEST_ASSERT(tpl != NULL);
+    BreezeProfile* prof = breeze_profile_new(tpl);
+    BreezeRenderState* state = breeze_render_state_new();
+    breeze_state_set_profile(state, prof);
+    OutputBuffer out = new_buf();
+    for (int i = 0; i < 4; i++) {
+        vars[0].value.value.boolean = i < 2;
+        vars[1].value.value.boolean = i % 2 == 0;
+        TEST_ASSERT(breeze_state_render(state, tpl, &ctx, &out, &err));
+    }
+    TEST_ASSERT_STR("<ab>.none.off.off.", out.data);
+
+    size_t count;
+    const BreezeNodeProfile* nodes = breeze_profile_dump(prof, &count);
+    uint64_t jumps = 0;
+    for (size_t i = 0; i < count; i++)
+        if (strcmp(nodes[i].kind, "jump") == 0) jumps += nodes[i].executions;
+    TEST_ASSERT(jumps == 2); /* the inner taken branch jumps straight past the outer endif */
+    free(out.data);
+    breeze_render_state_free(state);
+    breeze_profile_free(prof);
+    breeze_template_free(tpl);
+}
 
-    printf("\n── 9. Dynamic context ──────────────────────────────────\n");
-    RUN(test_ctx_new_basic);
-    RUN(test_ctx_update);
-    RUN(test_ctx_grows_past_initial_capacity);
-    RUN(test_ctx_bool_and_int);
+/* ================================================================
+  14. Literal scanning
+   ================================================================ */
 
-    printf("\n── 10. Custom filters ──────────────────────────────────\n");
-    RUN(test_custom_filter_shout);
-    RUN(test_custom_filter_wrap);
-    RUN(test_custom_filter_overwrite);
+static void test_scan_markup_lookalikes(void) {
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"v", {.type = TMPL_STRING, .value.str = "X"}}}, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("<div style=\"font-family: a-b\">{ not a tag } x->y <p>{{ v }}</p></div>-", &ctx, &out,
+                                &err));
+    TEST_ASSERT_STR("<div style=\"font-family: a-b\">{ not a tag } x->y <p>X</p></div>-", out.data);
+    free(out.data);
+}
 
-    printf("\n── 11. Error paths ─────────────────────────────────────\n");
-    RUN(test_err_unknown_filter);
-    RUN(test_err_unterminated_var);
-    RUN(test_err_unterminated_directive);
-    RUN(test_err_endfor_without_for);
-    RUN(test_err_endif_without_if);
-    RUN(test_err_else_without_if);
-    RUN(test_err_unclosed_if);
-    RUN(test_err_unterminated_comment);
-    RUN(test_err_for_invalid_syntax);
-    RUN(test_err_set_no_equals);
-    RUN(test_err_unknown_directive);
+static void test_scan_tags_at_every_offset(void) {
+    /* Cover markup at each position within a scanned word. */
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"v", {.type = TMPL_STRING, .value.str = "X"}}}, .count = 1};
+    const char* pad = "0123456789abcdef";
+    for (int i = 0; i < 16; i++) {
+        char tpl[64];
+        char expected[64];
+        snprintf(tpl, sizeof(tpl), "%.*s{{ v }}<!-- c -->%s", i, pad, pad);
+        snprintf(expected, sizeof(expected), "%.*sX%s", i, pad, pad);
+        OutputBuffer out = new_buf();
+        TemplateError err = {0};
+        TEST_ASSERT(render_template(tpl, &ctx, &out, &err));
+        TEST_ASSERT_STR(expected, out.data);
+        free(out.data);
+    }
+}
 
-    printf("\n── 12. Edge cases ──────────────────────────────────────\n");
-    RUN(test_edge_empty_array);
-    RUN(test_edge_zero_int_falsy);
-    RUN(test_edge_nonzero_int_truthy);
-    RUN(test_edge_empty_string_falsy);
-    RUN(test_edge_no_newline_at_end);
-    RUN(test_edge_nested_for_loops);
-    RUN(test_edge_comment_strips_vars);
-    RUN(test_edge_multiple_vars_same_line);
-    RUN(test_edge_filter_on_loop_meta);
-    RUN(test_edge_deep_nesting);
+static void test_scan_raw_endraw_spacing(void) {
+    TemplateContext ctx = {.vars = NULL, .count = 0};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{% raw %}{ {% if %} {{ x }}{%endraw%}!", &ctx, &out, &err));
+    TEST_ASSERT_STR("{ {% if %} {{ x }}!", out.data);
+    free(out.data);
+}
+
+static void test_scan_replace_many(void) {
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"s", {.type = TMPL_STRING, .value.str = "a-b-c-d"}}}, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ s | replace:-:+ }}", &ctx, &out, &err));
+    TEST_ASSERT_STR("a+b+c+d", out.data);
+    free(out.data);
+}
+
+/* ================================================================
+  15. Template cache
+   ================================================================ */
+
+static void write_file(const char* path, const char* content) {
+    FILE* fp = fopen(path, "w");
+    if (fp) {
+        fputs(content, fp);
+        fclose(fp);
+    }
+}
+
+static void test_cache_hit_returns_same_template(void) {
+    const char* path = "/tmp/breeze_cache_a.html";
+    write_file(path, "A {{ x }}");
+    BreezeTemplateCache* cache = breeze_cache_new(NULL);
+    TEST_ASSERT(cache != NULL);
+    TemplateError err = {0};
+    BreezeTemplate* t1 = breeze_cache_acquire(cache, path, &err);
+    BreezeTemplate* t2 = breeze_cache_acquire(cache, path, &err);
+    TEST_ASSERT(t1 != NULL && t1 == t2);
+    breeze_cache_release(cache, t1);
+    breeze_cache_release(cache, t2);
+    breeze_cache_free(cache);
+}
+
+static void test_cache_mtime_reload(void) {
+    const char* path = "/tmp/breeze_cache_b.html";
+    write_file(path, "v1 {{ x }}");
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"x", {.type = TMPL_INT, .value.integer = 1}}}, .count = 1};
+    BreezeCacheOptions opts = {.check_mtime = true};
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    TemplateError err = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_cache_render(cache, path, &ctx, &out, &err));
+    TEST_ASSERT_STR("v1 1", out.data);
+
+    /* A template still held by a caller survives the reload. */
+    BreezeTemplate* held = breeze_cache_acquire(cache, path, &err);
+    TEST_ASSERT(held != NULL);
+    write_file(path, "version2 {{ x }}");
+    out.size = 0;
+    TEST_ASSERT(breeze_cache_render(cache, path, &ctx, &out, &err));
+    TEST_ASSERT_STR("version2 1", out.data);
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(held, &ctx, &out, &err));
+    TEST_ASSERT_STR("v1 1", out.data);
+    breeze_cache_release(cache, held);
+
+    free(out.data);
+    breeze_cache_free(cache);
+}
+
+static void test_cache_production_mode_never_reloads(void) {
+    const char* path = "/tmp/breeze_cache_c.html";
+    write_file(path, "old");
+    BreezeTemplateCache* cache = breeze_cache_new(NULL);
+    TemplateContext ctx = {.vars = NULL, .count = 0};
+    TemplateError err = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_cache_render(cache, path, &ctx, &out, &err));
+    write_file(path, "new content");
+    out.size = 0;
+    TEST_ASSERT(breeze_cache_render(cache, path, &ctx, &out, &err));
+    TEST_ASSERT_STR("old", out.data);
+
+    breeze_cache_invalidate(cache, path);
+    out.size = 0;
+    TEST_ASSERT(breeze_cache_render(cache, path, &ctx, &out, &err));
+    TEST_ASSERT_STR("new content", out.data);
+    free(out.data);
+    breeze_cache_free(cache);
+}
+
+static void test_cache_lru_eviction(void) {
+    const char* paths[] = {"/tmp/breeze_cache_d0.html", "/tmp/breeze_cache_d1.html", "/tmp/breeze_cache_d2.html"};
+    for (int i = 0; i < 3; i++) write_file(paths[i], "{% for i in l %}{{ i }}{% endfor %} some text");
+    BreezeCacheOptions opts = {.max_bytes = 1}; /* every insert evicts all older entries */
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    TemplateError err = {0};
+    BreezeTemplate* first = breeze_cache_acquire(cache, paths[0], &err);
+    TEST_ASSERT(first != NULL);
+    breeze_cache_release(cache, first);
+    for (int i = 1; i < 3; i++) {
+        BreezeTemplate* t = breeze_cache_acquire(cache, paths[i], &err);
+        TEST_ASSERT(t != NULL);
+        breeze_cache_release(cache, t);
+    }
+    /* paths[0] was evicted, so this is a recompile (the old one was freed) */
+    BreezeTemplate* again = breeze_cache_acquire(cache, paths[0], &err);
+    TEST_ASSERT(again != NULL);
+    breeze_cache_release(cache, again);
+    breeze_cache_free(cache);
+}
+
+static void test_cache_missing_file(void) {
+    BreezeCacheOptions opts = {.check_mtime = true};
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    TemplateError err = {0};
+    TEST_ASSERT(breeze_cache_acquire(cache, "/tmp/no_such_breeze_cache.html", &err) == NULL);
+    TEST_ASSERT_ERR(TMPL_ERR_IO, err);
+    breeze_cache_free(cache);
+}
+
+typedef struct {
+    BreezeTemplateCache* cache;
+    const char* path;
+    int failures;
+} CacheThreadArg;
+
+static void* cache_thread(void* p) {
+    CacheThreadArg* a = p;
+    const char* items[] = {"a", "b"};
+    TemplateValue arr = {.type = TMPL_ARRAY, .value.array = {.items = items, .count = 2, .item_type = TMPL_STRING}};
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"l", arr}}, .count = 1};
+    OutputBuffer out = new_buf();
+    for (int i = 0; i < 500; i++) {
+        TemplateError err = {0};
+        out.size = 0;
+        if (!breeze_cache_render(a->cache, a->path, &ctx, &out, &err) || strcmp(out.data, "ab") != 0) a->failures++;
+    }
+    free(out.data);
+    return NULL;
+}
+
+static void test_cache_concurrent_lookups(void) {
+    const char* path = "/tmp/breeze_cache_e.html";
+    write_file(path, "{% for i in l %}{{ i }}{% endfor %}");
+    BreezeCacheOptions opts = {.check_mtime = true};
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    pthread_t threads[8];
+    CacheThreadArg args[8];
+    for (int i = 0; i < 8; i++) {
+        args[i] = (CacheThreadArg){.cache = cache, .path = path};
+        TEST_ASSERT(pthread_create(&threads[i], NULL, cache_thread, &args[i]) == 0);
+    }
+    int failures = 0;
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
+    }
+    TEST_ASSERT(failures == 0);
+    breeze_cache_free(cache);
+}
+
+/* ================================================================
+  16. Streaming output
+   ================================================================ */
+
+typedef struct {
+    OutputBuffer buf;
+    int calls;
+    int fail_after; /* fail on this call; 0 = never */
+} SinkState;
+
+static bool counting_sink(void* userdata, const BreezeSlice* slices, size_t count) {
+    SinkState* st = userdata;
+    if (++st->calls == st->fail_after) return false;
+    BreezeWriter inner = breeze_writer_buffer(&st->buf);
+    return inner.write(inner.userdata, slices, count);
+}
+
+/* Template whose output is several times larger than the writer chunk. */
+static const char* g_big_tpl = "{% for w in words %}<li>{{ loop.index }}: {{ w | upper }}</li>\n{% endfor %}";
+
+static TemplateContext big_context(const char** words, size_t n) {
+    static TemplateVar vars[1];
+    vars[0] = (TemplateVar){"words", {.type = TMPL_ARRAY, .value.array = {words, n, TMPL_STRING}}};
+    return (TemplateContext){.vars = vars, .count = 1};
+}
+
+static void test_stream_matches_buffer(void) {
+    const char* words[2000];
+    for (size_t i = 0; i < 2000; i++) words[i] = "streamed";
+    TemplateContext ctx = big_context(words, 2000);
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(g_big_tpl, &err);
+    TEST_ASSERT(tpl != NULL);
+
+    OutputBuffer expected = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &expected, &err));
+
+    SinkState st = {.buf = new_buf()};
+    BreezeWriter w = {.write = counting_sink, .userdata = &st};
+    TEST_ASSERT(breeze_render_to_writer(tpl, &ctx, &w, &err));
+    TEST_ASSERT(st.calls > 1);
+    TEST_ASSERT(st.buf.size == expected.size);
+    TEST_ASSERT_STR(expected.data, st.buf.data);
+
+    free(expected.data);
+    free(st.buf.data);
+    breeze_template_free(tpl);
+}
+
+static void test_stream_large_text_passthrough(void) {
+    size_t n = 20000;
+    char* src = malloc(n + 16);
+    TEST_ASSERT(src != NULL);
+    memset(src, 'x', n);
+    strcpy(src + n, "{{ v }}");
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"v", {.type = TMPL_INT, .value.integer = 7}}}, .count = 1};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(src, &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer out = new_buf();
+    BreezeWriter w = breeze_writer_buffer(&out);
+    TEST_ASSERT(breeze_render_to_writer(tpl, &ctx, &w, &err));
+    TEST_ASSERT(out.size == n + 1);
+    TEST_ASSERT(out.data[n - 1] == 'x' && out.data[n] == '7');
+    free(out.data);
+    free(src);
+    breeze_template_free(tpl);
+}
+
+static void test_stream_write_failure(void) {
+    const char* words[2000];
+    for (size_t i = 0; i < 2000; i++) words[i] = "w";
+    TemplateContext ctx = big_context(words, 2000);
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(g_big_tpl, &err);
+    TEST_ASSERT(tpl != NULL);
+    SinkState st = {.buf = new_buf(), .fail_after = 1};
+    BreezeWriter w = {.write = counting_sink, .userdata = &st};
+    TEST_ASSERT(!breeze_render_to_writer(tpl, &ctx, &w, &err));
+    TEST_ASSERT(err.type == TMPL_ERR_IO);
+    TEST_ASSERT(st.calls == 1);
+    free(st.buf.data);
+    breeze_template_free(tpl);
+}
+
+static void test_stream_file_writer(void) {
+    FILE* fp = tmpfile();
+    TEST_ASSERT(fp != NULL);
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"name", {.type = TMPL_STRING, .value.str = "file"}}}, .count = 1};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("Hello {{ name | upper }}!", &err);
+    TEST_ASSERT(tpl != NULL);
+    BreezeWriter w = breeze_writer_file(fp);
+    TEST_ASSERT(breeze_render_to_writer(tpl, &ctx, &w, &err));
+    rewind(fp);
+    char line[64] = {0};
+    TEST_ASSERT(fgets(line, sizeof(line), fp) != NULL);
+    TEST_ASSERT_STR("Hello FILE!", line);
+    fclose(fp);
+    breeze_template_free(tpl);
+}
+
+static void test_stream_fd_writer(void) {
+    const char* words[2000];
+    for (size_t i = 0; i < 2000; i++) words[i] = "fd";
+    TemplateContext ctx = big_context(words, 2000);
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(g_big_tpl, &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer expected = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &expected, &err));
+
+    FILE* fp = tmpfile();
+    TEST_ASSERT(fp != NULL);
+    BreezeWriter w = breeze_writer_fd(fileno(fp));
+    TEST_ASSERT(breeze_render_to_writer(tpl, &ctx, &w, &err));
+    TEST_ASSERT(lseek(fileno(fp), 0, SEEK_SET) == 0);
+    char* got = malloc(expected.size + 1);
+    TEST_ASSERT(got != NULL);
+    TEST_ASSERT(read(fileno(fp), got, expected.size + 1) == (ssize_t)expected.size);
+    got[expected.size] = '\0';
+    TEST_ASSERT_STR(expected.data, got);
+
+    free(got);
+    fclose(fp);
+    free(expected.data);
+    breeze_template_free(tpl);
+}
+
+/* ================================================================
+  17. Context lookup
+   ================================================================ */
+
+static void test_index_dynamic_context_many_keys(void) {
+    TemplateContext* ctx = context_new(2);
+    TEST_ASSERT(ctx != NULL && ctx->index != NULL);
+    static char keys[200][8];
+    for (int i = 0; i < 200; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "k%d", i);
+        TEST_ASSERT(context_set(ctx, keys[i], (TemplateValue){.type = TMPL_INT, .value.integer = i}));
+    }
+    TEST_ASSERT(context_set(ctx, "k42", (TemplateValue){.type = TMPL_INT, .value.integer = -1}));
+    TEST_ASSERT(ctx->count == 200);
+    TemplateError err = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(render_template("{{ k0 }} {{ k42 }} {{ k199 }}", ctx, &out, &err));
+    TEST_ASSERT_STR("0 -1 199", out.data);
+    free(out.data);
+    context_free(ctx);
+}
+
+static void test_index_static_context(void) {
+    TemplateVar vars[] = {
+        {"a", {.type = TMPL_STRING, .value.str = "first"}},
+        {"b", {.type = TMPL_INT, .value.integer = 2}},
+        {"a", {.type = TMPL_STRING, .value.str = "shadowed"}},
+    };
+    TemplateContext ctx = {.vars = vars, .count = 3};
+    TEST_ASSERT(context_build_index(&ctx));
+    TemplateError err = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(render_template("{{ a }}-{{ b }}", &ctx, &out, &err));
+    TEST_ASSERT_STR("first-2", out.data);
+    out.size = 0;
+    TEST_ASSERT(!render_template("{{ missing }}", &ctx, &out, &err));
+    TEST_ASSERT(err.type == TMPL_ERR_RENDER);
+    free(out.data);
+    context_free_index(&ctx);
+    TEST_ASSERT(ctx.index == NULL);
+}
+
+static void test_schema_slot_lookup(void) {
+    static const char* const keys[] = {"title", "items", "show"};
+    BreezeSchema schema = {keys, 3};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile_schema(
+        "{{ title }}:{% for i in items %}{% if show %}{{ i }}{% endif %}{% endfor %}{{ extra }}", &schema, &err);
+    TEST_ASSERT(tpl != NULL);
+
+    const char* items[] = {"x", "y"};
+    TemplateVar vars[] = {
+        {"title", {.type = TMPL_STRING, .value.str = "T"}},
+        {"items", {.type = TMPL_ARRAY, .value.array = {items, 2, TMPL_STRING}}},
+        {"show", {.type = TMPL_BOOL, .value.boolean = true}},
+        {"extra", {.type = TMPL_STRING, .value.str = "!"}},
+    };
+    TemplateContext ctx = {.vars = vars, .count = 4};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("T:xy!", out.data);
+
+    /* A context in a different order still renders correctly. */
+    TemplateVar reordered[] = {vars[3], vars[2], vars[1], vars[0]};
+    TemplateContext ctx2 = {.vars = reordered, .count = 4};
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx2, &out, &err));
+    TEST_ASSERT_STR("T:xy!", out.data);
+
+    free(out.data);
+    breeze_template_free(tpl);
+}
+
+/* ================================================================
+  18. Engines
+   ================================================================ */
+
+static bool star_filter(const TemplateValue* val, const char* arg, OutputBuffer* out) {
+    (void)arg;
+    const char* s = val->type == TMPL_STRING && val->value.str ? val->value.str : "";
+    size_t len = strlen(s);
+    size_t need = out->size + len + 3;
+    if (need > out->capacity) {
+        char* data = realloc(out->data, need);
+        if (!data) return false;
+        out->data = data;
+        out->capacity = need;
+    }
+    out->data[out->size++] = '*';
+    memcpy(out->data + out->size, s, len);
+    out->size += len;
+    out->data[out->size++] = '*';
+    out->data[out->size] = '\0';
+    return true;
+}
+
+static bool render_with_engine(BreezeEngine* engine, const char* src, OutputBuffer* out, TemplateError* err) {
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"s", {.type = TMPL_STRING, .value.str = "go"}}}, .count = 1};
+    BreezeTemplate* tpl = breeze_engine_compile(engine, src, NULL, err);
+    if (!tpl) return false;
+    out->size = 0;
+    bool ok = breeze_render_compiled(tpl, &ctx, out, err);
+    breeze_template_free(tpl);
+    return ok;
+}
+
+static void test_engine_filters_are_isolated(void) {
+    BreezeEngine* a = breeze_engine_new();
+    BreezeEngine* b = breeze_engine_new();
+    TEST_ASSERT(a && b);
+    TEST_ASSERT(breeze_engine_register_filter(a, "star", star_filter));
+    TemplateError err = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(render_with_engine(a, "{{ s | star | upper }}", &out, &err));
+    TEST_ASSERT_STR("*GO*", out.data);
+    TEST_ASSERT(!render_with_engine(b, "{{ s | star }}", &out, &err));
+    TEST_ASSERT(err.type == TMPL_ERR_RENDER);
+    TEST_ASSERT(breeze_engine_find_filter(breeze_default_engine(), "star") == NULL);
+    free(out.data);
+    breeze_engine_free(a);
+    breeze_engine_free(b);
+}
+
+static void test_engine_binds_at_compile_time(void) {
+    BreezeEngine* e = breeze_engine_new();
+    TEST_ASSERT(e != NULL);
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"s", {.type = TMPL_STRING, .value.str = "go"}}}, .count = 1};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(e, "{{ s | upper }}", NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    TEST_ASSERT(breeze_engine_register_filter(e, "upper", star_filter));
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("GO", out.data);
+    breeze_template_free(tpl);
+    TEST_ASSERT(render_with_engine(e, "{{ s | upper }}", &out, &err));
+    TEST_ASSERT_STR("*go*", out.data);
+
+    /* Clearing restores the built-in. */
+    TEST_ASSERT(breeze_engine_clear_filters(e));
+    TEST_ASSERT(render_with_engine(e, "{{ s | upper }}", &out, &err));
+    TEST_ASSERT_STR("GO", out.data);
+    free(out.data);
+    breeze_engine_free(e);
+}
+
+static void test_engine_many_filters(void) {
+    BreezeEngine* e = breeze_engine_new();
+    TEST_ASSERT(e != NULL);
+    static char names[300][16];
+    for (int i = 0; i < 300; i++) {
+        snprintf(names[i], sizeof(names[i]), "f%d", i);
+        TEST_ASSERT(breeze_engine_register_filter(e, names[i], star_filter));
+    }
+    for (int i = 0; i < 300; i++) TEST_ASSERT(breeze_engine_find_filter(e, names[i]) == star_filter);
+    TemplateError err = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(render_with_engine(e, "{{ s | f0 | f299 }}", &out, &err));
+    TEST_ASSERT_STR("**go**", out.data);
+    free(out.data);
+    breeze_engine_free(e);
+}
+
+typedef struct {
+    BreezeEngine* engine;
+    int id;
+    int failures;
+} EngineThreadArg;
+
+static void* engine_thread(void* p) {
+    EngineThreadArg* a = p;
+    char name[32];
+    OutputBuffer out = new_buf();
+    for (int i = 0; i < 200; i++) {
+        snprintf(name, sizeof(name), "t%d_%d", a->id, i);
+        if (!breeze_engine_register_filter(a->engine, name, star_filter)) a->failures++;
+        TemplateError err = {0};
+        if (!render_with_engine(a->engine, "{{ s | upper }}", &out, &err) || strcmp(out.data, "GO") != 0)
+            a->failures++;
+    }
+    free(out.data);
+    return NULL;
+}
+
+static void test_engine_concurrent_register_and_compile(void) {
+    BreezeEngine* e = breeze_engine_new();
+    TEST_ASSERT(e != NULL);
+    pthread_t threads[4];
+    EngineThreadArg args[4];
+    for (int i = 0; i < 4; i++) {
+        args[i] = (EngineThreadArg){.engine = e, .id = i};
+        TEST_ASSERT(pthread_create(&threads[i], NULL, engine_thread, &args[i]) == 0);
+    }
+    int failures = 0;
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
+    }
+    TEST_ASSERT(failures == 0);
+    TEST_ASSERT(breeze_engine_find_filter(e, "t3_199") == star_filter);
+    breeze_engine_free(e);
+}
+
+/* ================================================================
+  19. Typed filter chains
+   ================================================================ */
+
+/* first  –  first element of an array, keeping its type */
+static bool first_filter(const TemplateValue* val, const char* arg, TemplateValue* result, OutputBuffer* scratch) {
+    (void)arg;
+    (void)scratch;
+    return val->type == TMPL_ARRAY && breeze_array_get(val, 0, result);
+}
+
+/* double  –  numeric filter that fails on anything that is not an int */
+static bool double_filter(const TemplateValue* val, const char* arg, TemplateValue* result, OutputBuffer* scratch) {
+    (void)arg;
+    (void)scratch;
+    if (val->type == TMPL_INT) {
+        *result = (TemplateValue){.type = TMPL_INT, .value.integer = val->value.integer * 2};
+        return true;
+    }
+    if (val->type == TMPL_LONG) {
+        *result = (TemplateValue){.type = TMPL_LONG, .value.long_int = val->value.long_int * 2};
+        return true;
+    }
+    return false;
+}
+
+static void test_chain_array_stays_typed(void) {
+    const char* items[] = {"a", "b", "c"};
+    TemplateContext ctx = {
+        .vars = (TemplateVar[]){{"items", {.type = TMPL_ARRAY, .value.array = {items, 3, TMPL_STRING}}}}, .count = 1};
+    TEST_ASSERT(breeze_register_value_filter("first", first_filter));
+    TEST_ASSERT(breeze_register_value_filter("double", double_filter));
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ items | reverse | len }} {{ items | reverse | first }} {{ items | len | double }}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("3 c 6", out.data);
+    free(out.data);
+}
+
+static void test_chain_numbers_stay_typed(void) {
+    int a = 21, b = 4;
+    const int* nums[] = {&a, &b};
+    TemplateContext ctx = {
+        .vars = (TemplateVar[]){{"nums", {.type = TMPL_ARRAY, .value.array = {nums, 2, TMPL_INT}}}}, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ nums | reverse | reverse | first | double }}", &ctx, &out, &err));
+    TEST_ASSERT_STR("42", out.data);
+    free(out.data);
+}
+
+static void test_chain_passthrough_between_buffers(void) {
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"s", {.type = TMPL_STRING, .value.str = " MiXed "}}}, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    /* default hands upper's output through unchanged; lower must not overwrite it */
+    TEST_ASSERT(render_template("[{{ s | trim | upper | default:x | lower | capitalize | reverse }}]", &ctx, &out,
+                                &err));
+    TEST_ASSERT_STR("[dexiM]", out.data);
+    free(out.data);
+}
+
+static void test_chain_many_rows(void) {
+    const char* names[1000];
+    for (int i = 0; i < 1000; i++) names[i] = "  a rather long name  ";
+    TemplateContext ctx = {
+        .vars = (TemplateVar[]){{"names", {.type = TMPL_ARRAY, .value.array = {names, 1000, TMPL_STRING}}}},
+        .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{% for n in names %}{{ n | trim | upper | truncate:8 }};{% endfor %}", &ctx, &out,
+                                &err));
+    TEST_ASSERT(out.size == 1000 * strlen("A RATHER...;"));
+    TEST_ASSERT(strncmp(out.data, "A RATHER...;A RATHER...;", 24) == 0);
+    free(out.data);
+}
+
+static void test_chain_value_filter_failure(void) {
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"s", {.type = TMPL_STRING, .value.str = "x"}}}, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(!render_template("{{ s | double }}", &ctx, &out, &err));
+    TEST_ASSERT(err.type == TMPL_ERR_RENDER);
+    free(out.data);
+}
+
+/* ================================================================
+  20. Render state
+   ================================================================ */
+
+static void test_state_reuse_across_templates(void) {
+    BreezeRenderState* state = breeze_render_state_new();
+    TEST_ASSERT(state != NULL);
+    const char* items[] = {"x", "y"};
+    TemplateContext ctx = {.vars =
+                               (TemplateVar[]){
+                                   {"items", {.type = TMPL_ARRAY, .value.array = {items, 2, TMPL_STRING}}},
+                                   {"v", {.type = TMPL_INT, .value.integer = 3}},
+                               },
+                           .count = 2};
+    TemplateError err = {0};
+    BreezeTemplate* a = breeze_compile("{% for i in items %}{% for j in items %}{{ i }}{{ j }}{% endfor %}{% endfor %}",
+                                       &err);
+    BreezeTemplate* b = breeze_compile("{% set w = hi %}{% if v and not items or v %}{{ w | upper }}{% endif %}",
+                                       &err);
+    TEST_ASSERT(a && b);
+    OutputBuffer out = new_buf();
+    for (int round = 0; round < 3; round++) {
+        out.size = 0;
+        TEST_ASSERT(breeze_state_render(state, a, &ctx, &out, &err));
+        TEST_ASSERT_STR("xxxyyxyy", out.data);
+        out.size = 0;
+        TEST_ASSERT(breeze_state_render(state, b, &ctx, &out, &err));
+        TEST_ASSERT_STR("HI", out.data);
+    }
+    free(out.data);
+    breeze_template_free(a);
+    breeze_template_free(b);
+    breeze_render_state_free(state);
+}
+
+static void test_state_set_vars_reset_between_renders(void) {
+    BreezeRenderState* state = breeze_render_state_new();
+    TEST_ASSERT(state != NULL);
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"flag", {.type = TMPL_BOOL, .value.boolean = true}},
+                                                   {"name", {.type = TMPL_STRING, .value.str = "ctx"}}},
+                           .count = 2};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("{{ name }}{% if flag %}{% set name = set %}{% endif %}{{ name }}", &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_state_render(state, tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("ctxset", out.data);
+    ctx.vars[0].value.value.boolean = false;
+    out.size = 0;
+    TEST_ASSERT(breeze_state_render(state, tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("ctxctx", out.data);
+    free(out.data);
+    breeze_template_free(tpl);
+    breeze_render_state_free(state);
+}
+
+static void test_state_grows_for_large_templates(void) {
+    /* Enough distinct names to outgrow the arena's first block. */
+    char src[8192];
+    size_t len = 0;
+    TemplateVar vars[300];
+    static char keys[300][8];
+    for (int i = 0; i < 300; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "n%d", i);
+        vars[i] = (TemplateVar){keys[i], {.type = TMPL_INT, .value.integer = i}};
+        len += (size_t)snprintf(src + len, sizeof(src) - len, "{{ %s }}", keys[i]);
+    }
+    TemplateContext ctx = {.vars = vars, .count = 300};
+    TemplateError err = {0};
+    BreezeTemplate* small = breeze_compile("{{ n1 }}", &err);
+    BreezeTemplate* big = breeze_compile(src, &err);
+    TEST_ASSERT(small && big);
+    BreezeRenderState* state = breeze_render_state_new();
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_state_render(state, small, &ctx, &out, &err));
+    for (int round = 0; round < 2; round++) {
+        out.size = 0;
+        TEST_ASSERT(breeze_state_render(state, big, &ctx, &out, &err));
+        TEST_ASSERT(strncmp(out.data, "012345", 6) == 0);
+        TEST_ASSERT(strcmp(out.data + out.size - 6, "298299") == 0);
+    }
+    free(out.data);
+    breeze_template_free(small);
+    breeze_template_free(big);
+    breeze_render_state_free(state);
+}
+
+static void test_state_render_to_writer(void) {
+    const char* words[2000];
+    for (size_t i = 0; i < 2000; i++) words[i] = "state";
+    TemplateContext ctx = big_context(words, 2000);
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(g_big_tpl, &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer expected = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &expected, &err));
+
+    BreezeRenderState* state = breeze_render_state_new();
+    for (int round = 0; round < 2; round++) {
+        OutputBuffer got = new_buf();
+        BreezeWriter w = breeze_writer_buffer(&got);
+        TEST_ASSERT(breeze_state_render_to_writer(state, tpl, &ctx, &w, &err));
+        TEST_ASSERT_STR(expected.data, got.data);
+        free(got.data);
+    }
+    free(expected.data);
+    breeze_template_free(tpl);
+    breeze_render_state_free(state);
+}
+
+/* ================================================================
+  21. Number formatting
+   ================================================================ */
+
+static void test_num_integer_extremes(void) {
+    TemplateContext ctx = {.vars =
+                               (TemplateVar[]){
+                                   {"imin", {.type = TMPL_INT, .value.integer = INT_MIN}},
+                                   {"imax", {.type = TMPL_INT, .value.integer = INT_MAX}},
+                                   {"lmin", {.type = TMPL_LONG, .value.long_int = LONG_MIN}},
+                                   {"umax", {.type = TMPL_UINT, .value.uint = UINT_MAX}},
+                                   {"zero", {.type = TMPL_INT, .value.integer = 0}},
+                               },
+                           .count = 5};
+    char expected[256];
+    snprintf(expected, sizeof(expected), "%d %d %ld %u 0", INT_MIN, INT_MAX, LONG_MIN, UINT_MAX);
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ imin }} {{ imax }} {{ lmin }} {{ umax }} {{ zero }}", &ctx, &out, &err));
+    TEST_ASSERT_STR(expected, out.data);
+    free(out.data);
+}
+
+static void test_num_doubles_match_printf(void) {
+    static const double values[] = {0.0,     -0.0,  0.00005, 0.00015,   -0.00005, 2.675, 1.0 / 3, 123456.78905,
+                                    9.99995, 1e-12, 1e14,    -1234.5678, 1e300,   0.1,   0.3};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        TemplateContext ctx = {.vars = (TemplateVar[]){{"d", {.type = TMPL_DOUBLE, .value.dbl = values[i]}}},
+                               .count = 1};
+        char expected[128];
+        snprintf(expected, sizeof(expected), "%.4f", values[i]);
+        OutputBuffer out = new_buf();
+        TemplateError err = {0};
+        TEST_ASSERT(render_template("{{ d }}", &ctx, &out, &err));
+        TEST_ASSERT_STR(expected, out.data);
+        free(out.data);
+    }
+}
+
+static void test_num_round_filter(void) {
+    TemplateContext ctx = {.vars =
+                               (TemplateVar[]){
+                                   {"pi", {.type = TMPL_DOUBLE, .value.dbl = 3.14159265}},
+                                   {"f", {.type = TMPL_FLOAT, .value.floating = 2.5f}},
+                                   {"n", {.type = TMPL_INT, .value.integer = 7}},
+                                   {"s", {.type = TMPL_STRING, .value.str = "1.005e1"}},
+                                   {"t", {.type = TMPL_STRING, .value.str = "n/a"}},
+                               },
+                           .count = 5};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ pi | round:2 }} {{ pi | round }} {{ f | round:1 }} {{ n | round:2 }} "
+                                "{{ s | round:1 }} {{ t | round:2 }} {{ pi | round:12 }}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("3.14 3 2.5 7.00 10.1 n/a 3.141592650000", out.data);
+    free(out.data);
+}
+
+static void test_num_round_in_chain(void) {
+    int a = 1, b = 2, c = 3;
+    const int* nums[] = {&a, &b, &c};
+    TemplateContext ctx = {
+        .vars = (TemplateVar[]){{"nums", {.type = TMPL_ARRAY, .value.array = {nums, 3, TMPL_INT}}}}, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ nums | len | round:1 }}", &ctx, &out, &err));
+    TEST_ASSERT_STR("3.0", out.data);
+    free(out.data);
+}
+
+/* ================================================================
+  22. HTML escaping
+   ================================================================ */
+
+static void test_escape_filter_entities(void) {
+    TemplateContext ctx = {
+        .vars = (TemplateVar[]){{"s", {.type = TMPL_STRING, .value.str = "<a href=\"x\">Tom & Jerry's</a>"}}},
+        .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ s | escape }}", &ctx, &out, &err));
+    TEST_ASSERT_STR("&lt;a href=&quot;x&quot;&gt;Tom &amp; Jerry&#39;s&lt;/a&gt;", out.data);
+    free(out.data);
+}
+
+static void test_escape_every_offset(void) {
+    /* One special byte at each position of a long clean run covers the
+     * vector, word and byte-at-a-time paths. */
+    char src[48], expected[64];
+    for (size_t pos = 0; pos < sizeof(src) - 1; pos++) {
+        memset(src, 'a', sizeof(src) - 1);
+        src[sizeof(src) - 1] = '\0';
+        src[pos] = '<';
+        snprintf(expected, sizeof(expected), "%.*s&lt;%s", (int)pos, src, src + pos + 1);
+        TemplateContext ctx = {.vars = (TemplateVar[]){{"s", {.type = TMPL_STRING, .value.str = src}}}, .count = 1};
+        OutputBuffer out = new_buf();
+        TemplateError err = {0};
+        TEST_ASSERT(render_template("{{ s | escape }}", &ctx, &out, &err));
+        TEST_ASSERT_STR(expected, out.data);
+        free(out.data);
+    }
+}
+
+static void test_autoescape_engine(void) {
+    BreezeEngine* e = breeze_engine_new();
+    TEST_ASSERT(e != NULL);
+    breeze_engine_set_autoescape(e, true);
+    const char* items[] = {"<b>", "a&b"};
+    TemplateContext ctx = {.vars =
+                               (TemplateVar[]){
+                                   {"s", {.type = TMPL_STRING, .value.str = "<i>hi</i>"}},
+                                   {"n", {.type = TMPL_INT, .value.integer = -5}},
+                                   {"items", {.type = TMPL_ARRAY, .value.array = {items, 2, TMPL_STRING}}},
+                               },
+                           .count = 3};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(e,
+                                                "{{ s }}|{{ s | safe }}|{{ s | escape }}|{{ s | upper }}|{{ n }}|"
+                                                "{% for i in items %}{{ i }};{% endfor %}<p>literal</p>",
+                                                NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("&lt;i&gt;hi&lt;/i&gt;|<i>hi</i>|&lt;i&gt;hi&lt;/i&gt;|&lt;I&gt;HI&lt;/I&gt;|-5|&lt;b&gt;;a&amp;b;"
+                    "<p>literal</p>",
+                    out.data);
+    free(out.data);
+    breeze_template_free(tpl);
+    breeze_engine_free(e);
+}
+
+static void test_autoescape_off_by_default(void) {
+    TemplateContext ctx = {.vars = (TemplateVar[]){{"s", {.type = TMPL_STRING, .value.str = "<b>"}}}, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ s }}{{ s | safe }}", &ctx, &out, &err));
+    TEST_ASSERT_STR("<b><b>", out.data);
+    free(out.data);
+}
+
+/* ================================================================
+  23. Array layouts
+   ================================================================ */
+
+static void test_array_contiguous_values(void) {
+    int ints[] = {1, 2, 3};
+    double dbls[] = {0.5, 1.25};
+    const char* strs[] = {"a", "b"};
+    bool flags[] = {true, false};
+    TemplateVar vars[] = {
+        VAR_ARRAY_INT("ints", ints),
+        VAR_ARRAY_DOUBLE("dbls", dbls),
+        VAR_ARRAY_OF("strs", strs, TMPL_STRING),
+        VAR_ARRAY_BOOL("flags", flags),
+    };
+    TemplateContext ctx = {.vars = vars, .count = 4};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{% for i in ints %}{{ i }}{% if not loop.last %},{% endif %}{% endfor %} "
+                                "{% for d in dbls %}{{ d | round:2 }};{% endfor %} "
+                                "{% for s in strs %}{{ s }}{% endfor %} "
+                                "{% for f in flags %}{% if f %}T{% else %}F{% endif %}{% endfor %}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("1,2,3 0.50;1.25; ab TF", out.data);
+    free(out.data);
+}
+
+typedef struct {
+    int id;
+    const char* name;
+    double price;
+    char pad[3];
+} Row;
+
+static void test_array_struct_fields(void) {
+    Row rows[] = {{1, "apple", 0.5, ""}, {2, "pear", 1.75, ""}, {3, "fig", 3.0, ""}};
+    TemplateVar vars[] = {
+        VAR_ARRAY_FIELD("ids", rows, 3, id, TMPL_INT),
+        VAR_ARRAY_FIELD("names", rows, 3, name, TMPL_STRING),
+        VAR_ARRAY_FIELD("prices", rows, 3, price, TMPL_DOUBLE),
+    };
+    TemplateContext ctx = {.vars = vars, .count = 3};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{% for n in names %}{{ loop.index1 }}.{{ n }} {% endfor %}"
+                                "{% for p in prices %}{{ p | round:2 }} {% endfor %}"
+                                "{{ ids | len }} {{ names | reverse | first }} {{ prices | first | round:1 }}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("1.apple 2.pear 3.fig 0.50 1.75 3.00 3 fig 0.5", out.data);
+    free(out.data);
+}
+
+static void test_array_reverse_strided_numbers(void) {
+    Row rows[] = {{10, "a", 0, ""}, {20, "b", 0, ""}, {30, "c", 0, ""}};
+    TemplateVar vars[] = {VAR_ARRAY_FIELD("ids", rows, 3, id, TMPL_INT)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ ids | reverse | first }} {{ ids | reverse | reverse | first }}", &ctx, &out, &err));
+    TEST_ASSERT_STR("30 10", out.data);
+    free(out.data);
+}
+
+static void test_array_get_bounds(void) {
+    int ints[] = {7, 8};
+    TemplateVar v = VAR_ARRAY_INT("ints", ints);
+    TemplateValue item;
+    TEST_ASSERT(breeze_array_get(&v.value, 1, &item));
+    TEST_ASSERT(item.type == TMPL_INT && item.value.integer == 8);
+    TEST_ASSERT(!breeze_array_get(&v.value, 2, &item));
+    TemplateValue not_array = {.type = TMPL_INT, .value.integer = 1};
+    TEST_ASSERT(!breeze_array_get(&not_array, 0, &item));
+}
+
+/* ================================================================
+  24. Records
+   ================================================================ */
+
+static const BreezeField row_fields[] = {
+    BREEZE_FIELD(Row, id, TMPL_INT),
+    BREEZE_FIELD(Row, name, TMPL_STRING),
+    BREEZE_FIELD(Row, price, TMPL_DOUBLE),
+};
+static const BreezeRecordType row_type = BREEZE_RECORD_TYPE(Row, row_fields);
+
+static void test_record_fields(void) {
+    Row row = {7, "kiwi", 2.5, ""};
+    TemplateVar vars[] = {VAR_RECORD("row", &row, &row_type)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ row.id }} {{ row.name | upper }} {{ row.price | round:2 }}"
+                                "{% if row.name %} big{% endif %}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("7 KIWI 2.50 big", out.data);
+    free(out.data);
+}
+
+static void test_record_array_loop(void) {
+    Row rows[] = {{1, "apple", 0.5, ""}, {2, "pear", 1.75, ""}, {3, "fig", 3.0, ""}};
+    TemplateVar vars[] = {VAR_ARRAY_RECORDS("rows", rows, 3, &row_type)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    BreezeTemplate* tpl =
+        breeze_compile("{% for r in rows %}{{ r.id }}:{{ r.name }}={{ r.price | round:1 }} {% endfor %}", &err);
+    TEST_ASSERT(tpl != NULL);
+    for (int i = 0; i < 2; i++) {
+        out.size = 0;
+        TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+        TEST_ASSERT_STR("1:apple=0.5 2:pear=1.8 3:fig=3.0 ", out.data);
+    }
+    breeze_template_free(tpl);
+    free(out.data);
+}
+
+static void test_record_unknown_field(void) {
+    Row row = {1, "a", 0, ""};
+    TemplateVar vars[] = {VAR_RECORD("row", &row, &row_type)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(!render_template("{{ row.nope }}", &ctx, &out, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_RENDER, err);
+    TEST_ASSERT(strstr(err.message, "row.nope") != NULL);
+    free(out.data);
+}
+
+static void test_record_dotted_keys_still_work(void) {
+    TemplateVar vars[] = {VAR_STRING("user.name", "ann")};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ user.name }}", &ctx, &out, &err));
+    TEST_ASSERT_STR("ann", out.data);
+    free(out.data);
+}
+
+/* ================================================================
+  25. Iterators
+   ================================================================ */
+
+typedef struct {
+    int next;
+    int end;
+    char text[16];
+} Cursor;
+
+static bool cursor_next(void* userdata, TemplateValue* item) {
+    Cursor* c = userdata;
+    if (c->next >= c->end) return false;
+    /* Reuse one buffer, as a database cursor would. */
+    snprintf(c->text, sizeof(c->text), "r%d", c->next++);
+    *item = (TemplateValue){.type = TMPL_STRING, .value.str = c->text};
+    return true;
+}
+
+static void test_iter_loop(void) {
+    Cursor cur = {0, 3, ""};
+    TemplateVar vars[] = {VAR_ITER("rows", cursor_next, &cur, BREEZE_COUNT_UNKNOWN)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{% for r in rows %}{% if loop.first %}[{% endif %}{{ loop.index }}={{ r | upper }} "
+                                "{% endfor %}]",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("[0=R0 1=R1 2=R2 ]", out.data);
+    TEST_ASSERT(cur.next == 3);
+    free(out.data);
+}
+
+static void test_iter_count_hint(void) {
+    Cursor cur = {0, 3, ""};
+    Cursor empty = {0, 0, ""};
+    TemplateVar vars[] = {
+        VAR_ITER("rows", cursor_next, &cur, 3),
+        VAR_ITER("none", cursor_next, &empty, 0),
+    };
+    TemplateContext ctx = {.vars = vars, .count = 2};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{{ rows | len }}:{% for r in rows %}{{ r }}{% if not loop.last %},{% endif %}"
+                                "{% endfor %}/{% for n in none %}x{% endfor %}{% if none %}y{% endif %}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("3:r0,r1,r2/", out.data);
+    free(out.data);
+}
+
+static void test_iter_needs_count_for_last(void) {
+    Cursor cur = {0, 3, ""};
+    TemplateVar vars[] = {VAR_ITER("rows", cursor_next, &cur, BREEZE_COUNT_UNKNOWN)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(!render_template("{% for r in rows %}{{ loop.length }}{% endfor %}", &ctx, &out, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_RENDER, err);
+    TEST_ASSERT(cur.next == 0);
+    free(out.data);
+}
+
+typedef struct {
+    size_t bytes;
+    size_t largest_call;
+} DiscardSink;
+
+static bool discard_sink(void* userdata, const BreezeSlice* slices, size_t count) {
+    DiscardSink* st = userdata;
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) n += slices[i].len;
+    st->bytes += n;
+    if (n > st->largest_call) st->largest_call = n;
+    return true;
+}
+
+static void test_iter_streams_many_rows(void) {
+    Cursor cur = {0, 200000, ""};
+    TemplateVar vars[] = {VAR_ITER("rows", cursor_next, &cur, BREEZE_COUNT_UNKNOWN)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("{% for r in rows %}<td>{{ r }}</td>\n{% endfor %}", &err);
+    TEST_ASSERT(tpl != NULL);
+    DiscardSink st = {0};
+    BreezeWriter w = {.write = discard_sink, .userdata = &st};
+    TEST_ASSERT(breeze_render_to_writer(tpl, &ctx, &w, &err));
+
+    size_t expected = 0;
+    for (int i = 0; i < 200000; i++) expected += (size_t)snprintf(NULL, 0, "<td>r%d</td>\n", i);
+    TEST_ASSERT(st.bytes == expected);
+    TEST_ASSERT(st.largest_call < 16384);
+    breeze_template_free(tpl);
+}
+
+/* ================================================================
+  26. Conditions
+   ================================================================ */
+
+static void test_cond_short_circuit_skips_missing(void) {
+    TemplateVar vars[] = {VAR_BOOL("yes", true), VAR_BOOL("no", false)};
+    TemplateContext ctx = {.vars = vars, .count = 2};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{% if yes or missing %}a{% endif %}{% if no and missing %}b{% else %}c{% endif %}"
+                                "{% if not (no and missing) %}d{% endif %}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("acd", out.data);
+    out.size = 0;
+    TEST_ASSERT(!render_template("{% if no or missing %}a{% endif %}", &ctx, &out, &err));
+    TEST_ASSERT(strstr(err.message, "missing") != NULL);
+    free(out.data);
+}
+
+static void test_cond_typed_comparisons(void) {
+    TemplateVar vars[] = {
+        VAR_INT("n", 5),
+        VAR_DOUBLE("price", 9.5),
+        VAR_UINT("big", 4000000000u),
+        VAR_STRING("role", "admin"),
+    };
+    TemplateContext ctx = {.vars = vars, .count = 4};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{% if n == 5 %}1{% endif %}{% if n != 5 %}x{% endif %}{% if n<6 %}2{% endif %}"
+                                "{% if n >= 5 and n <= 5 %}3{% endif %}{% if price > n %}4{% endif %}"
+                                "{% if big > n %}5{% endif %}{% if role == \"admin\" %}6{% endif %}"
+                                "{% if role == 'user' %}x{% endif %}{% if role < 'b' %}7{% endif %}"
+                                "{% if n == '5' %}8{% endif %}{% if n == role %}x{% endif %}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("12345678", out.data);
+    free(out.data);
+}
+
+static void test_cond_in_operator(void) {
+    int ids[] = {3, 7, 9};
+    const char* tags[] = {"c", "fast"};
+    TemplateVar vars[] = {
+        VAR_ARRAY_INT("ids", ids),
+        VAR_ARRAY_OF("tags", tags, TMPL_STRING),
+        VAR_STRING("title", "hello world"),
+        VAR_INT("id", 7),
+    };
+    TemplateContext ctx = {.vars = vars, .count = 4};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{% if id in ids %}1{% endif %}{% if 8 in ids %}x{% endif %}"
+                                "{% if 'fast' in tags %}2{% endif %}{% if 'slow' not in tags %}3{% endif %}"
+                                "{% if 'world' in title %}4{% endif %}"
+                                "{% for t in tags %}{% if t == 'c' or t in title %}[{{ t }}]{% endif %}{% endfor %}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("1234[c]", out.data);
+    free(out.data);
+}
+
+static void test_cond_set_and_loop_values(void) {
+    int nums[] = {1, 2, 3, 4};
+    TemplateVar vars[] = {VAR_ARRAY_INT("nums", nums)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template("{% set limit = 3 %}{% for x in nums %}"
+                                "{% if x < limit or loop.last %}{{ x }}{% endif %}"
+                                "{% if loop.index1 == loop.length %}!{% endif %}{% endfor %}",
+                                &ctx, &out, &err));
+    TEST_ASSERT_STR("124!", out.data);
+    free(out.data);
+}
+
+static void test_cond_errors(void) {
+    TemplateVar vars[] = {VAR_INT("n", 1), VAR_STRING("s", "x")};
+    TemplateContext ctx = {.vars = vars, .count = 2};
+    TemplateError err = {0};
+    const char* bad[] = {"{% if n == %}a{% endif %}", "{% if (n %}a{% endif %}", "{% if n) %}a{% endif %}",
+                         "{% if n = 1 %}a{% endif %}", "{% if 1 < n < 3 %}a{% endif %}", "{% if 's %}a{% endif %}"};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        err = (TemplateError){0};
+        BreezeTemplate* tpl = breeze_compile(bad[i], &err);
+        TEST_ASSERT(tpl == NULL);
+        TEST_ASSERT_ERR(TMPL_ERR_PARSE, err);
+    }
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(!render_template("{% if s < 2 %}a{% endif %}", &ctx, &out, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_RENDER, err);
+    TEST_ASSERT(!render_template("{% if 1 in n %}a{% endif %}", &ctx, &out, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_RENDER, err);
+    free(out.data);
+}
+
+/* ================================================================
+  27. Includes and inheritance
+   ================================================================ */
+
+static void test_include_shared_partial(void) {
+    write_file("/tmp/breeze_inc_header.html", "<h1>{{ site }}</h1>\n");
+    write_file("/tmp/breeze_inc_page1.html", "{% include \"breeze_inc_header.html\" %}one");
+    write_file("/tmp/breeze_inc_page2.html", "{% include 'breeze_inc_header.html' %}two {{ site | upper }}");
+    BreezeCacheOptions opts = {.root = "/tmp"};
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    TemplateVar vars[] = {VAR_STRING("site", "Breeze")};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    TemplateError err = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_cache_render(cache, "/tmp/breeze_inc_page1.html", &ctx, &out, &err));
+    TEST_ASSERT_STR("<h1>Breeze</h1>\none", out.data);
+    out.size = 0;
+    TEST_ASSERT(breeze_cache_render(cache, "/tmp/breeze_inc_page2.html", &ctx, &out, &err));
+    TEST_ASSERT_STR("<h1>Breeze</h1>\ntwo BREEZE", out.data);
+
+    /* Invalidating everything keeps the partial alive for the pages holding it. */
+    BreezeTemplate* page = breeze_cache_acquire(cache, "/tmp/breeze_inc_page1.html", &err);
+    TEST_ASSERT(page != NULL);
+    breeze_cache_invalidate(cache, NULL);
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(page, &ctx, &out, &err));
+    TEST_ASSERT_STR("<h1>Breeze</h1>\none", out.data);
+    breeze_cache_release(cache, page);
+    free(out.data);
+    breeze_cache_free(cache);
+}
+
+static void test_include_sees_loop_and_set(void) {
+    write_file("/tmp/breeze_inc_row.html", "<li>{{ sep }}{{ r.name }}={{ r.id }}{% if r.id == 2 %}*{% endif %}</li>");
+    write_file("/tmp/breeze_inc_list.html",
+               "{% set sep = - %}{% for r in rows %}{% include \"breeze_inc_row.html\" %}{% endfor %}");
+    Row rows[] = {{1, "apple", 0.5, ""}, {2, "pear", 1.75, ""}, {3, "fig", 3.0, ""}};
+    TemplateVar vars[] = {VAR_ARRAY_RECORDS("rows", rows, 3, &row_type)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    BreezeCacheOptions opts = {.root = "/tmp/"};
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    TemplateError err = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_cache_render(cache, "/tmp/breeze_inc_list.html", &ctx, &out, &err));
+    TEST_ASSERT_STR("<li>-apple=1</li><li>-pear=2*</li><li>-fig=3</li>", out.data);
+    free(out.data);
+    breeze_cache_free(cache);
+}
+
+static void test_extends_blocks(void) {
+    write_file("/tmp/breeze_ext_base.html", "<title>{% block title %}Site{% endblock %}</title>\n"
+                                            "{% block body %}\nempty\n{% endblock %}\n"
+                                            "<footer>{% block footer %}(c){% endblock %}</footer>");
+    write_file("/tmp/breeze_ext_mid.html", "{% extends \"breeze_ext_base.html\" %}\n"
+                                           "{% block title %}Docs{% endblock %}\n"
+                                           "{% block body %}\n<main>{% block content %}none{% endblock %}</main>\n"
+                                           "{% endblock %}\n");
+    write_file("/tmp/breeze_ext_page.html", "{% extends \"breeze_ext_mid.html\" %}\n"
+                                            "ignored text\n"
+                                            "{% block content %}Hello {{ name }}{% endblock %}\n");
+    BreezeCacheOptions opts = {.root = "/tmp"};
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    TemplateVar vars[] = {VAR_STRING("name", "Ann")};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    TemplateError err = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_cache_render(cache, "/tmp/breeze_ext_page.html", &ctx, &out, &err));
+    TEST_ASSERT_STR("<title>Docs</title>\n<main>Hello Ann</main>\n<footer>(c)</footer>", out.data);
+    out.size = 0;
+    TEST_ASSERT(breeze_cache_render(cache, "/tmp/breeze_ext_base.html", &ctx, &out, &err));
+    TEST_ASSERT_STR("<title>Site</title>\nempty\n<footer>(c)</footer>", out.data);
+    free(out.data);
+    breeze_cache_free(cache);
+}
+
+static void test_include_errors(void) {
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("{% include \"x.html\" %}", &err);
+    TEST_ASSERT(tpl == NULL);
+    TEST_ASSERT_ERR(TMPL_ERR_SYNTAX, err);
+    tpl = breeze_compile("{% extends \"x.html\" %}", &err);
+    TEST_ASSERT(tpl == NULL);
+    TEST_ASSERT_ERR(TMPL_ERR_SYNTAX, err);
+
+    write_file("/tmp/breeze_inc_loop_a.html", "a{% include \"breeze_inc_loop_b.html\" %}");
+    write_file("/tmp/breeze_inc_loop_b.html", "b{% include \"breeze_inc_loop_a.html\" %}");
+    write_file("/tmp/breeze_ext_loop.html", "{% extends \"breeze_ext_loop.html\" %}");
+    write_file("/tmp/breeze_inc_missing.html", "{% include \"breeze_no_such_file.html\" %}");
+    BreezeCacheOptions opts = {.root = "/tmp"};
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    TEST_ASSERT(breeze_cache_acquire(cache, "/tmp/breeze_inc_loop_a.html", &err) == NULL);
+    TEST_ASSERT_ERR(TMPL_ERR_SYNTAX, err);
+    TEST_ASSERT(breeze_cache_acquire(cache, "/tmp/breeze_ext_loop.html", &err) == NULL);
+    TEST_ASSERT_ERR(TMPL_ERR_SYNTAX, err);
+    TEST_ASSERT(breeze_cache_acquire(cache, "/tmp/breeze_inc_missing.html", &err) == NULL);
+    TEST_ASSERT_ERR(TMPL_ERR_IO, err);
+    breeze_cache_free(cache);
+}
+
+static void test_include_hot_reload(void) {
+    write_file("/tmp/breeze_inc_nav.html", "nav1");
+    write_file("/tmp/breeze_ext_layout.html", "[{% block main %}{% endblock %}]");
+    write_file("/tmp/breeze_inc_home.html",
+               "{% extends \"breeze_ext_layout.html\" %}{% block main %}{% include \"breeze_inc_nav.html\" %}"
+               "{% endblock %}");
+    BreezeCacheOptions opts = {.check_mtime = true, .root = "/tmp"};
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    TemplateContext ctx = {0};
+    TemplateError err = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_cache_render(cache, "/tmp/breeze_inc_home.html", &ctx, &out, &err));
+    TEST_ASSERT_STR("[nav1]", out.data);
+    write_file("/tmp/breeze_inc_nav.html", "nav-two");
+    out.size = 0;
+    TEST_ASSERT(breeze_cache_render(cache, "/tmp/breeze_inc_home.html", &ctx, &out, &err));
+    TEST_ASSERT_STR("[nav-two]", out.data);
+    write_file("/tmp/breeze_ext_layout.html", "<<{% block main %}{% endblock %}>>");
+    out.size = 0;
+    TEST_ASSERT(breeze_cache_render(cache, "/tmp/breeze_inc_home.html", &ctx, &out, &err));
+    TEST_ASSERT_STR("<<nav-two>>", out.data);
+    free(out.data);
+    breeze_cache_free(cache);
+}
+
+/* ================================================================
+  28. Fragment cache
+   ================================================================ */
+
+static void test_fragment_hit_skips_render(void) {
+    BreezeEngine* engine = breeze_engine_new();
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(engine, "<{% cache \"nav\" 60 %}{{ n }}{% endcache %}>", NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    TemplateVar vars[] = {VAR_INT("n", 1)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("<1>", out.data);
+    vars[0] = (TemplateVar)VAR_INT("n", 2);
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("<1>", out.data);
+
+    /* A hit does not even need the variables of the block. */
+    TemplateContext empty = {0};
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &empty, &out, &err));
+    TEST_ASSERT_STR("<1>", out.data);
+
+    breeze_engine_invalidate_fragments(engine, "nav");
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("<2>", out.data);
+    free(out.data);
+    breeze_template_free(tpl);
+    breeze_engine_free(engine);
+}
+
+static void test_fragment_key_variables(void) {
+    BreezeEngine* engine = breeze_engine_new();
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(
+        engine, "{% cache 'user' 0 id lang %}{{ id }}/{{ lang }}:{{ n }}{% endcache %}", NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    TemplateVar vars[] = {VAR_INT("id", 7), VAR_STRING("lang", "en"), VAR_INT("n", 1)};
+    TemplateContext ctx = {.vars = vars, .count = 3};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("7/en:1", out.data);
+    vars[1] = (TemplateVar)VAR_STRING("lang", "fr");
+    vars[2] = (TemplateVar)VAR_INT("n", 2);
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("7/fr:2", out.data);
+    vars[1] = (TemplateVar)VAR_STRING("lang", "en");
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("7/en:1", out.data);
+
+    /* Prefix invalidation drops one user's fragments only. */
+    breeze_engine_invalidate_fragments(engine, "user:7:fr");
+    vars[2] = (TemplateVar)VAR_INT("n", 3);
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("7/en:1", out.data);
+    breeze_engine_invalidate_fragments(engine, "user:");
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("7/en:3", out.data);
+
+    TemplateContext missing = {.vars = vars + 1, .count = 2};
+    out.size = 0;
+    TEST_ASSERT(!breeze_render_compiled(tpl, &missing, &out, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_RENDER, err);
+    free(out.data);
+    breeze_template_free(tpl);
+    breeze_engine_free(engine);
+}
+
+static void test_fragment_limit_and_errors(void) {
+    BreezeEngine* engine = breeze_engine_new();
+    breeze_engine_set_fragment_limit(engine, 16); /* smaller than any entry */
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(engine, "{% cache \"x\" 5 %}{{ n }}{% endcache %}", NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    TemplateVar vars[] = {VAR_INT("n", 1)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    vars[0] = (TemplateVar)VAR_INT("n", 2);
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("2", out.data);
+    free(out.data);
+    breeze_template_free(tpl);
+
+    const char* bad[] = {"{% cache %}a{% endcache %}", "{% cache \"x\" %}a{% endcache %}",
+                         "{% cache \"x\" -1 %}a{% endcache %}", "{% cache \"x\" 5 %}a", "a{% endcache %}",
+                         "{% for i in xs %}{% cache \"x\" 5 %}{% endfor %}{% endcache %}"};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        err = (TemplateError){0};
+        TEST_ASSERT(breeze_engine_compile(engine, bad[i], NULL, &err) == NULL);
+        TEST_ASSERT_ERR(TMPL_ERR_SYNTAX, err);
+    }
+    breeze_engine_free(engine);
+}
+
+static void test_fragment_nested(void) {
+    BreezeEngine* engine = breeze_engine_new();
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(
+        engine, "{% cache \"page\" 0 %}a{{ n }}{% cache \"side\" 0 %}b{{ n }}{% endcache %}{% endcache %}", NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    TemplateVar vars[] = {VAR_INT("n", 1)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("a1b1", out.data);
+    vars[0] = (TemplateVar)VAR_INT("n", 2);
+    breeze_engine_invalidate_fragments(engine, "page");
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("a2b1", out.data);
+    free(out.data);
+    breeze_template_free(tpl);
+    breeze_engine_free(engine);
+}
+
+typedef struct {
+    char key[64];
+    char data[64];
+    unsigned ttl;
+    int gets, puts;
+} OneSlotStore;
+
+static bool one_slot_get(void* userdata, const char* key, OutputBuffer* out) {
+    OneSlotStore* st = userdata;
+    st->gets++;
+    return strcmp(st->key, key) == 0 && breeze_buffer_append(out, st->data, strlen(st->data));
+}
+
+static void one_slot_put(void* userdata, const char* key, const char* data, size_t len, unsigned ttl) {
+    OneSlotStore* st = userdata;
+    st->puts++;
+    snprintf(st->key, sizeof(st->key), "%s", key);
+    snprintf(st->data, sizeof(st->data), "%.*s", (int)len, data);
+    st->ttl = ttl;
+}
+
+static void one_slot_invalidate(void* userdata, const char* prefix) {
+    OneSlotStore* st = userdata;
+    if (strncmp(st->key, prefix, strlen(prefix)) == 0) st->key[0] = '\0';
+}
+
+static void test_fragment_custom_store_streaming(void) {
+    BreezeEngine* engine = breeze_engine_new();
+    OneSlotStore st = {0};
+    BreezeFragmentStore store = {one_slot_get, one_slot_put, one_slot_invalidate, &st};
+    breeze_engine_set_fragment_store(engine, &store);
+
+    /* A fragment larger than the writer chunk is captured whole, even while streaming. */
+    const char* words[2000];
+    for (size_t i = 0; i < 2000; i++) words[i] = "w";
+    TemplateContext ctx = big_context(words, 2000);
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(
+        engine, "[{% cache \"big\" 30 %}{% for w in words %}{{ w }}{% endfor %}{% endcache %}]", NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    SinkState sink = {.buf = new_buf()};
+    BreezeWriter w = {.write = counting_sink, .userdata = &sink};
+    TEST_ASSERT(breeze_render_to_writer(tpl, &ctx, &w, &err));
+    TEST_ASSERT(sink.buf.size == 2002);
+    TEST_ASSERT(st.puts == 1 && st.ttl == 30);
+    TEST_ASSERT_STR("big", st.key);
+    TEST_ASSERT(strspn(st.data, "w") == sizeof(st.data) - 1); /* the store truncated it */
+    breeze_engine_invalidate_fragments(engine, "b");
+    TEST_ASSERT(st.key[0] == '\0');
+    breeze_template_free(tpl);
+
+    tpl = breeze_engine_compile(engine, "{% cache \"k\" 0 %}miss{% endcache %}!", NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    snprintf(st.key, sizeof(st.key), "k");
+    snprintf(st.data, sizeof(st.data), "stored");
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("stored!", out.data);
+    TEST_ASSERT(st.puts == 1);
+
+    breeze_engine_set_fragment_store(engine, NULL);
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("miss!", out.data);
+    free(out.data);
+    free(sink.buf.data);
+    breeze_template_free(tpl);
+    breeze_engine_free(engine);
+}
+
+/* ================================================================
+  29. Constant folding
+   ================================================================ */
+
+/* Render `src` with the optimizer on and off; both must give `expected`. */
+static void check_folded(const char* src, const TemplateContext* ctx, const char* expected, BreezeFoldStats* stats) {
+    BreezeEngine* engine = breeze_engine_new();
+    for (int pass = 0; pass < 2; pass++) {
+        breeze_engine_set_optimize(engine, pass == 0);
+        TemplateError err = {0};
+        BreezeTemplate* tpl = breeze_engine_compile(engine, src, NULL, &err);
+        TEST_ASSERT(tpl != NULL);
+        OutputBuffer out = new_buf();
+        TEST_ASSERT(breeze_render_compiled(tpl, ctx, &out, &err));
+        TEST_ASSERT_STR(expected, out.data);
+        if (pass == 0) breeze_template_fold_stats(tpl, stats);
+        free(out.data);
+        breeze_template_free(tpl);
+    }
+    breeze_engine_free(engine);
+}
+
+static void test_fold_set_and_filters(void) {
+    TemplateContext ctx = {0};
+    BreezeFoldStats st;
+    check_folded("{% set t = 'hello world' %}<{{ t | upper }}>\n{{ t | truncate:5 }}|{{ t|len }}", &ctx,
+                 "<HELLO WORLD>\nhello...|11", &st);
+    TEST_ASSERT(st.vars_folded == 3);
+    TEST_ASSERT(st.sets_dropped == 1);
+    TEST_ASSERT(st.nodes_after == 1);
+    TEST_ASSERT(st.nodes_before == 7);
+    TEST_ASSERT(st.texts_merged == 5);
+}
+
+static void test_fold_constant_branches(void) {
+    const char* xs[] = {"a", "b"};
+    TemplateVar vars[] = {VAR_ARRAY_STR("xs", xs)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    BreezeFoldStats st;
+    check_folded("{% set mode = dark %}{% if mode == 'dark' %}D{% elif missing %}E{% else %}F{% endif %}!", &ctx, "D!",
+                 &st);
+    TEST_ASSERT(st.branches_folded == 1);
+    TEST_ASSERT(st.nodes_after == 1);
+
+    check_folded("{% set n = 3 %}{% for x in xs %}{% if n > 5 %}big{% elif not n %}none{% else %}{{ x }}{% endif %}"
+                 "{% endfor %}",
+                 &ctx, "ab", &st);
+    TEST_ASSERT(st.branches_folded == 2);
+    TEST_ASSERT(st.nodes_after == 3); /* for, {{ x }}, endfor */
+
+    /* Conditions that read the context stay. */
+    check_folded("{% set n = 1 %}{% for x in xs %}{% if n and loop.first %}[{{ x }}]{% endif %}{% endfor %}", &ctx,
+                 "[a]", &st);
+    TEST_ASSERT(st.branches_folded == 0);
+}
+
+static void test_fold_keeps_dynamic_sets(void) {
+    TemplateVar vars[] = {VAR_STRING("a", "ctx"), VAR_BOOL("flag", true)};
+    TemplateContext ctx = {.vars = vars, .count = 2};
+    BreezeFoldStats st;
+    /* Read before the set: the first {{ a }} comes from the context. */
+    check_folded("{{ a }}{% set a = x %}{{ a }}", &ctx, "ctxx", &st);
+    TEST_ASSERT(st.vars_folded == 1);
+    TEST_ASSERT(st.sets_dropped == 0);
+    /* Set inside a block, or twice: not a constant. */
+    check_folded("{% set b = 1 %}{% if flag %}{% set b = 2 %}{% endif %}{{ b }}", &ctx, "2", &st);
+    TEST_ASSERT(st.vars_folded == 0);
+    check_folded("{% set c = 1 %}{{ c }}{% set c = 2 %}{{ c }}", &ctx, "12", &st);
+    TEST_ASSERT(st.vars_folded == 0);
+}
+
+static void test_fold_errors_and_escaping(void) {
+    BreezeEngine* engine = breeze_engine_new();
+    breeze_engine_set_autoescape(engine, true);
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(engine, "{% set h = <b> %}{{ h }}{{ h | safe }}", NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    TemplateContext ctx = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("&lt;b&gt;<b>", out.data);
+    breeze_template_free(tpl);
+
+    /* Failures are left for render time and reported there. */
+    tpl = breeze_engine_compile(engine, "{% set s = abc %}{{ s | nosuch }}{% if s < 2 %}x{% endif %}", NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    BreezeFoldStats st;
+    breeze_template_fold_stats(tpl, &st);
+    TEST_ASSERT(st.vars_folded == 0 && st.branches_folded == 0);
+    out.size = 0;
+    TEST_ASSERT(!breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_RENDER, err);
+    free(out.data);
+    breeze_template_free(tpl);
+    breeze_engine_free(engine);
+}
+
+static int g_fold_calls;
+
+/* Impure: prints how often it has been called. */
+static bool count_calls_filter(const TemplateValue* val, const char* arg, OutputBuffer* out) {
+    (void)val;
+    (void)arg;
+    char num[16];
+    int n = snprintf(num, sizeof(num), "%d", ++g_fold_calls);
+    return breeze_buffer_append(out, num, (size_t)n);
+}
+
+static void test_fold_skips_user_filters(void) {
+    BreezeEngine* engine = breeze_engine_new();
+    TEST_ASSERT(engine != NULL);
+    TEST_ASSERT(breeze_engine_register_filter(engine, "cnt", count_calls_filter));
+    TEST_ASSERT(breeze_engine_register_filter(engine, "upper", count_calls_filter)); /* replaces the built-in */
+    g_fold_calls = 0;
+    TemplateError err = {0};
+    BreezeTemplate* tpl =
+        breeze_engine_compile(engine, "{% set x = a %}[{{ x | cnt }}][{{ x | upper }}]{{ x | len }}", NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    TEST_ASSERT(g_fold_calls == 0);
+    BreezeFoldStats st;
+    breeze_template_fold_stats(tpl, &st);
+    TEST_ASSERT(st.vars_folded == 1); /* only the built-in len */
+
+    TemplateContext ctx = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("[1][2]1", out.data);
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("[3][4]1", out.data);
+    free(out.data);
+    breeze_template_free(tpl);
+    breeze_engine_free(engine);
+}
+
+/* ================================================================
+  30. Batch rendering
+   ================================================================ */
+
+#define BATCH_N 1000
+
+static void test_batch_matches_serial(void) {
+    static TemplateVar vars[BATCH_N][2];
+    static TemplateContext ctxs[BATCH_N];
+    const char* items[] = {"pen", "ink", "pad"};
+    for (size_t i = 0; i < BATCH_N; i++) {
+        vars[i][0] = (TemplateVar)VAR_INT("id", (int)i);
+        vars[i][1] = (TemplateVar)VAR_ARRAY_STR("items", items);
+        ctxs[i] = (TemplateContext){.vars = vars[i], .count = 2};
+    }
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(
+        "Invoice {{ id }}:{% for it in items %} {{ loop.index1 }}.{{ it | upper }}{% endfor %}"
+        "{% if id > 500 %} late{% endif %}",
+        &err);
+    TEST_ASSERT(tpl != NULL);
+
+    size_t thread_counts[] = {1, 4, 0};
+    for (size_t t = 0; t < 3; t++) {
+        OutputBuffer* outs = calloc(BATCH_N, sizeof(OutputBuffer));
+        TEST_ASSERT(outs != NULL);
+        TEST_ASSERT(breeze_render_batch(tpl, ctxs, BATCH_N, outs, NULL, thread_counts[t]));
+        for (size_t i = 0; i < BATCH_N; i++) {
+            OutputBuffer expected = new_buf();
+            TEST_ASSERT(breeze_render_compiled(tpl, &ctxs[i], &expected, &err));
+            TEST_ASSERT_STR(expected.data, outs[i].data);
+            free(expected.data);
+            free(outs[i].data);
+        }
+        free(outs);
+    }
+    breeze_template_free(tpl);
+}
+
+static void test_batch_reports_each_error(void) {
+    TemplateVar with = VAR_STRING("name", "ok");
+    TemplateContext ctxs[64];
+    for (size_t i = 0; i < 64; i++) ctxs[i] = (TemplateContext){.vars = &with, .count = i % 3 ? 1 : 0};
+    OutputBuffer outs[64] = {{0}};
+    TemplateError errs[64];
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("[{{ name }}]", &err);
+    TEST_ASSERT(tpl != NULL);
+    TEST_ASSERT(!breeze_render_batch(tpl, ctxs, 64, outs, errs, 8));
+    for (size_t i = 0; i < 64; i++) {
+        if (i % 3) {
+            TEST_ASSERT(errs[i].type == TMPL_ERR_NONE);
+            TEST_ASSERT_STR("[ok]", outs[i].data);
+        } else {
+            TEST_ASSERT(errs[i].type == TMPL_ERR_RENDER);
+        }
+        free(outs[i].data);
+    }
+    TEST_ASSERT(breeze_render_batch(tpl, ctxs, 0, outs, errs, 8));
+    breeze_template_free(tpl);
+}
+
+/* ================================================================
+  31. Profiling
+   ================================================================ */
+
+static void test_profile_counts_nodes_and_filters(void) {
+    const char* words[] = {"a", "bb", "ccc"};
+    TemplateVar vars[] = {VAR_ARRAY_STR("words", words), VAR_STRING("title", "hi")};
+    TemplateContext ctx = {.vars = vars, .count = 2};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("<h1>{{ title | upper }}</h1>\n"
+                                         "{% for w in words %}<i>{{ w | upper | reverse }}</i>{% endfor %}",
+                                         &err);
+    TEST_ASSERT(tpl != NULL);
+    BreezeProfile* prof = breeze_profile_new(tpl);
+    BreezeRenderState* state = breeze_render_state_new();
+    TEST_ASSERT(prof != NULL && state != NULL);
+    breeze_state_set_profile(state, prof);
+    OutputBuffer out = new_buf();
+    for (int i = 0; i < 2; i++) {
+        out.size = 0;
+        TEST_ASSERT(breeze_state_render(state, tpl, &ctx, &out, &err));
+    }
+    TEST_ASSERT_STR("<h1>HI</h1>\n<i>A</i><i>BB</i><i>CCC</i>", out.data);
+    TEST_ASSERT(breeze_profile_renders(prof) == 2);
+
+    size_t count;
+    const BreezeNodeProfile* nodes = breeze_profile_dump(prof, &count);
+    uint64_t bytes = 0;
+    bool saw_loop_var = false;
+    for (size_t i = 0; i < count; i++) {
+        bytes += nodes[i].bytes;
+        if (strcmp(nodes[i].kind, "var") == 0 && nodes[i].line == 2) {
+            TEST_ASSERT(nodes[i].executions == 6);
+            TEST_ASSERT(nodes[i].bytes == 12);
+            saw_loop_var = true;
+        }
+        if (strcmp(nodes[i].kind, "for") == 0) TEST_ASSERT(nodes[i].executions == 2);
+    }
+    TEST_ASSERT(saw_loop_var);
+    TEST_ASSERT(bytes == 2 * out.size);
+
+    const BreezeFilterProfile* filters = breeze_profile_filters(prof, &count);
+    TEST_ASSERT(count == 3);
+    TEST_ASSERT_STR("upper", filters[0].name);
+    TEST_ASSERT(filters[0].line == 1 && filters[0].calls == 2);
+    TEST_ASSERT_STR("reverse", filters[2].name);
+    TEST_ASSERT(filters[2].line == 2 && filters[2].calls == 6);
+
+    OutputBuffer json = new_buf();
+    TEST_ASSERT(breeze_profile_dump_json(prof, &json));
+    TEST_ASSERT(strncmp(json.data, "{\"renders\":2,\"nodes\":[{\"node\":0,\"kind\":\"text\",\"line\":1,", 47) == 0);
+    TEST_ASSERT(strstr(json.data, "{\"name\":\"reverse\",\"line\":2,\"calls\":6,") != NULL);
+
+    breeze_profile_reset(prof);
+    TEST_ASSERT(breeze_profile_renders(prof) == 0);
+    nodes = breeze_profile_dump(prof, &count);
+    TEST_ASSERT(nodes[0].executions == 0 && nodes[0].line == 1);
+
+    /* Detached, or rendering another template: nothing is counted. */
+    breeze_state_set_profile(state, NULL);
+    TEST_ASSERT(breeze_state_render(state, tpl, &ctx, &out, &err));
+    breeze_state_set_profile(state, prof);
+    BreezeTemplate* other = breeze_compile("{{ title }}", &err);
+    TEST_ASSERT(other != NULL);
+    TEST_ASSERT(breeze_state_render(state, other, &ctx, &out, &err));
+    TEST_ASSERT(breeze_profile_renders(prof) == 0);
+    breeze_template_free(other);
+
+    free(json.data);
+    free(out.data);
+    breeze_render_state_free(state);
+    breeze_profile_free(prof);
+    breeze_template_free(tpl);
+}
+
+static void test_profile_streaming_bytes(void) {
+    const char* words[2000];
+    for (size_t i = 0; i < 2000; i++) words[i] = "streamed";
+    TemplateContext ctx = big_context(words, 2000);
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(g_big_tpl, &err);
+    TEST_ASSERT(tpl != NULL);
+    BreezeProfile* prof = breeze_profile_new(tpl);
+    BreezeRenderState* state = breeze_render_state_new();
+    breeze_state_set_profile(state, prof);
+    SinkState st = {.buf = new_buf()};
+    BreezeWriter w = {.write = counting_sink, .userdata = &st};
+    TEST_ASSERT(breeze_state_render_to_writer(state, tpl, &ctx, &w, &err));
+    size_t count;
+    const BreezeNodeProfile* nodes = breeze_profile_dump(prof, &count);
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < count; i++) bytes += nodes[i].bytes;
+    TEST_ASSERT(st.calls > 1);
+    TEST_ASSERT(bytes == st.buf.size);
+    free(st.buf.data);
+    breeze_render_state_free(state);
+    breeze_profile_free(prof);
+    breeze_template_free(tpl);
+}
+
+/* ================================================================
+  32. Trim markers
+   ================================================================ */
+
+static void check_trim(const char* src, const TemplateContext* ctx, const char* expected) {
+    OutputBuffer out = new_buf();
+    TemplateError err = {0};
+    TEST_ASSERT(render_template(src, ctx, &out, &err));
+    TEST_ASSERT_STR(expected, out.data);
+    free(out.data);
+}
+
+static void test_trim_directives(void) {
+    const char* xs[] = {"a", "b", "c"};
+    TemplateVar vars[] = {VAR_ARRAY_STR("xs", xs), {"on", {.type = TMPL_BOOL, .value.boolean = true}}};
+    TemplateContext ctx = {.vars = vars, .count = 2};
+    check_trim("[\n  {%- for x in xs -%}\n  {{ x }},\n  {%- endfor %}\n]", &ctx, "[a,b,c,]");
+    check_trim("<ul>\n  {%- if on %} <li>on</li> {% endif -%}\n</ul>", &ctx, "<ul> <li>on</li> </ul>");
+    check_trim("a   {%- set y = 1 -%}   b", &ctx, "ab");
+    /* Markers win over standalone detection on their side only. */
+    check_trim("x\n  {%- if on %}\ny\n{% endif %}\nz", &ctx, "xy\nz");
+    check_trim("x\n  {% if on -%}\n  y\n{% endif %}z", &ctx, "x\ny\nz");
+}
+
+static void test_trim_variables(void) {
+    TemplateVar vars[] = {VAR_STRING("k", "id"), VAR_INT("v", 7)};
+    TemplateContext ctx = {.vars = vars, .count = 2};
+    check_trim("{\n  \"{{ k }}\":\n    {{- v -}}  \n}", &ctx, "{\n  \"id\":7}");
+    check_trim("a {{-k}} b", &ctx, "aid b");
+    check_trim("a {{ k|upper -}} \n b", &ctx, "a IDb");
+    /* A '-' outside the delimiters is plain text. */
+    check_trim("{{ k }} - {{ v }}-\n", &ctx, "id - 7-\n");
+}
+
+static void test_trim_raw_and_blocks(void) {
+    TemplateContext ctx = {0};
+    check_trim("<pre>\n{%- raw -%}\n  {{ x }}\n{%- endraw -%}\n</pre>", &ctx, "<pre>{{ x }}</pre>");
+    check_trim("{% raw %}{%- if -%}{% endraw %}", &ctx, "{%- if -%}");
+
+    write_file("/tmp/breeze_trim_base.html", "<h1>\n  {%- block t -%} x {%- endblock -%}\n</h1>");
+    write_file("/tmp/breeze_trim_page.html", "{%- extends \"breeze_trim_base.html\" -%}\n"
+                                             "{% block t -%} Title {% endblock %}");
+    BreezeCacheOptions opts = {.root = "/tmp"};
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    TemplateError err = {0};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_cache_render(cache, "/tmp/breeze_trim_page.html", &ctx, &out, &err));
+    TEST_ASSERT_STR("<h1>Title</h1>", out.data); /* the parent's block tags keep their markers */
+    free(out.data);
+    breeze_cache_free(cache);
+}
+
+/* ================================================================
+  33. String views
+   ================================================================ */
+
+typedef struct {
+    int id;
+    BreezeSlice title;
+} Post;
+
+static const BreezeField post_fields[] = {
+    BREEZE_FIELD(Post, id, TMPL_INT),
+    BREEZE_FIELD(Post, title, TMPL_STRV),
+};
+static const BreezeRecordType post_type = BREEZE_RECORD_TYPE(Post, post_fields);
+
+static bool my_span_filter(const TemplateValue* val, const char* arg, OutputBuffer* out) {
+    (void)arg;
+    size_t len;
+    const char* s = breeze_value_str(val, &len);
+    char n[32];
+    snprintf(n, sizeof(n), "%zu:", len);
+    return breeze_buffer_append(out, n, strlen(n)) && (!s || breeze_buffer_append(out, s, len));
+}
+
+/* Views into one buffer, none of them NUL-terminated. */
+static void test_strv_filters_and_conditions(void) {
+    static const char buf[] = "xx<Hello> 42 world  yy";
+    TemplateVar vars[] = {VAR_STRN("tag", buf + 2, 7), VAR_STRN("num", buf + 10, 2), VAR_STRN("pad", buf + 12, 8),
+                          VAR_STRN("none", buf, 0), VAR_STRLIT("lit", "Hello")};
+    TemplateContext ctx = {.vars = vars, .count = 5};
+    check_trim("{{ tag }}|{{ tag | escape }}|{{ tag | upper }}|{{ tag | len }}|{{ tag | truncate:3 }}", &ctx,
+               "<Hello>|&lt;Hello&gt;|<HELLO>|7|<He...");
+    check_trim("[{{ pad | trim }}]|{{ pad | replace:o:0 }}|{{ num | round:1 }}|{{ tag | reverse }}", &ctx,
+               "[world]| w0rld  |42.0|>olleH<");
+    check_trim("{{ none | default:empty }}|{{ none | len }}|{{ lit | len }}", &ctx, "empty|0|5");
+    check_trim("{% if none %}a{% endif %}{% if tag %}b{% endif %}{% if num > 40 %}c{% endif %}"
+               "{% if 'ell' in tag %}d{% endif %}{% if 'o>' in tag %}e{% endif %}{% if 'y' in pad %}f{% endif %}"
+               "{% if lit == 'Hello' %}g{% endif %}{% if lit < 'Help' %}h{% endif %}{% if lit == 'Hell' %}i{% endif %}",
+               &ctx, "bcdegh");
+
+    BreezeEngine* engine = breeze_engine_new();
+    TEST_ASSERT(breeze_engine_register_filter(engine, "span", my_span_filter));
+    breeze_engine_set_autoescape(engine, true);
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(engine, "{{ tag }} {{ tag | span }} {{ num | span }}", NULL, &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("&lt;Hello&gt; 7:&lt;Hello&gt; 2:42", out.data);
+    free(out.data);
+    breeze_template_free(tpl);
+    breeze_engine_free(engine);
+}
+
+static void test_strv_arrays_records_context(void) {
+    static const char text[] = "alphabetagamma";
+    BreezeSlice words[] = {{text, 5}, {text + 5, 4}, {text + 9, 5}};
+    Post post = {3, {text + 5, 4}};
+    TemplateVar vars[] = {VAR_ARRAY_STRV("words", words), VAR_RECORD("post", &post, &post_type)};
+    TemplateContext ctx = {.vars = vars, .count = 2};
+    check_trim("{% for w in words %}{{ loop.index }}={{ w | capitalize }} {% endfor %}"
+               "{% if 'beta' in words %}!{% endif %}#{{ post.id }} {{ post.title | upper }}",
+               &ctx, "0=Alpha 1=Beta 2=Gamma !#3 BETA");
+
+    TemplateValue item;
+    TEST_ASSERT(breeze_array_get(&vars[0].value, 2, &item));
+    size_t len;
+    const char* s = breeze_value_str(&item, &len);
+    TEST_ASSERT(item.type == TMPL_STRV && s == text + 9 && len == 5);
+    TEST_ASSERT(breeze_value_str(&vars[1].value, &len) == NULL && len == 0);
+
+    TemplateContext* dyn = context_new(2);
+    TEST_ASSERT(context_set(dyn, "body", breeze_strn(text, 5)));
+    TEST_ASSERT(context_set(dyn, "body", breeze_strn(text + 9, 3)));
+    check_trim("<{{ body }}>", dyn, "<gam>");
+    context_free(dyn);
+}
+
+/* ================================================================
+  34. Generated code
+   ================================================================ */
+
+static void test_gen_emits_function(void) {
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("a\"b\\c?" "?=\n{% for x in xs %}{{ x.name }}{% if x.n > 1.5 %}!{% endif %}"
+                                         "{% endfor %}",
+                                         &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_template_to_c(tpl, "page", &out, &err));
+    TEST_ASSERT(strstr(out.data, "#include \"breeze.h\"") != NULL);
+    TEST_ASSERT(strstr(out.data, "bool page(const TemplateContext* ctx, OutputBuffer* out, TemplateError* err) {"));
+    TEST_ASSERT(strstr(out.data, "\"a\\\"b\\\\c?\\?=\\n\"") != NULL);
+    TEST_ASSERT(strstr(out.data, "breeze_gen_field(&loops[0].item, \"name\", &fields[0], NULL, &tmp)") != NULL);
+    TEST_ASSERT(strstr(out.data, ".value.dbl = 1.5}") != NULL);
+    TEST_ASSERT(strstr(out.data, "goto n") != NULL);
+    TEST_ASSERT(strstr(out.data, "bound[") == NULL); /* no filters, no filter table */
+
+    size_t len = out.size;
+    TEST_ASSERT(!breeze_template_to_c(tpl, "2page", &out, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_PARSE, err);
+    TEST_ASSERT(out.size == len);
+    free(out.data);
+    breeze_template_free(tpl);
+
+    tpl = breeze_compile("x\n  {% cache 'nav' 60 %}{{ n }}{% endcache %}", &err);
+    TEST_ASSERT(tpl != NULL);
+    out = new_buf();
+    TEST_ASSERT(!breeze_template_to_c(tpl, "page", &out, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_SYNTAX, err);
+    TEST_ASSERT(err.line == 2 && err.column == 3);
+    TEST_ASSERT(out.size == 0);
+    free(out.data);
+    breeze_template_free(tpl);
+}
+
+#ifdef BREEZE_TEST_GENERATED
+/* breeze_test.html, compiled by `breeze compile` in `make test`. */
+bool gen_test_page(const TemplateContext* ctx, OutputBuffer* out, TemplateError* err);
+
+static const char* const gen_schema_keys[] = {"title", "user", "items", "roles", "score", "post"};
+
+/* Render with the generated function and the interpreter; both must agree,
+ * errors included. */
+static void check_generated(BreezeTemplate* tpl, const TemplateContext* ctx, bool expect_ok) {
+    OutputBuffer a = new_buf(), b = new_buf();
+    TemplateError ea = {0}, eb = {0};
+    bool ok = gen_test_page(ctx, &a, &ea);
+    TEST_ASSERT(ok == expect_ok);
+    TEST_ASSERT(breeze_render_compiled(tpl, ctx, &b, &eb) == ok);
+    if (ok) {
+        TEST_ASSERT_STR(b.data, a.data);
+    } else {
+        TEST_ASSERT(ea.type == eb.type && ea.line == eb.line && ea.column == eb.column);
+        TEST_ASSERT_STR(eb.message, ea.message);
+    }
+    free(a.data);
+    free(b.data);
+}
+
+static BreezeTemplate* compile_gen_page(void) {
+    FILE* fp = fopen("breeze_test.html", "rb");
+    if (!fp) return NULL;
+    char src[4096];
+    size_t n = fread(src, 1, sizeof(src) - 1, fp);
+    fclose(fp);
+    src[n] = '\0';
+    BreezeEngine* engine = breeze_engine_new();
+    breeze_engine_set_autoescape(engine, true);
+    BreezeSchema schema = {gen_schema_keys, 6};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(engine, src, &schema, &err);
+    breeze_engine_free(engine);
+    return tpl;
+}
+
+static void test_gen_matches_interpreter(void) {
+    BreezeTemplate* tpl = compile_gen_page();
+    TEST_ASSERT(tpl != NULL);
+    const char* items[] = {"apple", "banana split", "cherry"};
+    const char* roles[] = {"admin", "editor"};
+    const char* one_role[] = {"viewer"};
+    Post post = {7, {"Beta", 4}};
+    TemplateVar vars[] = {VAR_STRING("title", "<Menu> & more"), VAR_STRING("user", "ann"),
+                          VAR_ARRAY_STR("items", items),        VAR_ARRAY_STR("roles", roles),
+                          VAR_INT("score", 95),                 VAR_RECORD("post", &post, &post_type)};
+    TemplateContext ctx = {.vars = vars, .count = 6};
+    check_generated(tpl, &ctx, true);
+
+    /* Other values, and a layout that misses the schema: names fall back to a lookup. */
+    TemplateVar other[] = {VAR_RECORD("post", &post, &post_type), VAR_DOUBLE("score", 60.5),
+                           VAR_ARRAY_STR("roles", one_role),       VAR_ARRAY_STR("items", items),
+                           VAR_STRING("user", "rex"),              VAR_STRING("title", "T")};
+    TemplateContext shuffled = {.vars = other, .count = 6};
+    check_generated(tpl, &shuffled, true);
+    post.title = (BreezeSlice){"Gamma", 5};
+    other[1] = (TemplateVar)VAR_INT("score", 10);
+    other[3].value.value.array.count = 1;
+    TemplateVar extra[7];
+    memcpy(extra, other, sizeof(other));
+    extra[6] = (TemplateVar)VAR_BOOL("fallback", false);
+    TemplateContext with_fallback = {.vars = extra, .count = 7};
+    check_generated(tpl, &with_fallback, true);
+    breeze_template_free(tpl);
+}
+
+static void test_gen_errors_match(void) {
+    BreezeTemplate* tpl = compile_gen_page();
+    TEST_ASSERT(tpl != NULL);
+    const char* items[] = {"apple"};
+    const char* roles[] = {"admin"};
+    Post post = {1, {"Beta", 4}};
+    TemplateVar vars[] = {VAR_STRING("title", "T"),      VAR_STRING("user", "u"),
+                          VAR_ARRAY_STR("items", items), VAR_ARRAY_STR("roles", roles),
+                          VAR_INT("score", 10),          VAR_RECORD("post", &post, &post_type)};
+    TemplateContext ctx = {.vars = vars, .count = 6};
+    check_generated(tpl, &ctx, false); /* score is low, so `fallback` is read and missing */
+
+    vars[4] = (TemplateVar)VAR_INT("score", 99);
+    vars[2] = (TemplateVar)VAR_STRING("items", "not a list");
+    check_generated(tpl, &ctx, false);
+
+    vars[2] = (TemplateVar)VAR_ARRAY_STR("items", items);
+    ctx.count = 5; /* no post */
+    check_generated(tpl, &ctx, false);
+
+    ctx.count = 1; /* no user */
+    check_generated(tpl, &ctx, false);
+    breeze_template_free(tpl);
+}
+#endif
+
+/* ================================================================
+  35. Template images
+   ================================================================ */
+
+static void check_same_render(const BreezeTemplate* a, const BreezeTemplate* b, const TemplateContext* ctx) {
+    OutputBuffer x = new_buf(), y = new_buf();
+    TemplateError ex = {0}, ey = {0};
+    bool ok = breeze_render_compiled(a, ctx, &x, &ex);
+    TEST_ASSERT(breeze_render_compiled(b, ctx, &y, &ey) == ok);
+    TEST_ASSERT_STR(x.data, y.data);
+    TEST_ASSERT(ex.type == ey.type && ex.line == ey.line && ex.column == ey.column);
+    TEST_ASSERT_STR(ex.message, ey.message);
+    free(x.data);
+    free(y.data);
+}
+
+static void test_image_round_trip(void) {
+    static const char* const keys[] = {"items", "post"};
+    BreezeSchema schema = {keys, 2};
+    BreezeEngine* engine = breeze_engine_new();
+    breeze_engine_set_autoescape(engine, true);
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(engine,
+                                                "{% set sep = ', ' %}{% for i in items %}{{ i | upper }}"
+                                                "{% if not loop.last %}{{ sep }}{% endif %}{% endfor %}\n"
+                                                "{% if post.id > 2 and 'et' in post.title %}<{{ post.title }}>{% endif %}"
+                                                "{% cache 'c' 0 post.id %}#{{ post.id }}{% endcache %}\n{{ missing }}",
+                                                &schema, &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer image = new_buf();
+    TEST_ASSERT(breeze_template_save(tpl, &image, &err));
+    TEST_ASSERT(image.size % 8 == 0);
+
+    size_t used = 0;
+    BreezeTemplate* loaded = breeze_template_load(engine, image.data, image.size, &used, &err);
+    TEST_ASSERT(loaded != NULL);
+    TEST_ASSERT(used == image.size);
+    const char* items[] = {"a&b", "c"};
+    Post post = {3, {"Beta", 4}};
+    TemplateVar vars[] = {VAR_ARRAY_STR("items", items), VAR_RECORD("post", &post, &post_type),
+                          VAR_STRING("missing", "m")};
+    TemplateContext ctx = {.vars = vars, .count = 3};
+    check_same_render(tpl, loaded, &ctx);
+    ctx.count = 2; /* the missing variable fails at the same place */
+    check_same_render(tpl, loaded, &ctx);
+
+    BreezeFoldStats a, b;
+    breeze_template_fold_stats(tpl, &a);
+    breeze_template_fold_stats(loaded, &b);
+    TEST_ASSERT(memcmp(&a, &b, sizeof(a)) == 0 && a.vars_folded > 0);
+    breeze_template_free(loaded);
+
+    /* A bundle of two images, walked with `used`. */
+    BreezeTemplate* second = breeze_compile("second {{ items | len }}", &err);
+    TEST_ASSERT(second != NULL);
+    size_t first_size = image.size;
+    TEST_ASSERT(breeze_template_save(second, &image, &err));
+    loaded = breeze_template_load(NULL, image.data + first_size, image.size - first_size, &used, &err);
+    TEST_ASSERT(loaded != NULL && first_size + used == image.size);
+    check_same_render(second, loaded, &ctx);
+    breeze_template_free(loaded);
+    breeze_template_free(second);
+
+    free(image.data);
+    breeze_template_free(tpl);
+    breeze_engine_free(engine);
+}
+
+/* Map an image file read-only, as a worker would at startup. */
+static void test_image_mmap(void) {
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("{% for x in xs %}[{{ x }}]{% endfor %}", &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer image = new_buf();
+    TEST_ASSERT(breeze_template_save(tpl, &image, &err));
+    const char* path = "/tmp/breeze_test_image.bin";
+    FILE* fp = fopen(path, "wb");
+    TEST_ASSERT(fp != NULL);
+    TEST_ASSERT(fwrite(image.data, 1, image.size, fp) == image.size);
+    fclose(fp);
+
+    int fd = open(path, O_RDONLY);
+    TEST_ASSERT(fd >= 0);
+    void* map = mmap(NULL, image.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    TEST_ASSERT(map != MAP_FAILED);
+    BreezeTemplate* loaded = breeze_template_load(NULL, map, image.size, NULL, &err);
+    TEST_ASSERT(loaded != NULL);
+    const char* xs[] = {"p", "q"};
+    TemplateVar vars[] = {VAR_ARRAY_STR("xs", xs)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(loaded, &ctx, &out, &err));
+    TEST_ASSERT_STR("[p][q]", out.data);
+    breeze_template_free(loaded);
+    munmap(map, image.size);
+    unlink(path);
+    free(out.data);
+    free(image.data);
+    breeze_template_free(tpl);
+}
+
+static void test_image_rejects_bad_input(void) {
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("x{{ y }}", &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer image = new_buf();
+    TEST_ASSERT(breeze_template_save(tpl, &image, &err));
+
+    TEST_ASSERT(!breeze_template_load(NULL, image.data, image.size - 8, NULL, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_PARSE, err);
+    TEST_ASSERT(strstr(err.message, "truncated") != NULL);
+    TEST_ASSERT(!breeze_template_load(NULL, image.data, 16, NULL, &err));
+
+    char* copy = malloc(image.size + 8);
+    memcpy(copy + 1, image.data, image.size);
+    TEST_ASSERT(!breeze_template_load(NULL, copy + 1, image.size, NULL, &err));
+    TEST_ASSERT(strstr(err.message, "misaligned") != NULL);
+
+    memcpy(copy, image.data, image.size);
+    copy[8]++; /* version */
+    TEST_ASSERT(!breeze_template_load(NULL, copy, image.size, NULL, &err));
+    TEST_ASSERT_STR("Unsupported template image version", err.message);
+    copy[0] = 'X';
+    TEST_ASSERT(!breeze_template_load(NULL, copy, image.size, NULL, &err));
+    TEST_ASSERT_STR("Not a template image", err.message);
+    free(copy);
+    free(image.data);
+    breeze_template_free(tpl);
+
+    const char* path = "/tmp/breeze_image_inc.html";
+    write_file(path, "{% include \"breeze_image_part.html\" %}");
+    write_file("/tmp/breeze_image_part.html", "part");
+    BreezeCacheOptions opts = {.root = "/tmp"};
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    tpl = breeze_cache_acquire(cache, path, &err);
+    TEST_ASSERT(tpl != NULL);
+    image = new_buf();
+    TEST_ASSERT(!breeze_template_save(tpl, &image, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_SYNTAX, err);
+    TEST_ASSERT(image.size == 0);
+    free(image.data);
+    breeze_cache_release(cache, tpl);
+    breeze_cache_free(cache);
+    unlink(path);
+    unlink("/tmp/breeze_image_part.html");
+}
+
+/* Byte offset of the one 4-aligned word of `image` equal to `value`, or -1
+ * if there is none or more than one. */
+static long find_word(const OutputBuffer* image, uint32_t value) {
+    long found = -1;
+    for (size_t at = 0; at + 4 <= image->size; at += 4) {
+        uint32_t w;
+        memcpy(&w, image->data + at, 4);
+        if (w != value) continue;
+        if (found >= 0) return -1;
+        found = (long)at;
+    }
+    return found;
+}
+
+/* Load `image` with the word at `at` replaced by `value`; it must be refused. */
+static bool rejects_patched(const OutputBuffer* image, long at, uint32_t value) {
+    char* copy = aligned_alloc(8, image->size);
+    memcpy(copy, image->data, image->size);
+    memcpy(copy + at, &value, 4);
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_template_load(NULL, copy, image->size, NULL, &err);
+    bool rejected = !tpl && err.type == TMPL_ERR_PARSE && strcmp(err.message, "Template image is corrupt") == 0;
+    breeze_template_free(tpl);
+    free(copy);
+    return rejected;
+}
+
+/* Damage inside the program is caught at load, never by rendering it. The
+ * fields are found through sentinels: a text run of a unique length, and
+ * tags at unique source offsets. */
+static void test_image_rejects_corrupt_program(void) {
+    char src[8192];
+    char pad_a[3001], pad_b[2001];
+    memset(pad_a, 'a', 3000);
+    pad_a[3000] = '\0';
+    memset(pad_b, 'b', 2000);
+    pad_b[2000] = '\0';
+    snprintf(src, sizeof(src), "{{ x }}%s{{ y|upper }}%s{%% if x %%}a{%% endif %%}{%% for i in xs %%}{{ i }}{%% endfor %%}",
+             pad_a, pad_b);
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(src, &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer image = new_buf();
+    TEST_ASSERT(breeze_template_save(tpl, &image, &err));
+    breeze_template_free(tpl);
+
+    /* Node fields follow `pos` in declaration order. */
+    long text_len = find_word(&image, 3000);   /* text run: pos, off, len */
+    long var_pos = find_word(&image, 3007);    /* {{ y|upper }}: pos, ref (12 bytes), filters, nfilters */
+    long branch_pos = find_word(&image, 5020); /* {% if %}: pos, cond, ncond, target */
+    TEST_ASSERT(text_len > 0 && var_pos > 0 && branch_pos > 0);
+    TEST_ASSERT(rejects_patched(&image, text_len - 4, 0x7ffffff0));   /* pool offset */
+    TEST_ASSERT(rejects_patched(&image, text_len, 0x7ffffff0));       /* run past the pool */
+    TEST_ASSERT(rejects_patched(&image, var_pos + 16, 0x7ffffff0));   /* filter index */
+    TEST_ASSERT(rejects_patched(&image, var_pos + 20, 2));            /* filter chain past the end */
+    TEST_ASSERT(rejects_patched(&image, var_pos + 8, 0x7ffffff0));    /* name index */
+    TEST_ASSERT(rejects_patched(&image, branch_pos + 12, 0x7ffffff0)); /* jump target */
+    TEST_ASSERT(rejects_patched(&image, branch_pos + 12, 0));         /* backward jump */
+    TEST_ASSERT(rejects_patched(&image, branch_pos + 4, 0x7ffffff0)); /* condition range */
+
+    /* Whatever a damaged word still loads as renders safely. */
+    const char* xs[] = {"p", "q"};
+    TemplateVar vars[] = {VAR_BOOL("x", true), VAR_STRING("y", "v"), VAR_ARRAY_STR("xs", xs)};
+    TemplateContext ctx = {.vars = vars, .count = 3};
+    char* copy = aligned_alloc(8, image.size);
+    OutputBuffer out = new_buf();
+    for (size_t at = 0; at + 4 <= image.size; at += 4) {
+        for (int k = 0; k < 3; k++) {
+            uint32_t w;
+            memcpy(copy, image.data, image.size);
+            memcpy(&w, copy + at, 4);
+            w = k == 0 ? w + 1 : k == 1 ? w - 1 : 0x7ffffff0;
+            memcpy(copy + at, &w, 4);
+            BreezeTemplate* loaded = breeze_template_load(NULL, copy, image.size, NULL, &err);
+            if (!loaded) continue;
+            out.size = 0;
+            (void)breeze_render_compiled(loaded, &ctx, &out, &err);
+            breeze_template_free(loaded);
+        }
+    }
+    free(out.data);
+    free(copy);
+    free(image.data);
+}
+
+/* ================================================================
+  36. Resumable rendering
+   ================================================================ */
+
+/* Drain a render begun on `state` in steps of `cap` bytes into `out`; the
+ * last step's status is left in `*status`. */
+static void drain_steps(BreezeRenderState* state, size_t cap, OutputBuffer* out, BreezeRenderStatus* status,
+                        TemplateError* err) {
+    char buf[64];
+    size_t steps = 0;
+    do {
+        size_t n = cap + 1;
+        *status = breeze_render_step(state, buf, cap, &n, err);
+        TEST_ASSERT(n <= cap);
+        TEST_ASSERT(breeze_buffer_append(out, buf, n));
+        TEST_ASSERT(++steps < 100000);
+    } while (*status == BREEZE_RENDER_MORE);
+}
+
+static void test_step_matches_render(void) {
+    const char* words[] = {"alpha", "beta", "gamma", "delta"};
+    TemplateVar vars[] = {VAR_ARRAY_STR("words", words)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    const char* src = "{% set s = \"!\" %}{% for w in words %}<{{ w | upper }}>{% if loop.last %}.{% endif %}"
+                      "{% endfor %}{% cache \"c\" 0 %}[{% for w in words %}{{ w }}{% endfor %}]{% endcache %}{{ s }}";
+    const char* want = "<ALPHA><BETA><GAMMA><DELTA>.[alphabetagammadelta]!";
+    const size_t caps[] = {1, 7, 64};
+    BreezeRenderState* state = breeze_render_state_new();
+    TEST_ASSERT(state != NULL);
+    TemplateError err = {0};
+    BreezeRenderStatus status;
+    OutputBuffer out = new_buf();
+    for (size_t i = 0; i < 3; i++) {
+        /* A fresh engine, so the cache block is captured during the steps. */
+        BreezeEngine* engine = breeze_engine_new();
+        BreezeTemplate* tpl = breeze_engine_compile(engine, src, NULL, &err);
+        TEST_ASSERT(tpl != NULL);
+        out.size = 0;
+        TEST_ASSERT(breeze_render_begin(state, tpl, &ctx, &err));
+        drain_steps(state, caps[i], &out, &status, &err);
+        TEST_ASSERT(status == BREEZE_RENDER_DONE);
+        TEST_ASSERT_STR(want, out.data);
+
+        /* Again, now that the fragment is a hit. */
+        out.size = 0;
+        TEST_ASSERT(breeze_render_begin(state, tpl, &ctx, &err));
+        drain_steps(state, caps[i], &out, &status, &err);
+        TEST_ASSERT(status == BREEZE_RENDER_DONE);
+        TEST_ASSERT_STR(want, out.data);
+        breeze_template_free(tpl);
+        breeze_engine_free(engine);
+    }
+
+    /* Done means done: further steps report an error, not more output. */
+    size_t n = 1;
+    char buf[4];
+    TEST_ASSERT(breeze_render_step(state, buf, sizeof(buf), &n, &err) == BREEZE_RENDER_ERROR);
+    TEST_ASSERT(n == 0);
+    TEST_ASSERT_STR("No render in progress", err.message);
+    free(out.data);
+    breeze_render_state_free(state);
+}
+
+static void test_step_through_includes(void) {
+    write_file("/tmp/breeze_step_row.html", "<li>{{ r.name }}={{ r.id }}</li>");
+    write_file("/tmp/breeze_step_list.html",
+               "<ul>{% for r in rows %}{% include \"breeze_step_row.html\" %}{% endfor %}</ul>");
+    Row rows[] = {{1, "apple", 0.5, ""}, {2, "pear", 1.75, ""}, {3, "fig", 3.0, ""}};
+    TemplateVar vars[] = {VAR_ARRAY_RECORDS("rows", rows, 3, &row_type)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    BreezeCacheOptions opts = {.root = "/tmp"};
+    BreezeTemplateCache* cache = breeze_cache_new(&opts);
+    TemplateError err = {0};
+    BreezeRenderStatus status;
+    BreezeTemplate* tpl = breeze_cache_acquire(cache, "/tmp/breeze_step_list.html", &err);
+    TEST_ASSERT(tpl != NULL);
+    OutputBuffer want = new_buf(), out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &want, &err));
+    BreezeRenderState* state = breeze_render_state_new();
+    for (size_t cap = 1; cap <= 9; cap += 4) {
+        out.size = 0;
+        TEST_ASSERT(breeze_render_begin(state, tpl, &ctx, &err));
+        drain_steps(state, cap, &out, &status, &err);
+        TEST_ASSERT(status == BREEZE_RENDER_DONE);
+        TEST_ASSERT_STR(want.data, out.data);
+    }
+    free(want.data);
+    free(out.data);
+    breeze_render_state_free(state);
+    breeze_cache_release(cache, tpl);
+    breeze_cache_free(cache);
+}
+
+static void test_step_errors_and_restart(void) {
+    TemplateError err = {0};
+    BreezeRenderStatus status;
+    BreezeTemplate* tpl = breeze_compile("{% for w in words %}[{{ w }}]{% endfor %}{{ missing }}tail", &err);
+    TEST_ASSERT(tpl != NULL);
+    const char* words[] = {"one", "two", "three"};
+    TemplateVar vars[] = {VAR_ARRAY_STR("words", words)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    BreezeRenderState* state = breeze_render_state_new();
+    OutputBuffer out = new_buf();
+
+    /* The output before the failure is still delivered. */
+    TEST_ASSERT(breeze_render_begin(state, tpl, &ctx, &err));
+    drain_steps(state, 5, &out, &status, &err);
+    TEST_ASSERT(status == BREEZE_RENDER_ERROR);
+    TEST_ASSERT_ERR(TMPL_ERR_RENDER, err);
+    TEST_ASSERT_STR("[one][two][three]", out.data);
+
+    /* Beginning again abandons a render half way through. */
+    TEST_ASSERT(breeze_render_begin(state, tpl, &ctx, &err));
+    char buf[4];
+    size_t n = 0;
+    TEST_ASSERT(breeze_render_step(state, buf, sizeof(buf), &n, &err) == BREEZE_RENDER_MORE);
+    TEST_ASSERT(n == 4 && memcmp(buf, "[one", 4) == 0);
+    BreezeTemplate* other = breeze_compile("{{ words | len }}", &err);
+    TEST_ASSERT(other != NULL);
+    out.size = 0;
+    TEST_ASSERT(breeze_render_begin(state, other, &ctx, &err));
+    drain_steps(state, 64, &out, &status, &err);
+    TEST_ASSERT(status == BREEZE_RENDER_DONE);
+    TEST_ASSERT_STR("3", out.data);
+
+    /* So does an ordinary render on the same state. */
+    TEST_ASSERT(breeze_render_begin(state, tpl, &ctx, &err));
+    out.size = 0;
+    TEST_ASSERT(breeze_state_render(state, other, &ctx, &out, &err));
+    TEST_ASSERT(breeze_render_step(state, buf, sizeof(buf), &n, &err) == BREEZE_RENDER_ERROR);
+    TEST_ASSERT(!breeze_render_begin(NULL, tpl, &ctx, &err));
+
+    free(out.data);
+    breeze_render_state_free(state);
+    breeze_template_free(other);
+    breeze_template_free(tpl);
+}
+
+/* ================================================================
+  37. JSON contexts
+   ================================================================ */
+
+static void check_json_render(const char* json, const char* tpl, const char* want) {
+    BreezeArena* arena = breeze_arena_new();
+    TemplateError err = {0};
+    TemplateContext* ctx = breeze_context_from_json(json, strlen(json), arena, &err);
+    TEST_ASSERT(ctx != NULL);
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(render_template(tpl, ctx, &out, &err));
+    TEST_ASSERT_STR(want, out.data);
+    free(out.data);
+    breeze_arena_free(arena);
+}
+
+static void test_json_scalars_and_strings(void) {
+    const char* json = " {\"name\": \"Ann\", \"age\": 41, \"ratio\": 0.25, \"big\": 12345678901234567890,"
+                       "\"admin\": true, \"guest\": false, \"note\": null,"
+                       "\"esc\": \"a\\\"b\\\\c\\/d\\n\\u00e9\\ud83d\\ude00\"} ";
+    BreezeArena* arena = breeze_arena_new();
+    TemplateError err = {0};
+    TemplateContext* ctx = breeze_context_from_json(json, strlen(json), arena, &err);
+    TEST_ASSERT(ctx != NULL && ctx->count == 8);
+    TEST_ASSERT(strcmp(ctx->vars[0].key, "name") == 0 && ctx->vars[0].value.type == TMPL_STRV);
+    /* Unescaped strings point into the text. */
+    TEST_ASSERT(ctx->vars[0].value.value.strv.data == json + 11 && ctx->vars[0].value.value.strv.len == 3);
+    TEST_ASSERT(ctx->vars[1].value.type == TMPL_LONG && ctx->vars[1].value.value.long_int == 41);
+    TEST_ASSERT(ctx->vars[2].value.type == TMPL_DOUBLE && ctx->vars[2].value.value.dbl == 0.25);
+    TEST_ASSERT(ctx->vars[3].value.type == TMPL_DOUBLE);
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(render_template("{{ name }} {{ age }} {% if admin and not guest and not note %}admin{% endif %} "
+                                "{{ esc }} {% if age > 40 %}40+{% endif %}",
+                                ctx, &out, &err));
+    TEST_ASSERT_STR("Ann 41 admin a\"b\\c/d\n\xc3\xa9\xf0\x9f\x98\x80 40+", out.data);
+    free(out.data);
+    breeze_arena_free(arena);
+
+    /* Not NUL-terminated: only `len` bytes are read. */
+    char buf[] = {'{', '"', 'k', '"', ':', '1', '}', 'x'};
+    arena = breeze_arena_new();
+    ctx = breeze_context_from_json(buf, 7, arena, &err);
+    TEST_ASSERT(ctx != NULL && ctx->count == 1 && ctx->vars[0].value.value.long_int == 1);
+    breeze_arena_free(arena);
+}
+
+static void test_json_arrays_and_records(void) {
+    const char* json = "{\"tags\": [\"a\", \"b\\u0021\"], \"nums\": [1, 2.5, 3], \"empty\": [],"
+                       "\"user\": {\"name\": \"Bo\", \"address\": {\"city\": \"Oslo\", \"zip\": 150},"
+                       "           \"roles\": [\"x\", \"y\"]},"
+                       "\"rows\": [{\"id\": 1, \"name\": \"apple\"}, {\"name\": \"pear\", \"id\": 2, \"sale\": true},"
+                       "           {\"id\": 3}],"
+                       "\"grid\": [[1, 2], [3]]}";
+    check_json_render(json, "{% for t in tags %}{{ t }}{% endfor %} {% for n in nums %}{{ n }},{% endfor %}"
+                            "{% for e in empty %}never{% endfor %}{{ nums | len }}",
+                      "ab! 1.0000,2.5000,3.0000,3");
+    check_json_render(json, "{{ user.name }}@{{ user.address.city }}/{{ user.address.zip }} "
+                            "{% for r in user.roles %}{{ r }}{% endfor %}",
+                      "Bo@Oslo/150 xy");
+    check_json_render(json, "{% for r in rows %}{{ r.id }}:{{ r.name }}{% if r.sale %}*{% endif %};{% endfor %}",
+                      "1:apple;2:pear*;3:;");
+    check_json_render(json, "{% for row in grid %}[{% for c in row %}{{ c }}{% endfor %}]{% endfor %}", "[12][3]");
+}
+
+static void test_json_errors(void) {
+    const char* bad[] = {"[1, 2]",           "{\"a\": }",           "{\"a\": 1,}",      "{\"a\" 1}",
+                         "{\"a\": \"x}",     "{\"a\": [1, \"x\"]}", "{\"a\": 01}",      "{\"a\": tru}",
+                         "{\"a\": 1} {}",    "{\"a\": \"\\q\"}",    "{\"a\": \"\\ud800\"}", "",
+                         "{\"a\": [{\"b\": 1}, {\"b\": \"s\"}]}"};
+    BreezeArena* arena = breeze_arena_new();
+    TemplateError err = {0};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        TEST_ASSERT(breeze_context_from_json(bad[i], strlen(bad[i]), arena, &err) == NULL);
+        TEST_ASSERT_ERR(TMPL_ERR_PARSE, err);
+        TEST_ASSERT(err.line == 1 && err.column > 0);
+    }
+    const char* mixed = "{\"ok\": 1,\n  \"a\": [1, \"x\"]}";
+    TEST_ASSERT(breeze_context_from_json(mixed, strlen(mixed), arena, &err) == NULL);
+    TEST_ASSERT_STR("JSON array items must share a type", err.message);
+    TEST_ASSERT(err.line == 2 && err.column == 12);
+
+    /* Deep nesting is refused rather than overflowing the stack. */
+    OutputBuffer deep = new_buf();
+    TEST_ASSERT(breeze_buffer_append(&deep, "{\"a\":", 5));
+    for (int i = 0; i < 1000; i++) TEST_ASSERT(breeze_buffer_append(&deep, "[", 1));
+    TEST_ASSERT(breeze_context_from_json(deep.data, deep.size, arena, &err) == NULL);
+    TEST_ASSERT_STR("JSON nested too deeply", err.message);
+    free(deep.data);
+
+    /* The arena is reusable after failures. */
+    breeze_arena_reset(arena);
+    TEST_ASSERT(breeze_context_from_json("{}", 2, arena, &err) != NULL);
+    TEST_ASSERT(breeze_context_from_json(NULL, 0, arena, &err) == NULL);
+    breeze_arena_free(arena);
+}
+
+/* ================================================================
+   38. Memory accounting
+   ================================================================ */
+
+typedef struct {
+    size_t mallocs, reallocs, frees;
+} CountingHeap;
+
+static void* counting_malloc(void* userdata, size_t size) {
+    ((CountingHeap*)userdata)->mallocs++;
+    return malloc(size);
+}
+
+static void* counting_realloc(void* userdata, void* ptr, size_t size) {
+    ((CountingHeap*)userdata)->reallocs++;
+    return realloc(ptr, size);
+}
+
+static void counting_free(void* userdata, void* ptr) {
+    ((CountingHeap*)userdata)->frees++;
+    free(ptr);
+}
+
+static const char* const memory_source = "{% for x in items %}<li>{{ x | upper }}</li>{% endfor %}{{ user }}";
+
+static void test_custom_allocator(void) {
+    CountingHeap heap = {0};
+    BreezeAllocator allocator = {counting_malloc, counting_realloc, counting_free, &heap};
+    breeze_set_allocator(&allocator);
+    const char* items[] = {"a", "b", "c"};
+    TemplateVar vars[] = {VAR_ARRAY_STR("items", items), VAR_STRING("user", "ann")};
+    TemplateContext ctx = {.vars = vars, .count = 2};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(memory_source, &err);
+    OutputBuffer out = {0};
+    bool ok = tpl && buffer_init(&out, 16) && breeze_render_compiled(tpl, &ctx, &out, &err);
+    breeze_template_free(tpl);
+    breeze_free(out.data);
+    breeze_set_allocator(NULL);
+    TEST_ASSERT(ok);
+    TEST_ASSERT(heap.mallocs > 0 && heap.reallocs > 0);
+    TEST_ASSERT(heap.frees > 0 && heap.frees <= heap.mallocs + heap.reallocs);
+
+    /* NULL restores the default allocator. */
+    size_t calls = heap.mallocs + heap.reallocs + heap.frees;
+    OutputBuffer plain = new_buf();
+    breeze_free(plain.data);
+    TEST_ASSERT(heap.mallocs + heap.reallocs + heap.frees == calls);
+}
+
+static void test_warm_state_stats(void) {
+    const char* items[] = {"a", "b", "c"};
+    TemplateVar vars[] = {VAR_ARRAY_STR("items", items), VAR_STRING("user", "ann")};
+    TemplateContext ctx = {.vars = vars, .count = 2};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(memory_source, &err);
+    BreezeRenderState* state = breeze_render_state_new();
+    TEST_ASSERT(tpl && state);
+    OutputBuffer out = new_buf();
+    BreezeRenderStats stats;
+    TEST_ASSERT(breeze_state_render(state, tpl, &ctx, &out, &err));
+    breeze_state_stats(state, &stats);
+    TEST_ASSERT(stats.allocations > 0 && stats.alloc_bytes > 0);
+    TEST_ASSERT(stats.output_bytes == out.size);
+
+    /* The same page again, into the same buffer: nothing left to allocate. */
+    out.size = 0;
+    TEST_ASSERT(breeze_state_render(state, tpl, &ctx, &out, &err));
+    breeze_state_stats(state, &stats);
+    TEST_ASSERT(stats.allocations == 0 && stats.alloc_bytes == 0);
+    TEST_ASSERT_STR("<li>A</li><li>B</li><li>C</li>ann", out.data);
+    TEST_ASSERT(stats.output_bytes == out.size);
+
+    /* Streamed output counts what was flushed. */
+    OutputBuffer streamed = new_buf();
+    BreezeWriter writer = breeze_writer_buffer(&streamed);
+    TEST_ASSERT(breeze_state_render_to_writer(state, tpl, &ctx, &writer, &err));
+    breeze_state_stats(state, &stats);
+    TEST_ASSERT(stats.output_bytes == streamed.size);
+
+    /* As does stepping. */
+    TEST_ASSERT(breeze_render_begin(state, tpl, &ctx, &err));
+    char chunk[8];
+    size_t written, total = 0;
+    BreezeRenderStatus status;
+    while ((status = breeze_render_step(state, chunk, sizeof(chunk), &written, &err)) == BREEZE_RENDER_MORE)
+        total += written;
+    total += written;
+    TEST_ASSERT(status == BREEZE_RENDER_DONE);
+    breeze_state_stats(state, &stats);
+    TEST_ASSERT(stats.output_bytes == total && total == out.size);
+
+    breeze_state_stats(NULL, &stats);
+    TEST_ASSERT(stats.allocations == 0 && stats.output_bytes == 0);
+    free(out.data);
+    free(streamed.data);
+    breeze_render_state_free(state);
+    breeze_template_free(tpl);
+}
+
+static void test_memory_limit(void) {
+    const char* items[] = {"a", "b", "c"};
+    TemplateVar vars[] = {VAR_ARRAY_STR("items", items), VAR_STRING("user", "ann")};
+    TemplateContext ctx = {.vars = vars, .count = 2};
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile(memory_source, &err);
+    BreezeRenderState* state = breeze_render_state_new();
+    TEST_ASSERT(tpl && state);
+    OutputBuffer out = new_buf();
+
+    /* A cold state has to allocate, so a tiny limit fails the render. */
+    breeze_state_set_memory_limit(state, 1);
+    TEST_ASSERT(!breeze_state_render(state, tpl, &ctx, &out, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_MEMORY, err);
+    TEST_ASSERT(!breeze_render_begin(state, tpl, &ctx, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_MEMORY, err);
+
+    /* Once warm, the same limit is never reached. */
+    BreezeRenderStats stats;
+    breeze_state_set_memory_limit(state, 0);
+    out.size = 0;
+    TEST_ASSERT(breeze_state_render(state, tpl, &ctx, &out, &err));
+    breeze_state_stats(state, &stats);
+    TEST_ASSERT(stats.allocations > 0);
+    breeze_state_set_memory_limit(state, 1);
+    out.size = 0;
+    TEST_ASSERT(breeze_state_render(state, tpl, &ctx, &out, &err));
+    TEST_ASSERT_STR("<li>A</li><li>B</li><li>C</li>ann", out.data);
+
+    /* Growing the output counts against the limit too. */
+    OutputBuffer small;
+    TEST_ASSERT(buffer_init(&small, 1));
+    TEST_ASSERT(!breeze_state_render(state, tpl, &ctx, &small, &err));
+    TEST_ASSERT_ERR(TMPL_ERR_MEMORY, err);
+    free(small.data);
+    free(out.data);
+    breeze_render_state_free(state);
+    breeze_template_free(tpl);
+}
+
+static void test_size_hint(void) {
+    TemplateError err = {0};
+    BreezeTemplate* tpl = breeze_compile("{{ body }}", &err);
+    TEST_ASSERT(tpl);
+    TEST_ASSERT(breeze_template_size_hint(tpl) == 0);
+    TEST_ASSERT(breeze_template_size_hint(NULL) == 0);
+
+    char big[801];
+    memset(big, 'x', 800);
+    big[800] = '\0';
+    TemplateVar vars[] = {VAR_STRING("body", big)};
+    TemplateContext ctx = {.vars = vars, .count = 1};
+    OutputBuffer out = new_buf();
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT(breeze_template_size_hint(tpl) == 800);
+
+    /* The next buffer is sized before the render starts. */
+    OutputBuffer next = new_buf();
+    BreezeRenderState* state = breeze_render_state_new();
+    TEST_ASSERT(state);
+    TEST_ASSERT(breeze_state_render(state, tpl, &ctx, &next, &err));
+    TEST_ASSERT(next.capacity > 800 && next.size == 800);
+
+    /* A smaller page lowers the hint by an eighth of the gap. */
+    vars[0] = (TemplateVar)VAR_STRING("body", "");
+    out.size = 0;
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT(breeze_template_size_hint(tpl) == 700);
+    vars[0] = (TemplateVar)VAR_STRING("body", big);
+    TEST_ASSERT(breeze_render_compiled(tpl, &ctx, &out, &err));
+    TEST_ASSERT(breeze_template_size_hint(tpl) == 800);
+
+    free(out.data);
+    free(next.data);
+    breeze_render_state_free(state);
+    breeze_template_free(tpl);
+}
+
+/* ================================================================
+   main
+   ================================================================ */
+
+int main(void) {
+    printf("\n=== Breeze Template Engine – Expanded Test Suite ===\n\n");
+
+    printf("── 1. Regression (original features) ──────────────────\n");
+    RUN(test_orig_variable_substitution);
+    RUN(test_orig_for_loop);
+    RUN(test_orig_if_else);
+    RUN(test_orig_complex_expr);
+    RUN(test_orig_all_value_types);
+    RUN(test_orig_whitespace_control);
+    RUN(test_orig_missing_variable);
+    RUN(test_orig_unclosed_for);
+    RUN(test_orig_nested_loops);
+    RUN(test_orig_html_comment);
+
+    printf("\n── 2. Built-in Filters ─────────────────────────────────\n");
+    RUN(test_filter_upper);
+    RUN(test_filter_lower);
+    RUN(test_filter_len_string);
+    RUN(test_filter_len_array);
+    RUN(test_filter_trim);
+    RUN(test_filter_reverse);
+    RUN(test_filter_default_falsy);
+    RUN(test_filter_default_truthy);
+    RUN(test_filter_default_false_bool);
+    RUN(test_filter_truncate_cuts);
+    RUN(test_filter_truncate_noop);
+    RUN(test_filter_capitalize);
+    RUN(test_filter_replace);
+    RUN(test_filter_on_int);
+    RUN(test_filter_upper_int);
+
+    printf("\n── 3. Chained Filters ──────────────────────────────────\n");
+    RUN(test_chain_upper_truncate);
+    RUN(test_chain_trim_upper_reverse);
+    RUN(test_chain_replace_upper);
+
+    printf("\n── 4. Loop Meta-variables ──────────────────────────────\n");
+    RUN(test_loop_index);
+    RUN(test_loop_index1);
+    RUN(test_loop_first_last);
+    RUN(test_loop_length);
+    RUN(test_loop_meta_combined);
+    RUN(test_loop_filter_on_item);
+    RUN(test_loop_separator_pattern);
+
+    printf("\n── 5. elif chains ──────────────────────────────────────\n");
+    RUN(test_elif_first_branch);
+    RUN(test_elif_middle_branch);
+    RUN(test_elif_else_branch);
+    RUN(test_elif_no_else);
+    RUN(test_elif_multiple_chains);
+    RUN(test_elif_without_if);
+
+    printf("\n── 6. set tag ──────────────────────────────────────────\n");
+    RUN(test_set_basic);
+    RUN(test_set_quoted);
+    RUN(test_set_single_quoted);
+    RUN(test_set_overrides_context);
+    RUN(test_set_multiple);
+    RUN(test_set_reuse_in_loop);
+    RUN(test_set_typed_values);
+    RUN(test_set_no_limits);
+    RUN(test_set_bad_syntax);
+
+    printf("\n── 7. raw blocks ───────────────────────────────────────\n");
+    RUN(test_raw_basic);
+    RUN(test_raw_mixed);
+    RUN(test_raw_unclosed);
+    RUN(test_raw_preserves_braces);
+
+    printf("\n── 8. render_template_file ─────────────────────────────\n");
+    RUN(test_render_file_ok);
+    RUN(test_render_file_missing);
+    RUN(test_render_file_with_filters);
+
+    printf("\n── 9. Dynamic context ──────────────────────────────────\n");
+    RUN(test_ctx_new_basic);
+    RUN(test_ctx_update);
+    RUN(test_ctx_grows_past_initial_capacity);
+    RUN(test_ctx_bool_and_int);
+
+    printf("\n── 10. Custom filters ──────────────────────────────────\n");
+    RUN(test_custom_filter_shout);
+    RUN(test_custom_filter_wrap);
+    RUN(test_custom_filter_overwrite);
+
+    printf("\n── 11. Error paths ─────────────────────────────────────\n");
+    RUN(test_err_unknown_filter);
+    RUN(test_err_unterminated_var);
+    RUN(test_err_unterminated_directive);
+    RUN(test_err_endfor_without_for);
+    RUN(test_err_endif_without_if);
+    RUN(test_err_else_without_if);
+    RUN(test_err_unclosed_if);
+    RUN(test_err_unterminated_comment);
+    RUN(test_err_for_invalid_syntax);
+    RUN(test_err_set_no_equals);
+    RUN(test_err_unknown_directive);
+
+    printf("\n── 12. Edge cases ──────────────────────────────────────\n");
+    RUN(test_edge_empty_array);
+    RUN(test_edge_zero_int_falsy);
+    RUN(test_edge_nonzero_int_truthy);
+    RUN(test_edge_empty_string_falsy);
+    RUN(test_edge_no_newline_at_end);
+    RUN(test_edge_nested_for_loops);
+    RUN(test_edge_comment_strips_vars);
+    RUN(test_edge_multiple_vars_same_line);
+    RUN(test_edge_filter_on_loop_meta);
+    RUN(test_edge_deep_nesting);
+
+    printf("\n── 13. Compiled templates ──────────────────────────────\n");
+    RUN(test_compile_render_many);
+    RUN(test_compile_syntax_error);
+    RUN(test_compile_error_columns);
+    RUN(test_compile_missing_var_at_render);
+    RUN(test_compile_nested_loops_and_branches);
+    RUN(test_compile_not_operator);
+    RUN(test_compile_threaded_jumps);
+
+    printf("\n── 14. Literal scanning ────────────────────────────────\n");
+    RUN(test_scan_markup_lookalikes);
+    RUN(test_scan_tags_at_every_offset);
+    RUN(test_scan_raw_endraw_spacing);
+    RUN(test_scan_replace_many);
+
+    printf("\n── 15. Template cache ──────────────────────────────────\n");
+    RUN(test_cache_hit_returns_same_template);
+    RUN(test_cache_mtime_reload);
+    RUN(test_cache_production_mode_never_reloads);
+    RUN(test_cache_lru_eviction);
+    RUN(test_cache_missing_file);
+    RUN(test_cache_concurrent_lookups);
+
+    printf("\n── 16. Streaming output ────────────────────────────────\n");
+    RUN(test_stream_matches_buffer);
+    RUN(test_stream_large_text_passthrough);
+    RUN(test_stream_write_failure);
+    RUN(test_stream_file_writer);
+    RUN(test_stream_fd_writer);
+
+    printf("\n── 17. Context lookup ──────────────────────────────────\n");
+    RUN(test_index_dynamic_context_many_keys);
+    RUN(test_index_static_context);
+    RUN(test_schema_slot_lookup);
+
+    printf("\n── 18. Engines ─────────────────────────────────────────\n");
+    RUN(test_engine_filters_are_isolated);
+    RUN(test_engine_binds_at_compile_time);
+    RUN(test_engine_many_filters);
+    RUN(test_engine_concurrent_register_and_compile);
+
+    printf("\n── 19. Typed filter chains ─────────────────────────────\n");
+    RUN(test_chain_array_stays_typed);
+    RUN(test_chain_numbers_stay_typed);
+    RUN(test_chain_passthrough_between_buffers);
+    RUN(test_chain_many_rows);
+    RUN(test_chain_value_filter_failure);
+
+    printf("\n── 20. Render state ────────────────────────────────────\n");
+    RUN(test_state_reuse_across_templates);
+    RUN(test_state_set_vars_reset_between_renders);
+    RUN(test_state_grows_for_large_templates);
+    RUN(test_state_render_to_writer);
+
+    printf("\n── 21. Number formatting ───────────────────────────────\n");
+    RUN(test_num_integer_extremes);
+    RUN(test_num_doubles_match_printf);
+    RUN(test_num_round_filter);
+    RUN(test_num_round_in_chain);
+
+    printf("\n── 22. HTML escaping ───────────────────────────────────\n");
+    RUN(test_escape_filter_entities);
+    RUN(test_escape_every_offset);
+    RUN(test_autoescape_engine);
+    RUN(test_autoescape_off_by_default);
+
+    printf("\n── 23. Array layouts ───────────────────────────────────\n");
+    RUN(test_array_contiguous_values);
+    RUN(test_array_struct_fields);
+    RUN(test_array_reverse_strided_numbers);
+    RUN(test_array_get_bounds);
+
+    printf("\n── 24. Records ─────────────────────────────────────────\n");
+    RUN(test_record_fields);
+    RUN(test_record_array_loop);
+    RUN(test_record_unknown_field);
+    RUN(test_record_dotted_keys_still_work);
+
+    printf("\n── 25. Iterators ───────────────────────────────────────\n");
+    RUN(test_iter_loop);
+    RUN(test_iter_count_hint);
+    RUN(test_iter_needs_count_for_last);
+    RUN(test_iter_streams_many_rows);
+
+    printf("\n── 26. Conditions ──────────────────────────────────────\n");
+    RUN(test_cond_short_circuit_skips_missing);
+    RUN(test_cond_typed_comparisons);
+    RUN(test_cond_in_operator);
+    RUN(test_cond_set_and_loop_values);
+    RUN(test_cond_errors);
+
+    printf("\n── 27. Includes and inheritance ────────────────────────\n");
+    RUN(test_include_shared_partial);
+    RUN(test_include_sees_loop_and_set);
+    RUN(test_extends_blocks);
+    RUN(test_include_errors);
+    RUN(test_include_hot_reload);
+
+    printf("\n── 28. Fragment cache ──────────────────────────────────\n");
+    RUN(test_fragment_hit_skips_render);
+    RUN(test_fragment_key_variables);
+    RUN(test_fragment_limit_and_errors);
+    RUN(test_fragment_nested);
+    RUN(test_fragment_custom_store_streaming);
+
+    printf("\n── 29. Constant folding ────────────────────────────────\n");
+    RUN(test_fold_set_and_filters);
+    RUN(test_fold_constant_branches);
+    RUN(test_fold_keeps_dynamic_sets);
+    RUN(test_fold_errors_and_escaping);
+    RUN(test_fold_skips_user_filters);
+
+    printf("\n── 30. Batch rendering ─────────────────────────────────\n");
+    RUN(test_batch_matches_serial);
+    RUN(test_batch_reports_each_error);
+
+    printf("\n── 31. Profiling ───────────────────────────────────────\n");
+    RUN(test_profile_counts_nodes_and_filters);
+    RUN(test_profile_streaming_bytes);
+
+    printf("\n── 32. Trim markers ────────────────────────────────────\n");
+    RUN(test_trim_directives);
+    RUN(test_trim_variables);
+    RUN(test_trim_raw_and_blocks);
+
+    printf("\n── 33. String views ────────────────────────────────────\n");
+    RUN(test_strv_filters_and_conditions);
+    RUN(test_strv_arrays_records_context);
+
+    printf("\n── 34. Generated code ──────────────────────────────────\n");
+    RUN(test_gen_emits_function);
+#ifdef BREEZE_TEST_GENERATED
+    RUN(test_gen_matches_interpreter);
+    RUN(test_gen_errors_match);
+#endif
+
+    printf("\n── 35. Template images ─────────────────────────────────\n");
+    RUN(test_image_round_trip);
+    RUN(test_image_mmap);
+    RUN(test_image_rejects_bad_input);
+    RUN(test_image_rejects_corrupt_program);
+
+    printf("\n── 36. Resumable rendering ─────────────────────────────\n");
+    RUN(test_step_matches_render);
+    RUN(test_step_through_includes);
+    RUN(test_step_errors_and_restart);
+
+    printf("\n── 37. JSON contexts ───────────────────────────────────\n");
+    RUN(test_json_scalars_and_strings);
+    RUN(test_json_arrays_and_records);
+    RUN(test_json_errors);
+
+    printf("\n── 38. Memory accounting ───────────────────────────────\n");
+    RUN(test_custom_allocator);
+    RUN(test_warm_state_stats);
+    RUN(test_memory_limit);
+    RUN(test_size_hint);
 
     printf("\n══════════════════════════════════════════════════════\n");
     printf("  Results: %d passed, %d failed\n", g_passed, g_failed);
@@ -1,6 +1,38 @@
 #include "breeze.h"
 
-int main() {
+static void usage(void) {
+    fprintf(stderr,
+            "usage: breeze render [template.html]\n"
+            "       breeze compile <template> [-o out.c] [--name fn] [--schema a,b,c] [--autoescape]\n");
+}
+
+/* Whole file as a NUL-terminated string, or NULL. */
+static char* read_file(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    char* data = NULL;
+    size_t size = 0, cap = 0, n;
+    do {
+        if (size + 4096 + 1 > cap) {
+            cap = cap ? cap * 2 : 8192;
+            char* grown = realloc(data, cap);
+            if (!grown) {
+                free(data);
+                fclose(fp);
+                return NULL;
+            }
+            data = grown;
+        }
+        n = fread(data + size, 1, 4096, fp);
+        size += n;
+    } while (n > 0);
+    fclose(fp);
+    data[size] = '\0';
+    return data;
+}
+
+/* The demo: render a template against a fixed context. */
+static int render_demo(const char* path) {
     const char* fruits[] = {"Apple", "Banana", "Cherry"};
     int numbers_data[] = {1, 2, 3, 4, 5};
     MAKE_PTR_ARRAY(numbers_data, int*, number_ptrs);
@@ -15,19 +47,11 @@ int main() {
 
     TemplateContext ctx = {.vars = vars, .count = sizeof(vars) / sizeof(vars[0])};
 
-    char template[2048];
-    FILE* fp = fopen("template.html", "r");
-    if (!fp) {
-        return -1;
-    }
-
-    ssize_t n = fread(template, 1, sizeof(template) - 1, fp);
-    if (n <= 0) {
-        fclose(fp);
-        return -2;
+    char* template = read_file(path);
+    if (!template) {
+        perror(path);
+        return 1;
     }
-    template[n] = '\0';
-    fclose(fp);
 
     // --- Render ---
     OutputBuffer out;
@@ -44,5 +68,76 @@ int main() {
     }
 
     free(out.data);
+    free(template);
     return 0;
 }
+
+/* Split "a,b,c" in place into schema keys. */
+static size_t split_schema(char* list, const char** keys, size_t max) {
+    size_t n = 0;
+    char* save = NULL;
+    for (char* key = strtok_r(list, ",", &save); key && n < max; key = strtok_r(NULL, ",", &save)) keys[n++] = key;
+    return n;
+}
+
+/* breeze compile: write a template as a C function. */
+static int compile_c(int argc, char** argv) {
+    const char *input = NULL, *output = NULL, *name = "render_template_c";
+    char* schema_list = NULL;
+    bool autoescape = false;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+        else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) name = argv[++i];
+        else if (strcmp(argv[i], "--schema") == 0 && i + 1 < argc) schema_list = argv[++i];
+        else if (strcmp(argv[i], "--autoescape") == 0) autoescape = true;
+        else if (!input && argv[i][0] != '-') input = argv[i];
+        else {
+            usage();
+            return 2;
+        }
+    }
+    if (!input) {
+        usage();
+        return 2;
+    }
+
+    char* source = read_file(input);
+    if (!source) {
+        perror(input);
+        return 1;
+    }
+    const char* keys[256];
+    BreezeSchema schema = {keys, schema_list ? split_schema(schema_list, keys, 256) : 0};
+    BreezeEngine* engine = breeze_engine_new();
+    if (!engine) {
+        free(source);
+        return 1;
+    }
+    breeze_engine_set_autoescape(engine, autoescape);
+
+    TemplateError err = {0};
+    OutputBuffer code = {0};
+    BreezeTemplate* tpl = breeze_engine_compile(engine, source, schema_list ? &schema : NULL, &err);
+    bool ok = tpl && buffer_init(&code, 4096) && breeze_template_to_c(tpl, name, &code, &err);
+    if (ok) {
+        FILE* fp = output ? fopen(output, "wb") : stdout;
+        ok = fp && fwrite(code.data, 1, code.size, fp) == code.size;
+        if (fp && fp != stdout) ok = fclose(fp) == 0 && ok;
+        if (!ok) perror(output ? output : "stdout");
+    } else {
+        fprintf(stderr, "%s:%zu:%zu: %s\n", input, err.line, err.column, err.message);
+    }
+
+    free(code.data);
+    breeze_template_free(tpl);
+    breeze_engine_free(engine);
+    free(source);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "compile") == 0) return compile_c(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "render") == 0) return render_demo(argc >= 3 ? argv[2] : "template.html");
+    usage();
+    return 2;
+}